@@ -26,6 +26,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <sys/stat.h>
 
 #include <yami_inf.h>
@@ -34,9 +36,21 @@
 #include "parse.h"
 #include "bmd.h"
 #include "bmd_error.h"
+#include "bmd_audio_ring.h"
+#include "bmd_codec.h"
 #include "bmd_declink.h"
+#include "bmd_encoder.h"
+#include "bmd_history.h"
 #include "bmd_log.h"
+#include "bmd_payload.h"
+#include "bmd_pool.h"
 #include "bmd_peer.h"
+#include "bmd_record.h"
+#include "bmd_shard.h"
+#include "bmd_surface.h"
+#include "bmd_synth.h"
+#include "bmd_timeshift.h"
+#include "bmd_udmabuf.h"
 #include "bmd_utils.h"
 
 static int g_term_pipe[2];
@@ -48,6 +62,24 @@ struct settings_info
     char bmd_log_filename[256];
     int daemonize;
     int mode_index;
+    int use_udmabuf;
+    int linger_ms;
+    int warm_standby;
+    int use_synth;
+    int use_seqpacket;
+    int compress;
+    int num_shards;
+    int history_mb;
+    int record_segment_s;
+    char record_dir[256];
+    int timeshift_mb;
+    char timeshift_path[256];
+    int use_io_uring;
+    int tcp_port;
+    char tcp_addr[64];
+    int num_renditions;
+    int rendition_types[BMD_MAX_RENDITIONS];
+    struct bmd_peer_limits peer_limits;
 };
 
 #define NUM_MODE_NAMES 16
@@ -128,22 +160,382 @@ yuy2_to_nv12(void* src, int src_stride_bytes,
 }
 
 /*****************************************************************************/
+/* called with av_mutex held, converts straight into the surface so the
+   exported fd needs no extra copy
+   with history each frame gets the next history surface and the older
+   frames stay where they were converted */
 static int
-bmd_process_av(struct bmd_info* bmd)
+bmd_process_video(struct bmd_info* bmd, struct bmd_av_info* av_info)
 {
-    struct bmd_av_info* av_info;
-    struct stream* out_s;
-    int bytes;
-    char* nv12_data;
     void* dst_data[2];
     int dst_stride[2];
+    int error;
+
+    if (bmd->history != NULL)
+    {
+        error = bmd_history_get_surface(bmd->history, bmd->surface_type,
+                                        bmd->udmabuf_fd, av_info->vwidth,
+                                        av_info->vheight, &(bmd->surface));
+        if (error != BMD_ERROR_NONE)
+        {
+            LOGLN0((LOG_ERROR, LOGS "bmd_history_get_surface failed", LOGP));
+            bmd->surface = NULL;
+            return error;
+        }
+        if ((bmd->surface_width != av_info->vwidth) ||
+            (bmd->surface_height != av_info->vheight))
+        {
+            bmd->video_frame_count = 0;
+            bmd->surface_width = av_info->vwidth;
+            bmd->surface_height = av_info->vheight;
+        }
+    }
+    else if ((bmd->surface == NULL) ||
+        (bmd->surface_width != av_info->vwidth) ||
+        (bmd->surface_height != av_info->vheight))
+    {
+        LOGLN0((LOG_INFO, LOGS "bmd_surface_create width %d height %d "
+                "type %d", LOGP, av_info->vwidth, av_info->vheight,
+                bmd->surface_type));
+        bmd_surface_delete(bmd->surface);
+        bmd->surface = NULL;
+        error = bmd_surface_create(bmd->surface_type, bmd->udmabuf_fd,
+                                   av_info->vwidth, av_info->vheight,
+                                   &(bmd->surface));
+        if (error != BMD_ERROR_NONE)
+        {
+            LOGLN0((LOG_ERROR, LOGS "bmd_surface_create failed", LOGP));
+            bmd->surface = NULL;
+            return error;
+        }
+        bmd->video_frame_count = 0;
+        bmd->surface_width = av_info->vwidth;
+        bmd->surface_height = av_info->vheight;
+    }
+    error = bmd_surface_get_ybuffer(bmd->surface, &(dst_data[0]),
+                                    &(dst_stride[0]));
+    if (error != BMD_ERROR_NONE)
+    {
+        LOGLN0((LOG_ERROR, LOGS "bmd_surface_get_ybuffer failed", LOGP));
+        return error;
+    }
+    error = bmd_surface_get_uvbuffer(bmd->surface, &(dst_data[1]),
+                                     &(dst_stride[1]));
+    if (error != BMD_ERROR_NONE)
+    {
+        LOGLN0((LOG_ERROR, LOGS "bmd_surface_get_uvbuffer failed", LOGP));
+        return error;
+    }
+    yuy2_to_nv12(av_info->vdata, av_info->vstride_bytes,
+                 dst_data, dst_stride,
+                 av_info->vwidth, av_info->vheight);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* one encode per rendition that has subscribers, the access unit is
+   queued to every peer subscribed to it */
+static int
+bmd_process_encode(struct bmd_info* bmd)
+{
+    struct bmd_rendition* rend;
+    struct bmd_payload* payload;
+    struct stream out_s;
+    int mask;
+    int index;
+    int error;
+    int max_bytes;
+    int cdata_bytes;
+    int flags;
+
+    bmd_peer_get_encoded_mask(bmd, &mask);
+    for (index = 0; index < bmd->num_renditions; index++)
+    {
+        if (!(mask & (1 << index)))
+        {
+            continue;
+        }
+        rend = bmd->renditions + index;
+        if ((rend->encoder == NULL) ||
+            (rend->width != bmd->surface_width) ||
+            (rend->height != bmd->surface_height))
+        {
+            bmd_encoder_delete(rend->encoder);
+            rend->encoder = NULL;
+            error = bmd_encoder_create(rend->type, bmd->surface_width,
+                                       bmd->surface_height,
+                                       &(rend->encoder));
+            if (error != BMD_ERROR_NONE)
+            {
+                LOGLN0((LOG_ERROR, LOGS "bmd_encoder_create failed for "
+                        "rendition %d", LOGP, index));
+                rend->encoder = NULL;
+                continue;
+            }
+            bmd_encoder_get_type(rend->encoder, &flags);
+            LOGLN0((LOG_INFO, LOGS "rendition %d encoder type %d width %d "
+                    "height %d", LOGP, index, flags, bmd->surface_width,
+                    bmd->surface_height));
+            rend->width = bmd->surface_width;
+            rend->height = bmd->surface_height;
+            rend->frame_count = 0;
+        }
+        bmd_encoder_get_max_bytes(rend->encoder, &max_bytes);
+        if (max_bytes + 40 > BMD_PDU_MAX_BYTES)
+        {
+            LOGLN0((LOG_ERROR, LOGS "max_bytes %d too big", LOGP, max_bytes));
+            continue;
+        }
+        error = bmd_payload_create(max_bytes + 40, &payload);
+        if (error != BMD_ERROR_NONE)
+        {
+            return error;
+        }
+        cdata_bytes = max_bytes;
+        error = bmd_encoder_encode(rend->encoder, bmd, payload->data + 40,
+                                   &cdata_bytes, &flags);
+        if (error != BMD_ERROR_NONE)
+        {
+            LOGLN0((LOG_ERROR, LOGS "bmd_encoder_encode failed for "
+                    "rendition %d", LOGP, index));
+            bmd_payload_release(payload);
+            continue;
+        }
+        rend->frame_count++;
+        bmd_payload_set_stream(payload, &out_s);
+        out_uint32_le(&out_s, BMD_PDU_CODE_ENCODED);
+        out_uint32_le(&out_s, 40 + cdata_bytes);
+        out_uint32_le(&out_s, bmd->fd_time);
+        out_uint32_le(&out_s, rend->frame_count);
+        out_uint32_le(&out_s, index);
+        out_uint32_le(&out_s, BMD_CODEC_H264);
+        out_uint32_le(&out_s, flags);
+        out_uint32_le(&out_s, rend->width);
+        out_uint32_le(&out_s, rend->height);
+        out_uint32_le(&out_s, cdata_bytes);
+        payload->bytes = 40 + cdata_bytes;
+        /* every subscriber of this rendition shares the one buffer */
+        bmd_peer_queue_all_encoded(bmd, index, payload);
+        bmd_payload_release(payload);
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* header and a dup of the frame fd, shared by every peer the frame goes to
+   and kept for peers that request it before the next frame */
+static int
+bmd_build_video_payload(struct bmd_info* bmd)
+{
+    struct bmd_payload* payload;
+    struct stream out_s;
+    int error;
+
+    bmd_payload_release(bmd->video_payload);
+    bmd->video_payload = NULL;
+    error = bmd_payload_create(40, &payload);
+    if (error != BMD_ERROR_NONE)
+    {
+        return error;
+    }
+    payload->fd = dup(bmd->fd);
+    if (payload->fd == -1)
+    {
+        bmd_payload_release(payload);
+        return BMD_ERROR_DUP;
+    }
+    bmd_payload_set_stream(payload, &out_s);
+    out_uint32_le(&out_s, BMD_PDU_CODE_VIDEO);
+    out_uint32_le(&out_s, 40);
+    out_uint32_le(&out_s, bmd->fd_time);
+    out_uint32_le(&out_s, bmd->fd_seq);
+    out_uint32_le(&out_s, bmd->fd);
+    out_uint32_le(&out_s, bmd->fd_width);
+    out_uint32_le(&out_s, bmd->fd_height);
+    out_uint32_le(&out_s, bmd->fd_stride);
+    out_uint32_le(&out_s, bmd->fd_size);
+    out_uint32_le(&out_s, bmd->fd_bpp);
+    payload->bytes = (int)(out_s.p - out_s.data);
+    bmd->video_payload = payload;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* remote peers can not take an fd, they get the pixels, tight NV12 read
+   back from the surface once and shared by every remote peer
+   the surface is converted into again next frame so the send can not
+   come from it */
+static int
+bmd_build_video_raw_payload(struct bmd_info* bmd)
+{
+    struct bmd_payload* payload;
+    struct stream out_s;
+    void* src_data[2];
+    int src_stride[2];
+    int error;
+    int bytes;
+    int index;
+
+    bmd_payload_release(bmd->video_raw_payload);
+    bmd->video_raw_payload = NULL;
+    error = bmd_surface_get_ybuffer(bmd->surface, &(src_data[0]),
+                                    &(src_stride[0]));
+    if (error != BMD_ERROR_NONE)
+    {
+        return error;
+    }
+    error = bmd_surface_get_uvbuffer(bmd->surface, &(src_data[1]),
+                                     &(src_stride[1]));
+    if (error != BMD_ERROR_NONE)
+    {
+        return error;
+    }
+    bytes = bmd->fd_width * bmd->fd_height * 3 / 2;
+    error = bmd_payload_create(40 + bytes, &payload);
+    if (error != BMD_ERROR_NONE)
+    {
+        return error;
+    }
+    bmd_payload_set_stream(payload, &out_s);
+    out_uint32_le(&out_s, BMD_PDU_CODE_VIDEO_RAW);
+    out_uint32_le(&out_s, 40 + bytes);
+    out_uint32_le(&out_s, bmd->fd_time);
+    out_uint32_le(&out_s, bmd->fd_seq);
+    out_uint8s(&out_s, 4);
+    out_uint32_le(&out_s, bmd->fd_width);
+    out_uint32_le(&out_s, bmd->fd_height);
+    out_uint32_le(&out_s, bmd->fd_width);
+    out_uint32_le(&out_s, bytes);
+    out_uint32_le(&out_s, bmd->fd_bpp);
+    for (index = 0; index < bmd->fd_height; index++)
+    {
+        out_uint8p(&out_s, (char*)(src_data[0]) + index * src_stride[0],
+                   bmd->fd_width);
+    }
+    for (index = 0; index < bmd->fd_height / 2; index++)
+    {
+        out_uint8p(&out_s, (char*)(src_data[1]) + index * src_stride[1],
+                   bmd->fd_width);
+    }
+    payload->bytes = (int)(out_s.p - out_s.data);
+    bmd->video_raw_payload = payload;
+    bmd->video_raw_frame_count = bmd->video_frame_count;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* code the changed tiles of the frame once for every compressing peer,
+   the surface is converted into again next frame so the codec keeps its
+   own copy to compare against, shards read the codec under the lock */
+static int
+bmd_encode_video_tiles_locked(struct bmd_info* bmd)
+{
     void* ydata;
     void* uvdata;
-    int ydata_stride_bytes;
-    int uvdata_stride_bytes;
-    int index;
-    char* src8;
-    char* dst8;
+    int ystride;
+    int uvstride;
+    int error;
+
+    if ((bmd->codec != NULL) && ((bmd->codec_width != bmd->fd_width) ||
+                                 (bmd->codec_height != bmd->fd_height)))
+    {
+        bmd_codec_delete(bmd->codec);
+        bmd->codec = NULL;
+    }
+    if (bmd->codec == NULL)
+    {
+        error = bmd_codec_create(bmd->fd_width, bmd->fd_height,
+                                 &(bmd->codec));
+        if (error != BMD_ERROR_NONE)
+        {
+            return error;
+        }
+        bmd->codec_width = bmd->fd_width;
+        bmd->codec_height = bmd->fd_height;
+    }
+    error = bmd_surface_get_ybuffer(bmd->surface, &ydata, &ystride);
+    if (error != BMD_ERROR_NONE)
+    {
+        return error;
+    }
+    error = bmd_surface_get_uvbuffer(bmd->surface, &uvdata, &uvstride);
+    if (error != BMD_ERROR_NONE)
+    {
+        return error;
+    }
+    error = bmd_codec_encode(bmd->codec, ydata, ystride, uvdata, uvstride,
+                             bmd->fd_seq);
+    if (error != BMD_ERROR_NONE)
+    {
+        return error;
+    }
+    bmd->video_tiles_frame_count = bmd->video_frame_count;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_encode_video_tiles(struct bmd_info* bmd)
+{
+    int error;
+
+    bmd_peer_release_video_tiles(bmd);
+    bmd_shard_lock_codec(bmd->shards, 1);
+    error = bmd_encode_video_tiles_locked(bmd);
+    bmd_shard_unlock_codec(bmd->shards);
+    return error;
+}
+
+/*****************************************************************************/
+/* the recorder and the timeshift copy the frame from the surface, the
+   recorder's writer thread does the rest */
+static int
+bmd_store_frame(struct bmd_info* bmd)
+{
+    void* ydata;
+    void* uvdata;
+    int ystride;
+    int uvstride;
+    int error;
+
+    error = bmd_surface_get_ybuffer(bmd->surface, &ydata, &ystride);
+    if (error != BMD_ERROR_NONE)
+    {
+        return error;
+    }
+    error = bmd_surface_get_uvbuffer(bmd->surface, &uvdata, &uvstride);
+    if (error != BMD_ERROR_NONE)
+    {
+        return error;
+    }
+    if (bmd->record != NULL)
+    {
+        bmd_record_video(bmd->record, bmd->fd_time, bmd->fd_seq,
+                         bmd->fd_width, bmd->fd_height,
+                         ydata, ystride, uvdata, uvstride);
+    }
+    if (bmd->timeshift != NULL)
+    {
+        bmd_timeshift_video(bmd->timeshift, bmd->fd_time, bmd->fd_seq,
+                            bmd->fd_width, bmd->fd_height,
+                            ydata, ystride, uvdata, uvstride);
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_process_av(struct bmd_info* bmd)
+{
+    struct bmd_av_info* av_info;
+    struct bmd_payload* payload;
+    struct stream out_s;
+    int bytes;
+    int got_frame;
+    int got_audio;
+    int vtime;
+    int vseq;
+    struct bmd_trace vtrace;
 
     LOGLN10((LOG_INFO, LOGS, LOGP));
     av_info = bmd->av_info;
@@ -151,143 +543,149 @@ bmd_process_av(struct bmd_info* bmd)
     {
         return BMD_ERROR_NONE;
     }
-    nv12_data = NULL;
-    out_s = NULL;
+    got_frame = 0;
+    vtime = 0;
+    vseq = 0;
+    bytes = 0;
+    payload = NULL;
+    memset(&vtrace, 0, sizeof(vtrace));
     pthread_mutex_lock(&(av_info->av_mutex));
     if (av_info->got_video)
     {
         LOGLN10((LOG_INFO, LOGS "got video", LOGP));
         av_info->got_video = 0;
-        bytes = av_info->vwidth * av_info->vheight * 2;
-        nv12_data = xnew(char, bytes);
-        if (nv12_data != NULL)
+        vtrace.callback_us = av_info->vcallback_us;
+        get_ustime(&(vtrace.dequeue_us));
+        /* demand may have gone away since the callback copied the frame,
+           keep the last converted frame in that case */
+        if (bmd->video_demand &&
+            (bmd_process_video(bmd, av_info) == BMD_ERROR_NONE))
         {
-            dst_data[0] = nv12_data;
-            dst_data[1] = nv12_data + (av_info->vwidth * av_info->vheight);
-            dst_stride[0] = av_info->vwidth;
-            dst_stride[1] = av_info->vwidth;
-            yuy2_to_nv12(av_info->vdata, av_info->vstride_bytes,
-                         dst_data, dst_stride,
-                         av_info->vwidth, av_info->vheight);
+            got_frame = 1;
+            vtime = av_info->vtime;
+            vseq = av_info->vframe_seq;
+            get_ustime(&(vtrace.convert_us));
         }
     }
-    if (av_info->got_audio)
+    got_audio = av_info->got_audio;
+    if (got_audio)
     {
         LOGLN10((LOG_INFO, LOGS "got audio", LOGP));
         av_info->got_audio = 0;
+        /* nothing to convert or export for audio */
+        bmd->audio_trace.seq = av_info->atime;
+        bmd->audio_trace.callback_us = av_info->acallback_us;
+        get_ustime(&(bmd->audio_trace.dequeue_us));
+        bmd->audio_trace.convert_us = bmd->audio_trace.dequeue_us;
+        bmd->audio_trace.export_us = bmd->audio_trace.dequeue_us;
         bytes = av_info->achannels * av_info->abytes_per_sample *
                 av_info->asamples;
-        out_s = xnew0(struct stream, 1);
-        if (out_s != NULL)
+        if (bmd->audio_shm_demand && (bmd->audio_ring != NULL))
         {
-            out_s->size = bytes + 1024;
-            out_s->data = xnew(char, out_s->size);
-            if (out_s->data != NULL)
-            {
-                out_s->p = out_s->data;
-                out_uint32_le(out_s, BMD_PDU_CODE_AUDIO);
-                out_uint32_le(out_s, 24 + bytes);
-                out_uint32_le(out_s, av_info->atime);
-                out_uint8s(out_s, 4);
-                out_uint32_le(out_s, av_info->achannels);
-                out_uint32_le(out_s, bytes);
-                out_uint8p(out_s, av_info->adata, bytes);
-                out_s->end = out_s->p;
-                out_s->p = out_s->data;
-            }
+            /* one copy and at most one wakeup for every shm subscriber */
+            bmd_audio_ring_write(bmd->audio_ring, av_info->adata, bytes,
+                                 av_info->atime, 1);
+        }
+        if (bmd->record != NULL)
+        {
+            bmd_record_audio(bmd->record, av_info->atime,
+                             av_info->achannels, av_info->abytes_per_sample,
+                             BMD_AUDIO_SAMPLE_RATE, av_info->adata, bytes);
+        }
+        if (bmd->timeshift != NULL)
+        {
+            bmd_timeshift_audio(bmd->timeshift, av_info->atime,
+                                av_info->achannels,
+                                av_info->abytes_per_sample,
+                                BMD_AUDIO_SAMPLE_RATE, av_info->adata,
+                                bytes);
         }
     }
-    pthread_mutex_unlock(&(av_info->av_mutex));
-    if (out_s != NULL)
+    if (got_audio && bmd->audio_socket_demand)
     {
-        if (out_s->data != NULL)
+        /* built once, every subscribed peer queues a reference */
+        if (bmd_payload_create(36 + bytes, &payload) == BMD_ERROR_NONE)
         {
-            bmd_peer_queue_all_audio(bmd, out_s);
-            free(out_s->data);
+            bmd_payload_set_stream(payload, &out_s);
+            out_uint32_le(&out_s, BMD_PDU_CODE_AUDIO);
+            out_uint32_le(&out_s, 36 + bytes);
+            out_uint32_le(&out_s, av_info->atime);
+            out_uint8s(&out_s, 4);
+            out_uint32_le(&out_s, av_info->achannels);
+            out_uint32_le(&out_s, bytes);
+            out_uint8p(&out_s, av_info->adata, bytes);
+            /* capture rate, not resampled */
+            out_uint32_le(&out_s, BMD_AUDIO_SAMPLE_RATE);
+            out_uint32_le(&out_s, 0);
+            /* the first sample came in a packet before the callback */
+            out_uint32_le(&out_s, (int)(bmd->audio_trace.dequeue_us -
+                                        av_info->acallback_us +
+                                        av_info->asamples * 1000000LL /
+                                        BMD_AUDIO_SAMPLE_RATE));
+            payload->bytes = (int)(out_s.p - out_s.data);
         }
-        free(out_s);
     }
-    if (nv12_data != NULL)
+    pthread_mutex_unlock(&(av_info->av_mutex));
+    if (payload != NULL)
+    {
+        bmd_peer_queue_all_audio(bmd, payload);
+        bmd_payload_release(payload);
+    }
+    if (got_frame)
     {
-        if ((bmd->yami == NULL) ||
-            (bmd->yami_width != av_info->vwidth) ||
-            (bmd->yami_height != av_info->vheight))
+        if (bmd->fd > 0)
         {
-            LOGLN0((LOG_INFO, LOGS "yami_surface_create width %d height %d",
-                    LOGP, av_info->vwidth, av_info->vheight));
-            yami_surface_delete(bmd->yami);
-            if (yami_surface_create(&(bmd->yami),
-                                    av_info->vwidth, av_info->vheight,
-                                    0, 0) != YI_SUCCESS)
-            {
-                LOGLN0((LOG_ERROR, LOGS "yami_surface_create failed", LOGP));
-                bmd->yami = NULL;
-                free(nv12_data);
-                return 1;
-            }
-            bmd->video_frame_count = 0;
-            bmd->yami_width = av_info->vwidth;
-            bmd->yami_height = av_info->vheight;
+            close(bmd->fd);
+            bmd->fd = 0;
         }
-        if (yami_surface_get_ybuffer(bmd->yami, &ydata,
-                                     &ydata_stride_bytes) != YI_SUCCESS)
+        if (bmd_surface_get_fd_dst(bmd->surface, &(bmd->fd),
+                                   &(bmd->fd_width),
+                                   &(bmd->fd_height),
+                                   &(bmd->fd_stride),
+                                   &(bmd->fd_size),
+                                   &(bmd->fd_bpp)) != BMD_ERROR_NONE)
         {
-            LOGLN0((LOG_ERROR, LOGS "yami_surface_get_ybuffer failed", LOGP));
-            free(nv12_data);
+            LOGLN0((LOG_ERROR, LOGS "bmd_surface_get_fd_dst failed", LOGP));
+            bmd->fd = 0;
             return 1;
         }
-        src8 = nv12_data;
-        dst8 = (char*)ydata;
-        bytes = av_info->vwidth;
-        if (bytes > ydata_stride_bytes)
-        {
-            bytes = ydata_stride_bytes;
-        }
-        for (index = 0; index < av_info->vheight; index++)
+        get_ustime(&(vtrace.export_us));
+        vtrace.seq = vseq;
+        bmd->video_trace = vtrace;
+        bmd->fd_time = vtime;
+        bmd->fd_seq = vseq;
+        bmd->video_frame_count++;
+        if (bmd_build_video_payload(bmd) != BMD_ERROR_NONE)
         {
-            memcpy(dst8, src8, bytes);
-            src8 += av_info->vwidth;
-            dst8 += ydata_stride_bytes;
+            LOGLN0((LOG_ERROR, LOGS "bmd_build_video_payload failed", LOGP));
+            return 1;
         }
-        if (yami_surface_get_uvbuffer(bmd->yami, &uvdata,
-                                      &uvdata_stride_bytes) != YI_SUCCESS)
+        if (bmd->history != NULL)
         {
-            LOGLN0((LOG_ERROR, LOGS "yami_surface_get_uvbuffer failed", LOGP));
-            free(nv12_data);
-            return 1;
+            bmd_history_add(bmd->history, vseq, vtime, bmd->video_payload);
         }
-        src8 = nv12_data + av_info->vwidth * av_info->vheight;
-        dst8 = (char*)uvdata;
-        bytes = av_info->vwidth;
-        if (bytes > uvdata_stride_bytes)
+        if ((bmd->record != NULL) || (bmd->timeshift != NULL))
         {
-            bytes = uvdata_stride_bytes;
+            bmd_store_frame(bmd);
         }
-        for (index = 0; index < av_info->vheight; index += 2)
+        if (bmd->video_raw_demand &&
+            (bmd_build_video_raw_payload(bmd) != BMD_ERROR_NONE))
         {
-            memcpy(dst8, src8, bytes);
-            src8 += av_info->vwidth;
-            dst8 += uvdata_stride_bytes;
+            LOGLN0((LOG_ERROR, LOGS "bmd_build_video_raw_payload failed",
+                    LOGP));
         }
-        free(nv12_data);
-        if (bmd->fd > 0)
+        if (bmd->video_tiles_demand &&
+            (bmd_encode_video_tiles(bmd) != BMD_ERROR_NONE))
         {
-            close(bmd->fd);
-            bmd->fd = 0;
+            LOGLN0((LOG_ERROR, LOGS "bmd_encode_video_tiles failed", LOGP));
         }
-        if (yami_surface_get_fd_dst(bmd->yami, &(bmd->fd),
-                                    &(bmd->fd_width),
-                                    &(bmd->fd_height),
-                                    &(bmd->fd_stride),
-                                    &(bmd->fd_size),
-                                    &(bmd->fd_bpp))!= YI_SUCCESS)
+        if (bmd->prime_surface)
         {
-            LOGLN0((LOG_ERROR, LOGS "yami_surface_get_fd_dst failed", LOGP));
-            return 1;
+            bmd->prime_surface = 0;
+            bmd_peer_update_demand(bmd);
         }
-        bmd->fd_time = av_info->vtime;
-        bmd->video_frame_count++;
         bmd_peer_queue_all_video(bmd);
+        bmd_process_encode(bmd);
     }
     return BMD_ERROR_NONE;
 }
@@ -314,6 +712,8 @@ static int
 process_args(int argc, char** argv, struct settings_info* settings)
 {
     int index;
+    int type;
+    char* colon;
 
     if (argc < 1)
     {
@@ -326,15 +726,255 @@ process_args(int argc, char** argv, struct settings_info* settings)
         {
             settings->daemonize = 1;
         }
-        else if (strcmp("-n", argv[index]) == 0)
+        else if (strcmp("-n", argv[index]) == 0)
+        {
+            index++;
+            strncpy(settings->bmd_uds_name, argv[index], 255);
+        }
+        else if (strcmp("-m", argv[index]) == 0)
+        {
+            index++;
+            settings->mode_index = atoi(argv[index]) % NUM_MODE_NAMES;
+        }
+        else if (strcmp("-u", argv[index]) == 0)
+        {
+            settings->use_udmabuf = 1;
+        }
+        else if (strcmp("-l", argv[index]) == 0)
+        {
+            index++;
+            if (index >= argc)
+            {
+                return BMD_ERROR_PARAM;
+            }
+            settings->linger_ms = atoi(argv[index]);
+            if (settings->linger_ms < 0)
+            {
+                return BMD_ERROR_PARAM;
+            }
+        }
+        else if (strcmp("-w", argv[index]) == 0)
+        {
+            settings->warm_standby = 1;
+        }
+        else if (strcmp("-S", argv[index]) == 0)
+        {
+            settings->use_synth = 1;
+        }
+        else if (strcmp("-P", argv[index]) == 0)
+        {
+            settings->use_seqpacket = 1;
+        }
+        else if (strcmp("-Z", argv[index]) == 0)
+        {
+            settings->compress = 1;
+        }
+        else if (strcmp("-R", argv[index]) == 0)
+        {
+            settings->use_io_uring = 1;
+        }
+        else if (strcmp("-K", argv[index]) == 0)
+        {
+            index++;
+            if (index >= argc)
+            {
+                return BMD_ERROR_PARAM;
+            }
+            settings->num_shards = atoi(argv[index]);
+            if ((settings->num_shards < 0) ||
+                (settings->num_shards > BMD_SHARD_MAX))
+            {
+                return BMD_ERROR_PARAM;
+            }
+        }
+        else if (strcmp("-H", argv[index]) == 0)
+        {
+            index++;
+            if (index >= argc)
+            {
+                return BMD_ERROR_PARAM;
+            }
+            settings->history_mb = atoi(argv[index]);
+            if ((settings->history_mb < 0) || (settings->history_mb > 65536))
+            {
+                return BMD_ERROR_PARAM;
+            }
+        }
+        else if (strcmp("-r", argv[index]) == 0)
+        {
+            index++;
+            if (index >= argc)
+            {
+                return BMD_ERROR_PARAM;
+            }
+            strncpy(settings->record_dir, argv[index], 255);
+        }
+        else if (strcmp("-g", argv[index]) == 0)
+        {
+            index++;
+            if (index >= argc)
+            {
+                return BMD_ERROR_PARAM;
+            }
+            settings->record_segment_s = atoi(argv[index]);
+            if ((settings->record_segment_s < 1) ||
+                (settings->record_segment_s > 86400))
+            {
+                return BMD_ERROR_PARAM;
+            }
+        }
+        else if (strcmp("-X", argv[index]) == 0)
+        {
+            index++;
+            if (index >= argc)
+            {
+                return BMD_ERROR_PARAM;
+            }
+            /* path:MB */
+            strncpy(settings->timeshift_path, argv[index], 255);
+            colon = strrchr(settings->timeshift_path, ':');
+            if (colon == NULL)
+            {
+                return BMD_ERROR_PARAM;
+            }
+            *colon = 0;
+            settings->timeshift_mb = atoi(colon + 1);
+            if ((settings->timeshift_path[0] == 0) ||
+                (settings->timeshift_mb <
+                 BMD_TIMESHIFT_MIN_BYTES / (1024 * 1024)) ||
+                (settings->timeshift_mb > 1024 * 1024))
+            {
+                return BMD_ERROR_PARAM;
+            }
+        }
+        else if (strcmp("-T", argv[index]) == 0)
+        {
+            index++;
+            if (index >= argc)
+            {
+                return BMD_ERROR_PARAM;
+            }
+            /* [addr:]port */
+            strncpy(settings->tcp_addr, argv[index], 63);
+            colon = strrchr(settings->tcp_addr, ':');
+            if (colon == NULL)
+            {
+                settings->tcp_port = atoi(settings->tcp_addr);
+                strcpy(settings->tcp_addr, "0.0.0.0");
+            }
+            else
+            {
+                *colon = 0;
+                settings->tcp_port = atoi(colon + 1);
+            }
+            if ((settings->tcp_port < 1) || (settings->tcp_port > 65535))
+            {
+                return BMD_ERROR_PARAM;
+            }
+        }
+        else if (strcmp("-b", argv[index]) == 0)
+        {
+            index++;
+            if (index >= argc)
+            {
+                return BMD_ERROR_PARAM;
+            }
+            settings->peer_limits.max_bytes = atoi(argv[index]);
+        }
+        else if (strcmp("-f", argv[index]) == 0)
+        {
+            index++;
+            if (index >= argc)
+            {
+                return BMD_ERROR_PARAM;
+            }
+            settings->peer_limits.max_fds = atoi(argv[index]);
+        }
+        else if (strcmp("-a", argv[index]) == 0)
+        {
+            index++;
+            if (index >= argc)
+            {
+                return BMD_ERROR_PARAM;
+            }
+            settings->peer_limits.max_age_ms = atoi(argv[index]);
+        }
+        else if (strcmp("-s", argv[index]) == 0)
+        {
+            index++;
+            if (index >= argc)
+            {
+                return BMD_ERROR_PARAM;
+            }
+            settings->peer_limits.stall_ms = atoi(argv[index]);
+        }
+        else if (strcmp("-V", argv[index]) == 0)
+        {
+            index++;
+            if (index >= argc)
+            {
+                return BMD_ERROR_PARAM;
+            }
+            if (strcmp(argv[index], "latest") == 0)
+            {
+                settings->peer_limits.video_policy = BMD_VIDEO_POLICY_LATEST;
+            }
+            else if (strcmp(argv[index], "queue") == 0)
+            {
+                settings->peer_limits.video_policy = BMD_VIDEO_POLICY_QUEUE;
+            }
+            else
+            {
+                return BMD_ERROR_PARAM;
+            }
+        }
+        else if (strcmp("-A", argv[index]) == 0)
         {
             index++;
-            strncpy(settings->bmd_uds_name, argv[index], 255);
+            if (index >= argc)
+            {
+                return BMD_ERROR_PARAM;
+            }
+            if (strcmp(argv[index], "oldest") == 0)
+            {
+                settings->peer_limits.audio_policy =
+                        BMD_AUDIO_POLICY_DROP_OLDEST;
+            }
+            else if (strcmp(argv[index], "newest") == 0)
+            {
+                settings->peer_limits.audio_policy =
+                        BMD_AUDIO_POLICY_DROP_NEWEST;
+            }
+            else
+            {
+                return BMD_ERROR_PARAM;
+            }
         }
-        else if (strcmp("-m", argv[index]) == 0)
+        else if (strcmp("-e", argv[index]) == 0)
         {
             index++;
-            settings->mode_index = atoi(argv[index]) % NUM_MODE_NAMES;
+            if ((index >= argc) ||
+                (settings->num_renditions >= BMD_MAX_RENDITIONS))
+            {
+                return BMD_ERROR_PARAM;
+            }
+            if (strcmp(argv[index], "auto") == 0)
+            {
+                type = BMD_ENCODER_TYPE_AUTO;
+            }
+            else if (strcmp(argv[index], "yami") == 0)
+            {
+                type = BMD_ENCODER_TYPE_YAMI;
+            }
+            else if (strcmp(argv[index], "sw") == 0)
+            {
+                type = BMD_ENCODER_TYPE_SW;
+            }
+            else
+            {
+                return BMD_ERROR_PARAM;
+            }
+            settings->rendition_types[settings->num_renditions++] = type;
         }
         else
         {
@@ -362,6 +1002,55 @@ printf_help(int argc, char** argv)
     {
         printf("                %d - %s\n", index, g_mode_names[index]);
     }
+    printf("    -u      use %s surfaces, no render node needed, "
+           "example -u\n", BMD_UDMABUF_DEV);
+    printf("    -l      ms to keep capture running after the last peer "
+           "leaves, default 0, example -l 5000\n");
+    printf("    -w      warm standby, start capture at startup and keep it "
+           "idle when no peers, example -w\n");
+    printf("    -S      synthetic capture at the -m mode instead of "
+           "DeckLink, for load tests, example -S\n");
+    printf("    -P      SOCK_SEQPACKET listener, one message per pdu, "
+           "pdus over %d bytes are dropped, sw renditions are not "
+           "sent, example -P\n",
+           BMD_SEQPACKET_MAX_BYTES);
+    printf("    -T      tcp listener for remote peers, [addr:]port, video "
+           "goes as pixels, example -T 127.0.0.1:5000\n");
+    printf("    -Z      lossless tile compression of video to tcp peers "
+           "that support it, example -Z\n");
+    printf("    -R      io_uring for peer io, falls back to select when "
+           "the kernel can not, example -R\n");
+    printf("    -K      peer io threads, peers are spread over them, 0 "
+           "serves peers on the main thread, default 0, max %d, "
+           "example -K 4\n", BMD_SHARD_MAX);
+    printf("    -H      MB of recent video frames kept for "
+           "REQUEST_VIDEO_HISTORY, each in its own surface, 0 for none, "
+           "default 0, example -H 256\n");
+    printf("    -r      record frames and capture audio to segment files "
+           "in a directory, capture stays up, example -r /var/bmd\n");
+    printf("    -g      seconds in a recording segment, default %d, "
+           "example -g 300\n", BMD_RECORD_SEGMENT_MS / 1000);
+    printf("    -X      timeshift file and MB, frames and capture audio "
+           "kept for REQUEST_TIMESHIFT, min %d, capture stays up, "
+           "example -X /var/bmd/timeshift:4096\n",
+           BMD_TIMESHIFT_MIN_BYTES / (1024 * 1024));
+    printf("    -b      per peer queued bytes limit, 0 for none, "
+           "default %d, example -b 16777216\n", BMD_PEER_MAX_BYTES);
+    printf("    -f      per peer queued fd limit, 0 for none, default %d, "
+           "example -f 4\n", BMD_PEER_MAX_FDS);
+    printf("    -a      ms queued video and audio can wait before it is "
+           "dropped, 0 for none, default %d, example -a 500\n",
+           BMD_PEER_MAX_AGE_MS);
+    printf("    -s      ms a peer can sit on queued output before it is "
+           "dropped, 0 for none, default %d, example -s 5000\n",
+           BMD_PEER_STALL_MS);
+    printf("    -V      video policy when a frame is already queued, latest "
+           "replaces it, queue keeps both, default latest, example -V "
+           "queue\n");
+    printf("    -A      audio policy when the queue is full, drop oldest or "
+           "newest, default oldest, example -A newest\n");
+    printf("    -e      add h264 rendition, auto, yami or sw, can be used "
+           "up to %d times, example -e auto\n", BMD_MAX_RENDITIONS);
     return BMD_ERROR_NONE;
 }
 
@@ -369,6 +1058,8 @@ printf_help(int argc, char** argv)
 static int
 bmd_cleanup(struct bmd_info* bmd)
 {
+    int index;
+
     LOGLN0((LOG_INFO, LOGS, LOGP));
     if (bmd->declink != NULL)
     {
@@ -376,6 +1067,11 @@ bmd_cleanup(struct bmd_info* bmd)
         bmd_declink_delete(bmd->declink);
         bmd->declink = NULL;
     }
+    if (bmd->synth != NULL)
+    {
+        bmd_synth_delete(bmd->synth);
+        bmd->synth = NULL;
+    }
     if (bmd->av_info != NULL)
     {
         LOGLN0((LOG_INFO, LOGS "av_info cleanup", LOGP));
@@ -387,13 +1083,38 @@ bmd_cleanup(struct bmd_info* bmd)
         free(bmd->av_info);
         bmd->av_info = NULL;
     }
-    if (bmd->yami != NULL)
+    if (bmd->history != NULL)
+    {
+        /* the surfaces are the history's */
+        bmd_history_clear(bmd->history, 1);
+    }
+    else if (bmd->surface != NULL)
+    {
+        bmd_surface_delete(bmd->surface);
+    }
+    bmd->surface = NULL;
+    bmd->surface_width = 0;
+    bmd->surface_height = 0;
+    for (index = 0; index < bmd->num_renditions; index++)
+    {
+        bmd_encoder_delete(bmd->renditions[index].encoder);
+        bmd->renditions[index].encoder = NULL;
+    }
+    bmd_payload_release(bmd->video_payload);
+    bmd->video_payload = NULL;
+    bmd_payload_release(bmd->video_raw_payload);
+    bmd->video_raw_payload = NULL;
+    bmd_peer_release_video_tiles(bmd);
+    bmd_shard_lock_codec(bmd->shards, 1);
+    bmd_codec_delete(bmd->codec);
+    bmd->codec = NULL;
+    bmd_shard_unlock_codec(bmd->shards);
+    if (bmd->shards == NULL)
     {
-        yami_surface_delete(bmd->yami);
-        bmd->yami = NULL;
+        /* with shards the ring lives as long as they do */
+        bmd_audio_ring_delete(bmd->audio_ring);
+        bmd->audio_ring = NULL;
     }
-    bmd->yami_width = 0;
-    bmd->yami_height = 0;
     if (bmd->fd > 0)
     {
         close(bmd->fd);
@@ -428,6 +1149,17 @@ bmd_start(struct bmd_info* bmd, struct settings_info* settings)
         bmd->av_info = NULL;
         return BMD_ERROR_PIPE;
     }
+    bmd_peer_update_demand(bmd);
+    if (settings->use_synth)
+    {
+        error = bmd_synth_create(settings->mode_index, bmd->av_info,
+                                 &(bmd->synth));
+        if (error != BMD_ERROR_NONE)
+        {
+            return error;
+        }
+        return bmd_synth_start(bmd->synth);
+    }
     error = bmd_declink_create(settings->mode_index, bmd->av_info,
                                &(bmd->declink));
     if (error != BMD_ERROR_NONE)
@@ -453,36 +1185,182 @@ bmd_stop(struct bmd_info* bmd)
     return BMD_ERROR_NONE;
 }
 
+/*****************************************************************************/
+/* last peer is gone and any linger time is over
+   in warm standby DeckLink, the surface and the encoders stay up and the
+   callback idles because there is no demand, only the cached frame is
+   dropped so a reconnecting peer does not get a stale picture */
+static int
+bmd_idle(struct bmd_info* bmd, struct settings_info* settings)
+{
+    bmd->is_lingering = 0;
+    if (bmd->shards != NULL)
+    {
+        /* shards drop the frame they hold too */
+        bmd_shard_post_idle(bmd->shards);
+    }
+    if (settings->warm_standby)
+    {
+        LOGLN0((LOG_INFO, LOGS "entering warm standby", LOGP));
+        if (bmd->fd > 0)
+        {
+            close(bmd->fd);
+            bmd->fd = 0;
+        }
+        bmd_payload_release(bmd->video_payload);
+        bmd->video_payload = NULL;
+        bmd_payload_release(bmd->video_raw_payload);
+        bmd->video_raw_payload = NULL;
+        bmd_peer_release_video_tiles(bmd);
+        if (bmd->history != NULL)
+        {
+            bmd_history_clear(bmd->history, 0);
+        }
+        return BMD_ERROR_NONE;
+    }
+    if (bmd_stop(bmd) == 0)
+    {
+        bmd->is_running = 0;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* there are peers, capture comes up if it is not, *started is set when
+   that brought it up */
+static int
+bmd_arrived(struct bmd_info* bmd, struct settings_info* settings,
+            int* started)
+{
+    *started = 0;
+    bmd->is_lingering = 0;
+    if (bmd->is_running == 0)
+    {
+        if (bmd_start(bmd, settings) == 0)
+        {
+            bmd->is_running = 1;
+            *started = 1;
+        }
+        else
+        {
+            bmd_stop(bmd);
+        }
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* a new peer on the uds or the tcp listener, *started is set when that
+   brought capture up */
+static int
+bmd_accept(struct bmd_info* bmd, struct settings_info* settings,
+           int listener, int remote, int* started)
+{
+    struct sockaddr_storage s;
+    socklen_t sock_len;
+    int sck;
+
+    *started = 0;
+    sock_len = sizeof(s);
+    sck = accept(listener, (struct sockaddr*)&s, &sock_len);
+    LOGLN0((LOG_INFO, LOGS "got connection sck %d remote %d", LOGP, sck,
+            remote));
+    if (sck == -1)
+    {
+        return BMD_ERROR_NONE;
+    }
+    if (bmd_peer_add_fd(bmd, sck, remote) != BMD_ERROR_NONE)
+    {
+        LOGLN0((LOG_ERROR, LOGS "bmd_peer_add_fd failed", LOGP));
+        close(sck);
+        return BMD_ERROR_NONE;
+    }
+    return bmd_arrived(bmd, settings, started);
+}
+
+/*****************************************************************************/
+/* a peer left, here or on a shard, *gone is set when that was the last one
+   and capture lingers or idles */
+static int
+bmd_check_gone(struct bmd_info* bmd, struct settings_info* settings,
+               int* gone)
+{
+    int count;
+    int now;
+    int error;
+
+    *gone = 0;
+    bmd_peer_get_count(bmd, &count);
+    if ((count == 0) && bmd->is_running && !(bmd->is_lingering))
+    {
+        *gone = 1;
+        if (settings->linger_ms > 0)
+        {
+            error = get_mstime(&now);
+            if (error != BMD_ERROR_NONE)
+            {
+                LOGLN0((LOG_ERROR, LOGS "get_mstime failed", LOGP));
+                return error;
+            }
+            LOGLN0((LOG_INFO, LOGS "lingering for %d ms",
+                    LOGP, settings->linger_ms));
+            bmd->is_lingering = 1;
+            bmd->linger_mstime = now + settings->linger_ms;
+            return BMD_ERROR_NONE;
+        }
+        bmd_idle(bmd, settings);
+    }
+    return BMD_ERROR_NONE;
+}
+
 /*****************************************************************************/
 static int
 bmd_process_fds(struct bmd_info* bmd, struct settings_info* settings,
                 int mstime)
 {
     int max_fd;
+    int shard_fd;
+    int gone;
+    int count;
     int now;
     int rv;
     int millis;
     int error;
-    int sck;
+    int started;
     fd_set rfds;
     fd_set wfds;
     struct timeval time;
     struct timeval* ptime;
-    socklen_t sock_len;
-    struct sockaddr_un s;
     char char4[4];
 
     rv = BMD_ERROR_NONE;
+    shard_fd = -1;
+    if (bmd->shards != NULL)
+    {
+        bmd_shard_get_wake_fd(bmd->shards, &shard_fd);
+    }
     for (;;)
     {
         FD_ZERO(&rfds);
         FD_ZERO(&wfds);
-        FD_SET(bmd->listener, &rfds);
-        max_fd = bmd->listener;
         FD_SET(g_term_pipe[0], &rfds);
-        if (g_term_pipe[0] > max_fd)
+        max_fd = g_term_pipe[0];
+        if (bmd->io_uring == NULL)
         {
-            max_fd = g_term_pipe[0];
+            /* with io_uring the listeners are on the ring */
+            FD_SET(bmd->listener, &rfds);
+            if (bmd->listener > max_fd)
+            {
+                max_fd = bmd->listener;
+            }
+            if (bmd->tcp_listener != -1)
+            {
+                FD_SET(bmd->tcp_listener, &rfds);
+                if (bmd->tcp_listener > max_fd)
+                {
+                    max_fd = bmd->tcp_listener;
+                }
+            }
         }
         if (bmd->av_info != NULL)
         {
@@ -492,6 +1370,14 @@ bmd_process_fds(struct bmd_info* bmd, struct settings_info* settings,
                 max_fd = bmd->av_info->av_pipe[0];
             }
         }
+        if (shard_fd != -1)
+        {
+            FD_SET(shard_fd, &rfds);
+            if (shard_fd > max_fd)
+            {
+                max_fd = shard_fd;
+            }
+        }
         if (bmd_peer_get_fds(bmd, &max_fd, &rfds, &wfds) != 0)
         {
             LOGLN0((LOG_ERROR, LOGS "bmd_peer_get_fds failed", LOGP));
@@ -541,49 +1427,58 @@ bmd_process_fds(struct bmd_info* bmd, struct settings_info* settings,
             }
             if (FD_ISSET(bmd->listener, &rfds))
             {
-                sock_len = sizeof(struct sockaddr_un);
-                sck = accept(bmd->listener, (struct sockaddr*)&s, &sock_len);
-                LOGLN0((LOG_INFO, LOGS "got connection sck %d", LOGP, sck));
-                if (sck != -1)
+                bmd_accept(bmd, settings, bmd->listener, 0, &started);
+                if (started)
                 {
-                    if (bmd_peer_add_fd(bmd, sck) != BMD_ERROR_NONE)
-                    {
-                        LOGLN0((LOG_ERROR, LOGS "bmd_peer_add_fd failed",
-                                LOGP));
-                        close(sck);
-                    }
-                    else
-                    {
-                        if (bmd->is_running == 0)
-                        {
-                            if (bmd_start(bmd, settings) == 0)
-                            {
-                                bmd->is_running = 1;
-                                break;
-                            }
-                            else
-                            {
-                                bmd_stop(bmd);
-                            }
-                        }
-                    }
+                    break;
+                }
+            }
+            if ((bmd->tcp_listener != -1) &&
+                FD_ISSET(bmd->tcp_listener, &rfds))
+            {
+                bmd_accept(bmd, settings, bmd->tcp_listener, 1, &started);
+                if (started)
+                {
+                    break;
+                }
+            }
+            if ((shard_fd != -1) && FD_ISSET(shard_fd, &rfds))
+            {
+                /* a shard's demand or peer count changed */
+                bmd_shard_check_wake(bmd->shards);
+                bmd_peer_update_demand(bmd);
+                if (bmd_check_gone(bmd, settings, &gone) != BMD_ERROR_NONE)
+                {
+                    break;
+                }
+                if (gone)
+                {
+                    break;
                 }
             }
             error = bmd_peer_check_fds(bmd, &rfds, &wfds);
+            if ((bmd->io_uring != NULL) && !(bmd->is_running) &&
+                (bmd_peer_get_count(bmd, &count) == BMD_ERROR_NONE) &&
+                (count > 0))
+            {
+                /* accepted on the ring */
+                bmd_arrived(bmd, settings, &started);
+                if (started)
+                {
+                    break;
+                }
+            }
             if (error != BMD_ERROR_NONE)
             {
                 LOGLN0((LOG_ERROR, LOGS "bmd_peer_check_fds error %d",
                         LOGP, error));
-                if (bmd->peer_head == NULL)
+                if (bmd_check_gone(bmd, settings, &gone) != BMD_ERROR_NONE)
                 {
-                    if (bmd->is_running)
-                    {
-                        if (bmd_stop(bmd) == 0)
-                        {
-                            bmd->is_running = 0;
-                            break;
-                        }
-                    }
+                    break;
+                }
+                if (gone)
+                {
+                    break;
                 }
             }
         }
@@ -604,6 +1499,45 @@ bmd_process_fds(struct bmd_info* bmd, struct settings_info* settings,
     return rv;
 }
 
+/*****************************************************************************/
+static int
+bmd_tcp_listen(struct bmd_info* bmd, struct settings_info* settings)
+{
+    struct sockaddr_in s;
+    int option;
+
+    memset(&s, 0, sizeof(s));
+    s.sin_family = AF_INET;
+    s.sin_port = htons(settings->tcp_port);
+    if (inet_pton(AF_INET, settings->tcp_addr, &(s.sin_addr)) != 1)
+    {
+        LOGLN0((LOG_ERROR, LOGS "bad tcp address %s", LOGP,
+                settings->tcp_addr));
+        return BMD_ERROR_PARAM;
+    }
+    bmd->tcp_listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (bmd->tcp_listener == -1)
+    {
+        LOGLN0((LOG_ERROR, LOGS "socket failed", LOGP));
+        return BMD_ERROR_FD;
+    }
+    option = 1;
+    setsockopt(bmd->tcp_listener, SOL_SOCKET, SO_REUSEADDR, &option,
+               sizeof(option));
+    if ((bind(bmd->tcp_listener, (struct sockaddr*)&s, sizeof(s)) != 0) ||
+        (listen(bmd->tcp_listener, 8) != 0))
+    {
+        LOGLN0((LOG_ERROR, LOGS "bind or listen failed for %s:%d", LOGP,
+                settings->tcp_addr, settings->tcp_port));
+        close(bmd->tcp_listener);
+        bmd->tcp_listener = -1;
+        return BMD_ERROR_FD;
+    }
+    LOGLN0((LOG_INFO, LOGS "listen ok socket %d tcp %s:%d", LOGP,
+            bmd->tcp_listener, settings->tcp_addr, settings->tcp_port));
+    return BMD_ERROR_NONE;
+}
+
 /*****************************************************************************/
 int
 main(int argc, char** argv)
@@ -613,6 +1547,9 @@ main(int argc, char** argv)
     struct settings_info* settings;
     int error;
     int pid;
+    int index;
+    int now;
+    int count;
     struct sockaddr_un s;
     socklen_t sock_len;
 
@@ -623,6 +1560,11 @@ main(int argc, char** argv)
         return 1;
     }
     settings->mode_index = 14;
+    settings->peer_limits.max_bytes = BMD_PEER_MAX_BYTES;
+    settings->peer_limits.max_fds = BMD_PEER_MAX_FDS;
+    settings->peer_limits.max_age_ms = BMD_PEER_MAX_AGE_MS;
+    settings->peer_limits.stall_ms = BMD_PEER_STALL_MS;
+    settings->record_segment_s = BMD_RECORD_SEGMENT_MS / 1000;
     if (process_args(argc, argv, settings) != 0)
     {
         printf_help(argc, argv);
@@ -673,23 +1615,54 @@ main(int argc, char** argv)
         free(settings);
         return 1;
     }
-    bmd->yami_fd = open("/dev/dri/renderD128", O_RDWR);
-    if (bmd->yami_fd == -1)
+    bmd->num_renditions = settings->num_renditions;
+    bmd->seqpacket = settings->use_seqpacket;
+    bmd->compress = settings->compress;
+    bmd->peer_limits = settings->peer_limits;
+    for (index = 0; index < bmd->num_renditions; index++)
     {
-        LOGLN0((LOG_ERROR, LOGS "open /dev/dri/renderD128 failed", LOGP));
-        free(settings);
-        free(bmd);
-        return 1;
+        bmd->renditions[index].type = settings->rendition_types[index];
     }
-    error = yami_init(YI_TYPE_DRM, (void*)(long)(bmd->yami_fd));
-    LOGLN0((LOG_INFO, LOGS "yami_init rv %d", LOGP, error));
-    if (error != 0)
+    bmd->yami_fd = -1;
+    bmd->udmabuf_fd = -1;
+    bmd->surface_type = BMD_SURFACE_TYPE_YAMI;
+    if (!(settings->use_udmabuf))
+    {
+        bmd->yami_fd = open("/dev/dri/renderD128", O_RDWR);
+        if (bmd->yami_fd == -1)
+        {
+            LOGLN0((LOG_ERROR, LOGS "open /dev/dri/renderD128 failed", LOGP));
+        }
+        else
+        {
+            error = yami_init(YI_TYPE_DRM, (void*)(long)(bmd->yami_fd));
+            LOGLN0((LOG_INFO, LOGS "yami_init rv %d", LOGP, error));
+            if (error != 0)
+            {
+                LOGLN0((LOG_ERROR, LOGS "yami_init failed %d", LOGP, error));
+                close(bmd->yami_fd);
+                bmd->yami_fd = -1;
+            }
+        }
+    }
+    if (bmd->yami_fd == -1)
     {
-        LOGLN0((LOG_ERROR, LOGS "yami_init failed %d", LOGP, error));
+        /* no usable render node, fall back to memfd backed dmabufs */
+        bmd->udmabuf_fd = open(BMD_UDMABUF_DEV, O_RDWR);
+        if (bmd->udmabuf_fd == -1)
+        {
+            LOGLN0((LOG_ERROR, LOGS "open %s failed", LOGP, BMD_UDMABUF_DEV));
+            free(settings);
+            free(bmd);
+            return 1;
+        }
+        bmd->surface_type = BMD_SURFACE_TYPE_UDMABUF;
+        LOGLN0((LOG_INFO, LOGS "using %s surfaces", LOGP, BMD_UDMABUF_DEV));
     }
     snprintf(settings->bmd_uds, 255, settings->bmd_uds_name, pid);
     unlink(settings->bmd_uds);
-    bmd->listener = socket(PF_LOCAL, SOCK_STREAM, 0);
+    bmd->listener = socket(PF_LOCAL, bmd->seqpacket ? SOCK_SEQPACKET :
+                           SOCK_STREAM, 0);
     if (bmd->listener == -1)
     {
         LOGLN0((LOG_ERROR, LOGS "socket failed", LOGP));
@@ -732,11 +1705,25 @@ main(int argc, char** argv)
     }
     LOGLN0((LOG_INFO, LOGS "listen ok socket %d uds %s",
             LOGP, bmd->listener, settings->bmd_uds));
+    bmd->tcp_listener = -1;
+    if ((settings->tcp_port > 0) &&
+        (bmd_tcp_listen(bmd, settings) != BMD_ERROR_NONE))
+    {
+        close(bmd->listener);
+        unlink(settings->bmd_uds);
+        free(settings);
+        free(bmd);
+        return 1;
+    }
     error = pipe(g_term_pipe);
     if (error != 0)
     {
         LOGLN0((LOG_ERROR, LOGS "pipe failed", LOGP));
         close(bmd->listener);
+        if (bmd->tcp_listener != -1)
+        {
+            close(bmd->tcp_listener);
+        }
         free(settings);
         free(bmd);
         return 1;
@@ -746,26 +1733,173 @@ main(int argc, char** argv)
     signal(SIGTERM, sig_int);
     signal(SIGPIPE, sig_pipe);
 
+    if (settings->use_io_uring)
+    {
+        error = bmd_peer_start_io_uring(bmd);
+        if (error == BMD_ERROR_NONE)
+        {
+            bmd_peer_add_listener(bmd, bmd->listener, 0);
+            if (bmd->tcp_listener != -1)
+            {
+                bmd_peer_add_listener(bmd, bmd->tcp_listener, 1);
+            }
+        }
+        else
+        {
+            LOGLN0((LOG_ERROR, LOGS "bmd_peer_start_io_uring failed error "
+                    "%d, using select", LOGP, error));
+            bmd->io_uring = NULL;
+        }
+    }
+    if (settings->history_mb > 0)
+    {
+        /* shards look frames up in it, so it lives as long as they do */
+        error = bmd_history_create(settings->history_mb * 1024 * 1024,
+                                   &(bmd->history));
+        if (error != BMD_ERROR_NONE)
+        {
+            LOGLN0((LOG_ERROR, LOGS "bmd_history_create failed error %d",
+                    LOGP, error));
+            bmd->history = NULL;
+        }
+        else
+        {
+            LOGLN0((LOG_INFO, LOGS "%d MB video history", LOGP,
+                    settings->history_mb));
+        }
+    }
+    if (settings->record_dir[0] != 0)
+    {
+        error = bmd_record_create(settings->record_dir,
+                                  settings->record_segment_s * 1000,
+                                  &(bmd->record));
+        if (error != BMD_ERROR_NONE)
+        {
+            LOGLN0((LOG_ERROR, LOGS "bmd_record_create failed error %d",
+                    LOGP, error));
+            bmd->record = NULL;
+        }
+        else
+        {
+            LOGLN0((LOG_INFO, LOGS "recording to %s", LOGP,
+                    settings->record_dir));
+            /* there is demand with no peers, capture comes up now and
+               stays up */
+            settings->warm_standby = 1;
+        }
+    }
+    if (settings->timeshift_path[0] != 0)
+    {
+        /* shards look up in it, so it lives as long as they do */
+        error = bmd_timeshift_create(settings->timeshift_path,
+                                     settings->timeshift_mb *
+                                     1024LL * 1024LL, &(bmd->timeshift));
+        if (error != BMD_ERROR_NONE)
+        {
+            LOGLN0((LOG_ERROR, LOGS "bmd_timeshift_create failed error %d",
+                    LOGP, error));
+            bmd->timeshift = NULL;
+        }
+        else
+        {
+            LOGLN0((LOG_INFO, LOGS "%d MB timeshift in %s", LOGP,
+                    settings->timeshift_mb, settings->timeshift_path));
+            settings->warm_standby = 1;
+        }
+    }
+    if (settings->num_shards > 0)
+    {
+        error = bmd_shard_create(bmd, settings->num_shards,
+                                 &(bmd->shards));
+        if (error != BMD_ERROR_NONE)
+        {
+            LOGLN0((LOG_ERROR, LOGS "bmd_shard_create failed error %d, "
+                    "serving peers on the main thread", LOGP, error));
+            bmd->shards = NULL;
+        }
+        else
+        {
+            LOGLN0((LOG_INFO, LOGS "%d peer io threads", LOGP,
+                    settings->num_shards));
+        }
+    }
+
+    if (settings->warm_standby)
+    {
+        /* bring capture up now, prime_surface has the first frame
+           converted so the surface is ready too */
+        if (bmd_start(bmd, settings) == 0)
+        {
+            bmd->is_running = 1;
+            bmd->prime_surface = 1;
+            bmd_peer_update_demand(bmd);
+        }
+        else
+        {
+            LOGLN0((LOG_ERROR, LOGS "bmd_start failed", LOGP));
+            bmd_stop(bmd);
+        }
+    }
+
     for (;;)
     {
-        error = bmd_process_fds(bmd, settings, -1);
+        error = bmd_process_fds(bmd, settings,
+                                bmd->is_lingering ? bmd->linger_mstime : -1);
         if (error != BMD_ERROR_NONE)
         {
             LOGLN0((LOG_ERROR, LOGS "bmd_process_fds failed error %d",
                     LOGP, error));
             break;
         }
+        bmd_peer_get_count(bmd, &count);
+        if (bmd->is_lingering && (count == 0))
+        {
+            if (get_mstime(&now) != BMD_ERROR_NONE)
+            {
+                break;
+            }
+            if (now - bmd->linger_mstime >= 0)
+            {
+                LOGLN0((LOG_INFO, LOGS "linger time over", LOGP));
+                bmd_idle(bmd, settings);
+            }
+        }
     }
 
     close(bmd->listener);
+    if (bmd->tcp_listener != -1)
+    {
+        close(bmd->tcp_listener);
+    }
     unlink(settings->bmd_uds);
+    /* shard threads hold payloads and read the codec, they go first */
+    bmd_shard_delete(bmd->shards);
+    bmd->shards = NULL;
+    /* the writer finishes what is queued */
+    bmd_record_delete(bmd->record);
+    bmd->record = NULL;
+    bmd_peer_cleanup(bmd);
     bmd_cleanup(bmd);
-    yami_deinit();
-    close(bmd->yami_fd);
+    bmd_audio_ring_delete(bmd->audio_ring);
+    bmd->audio_ring = NULL;
+    bmd_history_delete(bmd->history);
+    bmd->history = NULL;
+    bmd_timeshift_delete(bmd->timeshift);
+    bmd->timeshift = NULL;
+    if (bmd->yami_fd != -1)
+    {
+        yami_deinit();
+        close(bmd->yami_fd);
+    }
+    if (bmd->udmabuf_fd != -1)
+    {
+        close(bmd->udmabuf_fd);
+    }
     free(bmd);
     free(settings);
     close(g_term_pipe[0]);
     close(g_term_pipe[1]);
+    bmd_pool_cleanup();
     log_deinit();
 
     return 0;
@@ -21,8 +21,29 @@
 
 #define BMD_UDS "/tmp/wtv_bmd_%d"
 
+/* minor 2, SUBSCRIBE_ENCODED and ENCODED */
+/* minor 3, SUBSCRIBE_AUDIO_SHM and AUDIO_SHM */
+/* minor 4, the fd for VIDEO and AUDIO_SHM arrives as SCM_RIGHTS with the
+   pdu header bytes, there is no separate 4 byte message for it */
+/* minor 5, SUBSCRIBE_VIDEO and VIDEO_CREDIT, VIDEO carries the capture
+   frame sequence number in the word after the time
+   minor 6, SUBSCRIBE_TRACE, TRACE and TRACE_ECHO
+   minor 7, VIDEO_RAW to peers on the tcp listener
+   minor 8, VIDEO_TILES to tcp peers that say they are minor 8 or later
+   when the daemon runs with -Z
+   minor 9, SUBSCRIBE_AUDIO_FORMAT, AUDIO has its sample type and layout
+   in the word after the time
+   minor 10, SUBSCRIBE_AUDIO_FORMAT can end with a sample rate, AUDIO ends
+   with its sample rate and the resampler delay in microseconds after the
+   samples
+   minor 11, SUBSCRIBE_AUDIO_FORMAT can end with a packet period after the
+   rate, AUDIO ends with how old its first sample was when it was queued,
+   VERSION has the measured audio latency in place of a fixed one
+   minor 12, REQUEST_VIDEO_HISTORY and VIDEO_HISTORY
+   minor 13, REQUEST_TIMESHIFT and TIMESHIFT */
 #define BMD_VERSION_MAJOR   0
-#define BMD_VERSION_MINOR   1
+#define BMD_VERSION_MINOR   13
+/* ms in VERSION until capture audio has been measured */
 #define BMD_AUDIO_LATENCY   64
 
 #define BMD_PDU_CODE_SUBSCRIBE_AUDIO        1
@@ -30,20 +51,166 @@
 #define BMD_PDU_CODE_REQUEST_VIDEO_FRAME    3
 #define BMD_PDU_CODE_VIDEO                  4
 #define BMD_PDU_CODE_VERSION                5
+#define BMD_PDU_CODE_SUBSCRIBE_ENCODED      6
+#define BMD_PDU_CODE_ENCODED                7
+#define BMD_PDU_CODE_SUBSCRIBE_AUDIO_SHM    8
+#define BMD_PDU_CODE_AUDIO_SHM              9
+#define BMD_PDU_CODE_SUBSCRIBE_VIDEO        10
+#define BMD_PDU_CODE_VIDEO_CREDIT           11
+#define BMD_PDU_CODE_SUBSCRIBE_TRACE        12
+#define BMD_PDU_CODE_TRACE                  13
+#define BMD_PDU_CODE_TRACE_ECHO             14
+#define BMD_PDU_CODE_VIDEO_RAW              15
+#define BMD_PDU_CODE_VIDEO_TILES            16
+#define BMD_PDU_CODE_SUBSCRIBE_AUDIO_FORMAT 17
+#define BMD_PDU_CODE_REQUEST_VIDEO_HISTORY  18
+#define BMD_PDU_CODE_VIDEO_HISTORY          19
+#define BMD_PDU_CODE_REQUEST_TIMESHIFT      20
+#define BMD_PDU_CODE_TIMESHIFT              21
+
+/* VIDEO_TILES flags, a key has every tile, otherwise the stream has the
+   tiles changed since base_seq */
+#define BMD_VIDEO_TILES_FLAG_KEY            1
+/* deltas built per frame, peers behind by more bases than this get a key */
+#define BMD_VIDEO_TILES_PAYLOADS            4
+
+/* REQUEST_VIDEO_HISTORY, the frame with that capture sequence, the
+   newest frame not after that capture time, or that many frames before
+   the newest */
+#define BMD_VIDEO_HISTORY_BY_SEQ            0
+#define BMD_VIDEO_HISTORY_BY_TIME           1
+#define BMD_VIDEO_HISTORY_BY_AGE            2
+/* VIDEO_HISTORY status, the fd only comes with found */
+#define BMD_VIDEO_HISTORY_FOUND             0
+#define BMD_VIDEO_HISTORY_MISSING           1 /* not held, see the range */
+#define BMD_VIDEO_HISTORY_NONE              2 /* no history, or tcp peer */
+
+/* REQUEST_TIMESHIFT, a frame by seq or time as REQUEST_VIDEO_HISTORY or
+   the capture audio from a time for a duration, TIMESHIFT has the
+   VIDEO_HISTORY status and a sealed memfd with tight nv12 or s16, it can
+   come after pdus for later requests, TIMESHIFTs come in request order */
+#define BMD_TIMESHIFT_TYPE_VIDEO            1
+#define BMD_TIMESHIFT_TYPE_AUDIO            2
+
+#define BMD_CODEC_H264                      1
+
+#define BMD_AUDIO_CHANNELS                  2
+#define BMD_AUDIO_BYTES_PER_SAMPLE          2
+#define BMD_AUDIO_SAMPLE_RATE               48000
+
+/* AUDIO sample types and layouts, capture audio is s16 interleaved */
+#define BMD_AUDIO_SAMPLE_S16                0
+#define BMD_AUDIO_SAMPLE_S32                1
+#define BMD_AUDIO_SAMPLE_F32                2
+#define BMD_AUDIO_LAYOUT_INTERLEAVED        0
+#define BMD_AUDIO_LAYOUT_PLANAR             1 /* each channel in turn */
+/* SUBSCRIBE_AUDIO_FORMAT mix matrix, gain of 1 and most channels */
+#define BMD_AUDIO_MIX_UNITY                 16384
+#define BMD_AUDIO_MIX_MAX_CHANNELS          16
+/* SUBSCRIBE_AUDIO_FORMAT packet period, 0 is as captured */
+#define BMD_AUDIO_MIN_PERIOD_US             2000
+#define BMD_AUDIO_MAX_PERIOD_US             1000000
+
+/* power of 2, a little over a second of capture audio */
+#define BMD_AUDIO_RING_DATA_BYTES           (256 * 1024)
+
+/* what to do with a video frame when one is already queued to the peer */
+#define BMD_VIDEO_POLICY_LATEST             0 /* replace the queued one */
+#define BMD_VIDEO_POLICY_QUEUE              1 /* queue up to the limits */
+
+/* which audio goes when the peer queue is full */
+#define BMD_AUDIO_POLICY_DROP_OLDEST        0
+#define BMD_AUDIO_POLICY_DROP_NEWEST        1
+
+#define BMD_MAX_RENDITIONS                  8
+
+/* largest pdu queued to a peer, big enough for an uncompressed
+   software encoded 4k access unit */
+#define BMD_PDU_MAX_BYTES                   (32 * 1024 * 1024)
+/* largest pdu on a SOCK_SEQPACKET connection, one pdu is one message so
+   it has to fit the socket buffer, bigger ones are dropped */
+#define BMD_SEQPACKET_MAX_BYTES             (1024 * 1024)
 
 extern const char g_mode_names[][16]; /* in bmd.c */
 
+struct bmd_rendition
+{
+    int type; /* BMD_ENCODER_TYPE_* */
+    int width;
+    int height;
+    int frame_count;
+    void* encoder;
+};
+
+#define BMD_PEER_MAX_BYTES                  (64 * 1024 * 1024)
+#define BMD_PEER_MAX_FDS                    8
+#define BMD_PEER_MAX_AGE_MS                 1000
+#define BMD_PEER_STALL_MS                   10000
+
+/* CLOCK_MONOTONIC microsecond stamps of a captured frame or audio packet
+   on its way through the daemon, a traced peer gets them in a TRACE pdu
+   right after the VIDEO or AUDIO pdu along with its own enqueue and send
+   stamps, and can send them back in TRACE_ECHO with its receive and
+   display stamps */
+struct bmd_trace
+{
+    int seq; /* video capture sequence or audio time */
+    int pad0;
+    long long callback_us;
+    long long dequeue_us;
+    long long convert_us;
+    long long export_us;
+};
+
+/* per peer output queue limits, 0 means no limit */
+struct bmd_peer_limits
+{
+    int max_bytes;
+    int max_fds;
+    int max_age_ms; /* for queued video, audio and encoded pdus */
+    int stall_ms; /* evict a peer with queued output that sent nothing */
+    int video_policy;
+    int audio_policy;
+};
+
+/* what peers want from capture, from bmd_peer_update_demand and summed
+   over the shards when peers are on io threads */
+struct bmd_demand
+{
+    int video_demand; /* BMD_VIDEO_DEMAND_* bits */
+    int want_seq; /* with BMD_VIDEO_DEMAND_SEQ */
+    int want_mstime; /* with BMD_VIDEO_DEMAND_TIME */
+    int audio_socket_demand; /* boolean */
+    int audio_shm_demand; /* boolean */
+    int video_raw_demand; /* boolean */
+    int video_tiles_demand; /* boolean */
+    int encoded_mask; /* renditions with subscribers */
+};
+
 struct bmd_info
 {
     int listener;
+    int tcp_listener; /* -1 when there is none, -T */
     int yami_fd;
-    int yami_width;
-    int yami_height;
-    void* yami;
+    int udmabuf_fd;
+    int surface_type;
+    int surface_width;
+    int surface_height;
+    void* surface;
     void* declink;
+    void* synth; /* bmd_synth instead of declink, -S */
+    int seqpacket; /* boolean, SOCK_SEQPACKET listener, -P */
     struct bmd_av_info* av_info;
     struct peer_info* peer_head;
     struct peer_info* peer_tail;
+    void* io_uring; /* bmd_uring, peer io through io_uring, -R */
+    struct peer_info* peer_zombies; /* removed, io_uring not done yet */
+    void* shards; /* bmd_shard, peers are on io threads, -K */
+    int shard_encoded_mask; /* summed from the shards */
+    int pad0;
+    /* set in a shard's view, the bmd_info its thread runs bmd_peer on */
+    void* shard;
+    struct bmd_info* parent;
     int fd;
     int fd_width;
     int fd_height;
@@ -51,9 +218,46 @@ struct bmd_info
     int fd_size;
     int fd_bpp;
     int fd_time;
+    int fd_seq; /* capture sequence number of the frame */
     int video_frame_count;
     int is_running;
-    int pad0;
+    int num_renditions;
+    int video_demand; /* BMD_VIDEO_DEMAND_* bits */
+    int prime_surface; /* boolean */
+    int is_lingering; /* boolean */
+    int linger_mstime;
+    int audio_socket_demand; /* boolean */
+    int audio_shm_demand; /* boolean */
+    void* audio_ring;
+    void* history; /* bmd_history, recent frames, -H */
+    void* record; /* bmd_record, -r */
+    void* timeshift; /* bmd_timeshift, -X */
+    void* timeshift_replies; /* this thread's lookups, answered */
+    /* socket audio formats peers asked for, one conversion each */
+    struct peer_audio_group* audio_groups;
+    int audio_latency_us; /* capture to queued, averaged, for VERSION */
+    int pad1;
+    struct bmd_payload* video_payload; /* current frame header and fd */
+    /* current frame pixels for remote peers, built when they want video */
+    struct bmd_payload* video_raw_payload;
+    int video_raw_frame_count; /* video_frame_count of video_raw_payload */
+    int video_raw_demand; /* boolean */
+    int compress; /* boolean, VIDEO_TILES to remote peers, -Z */
+    void* codec; /* bmd_codec, current frame coded when there is demand */
+    int codec_width;
+    int codec_height;
+    int video_tiles_frame_count; /* video_frame_count codec has */
+    int video_tiles_demand; /* boolean */
+    /* VIDEO_TILES built for the current frame, a key and a delta per base
+       a peer had */
+    struct bmd_payload* video_tiles_key;
+    struct bmd_payload* video_tiles[BMD_VIDEO_TILES_PAYLOADS];
+    int video_tiles_base[BMD_VIDEO_TILES_PAYLOADS];
+    int video_tiles_count;
+    struct bmd_peer_limits peer_limits;
+    struct bmd_trace video_trace; /* for video_payload */
+    struct bmd_trace audio_trace;
+    struct bmd_rendition renditions[BMD_MAX_RENDITIONS];
 };
 
 #endif
@@ -0,0 +1,383 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* audio format conversion, see bmd_audio_format.h
+   a block of samples is mixed into a float row per output channel, the
+   gains carry the scale to the output type so a row only has to be
+   rounded and saturated on the way out, which is sse2 when there is
+   sse2, interleaving is a plain copy after that */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "bmd.h"
+#include "bmd_audio_format.h"
+#include "bmd_resample.h"
+#include "bmd_error.h"
+
+/* samples mixed at a time, the rows are on the stack */
+#define BMD_AUDIO_FORMAT_BLOCK BMD_RESAMPLE_MAX_SAMPLES
+
+/* largest float that converts to s32 without overflow */
+#define BMD_AUDIO_FORMAT_S32_MAX 2147483520.0f
+#define BMD_AUDIO_FORMAT_S32_MIN -2147483648.0f
+
+/*****************************************************************************/
+static int
+bmd_audio_format_sample_bytes(int sample_type)
+{
+    return sample_type == BMD_AUDIO_SAMPLE_S16 ? 2 : 4;
+}
+
+/*****************************************************************************/
+/* the format capture audio already has, no conversion */
+int
+bmd_audio_format_is_capture(const struct bmd_audio_format* format)
+{
+    return (format->sample_type == BMD_AUDIO_SAMPLE_S16) &&
+           (format->layout == BMD_AUDIO_LAYOUT_INTERLEAVED) &&
+           (format->out_channels == 0) && (format->rate == 0) &&
+           (format->period == 0);
+}
+
+/*****************************************************************************/
+int
+bmd_audio_format_equal(const struct bmd_audio_format* format1,
+                       const struct bmd_audio_format* format2)
+{
+    if ((format1->sample_type != format2->sample_type) ||
+        (format1->layout != format2->layout) ||
+        (format1->out_channels != format2->out_channels) ||
+        (format1->in_channels != format2->in_channels) ||
+        (format1->rate != format2->rate) ||
+        (format1->period != format2->period))
+    {
+        return 0;
+    }
+    return memcmp(format1->matrix, format2->matrix,
+                  sizeof(format1->matrix)) == 0;
+}
+
+/*****************************************************************************/
+/* channels are the capture audio's, out_samples per channel after any
+   resampling */
+int
+bmd_audio_format_get_bytes(const struct bmd_audio_format* format,
+                           int channels, int out_samples, int* out_channels,
+                           int* bytes)
+{
+    int och;
+
+    if ((channels < 1) || (channels > BMD_AUDIO_MIX_MAX_CHANNELS) ||
+        (out_samples < 0))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    och = format->out_channels == 0 ? channels : format->out_channels;
+    *out_channels = och;
+    *bytes = och * out_samples *
+             bmd_audio_format_sample_bytes(format->sample_type);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* gains scaled from s16 in to the output type */
+static void
+bmd_audio_format_gains(const struct bmd_audio_format* format, int channels,
+                       int och, float gains[][BMD_AUDIO_MIX_MAX_CHANNELS])
+{
+    float scale;
+    int in_channels;
+    int index;
+    int jndex;
+
+    switch (format->sample_type)
+    {
+        case BMD_AUDIO_SAMPLE_S32:
+            scale = 65536.0f;
+            break;
+        case BMD_AUDIO_SAMPLE_F32:
+            scale = 1.0f / 32768.0f;
+            break;
+        default:
+            scale = 1.0f;
+            break;
+    }
+    memset(gains, 0, sizeof(float) * BMD_AUDIO_MIX_MAX_CHANNELS * och);
+    if (format->out_channels == 0)
+    {
+        for (index = 0; index < och; index++)
+        {
+            gains[index][index] = scale;
+        }
+        return;
+    }
+    in_channels = format->in_channels < channels ?
+                  format->in_channels : channels;
+    scale /= BMD_AUDIO_MIX_UNITY;
+    for (index = 0; index < och; index++)
+    {
+        for (jndex = 0; jndex < in_channels; jndex++)
+        {
+            gains[index][jndex] = format->matrix[index][jndex] * scale;
+        }
+    }
+}
+
+/*****************************************************************************/
+/* one output channel of a block */
+static void
+bmd_audio_format_mix(const short* in, int channels, int count,
+                     const float* gains, float* mix)
+{
+    int assigned;
+    int index;
+    int jndex;
+    float gain;
+
+    assigned = 0;
+    for (jndex = 0; jndex < channels; jndex++)
+    {
+        gain = gains[jndex];
+        if (gain == 0.0f)
+        {
+            continue;
+        }
+        if (assigned)
+        {
+            for (index = 0; index < count; index++)
+            {
+                mix[index] += gain * in[index * channels + jndex];
+            }
+        }
+        else
+        {
+            for (index = 0; index < count; index++)
+            {
+                mix[index] = gain * in[index * channels + jndex];
+            }
+            assigned = 1;
+        }
+    }
+    if (!assigned)
+    {
+        memset(mix, 0, sizeof(float) * count);
+    }
+}
+
+/*****************************************************************************/
+static void
+bmd_audio_format_to_s16(const float* mix, int count, short* dst)
+{
+    float val;
+    int index;
+#if defined(__SSE2__)
+    __m128i lo;
+    __m128i hi;
+#endif
+
+    index = 0;
+#if defined(__SSE2__)
+    /* the gains keep a mix well inside s32 so cvtps can not overflow,
+       packs saturates */
+    for (; index + 8 <= count; index += 8)
+    {
+        lo = _mm_cvtps_epi32(_mm_loadu_ps(mix + index));
+        hi = _mm_cvtps_epi32(_mm_loadu_ps(mix + index + 4));
+        _mm_storeu_si128((__m128i*)(dst + index), _mm_packs_epi32(lo, hi));
+    }
+#endif
+    for (; index < count; index++)
+    {
+        val = mix[index];
+        val = val < -32768.0f ? -32768.0f : val > 32767.0f ? 32767.0f : val;
+        dst[index] = (short)lrintf(val);
+    }
+}
+
+/*****************************************************************************/
+static void
+bmd_audio_format_to_s32(const float* mix, int count, int* dst)
+{
+    float val;
+    int index;
+#if defined(__SSE2__)
+    __m128 vmin;
+    __m128 vmax;
+    __m128 v;
+#endif
+
+    index = 0;
+#if defined(__SSE2__)
+    vmin = _mm_set1_ps(BMD_AUDIO_FORMAT_S32_MIN);
+    vmax = _mm_set1_ps(BMD_AUDIO_FORMAT_S32_MAX);
+    for (; index + 4 <= count; index += 4)
+    {
+        v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(mix + index), vmin), vmax);
+        _mm_storeu_si128((__m128i*)(dst + index), _mm_cvtps_epi32(v));
+    }
+#endif
+    for (; index < count; index++)
+    {
+        val = mix[index];
+        val = val < BMD_AUDIO_FORMAT_S32_MIN ? BMD_AUDIO_FORMAT_S32_MIN :
+              val > BMD_AUDIO_FORMAT_S32_MAX ? BMD_AUDIO_FORMAT_S32_MAX :
+              val;
+        dst[index] = (int)lrintf(val);
+    }
+}
+
+/*****************************************************************************/
+/* a mixed row to count samples of the output type at dst */
+static void
+bmd_audio_format_store(int sample_type, const float* mix, int count,
+                       void* dst)
+{
+    switch (sample_type)
+    {
+        case BMD_AUDIO_SAMPLE_S32:
+            bmd_audio_format_to_s32(mix, count, (int*)dst);
+            break;
+        case BMD_AUDIO_SAMPLE_F32:
+            memcpy(dst, mix, sizeof(float) * count);
+            break;
+        default:
+            bmd_audio_format_to_s16(mix, count, (short*)dst);
+            break;
+    }
+}
+
+/*****************************************************************************/
+/* a stored row to every och'th sample at dst */
+static void
+bmd_audio_format_interleave(const void* row, int sample_bytes, int count,
+                            int och, void* dst)
+{
+    int index;
+
+    if (sample_bytes == 2)
+    {
+        for (index = 0; index < count; index++)
+        {
+            ((short*)dst)[index * och] = ((const short*)row)[index];
+        }
+    }
+    else
+    {
+        for (index = 0; index < count; index++)
+        {
+            ((int*)dst)[index * och] = ((const int*)row)[index];
+        }
+    }
+}
+
+/*****************************************************************************/
+/* in is samples of s16 interleaved capture audio with channels, out has
+   the bytes bmd_audio_format_get_bytes gave for out_samples, which is
+   samples or with resample what bmd_resample_get_out_samples gave */
+int
+bmd_audio_format_convert(const struct bmd_audio_format* format,
+                         void* resample, const short* in, int channels,
+                         int samples, int out_samples, void* out)
+{
+    float gains[BMD_AUDIO_MIX_MAX_CHANNELS][BMD_AUDIO_MIX_MAX_CHANNELS];
+    float mix[BMD_AUDIO_MIX_MAX_CHANNELS][BMD_AUDIO_FORMAT_BLOCK];
+    float* rows[BMD_AUDIO_MIX_MAX_CHANNELS];
+    int row[BMD_AUDIO_FORMAT_BLOCK];
+    char* dst;
+    int sample_bytes;
+    int planar;
+    int start;
+    int count;
+    int done;
+    int part;
+    int jndex;
+    int och;
+    int bytes;
+    int index;
+    int rv;
+
+    rv = bmd_audio_format_get_bytes(format, channels, out_samples, &och,
+                                    &bytes);
+    if (rv != BMD_ERROR_NONE)
+    {
+        return rv;
+    }
+    bmd_audio_format_gains(format, channels, och, gains);
+    sample_bytes = bmd_audio_format_sample_bytes(format->sample_type);
+    /* one channel interleaved is planar */
+    planar = (format->layout == BMD_AUDIO_LAYOUT_PLANAR) || (och == 1);
+    done = 0;
+    for (start = 0; start < samples; start += BMD_AUDIO_FORMAT_BLOCK)
+    {
+        count = samples - start;
+        count = count < BMD_AUDIO_FORMAT_BLOCK ?
+                count : BMD_AUDIO_FORMAT_BLOCK;
+        for (index = 0; index < och; index++)
+        {
+            bmd_audio_format_mix(in + start * channels, channels, count,
+                                 gains[index], mix[index]);
+            rows[index] = mix[index];
+        }
+        if (resample != NULL)
+        {
+            rv = bmd_resample_process(resample, rows, count, rows, &count);
+            if (rv != BMD_ERROR_NONE)
+            {
+                return rv;
+            }
+        }
+        if (done + count > out_samples)
+        {
+            return BMD_ERROR_RANGE;
+        }
+        for (index = 0; index < och; index++)
+        {
+            if (planar)
+            {
+                dst = (char*)out +
+                      (index * out_samples + done) * sample_bytes;
+                bmd_audio_format_store(format->sample_type, rows[index],
+                                       count, dst);
+            }
+            else
+            {
+                /* a resampled row can be longer than a block */
+                for (jndex = 0; jndex < count; jndex += part)
+                {
+                    part = count - jndex;
+                    part = part < BMD_AUDIO_FORMAT_BLOCK ?
+                           part : BMD_AUDIO_FORMAT_BLOCK;
+                    dst = (char*)out +
+                          ((done + jndex) * och + index) * sample_bytes;
+                    bmd_audio_format_store(format->sample_type,
+                                           rows[index] + jndex, part, row);
+                    bmd_audio_format_interleave(row, sample_bytes, part,
+                                                och, dst);
+                }
+            }
+        }
+        done += count;
+    }
+    return BMD_ERROR_NONE;
+}
@@ -0,0 +1,56 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _BMD_AUDIO_FORMAT_H_
+#define _BMD_AUDIO_FORMAT_H_
+
+/* capture audio, s16 interleaved, converted to the sample type, layout
+   and channels a SUBSCRIBE_AUDIO_FORMAT peer asked for
+   each output channel is a row of the mix matrix over the capture
+   channels, so a channel subset is a row with a single unity gain and a
+   downmix is a row with several */
+
+struct bmd_audio_format
+{
+    int sample_type; /* BMD_AUDIO_SAMPLE_* */
+    int layout; /* BMD_AUDIO_LAYOUT_* */
+    int out_channels; /* 0 keeps the capture channels as they are */
+    int in_channels; /* matrix columns, capture channels past it are not
+                        mixed */
+    int rate; /* 0 keeps the capture rate */
+    int period; /* capture samples a pdu, 0 is as captured */
+    /* [out][in], BMD_AUDIO_MIX_UNITY is a gain of 1, unused entries 0 */
+    short matrix[BMD_AUDIO_MIX_MAX_CHANNELS][BMD_AUDIO_MIX_MAX_CHANNELS];
+};
+
+int
+bmd_audio_format_is_capture(const struct bmd_audio_format* format);
+int
+bmd_audio_format_equal(const struct bmd_audio_format* format1,
+                       const struct bmd_audio_format* format2);
+int
+bmd_audio_format_get_bytes(const struct bmd_audio_format* format,
+                           int channels, int out_samples, int* out_channels,
+                           int* bytes);
+int
+bmd_audio_format_convert(const struct bmd_audio_format* format,
+                         void* resample, const short* in, int channels,
+                         int samples, int out_samples, void* out);
+
+#endif
@@ -0,0 +1,196 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* multi reader pcm ring in a memfd, written once per packet no matter how
+   many subscribers have it mapped */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "bmd_audio_ring.h"
+#include "bmd_error.h"
+#include "bmd_log.h"
+#include "bmd_utils.h"
+
+struct bmd_audio_ring
+{
+    int fd;
+    int fd_bytes;
+    struct bmd_audio_ring_header* header;
+    char* data;
+};
+
+/*****************************************************************************/
+int
+bmd_audio_ring_create(int data_bytes, int channels, int bytes_per_sample,
+                      int sample_rate, void** obj)
+{
+    struct bmd_audio_ring* self;
+    struct bmd_audio_ring_header* header;
+    int seals;
+
+    if ((data_bytes < 4096) || ((data_bytes & (data_bytes - 1)) != 0))
+    {
+        return BMD_ERROR_PARAM;
+    }
+    self = xnew0(struct bmd_audio_ring, 1);
+    if (self == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    self->fd_bytes = BMD_AUDIO_RING_HEADER_BYTES + data_bytes;
+    self->fd = memfd_create("bmd_audio_ring",
+                            MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (self->fd == -1)
+    {
+        LOGLN0((LOG_ERROR, LOGS "memfd_create failed", LOGP));
+        free(self);
+        return BMD_ERROR_FD;
+    }
+    if (ftruncate(self->fd, self->fd_bytes) != 0)
+    {
+        close(self->fd);
+        free(self);
+        return BMD_ERROR_FD;
+    }
+    header = (struct bmd_audio_ring_header*)
+             mmap(NULL, self->fd_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  self->fd, 0);
+    if (header == MAP_FAILED)
+    {
+        close(self->fd);
+        free(self);
+        return BMD_ERROR_MEMORY;
+    }
+    /* our mapping stays writable, subscribers can only map read only */
+    seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+#if defined(F_SEAL_FUTURE_WRITE)
+    seals |= F_SEAL_FUTURE_WRITE;
+#endif
+    if (fcntl(self->fd, F_ADD_SEALS, seals) != 0)
+    {
+        LOGLN0((LOG_INFO, LOGS "F_ADD_SEALS failed", LOGP));
+    }
+    header->magic = BMD_AUDIO_RING_MAGIC;
+    header->version = BMD_AUDIO_RING_VERSION;
+    header->header_bytes = BMD_AUDIO_RING_HEADER_BYTES;
+    header->data_bytes = data_bytes;
+    header->channels = channels;
+    header->bytes_per_sample = bytes_per_sample;
+    header->sample_rate = sample_rate;
+    self->header = header;
+    self->data = ((char*)header) + BMD_AUDIO_RING_HEADER_BYTES;
+    *obj = self;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_audio_ring_delete(void* obj)
+{
+    struct bmd_audio_ring* self;
+
+    self = (struct bmd_audio_ring*)obj;
+    if (self == NULL)
+    {
+        return BMD_ERROR_NONE;
+    }
+    munmap(self->header, self->fd_bytes);
+    close(self->fd);
+    free(self);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* fd is still owned by the ring */
+int
+bmd_audio_ring_get_fd(void* obj, int* fd, int* fd_bytes)
+{
+    struct bmd_audio_ring* self;
+
+    self = (struct bmd_audio_ring*)obj;
+    *fd = self->fd;
+    *fd_bytes = self->fd_bytes;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* single writer, wake is zero when nobody has the ring mapped */
+int
+bmd_audio_ring_write(void* obj, const void* data, int bytes, int mstime,
+                     int wake)
+{
+    struct bmd_audio_ring* self;
+    struct bmd_audio_ring_header* header;
+    unsigned long long write_index;
+    int data_bytes;
+    int offset;
+    int part;
+    int frame_bytes;
+    unsigned int seq;
+
+    self = (struct bmd_audio_ring*)obj;
+    header = self->header;
+    data_bytes = header->data_bytes;
+    if ((bytes < 1) || (bytes > data_bytes))
+    {
+        return BMD_ERROR_PARAM;
+    }
+    write_index = header->write_index;
+    offset = (int)(write_index & (data_bytes - 1));
+    part = data_bytes - offset;
+    if (part >= bytes)
+    {
+        memcpy(self->data + offset, data, bytes);
+    }
+    else
+    {
+        memcpy(self->data + offset, data, part);
+        memcpy(self->data, ((const char*)data) + part, bytes - part);
+    }
+    frame_bytes = header->channels * header->bytes_per_sample;
+    /* seqlock, readers retry while last_seq is odd or moved */
+    seq = header->last_seq;
+    __atomic_store_n(&(header->last_seq), seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&(header->last_index), write_index, __ATOMIC_RELAXED);
+    __atomic_store_n(&(header->last_time), mstime, __ATOMIC_RELAXED);
+    __atomic_store_n(&(header->last_samples),
+                     frame_bytes > 0 ? bytes / frame_bytes : 0,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&(header->last_seq), seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&(header->write_index), write_index + bytes,
+                     __ATOMIC_RELEASE);
+    __atomic_add_fetch(&(header->futex), 1, __ATOMIC_RELEASE);
+    if (wake)
+    {
+        /* one syscall wakes every waiting subscriber */
+        syscall(SYS_futex, &(header->futex), FUTEX_WAKE, INT_MAX,
+                NULL, NULL, 0);
+    }
+    return BMD_ERROR_NONE;
+}
@@ -0,0 +1,72 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BMD_AUDIO_RING_H_
+#define _BMD_AUDIO_RING_H_
+
+#define BMD_AUDIO_RING_MAGIC        0x474e5241 /* ARNG */
+#define BMD_AUDIO_RING_VERSION      2
+#define BMD_AUDIO_RING_HEADER_BYTES 4096
+
+/* start of the memfd, read only for subscribers, pcm data follows at
+   header_bytes
+   write_index counts bytes ever written, data for byte n is at
+   header_bytes + (n & (data_bytes - 1)), a reader that is more than
+   data_bytes behind has been overrun
+   futex is incremented after write_index moves, wait on it with
+   FUTEX_WAIT (not private)
+   last_seq is odd while the writer changes the last_* fields, read them
+   as a set with
+       do {
+           s1 = __atomic_load_n(&last_seq, __ATOMIC_ACQUIRE);
+           index = __atomic_load_n(&last_index, __ATOMIC_RELAXED);
+           time = __atomic_load_n(&last_time, __ATOMIC_RELAXED);
+           samples = __atomic_load_n(&last_samples, __ATOMIC_RELAXED);
+           __atomic_thread_fence(__ATOMIC_ACQUIRE);
+           s2 = __atomic_load_n(&last_seq, __ATOMIC_RELAXED);
+       } while ((s1 & 1) || (s1 != s2)); */
+struct bmd_audio_ring_header
+{
+    unsigned int magic;
+    unsigned int version;
+    unsigned int header_bytes;
+    unsigned int data_bytes; /* power of 2 */
+    unsigned int channels;
+    unsigned int bytes_per_sample;
+    unsigned int sample_rate;
+    unsigned int futex;
+    unsigned long long write_index;
+    unsigned long long last_index; /* write_index before the last packet */
+    unsigned int last_time; /* mstime of the last packet */
+    unsigned int last_samples;
+    unsigned int last_seq; /* version 2, see above */
+    unsigned int pad0;
+};
+
+int
+bmd_audio_ring_create(int data_bytes, int channels, int bytes_per_sample,
+                      int sample_rate, void** obj);
+int
+bmd_audio_ring_delete(void* obj);
+int
+bmd_audio_ring_get_fd(void* obj, int* fd, int* fd_bytes);
+int
+bmd_audio_ring_write(void* obj, const void* data, int bytes, int mstime,
+                     int wake);
+
+#endif
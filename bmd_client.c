@@ -0,0 +1,1126 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include "arch.h"
+#include "parse.h"
+#include "bmd.h"
+#include "bmd_client.h"
+#include "bmd_codec.h"
+#include "bmd_utils.h"
+#include "bmd_error.h"
+
+#define BMD_CLIENT_IN_BYTES     (64 * 1024)
+#define BMD_CLIENT_OUT_BYTES    4096
+#define BMD_CLIENT_MAX_FDS      16
+#define BMD_CLIENT_MAX_SURFACES 8
+
+/* a surface the daemon has sent, known by its inode so the dup the
+   daemon sends every frame maps to the same fd and mapping */
+struct bmd_client_surface
+{
+    int fd;
+    int size;
+    dev_t dev;
+    ino_t ino;
+    void* data;
+    int last_use;
+    int pad0;
+};
+
+struct bmd_client
+{
+    int sck;
+    int seqpacket; /* boolean, one message per pdu */
+    int num_fds;
+    int fds[BMD_CLIENT_MAX_FDS]; /* received, not yet matched to a pdu */
+    char* in_data;
+    int in_size;
+    int in_start;
+    int in_end;
+    int in_consumed; /* pdu handed out by the last bmd_client_check */
+    int out_end;
+    int use_count;
+    /* VIDEO_TILES are decoded into this, tight NV12 */
+    char* frame_data;
+    int frame_width;
+    int frame_height;
+    int frame_seq;
+    int have_frame; /* boolean, frame_data is frame_seq */
+    char out_data[BMD_CLIENT_OUT_BYTES];
+    struct bmd_client_surface surfaces[BMD_CLIENT_MAX_SURFACES];
+};
+
+/*****************************************************************************/
+/* a uds connect does not go in progress, a non blocking one fails with
+   EAGAIN when the listen backlog is full, so block for it */
+static int
+bmd_client_connect(const char* uds, int type, int* sck)
+{
+    struct sockaddr_un s;
+    int lsck;
+
+    lsck = socket(PF_LOCAL, type | SOCK_CLOEXEC, 0);
+    if (lsck == -1)
+    {
+        return BMD_ERROR_FD;
+    }
+    memset(&s, 0, sizeof(s));
+    s.sun_family = AF_UNIX;
+    strncpy(s.sun_path, uds, sizeof(s.sun_path) - 1);
+    if ((connect(lsck, (struct sockaddr*)&s, sizeof(s)) != 0) ||
+        (fcntl(lsck, F_SETFL, fcntl(lsck, F_GETFL) | O_NONBLOCK) != 0))
+    {
+        close(lsck);
+        return BMD_ERROR_FD;
+    }
+    *sck = lsck;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* host:port of a daemon run with -T, blocking connect like the uds one */
+static int
+bmd_client_connect_tcp(const char* host_port, int* sck)
+{
+    struct addrinfo hints;
+    struct addrinfo* ai;
+    struct addrinfo* lai;
+    const char* colon;
+    char host[256];
+    int lsck;
+    int val;
+
+    colon = strrchr(host_port, ':');
+    if ((colon == NULL) || (colon - host_port >= (int)sizeof(host)))
+    {
+        return BMD_ERROR_PARAM;
+    }
+    memcpy(host, host_port, colon - host_port);
+    host[colon - host_port] = 0;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &ai) != 0)
+    {
+        return BMD_ERROR_PARAM;
+    }
+    lsck = -1;
+    for (lai = ai; lai != NULL; lai = lai->ai_next)
+    {
+        lsck = socket(lai->ai_family, lai->ai_socktype | SOCK_CLOEXEC,
+                      lai->ai_protocol);
+        if (lsck == -1)
+        {
+            continue;
+        }
+        if (connect(lsck, lai->ai_addr, lai->ai_addrlen) == 0)
+        {
+            break;
+        }
+        close(lsck);
+        lsck = -1;
+    }
+    freeaddrinfo(ai);
+    if (lsck == -1)
+    {
+        return BMD_ERROR_FD;
+    }
+    val = 1;
+    setsockopt(lsck, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    if (fcntl(lsck, F_SETFL, fcntl(lsck, F_GETFL) | O_NONBLOCK) != 0)
+    {
+        close(lsck);
+        return BMD_ERROR_FD;
+    }
+    *sck = lsck;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_client_create(const char* uds, void** obj)
+{
+    struct bmd_client* self;
+    struct stream out_s;
+    int rv;
+
+    self = xnew0(struct bmd_client, 1);
+    if (self == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    self->in_data = xnew(char, BMD_CLIENT_IN_BYTES);
+    if (self->in_data == NULL)
+    {
+        free(self);
+        return BMD_ERROR_MEMORY;
+    }
+    self->in_size = BMD_CLIENT_IN_BYTES;
+    /* a daemon run with -P listens SOCK_SEQPACKET, connecting the other
+       type fails with EPROTOTYPE */
+    if (strncmp(uds, "tcp:", 4) == 0)
+    {
+        self->seqpacket = 0;
+        rv = bmd_client_connect_tcp(uds + 4, &(self->sck));
+    }
+    else
+    {
+        self->seqpacket = 1;
+        rv = bmd_client_connect(uds, SOCK_SEQPACKET, &(self->sck));
+    }
+    if ((rv != BMD_ERROR_NONE) && self->seqpacket && (errno == EPROTOTYPE))
+    {
+        self->seqpacket = 0;
+        rv = bmd_client_connect(uds, SOCK_STREAM, &(self->sck));
+    }
+    if (rv != BMD_ERROR_NONE)
+    {
+        free(self->in_data);
+        free(self);
+        return rv;
+    }
+    /* tell the daemon what protocol this library speaks */
+    memset(&out_s, 0, sizeof(out_s));
+    out_s.data = self->out_data;
+    out_s.p = out_s.data;
+    out_uint32_le(&out_s, BMD_PDU_CODE_VERSION);
+    out_uint32_le(&out_s, 16);
+    out_uint32_le(&out_s, BMD_VERSION_MAJOR);
+    out_uint32_le(&out_s, BMD_VERSION_MINOR);
+    self->out_end = 16;
+    *obj = self;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_client_delete(void* obj)
+{
+    struct bmd_client* self;
+    struct bmd_client_surface* surface;
+    int index;
+
+    self = (struct bmd_client*)obj;
+    if (self == NULL)
+    {
+        return BMD_ERROR_NONE;
+    }
+    for (index = 0; index < BMD_CLIENT_MAX_SURFACES; index++)
+    {
+        surface = self->surfaces + index;
+        if (surface->data != NULL)
+        {
+            munmap(surface->data, surface->size);
+        }
+        if (surface->fd > 0)
+        {
+            close(surface->fd);
+        }
+    }
+    for (index = 0; index < self->num_fds; index++)
+    {
+        close(self->fds[index]);
+    }
+    close(self->sck);
+    free(self->in_data);
+    free(self->frame_data);
+    free(self);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_client_get_fd(void* obj, int* fd, int* want_write)
+{
+    struct bmd_client* self;
+
+    self = (struct bmd_client*)obj;
+    *fd = self->sck;
+    *want_write = self->out_end > 0;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_client_flush(struct bmd_client* self)
+{
+    struct stream s;
+    ssize_t sent;
+    int bytes;
+
+    while (self->out_end > 0)
+    {
+        bytes = self->out_end;
+        if (self->seqpacket)
+        {
+            /* one pdu a message, the header has its length */
+            memset(&s, 0, sizeof(s));
+            s.data = self->out_data;
+            s.p = s.data + 4;
+            in_uint32_le(&s, bytes);
+        }
+        sent = send(self->sck, self->out_data, bytes, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+                (errno == EINTR))
+            {
+                return BMD_ERROR_NONE;
+            }
+            return BMD_ERROR_FD;
+        }
+        self->out_end -= sent;
+        memmove(self->out_data, self->out_data + sent, self->out_end);
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* s points into out_data after an 8 byte header, fill in the header,
+   keep the pdu and try to send it */
+static int
+bmd_client_send_pdu(struct bmd_client* self, struct stream* s, int code)
+{
+    int bytes;
+
+    bytes = (int)(s->p - s->data);
+    s->p = s->data;
+    out_uint32_le(s, code);
+    out_uint32_le(s, bytes);
+    self->out_end += bytes;
+    return bmd_client_flush(self);
+}
+
+/*****************************************************************************/
+static int
+bmd_client_init_pdu(struct bmd_client* self, struct stream* s, int bytes)
+{
+    if (self->out_end + bytes > BMD_CLIENT_OUT_BYTES)
+    {
+        /* daemon is not reading */
+        return BMD_ERROR_RANGE;
+    }
+    memset(s, 0, sizeof(struct stream));
+    s->data = self->out_data + self->out_end;
+    s->size = bytes;
+    s->p = s->data + 8;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* pull what the socket has into in_data, fds go on the fd list */
+static int
+bmd_client_recv(struct bmd_client* self)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    char control[CMSG_SPACE(sizeof(int) * BMD_CLIENT_MAX_FDS)];
+    ssize_t reed;
+    char* data;
+    int count;
+    int index;
+    int fd;
+
+    if (self->in_start > 0)
+    {
+        memmove(self->in_data, self->in_data + self->in_start,
+                self->in_end - self->in_start);
+        self->in_end -= self->in_start;
+        self->in_start = 0;
+    }
+    if (self->seqpacket &&
+        (self->in_size - self->in_end < BMD_SEQPACKET_MAX_BYTES))
+    {
+        /* a message can not be read in parts, make room for the
+           biggest */
+        data = (char*)realloc(self->in_data,
+                              self->in_end + BMD_SEQPACKET_MAX_BYTES);
+        if (data == NULL)
+        {
+            return BMD_ERROR_MEMORY;
+        }
+        self->in_data = data;
+        self->in_size = self->in_end + BMD_SEQPACKET_MAX_BYTES;
+    }
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = self->in_data + self->in_end;
+    iov.iov_len = self->in_size - self->in_end;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    reed = recvmsg(self->sck, &msg, MSG_CMSG_CLOEXEC);
+    if (reed < 0)
+    {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+        {
+            return BMD_ERROR_NOTREADY;
+        }
+        return BMD_ERROR_FD;
+    }
+    if (reed == 0)
+    {
+        return BMD_ERROR_PEER_REMOVED;
+    }
+    if (msg.msg_flags & MSG_TRUNC)
+    {
+        return BMD_ERROR_RANGE;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if ((cmsg->cmsg_level != SOL_SOCKET) ||
+            (cmsg->cmsg_type != SCM_RIGHTS))
+        {
+            continue;
+        }
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (index = 0; index < count; index++)
+        {
+            memcpy(&fd, CMSG_DATA(cmsg) + index * sizeof(int), sizeof(int));
+            if (self->num_fds < BMD_CLIENT_MAX_FDS)
+            {
+                self->fds[self->num_fds++] = fd;
+            }
+            else
+            {
+                close(fd);
+            }
+        }
+    }
+    self->in_end += reed;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* fds come in the order of the pdus they go with */
+static int
+bmd_client_pop_fd(struct bmd_client* self, int* fd)
+{
+    if (self->num_fds < 1)
+    {
+        return BMD_ERROR_FD;
+    }
+    *fd = self->fds[0];
+    self->num_fds--;
+    memmove(self->fds, self->fds + 1, self->num_fds * sizeof(int));
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* match the dup the daemon sent to a surface seen before, the dup is
+   closed when it is a known surface */
+static int
+bmd_client_get_surface(struct bmd_client* self, int fd, int size,
+                       struct bmd_client_surface** asurface)
+{
+    struct bmd_client_surface* surface;
+    struct bmd_client_surface* lru;
+    struct stat st;
+    int index;
+
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return BMD_ERROR_FD;
+    }
+    self->use_count++;
+    lru = self->surfaces;
+    for (index = 0; index < BMD_CLIENT_MAX_SURFACES; index++)
+    {
+        surface = self->surfaces + index;
+        if ((surface->fd > 0) && (surface->ino == st.st_ino) &&
+            (surface->dev == st.st_dev) && (surface->size == size))
+        {
+            close(fd);
+            surface->last_use = self->use_count;
+            *asurface = surface;
+            return BMD_ERROR_NONE;
+        }
+        if ((surface->fd < 1) ||
+            ((lru->fd > 0) && (surface->last_use < lru->last_use)))
+        {
+            lru = surface;
+        }
+    }
+    surface = lru;
+    if (surface->data != NULL)
+    {
+        munmap(surface->data, surface->size);
+    }
+    if (surface->fd > 0)
+    {
+        close(surface->fd);
+    }
+    surface->fd = fd;
+    surface->size = size;
+    surface->dev = st.st_dev;
+    surface->ino = st.st_ino;
+    surface->last_use = self->use_count;
+    surface->data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (surface->data == MAP_FAILED)
+    {
+        surface->data = NULL;
+    }
+    *asurface = surface;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* a delta from base_seq applies on top of any frame from base_seq on, a
+   delta that does not fit what we hold is skipped, the daemon sends a key
+   or a delta from what we got next */
+static int
+bmd_client_process_tiles(struct bmd_client* self, struct stream* s,
+                         struct bmd_client_event* event)
+{
+    char* frame_data;
+    int flags;
+    int base_seq;
+    int bytes;
+    int rv;
+
+    if (!s_check_rem(s, 32))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    in_uint32_le(s, event->time);
+    in_uint32_le(s, event->seq);
+    in_uint32_le(s, flags);
+    in_uint32_le(s, base_seq);
+    in_uint32_le(s, event->width);
+    in_uint32_le(s, event->height);
+    in_uint32_le(s, bytes);
+    in_uint32_le(s, event->bpp);
+    if ((bytes < 0) || !s_check_rem(s, bytes) || (event->width < 2) ||
+        (event->height < 2) || (event->width > 8192) ||
+        (event->height > 8192))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    if ((self->frame_width != event->width) ||
+        (self->frame_height != event->height))
+    {
+        frame_data = (char*)realloc(self->frame_data,
+                                    event->width * event->height * 3 / 2);
+        if (frame_data == NULL)
+        {
+            return BMD_ERROR_MEMORY;
+        }
+        self->frame_data = frame_data;
+        self->frame_width = event->width;
+        self->frame_height = event->height;
+        self->have_frame = 0;
+    }
+    if (!(flags & BMD_VIDEO_TILES_FLAG_KEY) &&
+        (!(self->have_frame) ||
+         ((int)((unsigned int)self->frame_seq - base_seq) < 0) ||
+         ((int)((unsigned int)event->seq - self->frame_seq) <= 0)))
+    {
+        return BMD_ERROR_NONE;
+    }
+    rv = bmd_codec_decode(event->width, event->height, s->p, bytes,
+                          self->frame_data, event->width,
+                          self->frame_data + event->width * event->height,
+                          event->width);
+    if (rv != BMD_ERROR_NONE)
+    {
+        self->have_frame = 0;
+        return rv;
+    }
+    self->frame_seq = event->seq;
+    self->have_frame = 1;
+    event->type = BMD_CLIENT_EVENT_VIDEO;
+    event->fd = -1;
+    event->stride = event->width;
+    event->size = event->width * event->height * 3 / 2;
+    event->data = self->frame_data;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_client_process_pdu(struct bmd_client* self, struct stream* s,
+                       int code, struct bmd_client_event* event)
+{
+    struct bmd_client_surface* surface;
+    int index;
+    int fd;
+    int rv;
+
+    switch (code)
+    {
+        case BMD_PDU_CODE_VERSION:
+            if (!s_check_rem(s, 16))
+            {
+                return BMD_ERROR_RANGE;
+            }
+            event->type = BMD_CLIENT_EVENT_VERSION;
+            in_uint32_le(s, event->major);
+            in_uint32_le(s, event->minor);
+            in_uint32_le(s, event->audio_latency);
+            in_uint32_le(s, event->num_renditions);
+            break;
+        case BMD_PDU_CODE_VIDEO:
+            if (!s_check_rem(s, 32))
+            {
+                return BMD_ERROR_RANGE;
+            }
+            event->type = BMD_CLIENT_EVENT_VIDEO;
+            in_uint32_le(s, event->time);
+            in_uint32_le(s, event->seq);
+            in_uint8s(s, 4); /* daemon's fd number */
+            in_uint32_le(s, event->width);
+            in_uint32_le(s, event->height);
+            in_uint32_le(s, event->stride);
+            in_uint32_le(s, event->size);
+            in_uint32_le(s, event->bpp);
+            rv = bmd_client_pop_fd(self, &fd);
+            if (rv != BMD_ERROR_NONE)
+            {
+                return rv;
+            }
+            rv = bmd_client_get_surface(self, fd, event->size, &surface);
+            if (rv != BMD_ERROR_NONE)
+            {
+                return rv;
+            }
+            event->fd = surface->fd;
+            event->data = surface->data;
+            break;
+        case BMD_PDU_CODE_VIDEO_HISTORY:
+            if (!s_check_rem(s, 56))
+            {
+                return BMD_ERROR_RANGE;
+            }
+            event->type = BMD_CLIENT_EVENT_VIDEO_HISTORY;
+            in_uint32_le(s, event->history_status);
+            in_uint32_le(s, event->history_frames);
+            in_uint32_le(s, event->history_oldest_seq);
+            in_uint32_le(s, event->history_newest_seq);
+            in_uint32_le(s, event->history_oldest_time);
+            in_uint32_le(s, event->history_newest_time);
+            in_uint32_le(s, event->time);
+            in_uint32_le(s, event->seq);
+            in_uint8s(s, 4); /* daemon's fd number */
+            in_uint32_le(s, event->width);
+            in_uint32_le(s, event->height);
+            in_uint32_le(s, event->stride);
+            in_uint32_le(s, event->size);
+            in_uint32_le(s, event->bpp);
+            event->fd = -1;
+            if (event->history_status != BMD_VIDEO_HISTORY_FOUND)
+            {
+                break;
+            }
+            rv = bmd_client_pop_fd(self, &fd);
+            if (rv != BMD_ERROR_NONE)
+            {
+                return rv;
+            }
+            rv = bmd_client_get_surface(self, fd, event->size, &surface);
+            if (rv != BMD_ERROR_NONE)
+            {
+                return rv;
+            }
+            event->fd = surface->fd;
+            event->data = surface->data;
+            break;
+        case BMD_PDU_CODE_TIMESHIFT:
+            if (!s_check_rem(s, 48))
+            {
+                return BMD_ERROR_RANGE;
+            }
+            event->type = BMD_CLIENT_EVENT_TIMESHIFT;
+            in_uint32_le(s, event->history_status);
+            in_uint32_le(s, event->timeshift_type);
+            in_uint32_le(s, event->time);
+            in_uint32_le(s, event->seq);
+            in_uint32_le(s, event->width);
+            in_uint32_le(s, event->height);
+            in_uint32_le(s, event->channels);
+            in_uint8s(s, 4); /* bytes per sample, always s16 */
+            in_uint32_le(s, event->rate);
+            in_uint32_le(s, event->bytes);
+            in_uint32_le(s, event->history_oldest_time);
+            in_uint32_le(s, event->history_newest_time);
+            event->sample_type = BMD_AUDIO_SAMPLE_S16;
+            event->layout = BMD_AUDIO_LAYOUT_INTERLEAVED;
+            event->fd = -1;
+            if (event->history_status != BMD_VIDEO_HISTORY_FOUND)
+            {
+                break;
+            }
+            rv = bmd_client_pop_fd(self, &(event->fd));
+            if (rv != BMD_ERROR_NONE)
+            {
+                return rv;
+            }
+            break;
+        case BMD_PDU_CODE_VIDEO_RAW:
+            if (!s_check_rem(s, 32))
+            {
+                return BMD_ERROR_RANGE;
+            }
+            event->type = BMD_CLIENT_EVENT_VIDEO;
+            in_uint32_le(s, event->time);
+            in_uint32_le(s, event->seq);
+            in_uint8s(s, 4);
+            in_uint32_le(s, event->width);
+            in_uint32_le(s, event->height);
+            in_uint32_le(s, event->stride);
+            in_uint32_le(s, event->size);
+            in_uint32_le(s, event->bpp);
+            if ((event->size < 0) || !s_check_rem(s, event->size))
+            {
+                return BMD_ERROR_RANGE;
+            }
+            event->fd = -1;
+            event->data = s->p;
+            break;
+        case BMD_PDU_CODE_VIDEO_TILES:
+            rv = bmd_client_process_tiles(self, s, event);
+            if (rv != BMD_ERROR_NONE)
+            {
+                return rv;
+            }
+            break;
+        case BMD_PDU_CODE_AUDIO:
+            if (!s_check_rem(s, 16))
+            {
+                return BMD_ERROR_RANGE;
+            }
+            event->type = BMD_CLIENT_EVENT_AUDIO;
+            in_uint32_le(s, event->time);
+            /* 0 from daemons before minor 9, s16 interleaved */
+            in_uint8(s, event->sample_type);
+            in_uint8(s, event->layout);
+            in_uint8s(s, 2);
+            in_uint32_le(s, event->channels);
+            in_uint32_le(s, event->bytes);
+            if ((event->bytes < 0) || !s_check_rem(s, event->bytes))
+            {
+                return BMD_ERROR_RANGE;
+            }
+            event->data = s->p;
+            in_uint8s(s, event->bytes);
+            event->rate = 0;
+            event->delay_us = 0;
+            event->latency_us = 0;
+            if (s_check_rem(s, 8))
+            {
+                in_uint32_le(s, event->rate);
+                in_uint32_le(s, event->delay_us);
+            }
+            if (s_check_rem(s, 4))
+            {
+                in_uint32_le(s, event->latency_us);
+            }
+            break;
+        case BMD_PDU_CODE_ENCODED:
+            if (!s_check_rem(s, 32))
+            {
+                return BMD_ERROR_RANGE;
+            }
+            event->type = BMD_CLIENT_EVENT_ENCODED;
+            in_uint32_le(s, event->time);
+            in_uint32_le(s, event->seq);
+            in_uint32_le(s, event->rendition);
+            in_uint32_le(s, event->codec);
+            in_uint32_le(s, event->flags);
+            in_uint32_le(s, event->width);
+            in_uint32_le(s, event->height);
+            in_uint32_le(s, event->bytes);
+            if ((event->bytes < 0) || !s_check_rem(s, event->bytes))
+            {
+                return BMD_ERROR_RANGE;
+            }
+            event->data = s->p;
+            break;
+        case BMD_PDU_CODE_AUDIO_SHM:
+            if (!s_check_rem(s, 4))
+            {
+                return BMD_ERROR_RANGE;
+            }
+            event->type = BMD_CLIENT_EVENT_AUDIO_SHM;
+            in_uint32_le(s, event->size);
+            rv = bmd_client_pop_fd(self, &(event->fd));
+            if (rv != BMD_ERROR_NONE)
+            {
+                return rv;
+            }
+            break;
+        case BMD_PDU_CODE_TRACE:
+            if (!s_check_rem(s, 8 + 8 * BMD_CLIENT_TRACE_STAMPS))
+            {
+                return BMD_ERROR_RANGE;
+            }
+            event->type = BMD_CLIENT_EVENT_TRACE;
+            in_uint32_le(s, event->trace_pdu_code);
+            in_uint32_le(s, event->seq);
+            for (index = 0; index < BMD_CLIENT_TRACE_STAMPS; index++)
+            {
+                in_uint64_le(s, event->trace_us[index]);
+            }
+            break;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* does the socket work and gives back at most one event, call until
+   event->type is BMD_CLIENT_EVENT_NONE */
+int
+bmd_client_check(void* obj, struct bmd_client_event* event)
+{
+    struct bmd_client* self;
+    struct stream s;
+    char* data;
+    int code;
+    int bytes;
+    int rv;
+
+    self = (struct bmd_client*)obj;
+    memset(event, 0, sizeof(struct bmd_client_event));
+    self->in_start += self->in_consumed;
+    self->in_consumed = 0;
+    rv = bmd_client_flush(self);
+    if (rv != BMD_ERROR_NONE)
+    {
+        return rv;
+    }
+    for (;;)
+    {
+        bytes = self->in_end - self->in_start;
+        if (bytes >= 8)
+        {
+            memset(&s, 0, sizeof(s));
+            s.data = self->in_data + self->in_start;
+            s.p = s.data;
+            s.end = s.data + bytes;
+            in_uint32_le(&s, code);
+            in_uint32_le(&s, bytes);
+            if ((bytes < 8) || (bytes > BMD_PDU_MAX_BYTES))
+            {
+                return BMD_ERROR_RANGE;
+            }
+            if (self->in_start + bytes <= self->in_end)
+            {
+                /* whole pdu is in */
+                s.end = s.data + bytes;
+                self->in_consumed = bytes;
+                rv = bmd_client_process_pdu(self, &s, code, event);
+                if ((rv != BMD_ERROR_NONE) ||
+                    (event->type != BMD_CLIENT_EVENT_NONE))
+                {
+                    return rv;
+                }
+                /* unknown pdu, skip it */
+                self->in_start += self->in_consumed;
+                self->in_consumed = 0;
+                continue;
+            }
+            if (bytes > self->in_size)
+            {
+                data = (char*)realloc(self->in_data, bytes);
+                if (data == NULL)
+                {
+                    return BMD_ERROR_MEMORY;
+                }
+                self->in_data = data;
+                self->in_size = bytes;
+            }
+        }
+        rv = bmd_client_recv(self);
+        if (rv == BMD_ERROR_NOTREADY)
+        {
+            return BMD_ERROR_NONE;
+        }
+        if (rv != BMD_ERROR_NONE)
+        {
+            return rv;
+        }
+    }
+}
+
+/*****************************************************************************/
+static int
+bmd_client_send_subscribe(struct bmd_client* self, int code, int subscribe)
+{
+    struct stream s;
+    int rv;
+
+    rv = bmd_client_init_pdu(self, &s, 9);
+    if (rv != BMD_ERROR_NONE)
+    {
+        return rv;
+    }
+    out_uint8(&s, subscribe ? 1 : 0);
+    return bmd_client_send_pdu(self, &s, code);
+}
+
+/*****************************************************************************/
+int
+bmd_client_subscribe_audio(void* obj, int subscribe)
+{
+    return bmd_client_send_subscribe((struct bmd_client*)obj,
+                                     BMD_PDU_CODE_SUBSCRIBE_AUDIO, subscribe);
+}
+
+/*****************************************************************************/
+/* socket audio as sample_type and layout, each of out_channels mixed from
+   the first in_channels capture channels by a row of matrix,
+   BMD_AUDIO_MIX_UNITY is a gain of 1, out_channels 0 keeps the capture
+   channels, daemon minor 9 or later
+   rate resamples, daemon minor 10 or later, 0 keeps the capture rate
+   period_us is the capture time in each pdu, daemon minor 11 or later,
+   0 sends each capture packet as it comes */
+int
+bmd_client_subscribe_audio_format(void* obj, int sample_type, int layout,
+                                  int out_channels, int in_channels,
+                                  const short* matrix, int rate,
+                                  int period_us)
+{
+    struct bmd_client* self;
+    struct stream s;
+    int index;
+    int rv;
+
+    self = (struct bmd_client*)obj;
+    if ((out_channels < 0) || (out_channels > BMD_AUDIO_MIX_MAX_CHANNELS) ||
+        (in_channels < 0) || (in_channels > BMD_AUDIO_MIX_MAX_CHANNELS))
+    {
+        return BMD_ERROR_PARAM;
+    }
+    if ((out_channels == 0) || (matrix == NULL))
+    {
+        out_channels = 0;
+        in_channels = 0;
+    }
+    rv = bmd_client_init_pdu(self, &s,
+                             20 + out_channels * in_channels * 2);
+    if (rv != BMD_ERROR_NONE)
+    {
+        return rv;
+    }
+    out_uint8(&s, sample_type);
+    out_uint8(&s, layout);
+    out_uint8(&s, out_channels);
+    out_uint8(&s, in_channels);
+    for (index = 0; index < out_channels * in_channels; index++)
+    {
+        out_uint16_le(&s, matrix[index]);
+    }
+    out_uint32_le(&s, rate);
+    out_uint32_le(&s, period_us);
+    return bmd_client_send_pdu(self, &s,
+                               BMD_PDU_CODE_SUBSCRIBE_AUDIO_FORMAT);
+}
+
+/*****************************************************************************/
+/* daemon minor 3 or later */
+int
+bmd_client_subscribe_audio_shm(void* obj, int subscribe)
+{
+    return bmd_client_send_subscribe((struct bmd_client*)obj,
+                                     BMD_PDU_CODE_SUBSCRIBE_AUDIO_SHM,
+                                     subscribe);
+}
+
+/*****************************************************************************/
+int
+bmd_client_subscribe_trace(void* obj, int subscribe)
+{
+    return bmd_client_send_subscribe((struct bmd_client*)obj,
+                                     BMD_PDU_CODE_SUBSCRIBE_TRACE, subscribe);
+}
+
+/*****************************************************************************/
+int
+bmd_client_request_video_frame(void* obj)
+{
+    struct bmd_client* self;
+    struct stream s;
+    int rv;
+
+    self = (struct bmd_client*)obj;
+    rv = bmd_client_init_pdu(self, &s, 8);
+    if (rv != BMD_ERROR_NONE)
+    {
+        return rv;
+    }
+    return bmd_client_send_pdu(self, &s, BMD_PDU_CODE_REQUEST_VIDEO_FRAME);
+}
+
+/*****************************************************************************/
+/* a recent frame, by is BMD_VIDEO_HISTORY_BY_*, the answer is a
+   BMD_CLIENT_EVENT_VIDEO_HISTORY, daemon minor 12 or later */
+int
+bmd_client_request_video_history(void* obj, int by, int value)
+{
+    struct bmd_client* self;
+    struct stream s;
+    int rv;
+
+    self = (struct bmd_client*)obj;
+    rv = bmd_client_init_pdu(self, &s, 16);
+    if (rv != BMD_ERROR_NONE)
+    {
+        return rv;
+    }
+    out_uint32_le(&s, by);
+    out_uint32_le(&s, value);
+    return bmd_client_send_pdu(self, &s,
+                               BMD_PDU_CODE_REQUEST_VIDEO_HISTORY);
+}
+
+/*****************************************************************************/
+/* type is BMD_TIMESHIFT_TYPE_*, a frame by BMD_VIDEO_HISTORY_BY_SEQ or
+   _BY_TIME, or the audio from time value for duration_ms, the answer is a
+   BMD_CLIENT_EVENT_TIMESHIFT, daemon minor 13 or later, it can come
+   after events for later requests */
+int
+bmd_client_request_timeshift(void* obj, int type, int by, int value,
+                             int duration_ms)
+{
+    struct bmd_client* self;
+    struct stream s;
+    int rv;
+
+    self = (struct bmd_client*)obj;
+    rv = bmd_client_init_pdu(self, &s, 24);
+    if (rv != BMD_ERROR_NONE)
+    {
+        return rv;
+    }
+    out_uint32_le(&s, type);
+    out_uint32_le(&s, by);
+    out_uint32_le(&s, value);
+    out_uint32_le(&s, duration_ms);
+    return bmd_client_send_pdu(self, &s, BMD_PDU_CODE_REQUEST_TIMESHIFT);
+}
+
+/*****************************************************************************/
+/* every Nth capture frame or fps frames a second, credits 0 for no flow
+   control */
+int
+bmd_client_subscribe_video(void* obj, int every, int fps, int credits,
+                           int subscribe)
+{
+    struct bmd_client* self;
+    struct stream s;
+    int rv;
+
+    self = (struct bmd_client*)obj;
+    rv = bmd_client_init_pdu(self, &s, 21);
+    if (rv != BMD_ERROR_NONE)
+    {
+        return rv;
+    }
+    out_uint32_le(&s, every);
+    out_uint32_le(&s, fps);
+    out_uint32_le(&s, credits);
+    out_uint8(&s, subscribe ? 1 : 0);
+    return bmd_client_send_pdu(self, &s, BMD_PDU_CODE_SUBSCRIBE_VIDEO);
+}
+
+/*****************************************************************************/
+int
+bmd_client_video_credit(void* obj, int credits)
+{
+    struct bmd_client* self;
+    struct stream s;
+    int rv;
+
+    self = (struct bmd_client*)obj;
+    rv = bmd_client_init_pdu(self, &s, 12);
+    if (rv != BMD_ERROR_NONE)
+    {
+        return rv;
+    }
+    out_uint32_le(&s, credits);
+    return bmd_client_send_pdu(self, &s, BMD_PDU_CODE_VIDEO_CREDIT);
+}
+
+/*****************************************************************************/
+/* daemon minor 2 or later, on a SOCK_SEQPACKET connection a rendition
+   whose access units do not fit a message, the sw encoder's, is
+   unsubscribed at its first frame */
+int
+bmd_client_subscribe_encoded(void* obj, int rendition, int subscribe)
+{
+    struct bmd_client* self;
+    struct stream s;
+    int rv;
+
+    self = (struct bmd_client*)obj;
+    rv = bmd_client_init_pdu(self, &s, 13);
+    if (rv != BMD_ERROR_NONE)
+    {
+        return rv;
+    }
+    out_uint32_le(&s, rendition);
+    out_uint8(&s, subscribe ? 1 : 0);
+    return bmd_client_send_pdu(self, &s, BMD_PDU_CODE_SUBSCRIBE_ENCODED);
+}
+
+/*****************************************************************************/
+/* recv_us and display_us are CLOCK_MONOTONIC microseconds, 0 when not
+   known */
+int
+bmd_client_trace_echo(void* obj, const struct bmd_client_event* trace,
+                      long long recv_us, long long display_us)
+{
+    struct bmd_client* self;
+    struct stream s;
+    int index;
+    int rv;
+
+    self = (struct bmd_client*)obj;
+    rv = bmd_client_init_pdu(self, &s, 80);
+    if (rv != BMD_ERROR_NONE)
+    {
+        return rv;
+    }
+    out_uint32_le(&s, trace->trace_pdu_code);
+    out_uint32_le(&s, trace->seq);
+    for (index = 0; index < BMD_CLIENT_TRACE_STAMPS; index++)
+    {
+        out_uint64_le(&s, trace->trace_us[index]);
+    }
+    out_uint64_le(&s, recv_us);
+    out_uint64_le(&s, display_us);
+    return bmd_client_send_pdu(self, &s, BMD_PDU_CODE_TRACE_ECHO);
+}
@@ -0,0 +1,130 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BMD_CLIENT_H_
+#define _BMD_CLIENT_H_
+
+/* libbmdclient, non blocking client side of the bmd uds protocol, or
+   of its tcp listener when the name given to create is tcp:host:port
+   functions return BMD_ERROR_* from bmd_error.h
+   poll the fd from bmd_client_get_fd for read, and for write when
+   bmd_client_get_fd says output is pending, then call bmd_client_check
+   until it gives BMD_CLIENT_EVENT_NONE */
+
+#define BMD_CLIENT_EVENT_NONE       0
+#define BMD_CLIENT_EVENT_VERSION    1
+#define BMD_CLIENT_EVENT_VIDEO      2
+#define BMD_CLIENT_EVENT_AUDIO      3
+#define BMD_CLIENT_EVENT_ENCODED    4
+#define BMD_CLIENT_EVENT_AUDIO_SHM  5
+#define BMD_CLIENT_EVENT_TRACE      6
+#define BMD_CLIENT_EVENT_VIDEO_HISTORY 7
+#define BMD_CLIENT_EVENT_TIMESHIFT  8
+
+#define BMD_CLIENT_TRACE_STAMPS     6
+
+struct bmd_client_event
+{
+    int type;
+    int time; /* mstime from the pdu */
+    int seq; /* video capture seq, encoded frame count or traced seq */
+    /* video, the surface fd stays owned by the library and is the same
+       fd every time the daemon sends that surface, -1 over tcp
+       audio shm, the ring fd is the caller's to close */
+    int fd;
+    int width;
+    int height;
+    int stride;
+    int size;
+    int bpp;
+    int channels;
+    int rendition;
+    int codec;
+    int flags;
+    int bytes; /* of data for audio and encoded */
+    int major; /* version */
+    int minor;
+    int audio_latency;
+    int num_renditions;
+    int trace_pdu_code; /* pdu the trace is for */
+    int sample_type; /* audio, BMD_AUDIO_SAMPLE_* */
+    int layout; /* audio, BMD_AUDIO_LAYOUT_* */
+    int rate; /* audio, 0 from daemons before minor 10 */
+    int delay_us; /* audio, resampler delay, the samples are that much
+                     older than time says */
+    int latency_us; /* audio, age of the first sample when the daemon
+                       queued it, 0 from daemons before minor 11 */
+    /* video history, BMD_VIDEO_HISTORY_*, with found the frame is in the
+       video fields, and what the daemon holds */
+    int history_status;
+    int history_frames;
+    int history_oldest_seq;
+    int history_newest_seq;
+    int history_oldest_time;
+    int history_newest_time;
+    /* timeshift, BMD_TIMESHIFT_TYPE_*, the history status and times are
+       set, with found fd is a sealed memfd of bytes, tight nv12 or s16
+       interleaved, and is the caller's to close */
+    int timeshift_type;
+    /* audio pcm and encoded bitstream, valid until the next
+       bmd_client_check, video read only mapping of the surface or NULL
+       when it can not be mapped, valid until bmd_client_delete, over tcp
+       the nv12 pixels, valid until the next bmd_client_check */
+    void* data;
+    /* callback, dequeue, convert, export, enqueue and send */
+    long long trace_us[BMD_CLIENT_TRACE_STAMPS];
+};
+
+int
+bmd_client_create(const char* uds, void** obj);
+int
+bmd_client_delete(void* obj);
+int
+bmd_client_get_fd(void* obj, int* fd, int* want_write);
+int
+bmd_client_check(void* obj, struct bmd_client_event* event);
+int
+bmd_client_subscribe_audio(void* obj, int subscribe);
+int
+bmd_client_subscribe_audio_format(void* obj, int sample_type, int layout,
+                                  int out_channels, int in_channels,
+                                  const short* matrix, int rate,
+                                  int period_us);
+int
+bmd_client_subscribe_audio_shm(void* obj, int subscribe);
+int
+bmd_client_request_video_frame(void* obj);
+int
+bmd_client_request_video_history(void* obj, int by, int value);
+int
+bmd_client_request_timeshift(void* obj, int type, int by, int value,
+                             int duration_ms);
+int
+bmd_client_subscribe_video(void* obj, int every, int fps, int credits,
+                           int subscribe);
+int
+bmd_client_video_credit(void* obj, int credits);
+int
+bmd_client_subscribe_encoded(void* obj, int rendition, int subscribe);
+int
+bmd_client_subscribe_trace(void* obj, int subscribe);
+int
+bmd_client_trace_echo(void* obj, const struct bmd_client_event* trace,
+                      long long recv_us, long long display_us);
+
+#endif
@@ -0,0 +1,641 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* lossless tile codec, see bmd_codec.h
+   shared by the daemon and libbmdclient so it does not log
+   prediction is plain byte loops over rows the compiler vectorizes, bit
+   packing is by planes so a group packs with one sse2 movemask per bit */
+
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "bmd_codec.h"
+#include "bmd_error.h"
+#include "bmd_utils.h"
+
+#define BMD_CODEC_MAX_DIM   8192
+/* residuals in a full tile, luma then chroma */
+#define BMD_CODEC_TILE_VALS (BMD_CODEC_TILE * BMD_CODEC_TILE * 3 / 2)
+/* a width byte and up to 8 bits per value for every group */
+#define BMD_CODEC_TILE_MAX_BYTES \
+    (BMD_CODEC_TILE_VALS / BMD_CODEC_GROUP * (1 + BMD_CODEC_GROUP))
+
+struct bmd_codec
+{
+    int width;
+    int height;
+    int tiles_x;
+    int num_tiles;
+    int have_frame; /* boolean, first_seq and seq are set */
+    unsigned int first_seq; /* first encode, older bases are not known */
+    unsigned int seq; /* last encode */
+    unsigned int* tile_seq; /* encode the tile last changed in */
+    int* tile_bytes;
+    unsigned char* tile_data; /* BMD_CODEC_TILE_MAX_BYTES per tile */
+    unsigned char* ydata; /* last frame encoded, tight */
+    unsigned char* uvdata;
+    unsigned char vals[BMD_CODEC_TILE_VALS];
+};
+
+struct bmd_codec_rect
+{
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+/*****************************************************************************/
+static int
+bmd_codec_check_size(int width, int height, int* tiles_x, int* num_tiles)
+{
+    if ((width < 2) || (height < 2) || (width > BMD_CODEC_MAX_DIM) ||
+        (height > BMD_CODEC_MAX_DIM) || (width & 1) || (height & 1))
+    {
+        return BMD_ERROR_PARAM;
+    }
+    *tiles_x = (width + BMD_CODEC_TILE - 1) / BMD_CODEC_TILE;
+    *num_tiles = *tiles_x * ((height + BMD_CODEC_TILE - 1) / BMD_CODEC_TILE);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* luma rect of a tile, edge tiles are smaller, always even */
+static void
+bmd_codec_get_rect(int width, int height, int tiles_x, int tile,
+                   struct bmd_codec_rect* rect)
+{
+    rect->x = (tile % tiles_x) * BMD_CODEC_TILE;
+    rect->y = (tile / tiles_x) * BMD_CODEC_TILE;
+    rect->width = width - rect->x;
+    if (rect->width > BMD_CODEC_TILE)
+    {
+        rect->width = BMD_CODEC_TILE;
+    }
+    rect->height = height - rect->y;
+    if (rect->height > BMD_CODEC_TILE)
+    {
+        rect->height = BMD_CODEC_TILE;
+    }
+}
+
+/*****************************************************************************/
+/* residuals of a tile, luma and chroma, rounded up to whole groups */
+static int
+bmd_codec_get_vals(const struct bmd_codec_rect* rect)
+{
+    int count;
+
+    count = rect->width * rect->height * 3 / 2;
+    return (count + BMD_CODEC_GROUP - 1) & ~(BMD_CODEC_GROUP - 1);
+}
+
+/*****************************************************************************/
+/* small residuals either side of 0 map to small values */
+static unsigned char
+bmd_codec_zigzag(unsigned char d)
+{
+    return (unsigned char)((d << 1) ^ (unsigned char)((signed char)d >> 7));
+}
+
+/*****************************************************************************/
+static unsigned char
+bmd_codec_unzigzag(unsigned char z)
+{
+    return (unsigned char)((z >> 1) ^ (unsigned char)(-(z & 1)));
+}
+
+/*****************************************************************************/
+/* first row against the value dist bytes to the left, dist is 2 for the
+   interleaved chroma, the other rows against the row above */
+static unsigned char*
+bmd_codec_predict(const unsigned char* src, int stride, int width,
+                  int height, int dist, unsigned char* vals)
+{
+    const unsigned char* above;
+    int index;
+    int jndex;
+
+    for (index = 0; index < dist; index++)
+    {
+        vals[index] = bmd_codec_zigzag(src[index]);
+    }
+    for (index = dist; index < width; index++)
+    {
+        vals[index] = bmd_codec_zigzag(src[index] - src[index - dist]);
+    }
+    vals += width;
+    for (jndex = 1; jndex < height; jndex++)
+    {
+        above = src;
+        src += stride;
+        for (index = 0; index < width; index++)
+        {
+            vals[index] = bmd_codec_zigzag(src[index] - above[index]);
+        }
+        vals += width;
+    }
+    return vals;
+}
+
+/*****************************************************************************/
+static const unsigned char*
+bmd_codec_reconstruct(const unsigned char* vals, unsigned char* dst,
+                      int stride, int width, int height, int dist)
+{
+    const unsigned char* above;
+    int index;
+    int jndex;
+
+    for (index = 0; index < dist; index++)
+    {
+        dst[index] = bmd_codec_unzigzag(vals[index]);
+    }
+    for (index = dist; index < width; index++)
+    {
+        dst[index] = dst[index - dist] + bmd_codec_unzigzag(vals[index]);
+    }
+    vals += width;
+    for (jndex = 1; jndex < height; jndex++)
+    {
+        above = dst;
+        dst += stride;
+        for (index = 0; index < width; index++)
+        {
+            dst[index] = above[index] + bmd_codec_unzigzag(vals[index]);
+        }
+        vals += width;
+    }
+    return vals;
+}
+
+/*****************************************************************************/
+/* plane k of a group is bit k of its 16 values, 2 bytes, which is one
+   movemask on sse2 */
+static void
+bmd_codec_pack_group(const unsigned char* vals, int bits, unsigned char* out)
+{
+#if defined(__SSE2__)
+    __m128i v;
+    int mask;
+    int index;
+
+    v = _mm_loadu_si128((const __m128i*)vals);
+    for (index = 0; index < bits; index++)
+    {
+        /* bit k of each byte to bit 7, 16 bit lanes keep the high byte's
+           bit k at bit 15 */
+        mask = _mm_movemask_epi8(_mm_slli_epi16(v, 7 - index));
+        out[index * 2] = (unsigned char)mask;
+        out[index * 2 + 1] = (unsigned char)(mask >> 8);
+    }
+#else
+    int mask;
+    int index;
+    int jndex;
+
+    for (index = 0; index < bits; index++)
+    {
+        mask = 0;
+        for (jndex = 0; jndex < BMD_CODEC_GROUP; jndex++)
+        {
+            mask |= ((vals[jndex] >> index) & 1) << jndex;
+        }
+        out[index * 2] = (unsigned char)mask;
+        out[index * 2 + 1] = (unsigned char)(mask >> 8);
+    }
+#endif
+}
+
+/*****************************************************************************/
+static void
+bmd_codec_unpack_group(const unsigned char* in, int bits, unsigned char* vals)
+{
+#if defined(__SSE2__)
+    __m128i sel;
+    __m128i one;
+    __m128i acc;
+    __m128i plane;
+    int index;
+
+    sel = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                        1, 2, 4, 8, 16, 32, 64, -128);
+    one = _mm_set1_epi8(1);
+    acc = _mm_setzero_si128();
+    for (index = bits - 1; index >= 0; index--)
+    {
+        /* spread the 16 bits one per byte, then shift in as bit k */
+        plane = _mm_unpacklo_epi64(_mm_set1_epi8((char)(in[index * 2])),
+                                   _mm_set1_epi8((char)(in[index * 2 + 1])));
+        plane = _mm_cmpeq_epi8(_mm_and_si128(plane, sel), sel);
+        acc = _mm_add_epi8(acc, acc);
+        acc = _mm_or_si128(acc, _mm_and_si128(plane, one));
+    }
+    _mm_storeu_si128((__m128i*)vals, acc);
+#else
+    int mask;
+    int index;
+    int jndex;
+
+    memset(vals, 0, BMD_CODEC_GROUP);
+    for (index = 0; index < bits; index++)
+    {
+        mask = in[index * 2] | (in[index * 2 + 1] << 8);
+        for (jndex = 0; jndex < BMD_CODEC_GROUP; jndex++)
+        {
+            vals[jndex] |= ((mask >> jndex) & 1) << index;
+        }
+    }
+#endif
+}
+
+/*****************************************************************************/
+/* each group is a byte with its bit width then that many bit planes, a
+   flat group is the byte alone */
+static int
+bmd_codec_pack(const unsigned char* vals, int count, unsigned char* out)
+{
+    unsigned char* start;
+    unsigned char or_bits;
+    int bits;
+    int index;
+    int jndex;
+
+    start = out;
+    for (index = 0; index < count; index += BMD_CODEC_GROUP)
+    {
+        or_bits = 0;
+        for (jndex = 0; jndex < BMD_CODEC_GROUP; jndex++)
+        {
+            or_bits |= vals[jndex];
+        }
+        bits = or_bits ? 32 - __builtin_clz(or_bits) : 0;
+        *(out++) = bits;
+        bmd_codec_pack_group(vals, bits, out);
+        out += bits * 2;
+        vals += BMD_CODEC_GROUP;
+    }
+    return (int)(out - start);
+}
+
+/*****************************************************************************/
+/* returns BMD_ERROR_RANGE unless the groups use exactly bytes */
+static int
+bmd_codec_unpack(const unsigned char* in, int bytes, int count,
+                 unsigned char* vals)
+{
+    const unsigned char* end;
+    int bits;
+    int index;
+
+    end = in + bytes;
+    for (index = 0; index < count; index += BMD_CODEC_GROUP)
+    {
+        if (in >= end)
+        {
+            return BMD_ERROR_RANGE;
+        }
+        bits = *(in++);
+        if ((bits > 8) || (end - in < bits * 2))
+        {
+            return BMD_ERROR_RANGE;
+        }
+        bmd_codec_unpack_group(in, bits, vals);
+        in += bits * 2;
+        vals += BMD_CODEC_GROUP;
+    }
+    return (in == end) ? BMD_ERROR_NONE : BMD_ERROR_RANGE;
+}
+
+/*****************************************************************************/
+int
+bmd_codec_create(int width, int height, void** obj)
+{
+    struct bmd_codec* self;
+    int tiles_x;
+    int num_tiles;
+    int error;
+
+    error = bmd_codec_check_size(width, height, &tiles_x, &num_tiles);
+    if (error != BMD_ERROR_NONE)
+    {
+        return error;
+    }
+    self = xnew0(struct bmd_codec, 1);
+    if (self == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    self->width = width;
+    self->height = height;
+    self->tiles_x = tiles_x;
+    self->num_tiles = num_tiles;
+    self->tile_seq = xnew0(unsigned int, num_tiles);
+    self->tile_bytes = xnew0(int, num_tiles);
+    self->tile_data = xnew(unsigned char,
+                           (size_t)num_tiles * BMD_CODEC_TILE_MAX_BYTES);
+    self->ydata = xnew(unsigned char, width * height);
+    self->uvdata = xnew(unsigned char, width * height / 2);
+    if ((self->tile_seq == NULL) || (self->tile_bytes == NULL) ||
+        (self->tile_data == NULL) || (self->ydata == NULL) ||
+        (self->uvdata == NULL))
+    {
+        bmd_codec_delete(self);
+        return BMD_ERROR_MEMORY;
+    }
+    *obj = self;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_codec_delete(void* obj)
+{
+    struct bmd_codec* self;
+
+    self = (struct bmd_codec*)obj;
+    if (self == NULL)
+    {
+        return BMD_ERROR_NONE;
+    }
+    free(self->tile_seq);
+    free(self->tile_bytes);
+    free(self->tile_data);
+    free(self->ydata);
+    free(self->uvdata);
+    free(self);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* copy the tile into the last frame when it differs, returns boolean */
+static int
+bmd_codec_update_tile(struct bmd_codec* self, const struct bmd_codec_rect* rect,
+                      const unsigned char* ydata, int ystride,
+                      const unsigned char* uvdata, int uvstride)
+{
+    const unsigned char* src;
+    unsigned char* dst;
+    int changed;
+    int index;
+
+    changed = !(self->have_frame);
+    src = ydata + rect->y * ystride + rect->x;
+    dst = self->ydata + rect->y * self->width + rect->x;
+    for (index = 0; index < rect->height; index++)
+    {
+        if (changed || (memcmp(dst, src, rect->width) != 0))
+        {
+            memcpy(dst, src, rect->width);
+            changed = 1;
+        }
+        src += ystride;
+        dst += self->width;
+    }
+    src = uvdata + (rect->y / 2) * uvstride + rect->x;
+    dst = self->uvdata + (rect->y / 2) * self->width + rect->x;
+    for (index = 0; index < rect->height / 2; index++)
+    {
+        if (changed || (memcmp(dst, src, rect->width) != 0))
+        {
+            memcpy(dst, src, rect->width);
+            changed = 1;
+        }
+        src += uvstride;
+        dst += self->width;
+    }
+    return changed;
+}
+
+/*****************************************************************************/
+/* compare every tile with the last frame encoded and code the changed
+   ones, seq names this frame for the base_seq of later writes */
+int
+bmd_codec_encode(void* obj, const void* ydata, int ystride,
+                 const void* uvdata, int uvstride, int seq)
+{
+    struct bmd_codec* self;
+    struct bmd_codec_rect rect;
+    unsigned char* vals;
+    int count;
+    int tile;
+
+    self = (struct bmd_codec*)obj;
+    for (tile = 0; tile < self->num_tiles; tile++)
+    {
+        bmd_codec_get_rect(self->width, self->height, self->tiles_x, tile,
+                           &rect);
+        if (!bmd_codec_update_tile(self, &rect,
+                                   (const unsigned char*)ydata, ystride,
+                                   (const unsigned char*)uvdata, uvstride))
+        {
+            continue;
+        }
+        vals = bmd_codec_predict(self->ydata + rect.y * self->width + rect.x,
+                                 self->width, rect.width, rect.height, 1,
+                                 self->vals);
+        vals = bmd_codec_predict(self->uvdata +
+                                 (rect.y / 2) * self->width + rect.x,
+                                 self->width, rect.width, rect.height / 2, 2,
+                                 vals);
+        count = bmd_codec_get_vals(&rect);
+        memset(vals, 0, count - (int)(vals - self->vals));
+        self->tile_bytes[tile] =
+            bmd_codec_pack(self->vals, count, self->tile_data +
+                           (size_t)tile * BMD_CODEC_TILE_MAX_BYTES);
+        self->tile_seq[tile] = seq;
+    }
+    if (!(self->have_frame))
+    {
+        self->first_seq = seq;
+        self->have_frame = 1;
+    }
+    self->seq = seq;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* BMD_ERROR_NONE when a peer holding frame base_seq can take a delta */
+int
+bmd_codec_check_base(void* obj, int base_seq)
+{
+    struct bmd_codec* self;
+
+    self = (struct bmd_codec*)obj;
+    if (!(self->have_frame))
+    {
+        return BMD_ERROR_NOTREADY;
+    }
+    if ((unsigned int)base_seq - self->first_seq >
+        self->seq - self->first_seq)
+    {
+        return BMD_ERROR_RANGE;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_codec_is_included(struct bmd_codec* self, int key, int base_seq,
+                      int tile)
+{
+    if (key)
+    {
+        return 1;
+    }
+    return self->tile_seq[tile] - self->first_seq >
+           (unsigned int)base_seq - self->first_seq;
+}
+
+/*****************************************************************************/
+/* stream bytes for a key, every tile, or for a delta from base_seq */
+int
+bmd_codec_get_bytes(void* obj, int key, int base_seq, int* bytes)
+{
+    struct bmd_codec* self;
+    int lbytes;
+    int tile;
+
+    self = (struct bmd_codec*)obj;
+    if (!(self->have_frame))
+    {
+        return BMD_ERROR_NOTREADY;
+    }
+    if (!key && (bmd_codec_check_base(self, base_seq) != BMD_ERROR_NONE))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    lbytes = self->num_tiles * 4;
+    for (tile = 0; tile < self->num_tiles; tile++)
+    {
+        if (bmd_codec_is_included(self, key, base_seq, tile))
+        {
+            lbytes += self->tile_bytes[tile];
+        }
+    }
+    *bytes = lbytes;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* bytes is from bmd_codec_get_bytes with the same key and base_seq */
+int
+bmd_codec_write(void* obj, int key, int base_seq, void* data, int bytes)
+{
+    struct bmd_codec* self;
+    unsigned char* table;
+    unsigned char* out;
+    unsigned char* end;
+    int tile_bytes;
+    int tile;
+
+    self = (struct bmd_codec*)obj;
+    if (bytes < self->num_tiles * 4)
+    {
+        return BMD_ERROR_RANGE;
+    }
+    table = (unsigned char*)data;
+    out = table + self->num_tiles * 4;
+    end = table + bytes;
+    for (tile = 0; tile < self->num_tiles; tile++)
+    {
+        tile_bytes = 0;
+        if (bmd_codec_is_included(self, key, base_seq, tile))
+        {
+            tile_bytes = self->tile_bytes[tile];
+            if (end - out < tile_bytes)
+            {
+                return BMD_ERROR_RANGE;
+            }
+            memcpy(out, self->tile_data +
+                   (size_t)tile * BMD_CODEC_TILE_MAX_BYTES, tile_bytes);
+            out += tile_bytes;
+        }
+        table[0] = (unsigned char)tile_bytes;
+        table[1] = (unsigned char)(tile_bytes >> 8);
+        table[2] = (unsigned char)(tile_bytes >> 16);
+        table[3] = (unsigned char)(tile_bytes >> 24);
+        table += 4;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* decode the tiles in the stream into the frame, tiles not in the stream
+   are left as they are */
+int
+bmd_codec_decode(int width, int height, const void* data, int bytes,
+                 void* ydata, int ystride, void* uvdata, int uvstride)
+{
+    struct bmd_codec_rect rect;
+    unsigned char vals[BMD_CODEC_TILE_VALS];
+    const unsigned char* table;
+    const unsigned char* in;
+    const unsigned char* end;
+    const unsigned char* lvals;
+    int tiles_x;
+    int num_tiles;
+    int tile_bytes;
+    int error;
+    int tile;
+
+    error = bmd_codec_check_size(width, height, &tiles_x, &num_tiles);
+    if (error != BMD_ERROR_NONE)
+    {
+        return error;
+    }
+    if (bytes < num_tiles * 4)
+    {
+        return BMD_ERROR_RANGE;
+    }
+    table = (const unsigned char*)data;
+    in = table + num_tiles * 4;
+    end = table + bytes;
+    for (tile = 0; tile < num_tiles; tile++)
+    {
+        tile_bytes = table[0] | (table[1] << 8) | (table[2] << 16) |
+                     (table[3] << 24);
+        table += 4;
+        if (tile_bytes == 0)
+        {
+            continue;
+        }
+        if ((tile_bytes < 0) || (end - in < tile_bytes))
+        {
+            return BMD_ERROR_RANGE;
+        }
+        bmd_codec_get_rect(width, height, tiles_x, tile, &rect);
+        error = bmd_codec_unpack(in, tile_bytes, bmd_codec_get_vals(&rect),
+                                 vals);
+        if (error != BMD_ERROR_NONE)
+        {
+            return error;
+        }
+        in += tile_bytes;
+        lvals = bmd_codec_reconstruct(vals, (unsigned char*)ydata +
+                                      rect.y * ystride + rect.x,
+                                      ystride, rect.width, rect.height, 1);
+        bmd_codec_reconstruct(lvals, (unsigned char*)uvdata +
+                              (rect.y / 2) * uvstride + rect.x,
+                              uvstride, rect.width, rect.height / 2, 2);
+    }
+    return (in == end) ? BMD_ERROR_NONE : BMD_ERROR_RANGE;
+}
@@ -0,0 +1,53 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BMD_CODEC_H_
+#define _BMD_CODEC_H_
+
+/* lossless tile codec for NV12 frames leaving over tcp
+   the frame is cut into BMD_CODEC_TILE square luma tiles, each with its
+   chroma rows, and every tile is coded on its own so tiles can be coded
+   and decoded in any order or in parallel
+   a tile is the first row left predicted, the rest predicted from the
+   row above, the residuals zigzagged and bit packed in groups of
+   BMD_CODEC_GROUP behind a byte giving the group's bit width
+   the stream is a u32 le per tile, the coded bytes of the tile or 0 when
+   it has not changed since the base frame, then the coded tiles in
+   raster order */
+
+#define BMD_CODEC_TILE  64
+#define BMD_CODEC_GROUP 16
+
+int
+bmd_codec_create(int width, int height, void** obj);
+int
+bmd_codec_delete(void* obj);
+int
+bmd_codec_encode(void* obj, const void* ydata, int ystride,
+                 const void* uvdata, int uvstride, int seq);
+int
+bmd_codec_check_base(void* obj, int base_seq);
+int
+bmd_codec_get_bytes(void* obj, int key, int base_seq, int* bytes);
+int
+bmd_codec_write(void* obj, int key, int base_seq, void* data, int bytes);
+int
+bmd_codec_decode(int width, int height, const void* data, int bytes,
+                 void* ydata, int ystride, void* uvdata, int uvstride);
+
+#endif
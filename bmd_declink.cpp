@@ -142,6 +142,9 @@ DeckLinkCaptureDelegate::
     int do_sig;
     int bytes;
     int now;
+    int demand;
+    int take_video;
+    long long now_us;
 
     LOGLN10((LOG_INFO, LOGS "videoFrame %p audioFrame %p", LOGP,
              videoFrame, audioFrame));
@@ -149,10 +152,33 @@ DeckLinkCaptureDelegate::
     {
         return S_OK;
     }
+    get_ustime(&now_us);
     do_sig = 0;
     av_info = m_av_info;
     pthread_mutex_lock(&(av_info->av_mutex));
-    if ((videoFrame != NULL) && (!(av_info->got_video)))
+    take_video = 0;
+    if (videoFrame != NULL)
+    {
+        av_info->vseq++;
+        demand = __atomic_load_n(&(av_info->video_demand), __ATOMIC_ACQUIRE);
+        if (demand & BMD_VIDEO_DEMAND_ALL)
+        {
+            take_video = 1;
+        }
+        if ((demand & BMD_VIDEO_DEMAND_SEQ) &&
+            (av_info->vseq - __atomic_load_n(&(av_info->video_want_seq),
+                                             __ATOMIC_RELAXED) >= 0))
+        {
+            take_video = 1;
+        }
+        if ((demand & BMD_VIDEO_DEMAND_TIME) &&
+            (now - __atomic_load_n(&(av_info->video_want_mstime),
+                                   __ATOMIC_RELAXED) >= 0))
+        {
+            take_video = 1;
+        }
+    }
+    if (take_video && (!(av_info->got_video)))
     {
         video_data = NULL;
         videoFrame->GetBytes(&video_data);
@@ -178,12 +204,15 @@ DeckLinkCaptureDelegate::
             av_info->vheight = video_height;
             av_info->vstride_bytes = stride_bytes;
             av_info->vtime = now;
+            av_info->vframe_seq = av_info->vseq;
+            av_info->vcallback_us = now_us;
             memcpy(av_info->vdata, video_data, bytes);
             av_info->got_video = 1;
             do_sig = 1;
         }
     }
-    if ((audioFrame != NULL) && (!(av_info->got_audio)))
+    if ((audioFrame != NULL) && (!(av_info->got_audio)) &&
+        __atomic_load_n(&(av_info->audio_demand), __ATOMIC_ACQUIRE))
     {
         audio_data = NULL;
         audioFrame->GetBytes(&audio_data);
@@ -206,6 +235,7 @@ DeckLinkCaptureDelegate::
             av_info->abytes_per_sample = 2;
             av_info->asamples = audio_frame_count;
             av_info->atime = now;
+            av_info->acallback_us = now_us;
             memcpy(av_info->adata, audio_data, bytes);
             av_info->got_audio = 1;
             do_sig = 1;
@@ -22,6 +22,11 @@
 #define BMD_FLAGS_VIDEO_PRESENT 1
 #define BMD_FLAGS_AUDIO_PRESENT 2
 
+/* video_demand bits */
+#define BMD_VIDEO_DEMAND_ALL    1 /* every frame */
+#define BMD_VIDEO_DEMAND_SEQ    2 /* frames from video_want_seq on */
+#define BMD_VIDEO_DEMAND_TIME   4 /* frames from video_want_mstime on */
+
 struct bmd_av_info
 {
     int got_video; /* boolean */
@@ -41,8 +46,17 @@ struct bmd_av_info
     int atime;
     char* adata;
     int adata_alloc_bytes;
-    int pad1;
+    /* set by the main thread, read by the capture callback with
+       __atomic_load_n, non zero when a peer will take the data */
+    int video_demand;
+    int audio_demand;
+    int video_want_seq;
+    int video_want_mstime;
+    int vseq; /* counts every video frame that arrives */
+    int vframe_seq; /* vseq of the frame in vdata */
     int av_pipe[2];
+    long long vcallback_us; /* get_ustime at callback entry for vdata */
+    long long acallback_us; /* and for adata */
     pthread_mutex_t av_mutex;
 };
 
@@ -0,0 +1,220 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <yami_inf.h>
+
+#include "bmd.h"
+#include "bmd_encoder.h"
+#include "bmd_h264sw.h"
+#include "bmd_surface.h"
+#include "bmd_error.h"
+#include "bmd_log.h"
+#include "bmd_utils.h"
+
+struct bmd_encoder
+{
+    int type;
+    int width;
+    int height;
+    int pad0;
+    void* obj;
+};
+
+/*****************************************************************************/
+int
+bmd_encoder_create(int type, int width, int height, void** obj)
+{
+    struct bmd_encoder* self;
+    int error;
+
+    self = xnew0(struct bmd_encoder, 1);
+    if (self == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    self->width = width;
+    self->height = height;
+    if ((type == BMD_ENCODER_TYPE_AUTO) || (type == BMD_ENCODER_TYPE_YAMI))
+    {
+        error = yami_encoder_create(&(self->obj), width, height,
+                                    YI_TYPE_H264,
+                                    YI_H264_ENC_FLAGS_PROFILE_MAIN);
+        if (error == YI_SUCCESS)
+        {
+            self->type = BMD_ENCODER_TYPE_YAMI;
+            *obj = self;
+            return BMD_ERROR_NONE;
+        }
+        LOGLN0((LOG_ERROR, LOGS "yami_encoder_create failed %d",
+                LOGP, error));
+        if (type == BMD_ENCODER_TYPE_YAMI)
+        {
+            free(self);
+            return BMD_ERROR_CREATE;
+        }
+    }
+    error = bmd_h264sw_create(width, height, &(self->obj));
+    if (error != BMD_ERROR_NONE)
+    {
+        LOGLN0((LOG_ERROR, LOGS "bmd_h264sw_create failed %d", LOGP, error));
+        free(self);
+        return error;
+    }
+    self->type = BMD_ENCODER_TYPE_SW;
+    *obj = self;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_encoder_delete(void* obj)
+{
+    struct bmd_encoder* self;
+
+    self = (struct bmd_encoder*)obj;
+    if (self == NULL)
+    {
+        return BMD_ERROR_NONE;
+    }
+    if (self->type == BMD_ENCODER_TYPE_YAMI)
+    {
+        yami_encoder_delete(self->obj);
+    }
+    else
+    {
+        bmd_h264sw_delete(self->obj);
+    }
+    free(self);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_encoder_get_type(void* obj, int* type)
+{
+    struct bmd_encoder* self;
+
+    self = (struct bmd_encoder*)obj;
+    *type = self->type;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_encoder_get_max_bytes(void* obj, int* max_bytes)
+{
+    struct bmd_encoder* self;
+
+    self = (struct bmd_encoder*)obj;
+    if (self->type == BMD_ENCODER_TYPE_YAMI)
+    {
+        *max_bytes = self->width * self->height * 2;
+        return BMD_ERROR_NONE;
+    }
+    return bmd_h264sw_get_max_bytes(self->obj, max_bytes);
+}
+
+/*****************************************************************************/
+/* boolean, the annex b access unit has an IDR slice, a non IDR I slice
+   is only a safe place to start with one reference and no B frames and
+   nothing makes yami keep to that */
+static int
+bmd_encoder_h264_is_key(const unsigned char* data, int bytes)
+{
+    int index;
+
+    for (index = 0; index + 3 < bytes; index++)
+    {
+        if ((data[index] == 0) && (data[index + 1] == 0) &&
+            (data[index + 2] == 1) && ((data[index + 3] & 0x1f) == 5))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*****************************************************************************/
+/* encodes the current frame, the yami backend takes the exported dmabuf,
+   the software backend reads the surface planes
+   cdata_bytes is in / out, in is the max size of cdata */
+int
+bmd_encoder_encode(void* obj, struct bmd_info* bmd,
+                   void* cdata, int* cdata_bytes, int* flags)
+{
+    struct bmd_encoder* self;
+    void* ydata;
+    void* uvdata;
+    int ydata_stride_bytes;
+    int uvdata_stride_bytes;
+    int error;
+
+    self = (struct bmd_encoder*)obj;
+    *flags = 0;
+    if (self->type == BMD_ENCODER_TYPE_YAMI)
+    {
+        error = yami_encoder_set_fd_src(self->obj, bmd->fd,
+                                        bmd->fd_width, bmd->fd_height,
+                                        bmd->fd_stride, bmd->fd_size,
+                                        bmd->fd_bpp);
+        if (error != YI_SUCCESS)
+        {
+            LOGLN0((LOG_ERROR, LOGS "yami_encoder_set_fd_src failed %d",
+                    LOGP, error));
+            return BMD_ERROR_FD;
+        }
+        error = yami_encoder_encode(self->obj, cdata, cdata_bytes);
+        if (error != YI_SUCCESS)
+        {
+            LOGLN0((LOG_ERROR, LOGS "yami_encoder_encode failed %d",
+                    LOGP, error));
+            return BMD_ERROR_ENCODE;
+        }
+        if (bmd_encoder_h264_is_key((const unsigned char*)cdata,
+                                    *cdata_bytes))
+        {
+            *flags = BMD_ENCODER_FLAGS_KEYFRAME;
+        }
+        return BMD_ERROR_NONE;
+    }
+    error = bmd_surface_get_ybuffer(bmd->surface, &ydata,
+                                    &ydata_stride_bytes);
+    if (error != BMD_ERROR_NONE)
+    {
+        return error;
+    }
+    error = bmd_surface_get_uvbuffer(bmd->surface, &uvdata,
+                                     &uvdata_stride_bytes);
+    if (error != BMD_ERROR_NONE)
+    {
+        return error;
+    }
+    error = bmd_h264sw_encode(self->obj, ydata, ydata_stride_bytes,
+                              uvdata, uvdata_stride_bytes,
+                              cdata, cdata_bytes);
+    if (error != BMD_ERROR_NONE)
+    {
+        return error;
+    }
+    *flags = BMD_ENCODER_FLAGS_KEYFRAME;
+    return BMD_ERROR_NONE;
+}
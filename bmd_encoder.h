@@ -0,0 +1,40 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BMD_ENCODER_H_
+#define _BMD_ENCODER_H_
+
+#define BMD_ENCODER_TYPE_AUTO       0
+#define BMD_ENCODER_TYPE_YAMI       1
+#define BMD_ENCODER_TYPE_SW         2
+
+#define BMD_ENCODER_FLAGS_KEYFRAME  1
+
+int
+bmd_encoder_create(int type, int width, int height, void** obj);
+int
+bmd_encoder_delete(void* obj);
+int
+bmd_encoder_get_type(void* obj, int* type);
+int
+bmd_encoder_get_max_bytes(void* obj, int* max_bytes);
+int
+bmd_encoder_encode(void* obj, struct bmd_info* bmd,
+                   void* cdata, int* cdata_bytes, int* flags);
+
+#endif
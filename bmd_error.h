@@ -39,6 +39,7 @@
 #define BMD_ERROR_DECKLINK          17
 #define BMD_ERROR_MUTEX             18
 #define BMD_ERROR_PIPE              19
+#define BMD_ERROR_ENCODE            20
 
 #endif
 
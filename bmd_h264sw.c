@@ -0,0 +1,419 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* reference software h264 encoder
+   every picture is an IDR made of I_PCM macroblocks, constrained baseline,
+   any decoder can play it, no compression, only used when there is no
+   hardware encoder */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bmd_h264sw.h"
+#include "bmd_error.h"
+#include "bmd_log.h"
+#include "bmd_utils.h"
+
+#define MB_TYPE_I_PCM 25
+
+struct bits_info
+{
+    unsigned char* data;
+    int bytes;
+    int bits_left;
+    unsigned int cur;
+};
+
+struct bmd_h264sw
+{
+    int width;
+    int height;
+    int width_mbs;
+    int height_mbs;
+    int idr_pic_id;
+    int rbsp_alloc_bytes;
+    unsigned char* rbsp;
+};
+
+/*****************************************************************************/
+static void
+bits_init(struct bits_info* bits, unsigned char* data)
+{
+    bits->data = data;
+    bits->bytes = 0;
+    bits->bits_left = 8;
+    bits->cur = 0;
+}
+
+/*****************************************************************************/
+static void
+bits_put(struct bits_info* bits, unsigned int val, int num_bits)
+{
+    while (num_bits > 0)
+    {
+        num_bits--;
+        bits->cur = (bits->cur << 1) | ((val >> num_bits) & 1);
+        bits->bits_left--;
+        if (bits->bits_left == 0)
+        {
+            bits->data[bits->bytes++] = bits->cur;
+            bits->bits_left = 8;
+            bits->cur = 0;
+        }
+    }
+}
+
+/*****************************************************************************/
+/* Exp-Golomb unsigned */
+static void
+bits_put_ue(struct bits_info* bits, unsigned int val)
+{
+    unsigned int code;
+    int num_bits;
+
+    code = val + 1;
+    num_bits = 0;
+    while ((code >> num_bits) > 1)
+    {
+        num_bits++;
+    }
+    bits_put(bits, 0, num_bits);
+    bits_put(bits, code, num_bits + 1);
+}
+
+/*****************************************************************************/
+/* Exp-Golomb signed */
+static void
+bits_put_se(struct bits_info* bits, int val)
+{
+    if (val > 0)
+    {
+        bits_put_ue(bits, val * 2 - 1);
+    }
+    else
+    {
+        bits_put_ue(bits, -val * 2);
+    }
+}
+
+/*****************************************************************************/
+static void
+bits_align_zero(struct bits_info* bits)
+{
+    if (bits->bits_left != 8)
+    {
+        bits_put(bits, 0, bits->bits_left);
+    }
+}
+
+/*****************************************************************************/
+static void
+bits_trailing(struct bits_info* bits)
+{
+    bits_put(bits, 1, 1);
+    bits_align_zero(bits);
+}
+
+/*****************************************************************************/
+/* byte aligned raw copy, pcm samples can not be 0 in older decoders */
+static void
+bits_put_pcm(struct bits_info* bits, const unsigned char* src, int count,
+             int src_step)
+{
+    unsigned char* dst;
+    int index;
+    int val;
+
+    dst = bits->data + bits->bytes;
+    for (index = 0; index < count; index++)
+    {
+        val = *src;
+        dst[index] = val == 0 ? 1 : val;
+        src += src_step;
+    }
+    bits->bytes += count;
+}
+
+/*****************************************************************************/
+/* start code, nal header and emulation prevention */
+static int
+bmd_h264sw_out_nal(int nal_ref_idc, int nal_unit_type,
+                   const unsigned char* rbsp, int rbsp_bytes,
+                   unsigned char* dst)
+{
+    int index;
+    int zeros;
+    int dst_bytes;
+
+    dst[0] = 0;
+    dst[1] = 0;
+    dst[2] = 0;
+    dst[3] = 1;
+    dst[4] = (nal_ref_idc << 5) | nal_unit_type;
+    dst_bytes = 5;
+    zeros = 0;
+    for (index = 0; index < rbsp_bytes; index++)
+    {
+        if ((zeros == 2) && (rbsp[index] <= 3))
+        {
+            dst[dst_bytes++] = 3;
+            zeros = 0;
+        }
+        dst[dst_bytes++] = rbsp[index];
+        zeros = rbsp[index] == 0 ? zeros + 1 : 0;
+    }
+    return dst_bytes;
+}
+
+/*****************************************************************************/
+static int
+bmd_h264sw_sps(struct bmd_h264sw* self, unsigned char* rbsp)
+{
+    struct bits_info bits;
+    int crop_right;
+    int crop_bottom;
+
+    bits_init(&bits, rbsp);
+    bits_put(&bits, 66, 8); /* profile_idc baseline */
+    bits_put(&bits, 0xC0, 8); /* constraint_set0 and 1 */
+    bits_put(&bits, 51, 8); /* level_idc */
+    bits_put_ue(&bits, 0); /* seq_parameter_set_id */
+    bits_put_ue(&bits, 0); /* log2_max_frame_num_minus4 */
+    bits_put_ue(&bits, 2); /* pic_order_cnt_type */
+    bits_put_ue(&bits, 0); /* max_num_ref_frames */
+    bits_put(&bits, 0, 1); /* gaps_in_frame_num_value_allowed_flag */
+    bits_put_ue(&bits, self->width_mbs - 1);
+    bits_put_ue(&bits, self->height_mbs - 1);
+    bits_put(&bits, 1, 1); /* frame_mbs_only_flag */
+    bits_put(&bits, 1, 1); /* direct_8x8_inference_flag */
+    crop_right = (self->width_mbs * 16 - self->width) / 2;
+    crop_bottom = (self->height_mbs * 16 - self->height) / 2;
+    if ((crop_right != 0) || (crop_bottom != 0))
+    {
+        bits_put(&bits, 1, 1); /* frame_cropping_flag */
+        bits_put_ue(&bits, 0);
+        bits_put_ue(&bits, crop_right);
+        bits_put_ue(&bits, 0);
+        bits_put_ue(&bits, crop_bottom);
+    }
+    else
+    {
+        bits_put(&bits, 0, 1);
+    }
+    bits_put(&bits, 0, 1); /* vui_parameters_present_flag */
+    bits_trailing(&bits);
+    return bits.bytes;
+}
+
+/*****************************************************************************/
+static int
+bmd_h264sw_pps(unsigned char* rbsp)
+{
+    struct bits_info bits;
+
+    bits_init(&bits, rbsp);
+    bits_put_ue(&bits, 0); /* pic_parameter_set_id */
+    bits_put_ue(&bits, 0); /* seq_parameter_set_id */
+    bits_put(&bits, 0, 1); /* entropy_coding_mode_flag, cavlc */
+    bits_put(&bits, 0, 1); /* bottom_field_pic_order_in_frame_present */
+    bits_put_ue(&bits, 0); /* num_slice_groups_minus1 */
+    bits_put_ue(&bits, 0); /* num_ref_idx_l0_default_active_minus1 */
+    bits_put_ue(&bits, 0); /* num_ref_idx_l1_default_active_minus1 */
+    bits_put(&bits, 0, 1); /* weighted_pred_flag */
+    bits_put(&bits, 0, 2); /* weighted_bipred_idc */
+    bits_put_se(&bits, 0); /* pic_init_qp_minus26 */
+    bits_put_se(&bits, 0); /* pic_init_qs_minus26 */
+    bits_put_se(&bits, 0); /* chroma_qp_index_offset */
+    bits_put(&bits, 0, 1); /* deblocking_filter_control_present_flag */
+    bits_put(&bits, 0, 1); /* constrained_intra_pred_flag */
+    bits_put(&bits, 0, 1); /* redundant_pic_cnt_present_flag */
+    bits_trailing(&bits);
+    return bits.bytes;
+}
+
+/*****************************************************************************/
+/* edge macroblocks replicate the last row / column */
+static int
+bmd_h264sw_slice(struct bmd_h264sw* self,
+                 const unsigned char* ydata, int ydata_stride_bytes,
+                 const unsigned char* uvdata, int uvdata_stride_bytes,
+                 unsigned char* rbsp)
+{
+    struct bits_info bits;
+    const unsigned char* src8;
+    int mbx;
+    int mby;
+    int row;
+    int x;
+    int y;
+    int plane;
+
+    bits_init(&bits, rbsp);
+    bits_put_ue(&bits, 0); /* first_mb_in_slice */
+    bits_put_ue(&bits, 7); /* slice_type, all I */
+    bits_put_ue(&bits, 0); /* pic_parameter_set_id */
+    bits_put(&bits, 0, 4); /* frame_num */
+    bits_put_ue(&bits, self->idr_pic_id);
+    bits_put(&bits, 0, 1); /* no_output_of_prior_pics_flag */
+    bits_put(&bits, 0, 1); /* long_term_reference_flag */
+    bits_put_se(&bits, 0); /* slice_qp_delta */
+    for (mby = 0; mby < self->height_mbs; mby++)
+    {
+        for (mbx = 0; mbx < self->width_mbs; mbx++)
+        {
+            bits_put_ue(&bits, MB_TYPE_I_PCM);
+            bits_align_zero(&bits);
+            for (row = 0; row < 16; row++)
+            {
+                y = mby * 16 + row;
+                y = y < self->height ? y : self->height - 1;
+                x = mbx * 16;
+                src8 = ydata + y * ydata_stride_bytes + x;
+                if (x + 16 <= self->width)
+                {
+                    bits_put_pcm(&bits, src8, 16, 1);
+                }
+                else
+                {
+                    bits_put_pcm(&bits, src8, self->width - x, 1);
+                    bits_put_pcm(&bits, src8 + self->width - x - 1,
+                                 16 - (self->width - x), 0);
+                }
+            }
+            /* nv12 uv is interleaved, pcm wants all cb then all cr */
+            for (plane = 0; plane < 2; plane++)
+            {
+                for (row = 0; row < 8; row++)
+                {
+                    y = mby * 8 + row;
+                    y = y < self->height / 2 ? y : self->height / 2 - 1;
+                    x = mbx * 8;
+                    src8 = uvdata + y * uvdata_stride_bytes + x * 2 + plane;
+                    if (x + 8 <= self->width / 2)
+                    {
+                        bits_put_pcm(&bits, src8, 8, 2);
+                    }
+                    else
+                    {
+                        bits_put_pcm(&bits, src8, self->width / 2 - x, 2);
+                        bits_put_pcm(&bits,
+                                     src8 + (self->width / 2 - x - 1) * 2,
+                                     8 - (self->width / 2 - x), 0);
+                    }
+                }
+            }
+        }
+    }
+    bits_trailing(&bits);
+    return bits.bytes;
+}
+
+/*****************************************************************************/
+int
+bmd_h264sw_create(int width, int height, void** obj)
+{
+    struct bmd_h264sw* self;
+
+    if ((width < 16) || (height < 16) || (width & 1) || (height & 1))
+    {
+        return BMD_ERROR_PARAM;
+    }
+    self = xnew0(struct bmd_h264sw, 1);
+    if (self == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    self->width = width;
+    self->height = height;
+    self->width_mbs = (width + 15) / 16;
+    self->height_mbs = (height + 15) / 16;
+    /* 384 pcm bytes plus a few bits of header for each macroblock */
+    self->rbsp_alloc_bytes = self->width_mbs * self->height_mbs * 392 + 1024;
+    self->rbsp = xnew(unsigned char, self->rbsp_alloc_bytes);
+    if (self->rbsp == NULL)
+    {
+        free(self);
+        return BMD_ERROR_MEMORY;
+    }
+    *obj = self;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_h264sw_delete(void* obj)
+{
+    struct bmd_h264sw* self;
+
+    self = (struct bmd_h264sw*)obj;
+    if (self == NULL)
+    {
+        return BMD_ERROR_NONE;
+    }
+    free(self->rbsp);
+    free(self);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* worst case is every rbsp byte escaped plus start codes */
+int
+bmd_h264sw_get_max_bytes(void* obj, int* max_bytes)
+{
+    struct bmd_h264sw* self;
+
+    self = (struct bmd_h264sw*)obj;
+    *max_bytes = self->rbsp_alloc_bytes + self->rbsp_alloc_bytes / 2 + 1024;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* cdata_bytes is in / out, in is the max size of cdata */
+int
+bmd_h264sw_encode(void* obj, void* ydata, int ydata_stride_bytes,
+                  void* uvdata, int uvdata_stride_bytes,
+                  void* cdata, int* cdata_bytes)
+{
+    struct bmd_h264sw* self;
+    unsigned char* dst8;
+    int max_bytes;
+    int rbsp_bytes;
+    int bytes;
+
+    self = (struct bmd_h264sw*)obj;
+    bmd_h264sw_get_max_bytes(self, &max_bytes);
+    if (*cdata_bytes < max_bytes)
+    {
+        return BMD_ERROR_RANGE;
+    }
+    dst8 = (unsigned char*)cdata;
+    rbsp_bytes = bmd_h264sw_sps(self, self->rbsp);
+    bytes = bmd_h264sw_out_nal(3, 7, self->rbsp, rbsp_bytes, dst8);
+    rbsp_bytes = bmd_h264sw_pps(self->rbsp);
+    bytes += bmd_h264sw_out_nal(3, 8, self->rbsp, rbsp_bytes, dst8 + bytes);
+    rbsp_bytes = bmd_h264sw_slice(self, (const unsigned char*)ydata,
+                                  ydata_stride_bytes,
+                                  (const unsigned char*)uvdata,
+                                  uvdata_stride_bytes, self->rbsp);
+    bytes += bmd_h264sw_out_nal(3, 5, self->rbsp, rbsp_bytes, dst8 + bytes);
+    /* consecutive IDR pictures need different idr_pic_id */
+    self->idr_pic_id ^= 1;
+    *cdata_bytes = bytes;
+    return BMD_ERROR_NONE;
+}
@@ -0,0 +1,33 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BMD_H264SW_H_
+#define _BMD_H264SW_H_
+
+int
+bmd_h264sw_create(int width, int height, void** obj);
+int
+bmd_h264sw_delete(void* obj);
+int
+bmd_h264sw_get_max_bytes(void* obj, int* max_bytes);
+int
+bmd_h264sw_encode(void* obj, void* ydata, int ydata_stride_bytes,
+                  void* uvdata, int uvdata_stride_bytes,
+                  void* cdata, int* cdata_bytes);
+
+#endif
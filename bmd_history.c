@@ -0,0 +1,320 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* video frame history, see bmd_history.h
+   the slots are a ring, oldest then the published frames in order, the
+   slot after the newest is the one being converted into
+   a slot keeps its payload after it drops out of the ring, when a lookup
+   handed the frame out or the payload is still queued to a peer the slot
+   gets a new surface, the old one lives on in the peers' fds
+   the main thread is the only writer, it holds the mutex while it moves
+   the ring, lookups hold it just long enough to take a reference */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "arch.h"
+#include "parse.h"
+#include "bmd.h"
+#include "bmd_history.h"
+#include "bmd_payload.h"
+#include "bmd_surface.h"
+#include "bmd_error.h"
+#include "bmd_log.h"
+#include "bmd_utils.h"
+
+struct history_slot
+{
+    void* surface;
+    struct bmd_payload* payload; /* the last frame in surface or NULL */
+    int seq;
+    int mstime;
+    int lent; /* boolean, a lookup returned the frame */
+    int pad0;
+};
+
+struct bmd_history
+{
+    pthread_mutex_t mutex;
+    int max_bytes;
+    int num_slots; /* for width and height */
+    int oldest;
+    int frames; /* published, from oldest */
+    int width;
+    int height;
+    struct history_slot slots[BMD_HISTORY_MAX_FRAMES];
+};
+
+/*****************************************************************************/
+static int
+bmd_history_clear_locked(struct bmd_history* self, int surfaces)
+{
+    struct history_slot* slot;
+    int index;
+
+    if (surfaces)
+    {
+        for (index = 0; index < BMD_HISTORY_MAX_FRAMES; index++)
+        {
+            slot = self->slots + index;
+            bmd_payload_release(slot->payload);
+            slot->payload = NULL;
+            bmd_surface_delete(slot->surface);
+            slot->surface = NULL;
+            slot->lent = 0;
+        }
+    }
+    self->oldest = 0;
+    self->frames = 0;
+    if (surfaces)
+    {
+        self->width = 0;
+        self->height = 0;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_history_create(int max_bytes, void** obj)
+{
+    struct bmd_history* self;
+
+    if (max_bytes < 1)
+    {
+        return BMD_ERROR_PARAM;
+    }
+    self = xnew0(struct bmd_history, 1);
+    if (self == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    if (pthread_mutex_init(&(self->mutex), NULL) != 0)
+    {
+        free(self);
+        return BMD_ERROR_MUTEX;
+    }
+    self->max_bytes = max_bytes;
+    *obj = self;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_history_delete(void* obj)
+{
+    struct bmd_history* self;
+
+    self = (struct bmd_history*)obj;
+    if (self == NULL)
+    {
+        return BMD_ERROR_NONE;
+    }
+    bmd_history_clear_locked(self, 1);
+    pthread_mutex_destroy(&(self->mutex));
+    free(self);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* the surface for the next frame, a new one until the budget is used,
+   then the oldest frame's, a size change starts over */
+int
+bmd_history_get_surface(void* obj, int type, int dev_fd, int width,
+                        int height, void** surface)
+{
+    struct bmd_history* self;
+    struct history_slot* slot;
+    int num_slots;
+    int error;
+
+    self = (struct bmd_history*)obj;
+    pthread_mutex_lock(&(self->mutex));
+    if ((self->width != width) || (self->height != height))
+    {
+        bmd_history_clear_locked(self, 1);
+        /* nv12, at least the newest frame and the one being converted */
+        num_slots = self->max_bytes / (width * height * 3 / 2);
+        if (num_slots < 2)
+        {
+            num_slots = 2;
+        }
+        if (num_slots > BMD_HISTORY_MAX_FRAMES)
+        {
+            num_slots = BMD_HISTORY_MAX_FRAMES;
+        }
+        LOGLN0((LOG_INFO, LOGS "width %d height %d frames %d", LOGP,
+                width, height, num_slots));
+        self->num_slots = num_slots;
+        self->width = width;
+        self->height = height;
+    }
+    if (self->frames >= self->num_slots)
+    {
+        self->oldest = (self->oldest + 1) % self->num_slots;
+        self->frames--;
+    }
+    slot = self->slots + (self->oldest + self->frames) % self->num_slots;
+    if (slot->lent ||
+        ((slot->payload != NULL) &&
+         (__atomic_load_n(&(slot->payload->ref_count),
+                          __ATOMIC_ACQUIRE) > 1)))
+    {
+        /* a peer has the frame, converting over it would change what
+           it reads */
+        bmd_surface_delete(slot->surface);
+        slot->surface = NULL;
+        slot->lent = 0;
+    }
+    bmd_payload_release(slot->payload);
+    slot->payload = NULL;
+    if (slot->surface == NULL)
+    {
+        error = bmd_surface_create(type, dev_fd, width, height,
+                                   &(slot->surface));
+        if (error != BMD_ERROR_NONE)
+        {
+            slot->surface = NULL;
+            pthread_mutex_unlock(&(self->mutex));
+            return error;
+        }
+    }
+    *surface = slot->surface;
+    pthread_mutex_unlock(&(self->mutex));
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* publish the frame converted into the last bmd_history_get_surface */
+int
+bmd_history_add(void* obj, int seq, int mstime,
+                struct bmd_payload* payload)
+{
+    struct bmd_history* self;
+    struct history_slot* slot;
+
+    self = (struct bmd_history*)obj;
+    pthread_mutex_lock(&(self->mutex));
+    if (self->frames >= self->num_slots)
+    {
+        pthread_mutex_unlock(&(self->mutex));
+        return BMD_ERROR_RANGE;
+    }
+    slot = self->slots + (self->oldest + self->frames) % self->num_slots;
+    bmd_payload_addref(payload);
+    slot->payload = payload;
+    slot->seq = seq;
+    slot->mstime = mstime;
+    self->frames++;
+    pthread_mutex_unlock(&(self->mutex));
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* drop the frames, and the surfaces too when surfaces is set, without
+   the surfaces the payloads stay to say when a surface is still held */
+int
+bmd_history_clear(void* obj, int surfaces)
+{
+    struct bmd_history* self;
+
+    self = (struct bmd_history*)obj;
+    pthread_mutex_lock(&(self->mutex));
+    bmd_history_clear_locked(self, surfaces);
+    pthread_mutex_unlock(&(self->mutex));
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* by is BMD_VIDEO_HISTORY_BY_*, *payload is a reference to the frame's
+   VIDEO payload or NULL when it is not held, range is filled either way */
+int
+bmd_history_find(void* obj, int by, int value,
+                 struct bmd_payload** payload,
+                 struct bmd_history_range* range)
+{
+    struct bmd_history* self;
+    struct history_slot* slot;
+    int found;
+    int index;
+
+    self = (struct bmd_history*)obj;
+    *payload = NULL;
+    memset(range, 0, sizeof(struct bmd_history_range));
+    pthread_mutex_lock(&(self->mutex));
+    if (self->frames < 1)
+    {
+        pthread_mutex_unlock(&(self->mutex));
+        return BMD_ERROR_NONE;
+    }
+    range->frames = self->frames;
+    slot = self->slots + self->oldest;
+    range->oldest_seq = slot->seq;
+    range->oldest_time = slot->mstime;
+    slot = self->slots + (self->oldest + self->frames - 1) % self->num_slots;
+    range->newest_seq = slot->seq;
+    range->newest_time = slot->mstime;
+    found = -1;
+    switch (by)
+    {
+        case BMD_VIDEO_HISTORY_BY_SEQ:
+            for (index = 0; index < self->frames; index++)
+            {
+                slot = self->slots + (self->oldest + index) % self->num_slots;
+                if (slot->seq == value)
+                {
+                    found = index;
+                    break;
+                }
+            }
+            break;
+        case BMD_VIDEO_HISTORY_BY_TIME:
+            /* the frame on screen at value, the newest not after it */
+            for (index = self->frames - 1; index >= 0; index--)
+            {
+                slot = self->slots + (self->oldest + index) % self->num_slots;
+                if (value - slot->mstime >= 0)
+                {
+                    found = index;
+                    break;
+                }
+            }
+            break;
+        case BMD_VIDEO_HISTORY_BY_AGE:
+            if ((value >= 0) && (value < self->frames))
+            {
+                found = self->frames - 1 - value;
+            }
+            break;
+        default:
+            pthread_mutex_unlock(&(self->mutex));
+            return BMD_ERROR_PARAM;
+    }
+    if (found >= 0)
+    {
+        slot = self->slots + (self->oldest + found) % self->num_slots;
+        bmd_payload_addref(slot->payload);
+        *payload = slot->payload;
+        slot->lent = 1;
+    }
+    pthread_mutex_unlock(&(self->mutex));
+    return BMD_ERROR_NONE;
+}
@@ -0,0 +1,63 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _BMD_HISTORY_H_
+#define _BMD_HISTORY_H_
+
+/* the last converted video frames, -H
+   each frame stays in the surface it was converted into along with its
+   VIDEO payload, once the memory budget is used the main thread takes
+   the oldest surface back for the next frame, or makes a new one when
+   the oldest frame was handed out
+   peers on any thread look a frame up and get a reference to its
+   payload, nothing is copied */
+
+#define BMD_HISTORY_MAX_FRAMES      1024
+
+struct bmd_payload;
+
+/* what the history holds */
+struct bmd_history_range
+{
+    int frames;
+    int oldest_seq;
+    int newest_seq;
+    int oldest_time;
+    int newest_time;
+    int pad0;
+};
+
+int
+bmd_history_create(int max_bytes, void** obj);
+int
+bmd_history_delete(void* obj);
+int
+bmd_history_get_surface(void* obj, int type, int dev_fd, int width,
+                        int height, void** surface);
+int
+bmd_history_add(void* obj, int seq, int mstime,
+                struct bmd_payload* payload);
+int
+bmd_history_clear(void* obj, int surfaces);
+int
+bmd_history_find(void* obj, int by, int value,
+                 struct bmd_payload** payload,
+                 struct bmd_history_range* range);
+
+#endif
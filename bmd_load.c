@@ -0,0 +1,861 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* bmd_load, starts N peers against a running bmd and reports delivery
+   latency percentiles, missed video frames, audio gaps and the daemon's
+   cpu and rss, run the daemon with -S for a capture source that does not
+   need a DeckLink card */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "arch.h"
+#include "bmd.h"
+#include "bmd_client.h"
+#include "bmd_error.h"
+#include "bmd_utils.h"
+
+#define LOAD_AUDIO_RATE 48000
+
+struct load_samples
+{
+    int* data; /* microseconds */
+    int count;
+    int alloc;
+};
+
+struct load_peer
+{
+    void* client;
+    int failed; /* boolean */
+    int video_count;
+    int audio_count;
+    int audio_shm_count;
+    int missed; /* video frames skipped in the capture sequence */
+    int have_video; /* boolean */
+    int last_video_seq;
+    int have_audio; /* boolean */
+    int last_audio_time;
+    int last_audio_ms; /* duration of the last audio packet */
+    int audio_gaps;
+    int audio_gap_ms;
+    int video_recv_seq;
+    int audio_recv_time;
+    long long video_recv_us;
+    long long audio_recv_us;
+    struct load_samples video_latency;
+    struct load_samples audio_latency;
+};
+
+struct load_settings
+{
+    char uds[256];
+    int pid; /* daemon, for cpu and rss, 0 when not known */
+    int num_peers;
+    int seconds;
+    int warmup_seconds;
+    int every;
+    int fps;
+    int credits;
+    int request; /* boolean, request mode video */
+    int audio; /* boolean */
+    int audio_shm; /* boolean */
+    int read_frames; /* boolean */
+    char audio_formats[64]; /* spread over the peers, -m */
+};
+
+struct load_daemon
+{
+    long long ticks;
+    int rss_kb;
+    int max_rss_kb;
+};
+
+static volatile unsigned int g_sink;
+
+/*****************************************************************************/
+static int
+load_samples_add(struct load_samples* samples, long long us)
+{
+    int* data;
+    int alloc;
+
+    if (samples->count >= samples->alloc)
+    {
+        alloc = samples->alloc < 1024 ? 1024 : samples->alloc * 2;
+        data = (int*)realloc(samples->data, alloc * sizeof(int));
+        if (data == NULL)
+        {
+            return BMD_ERROR_MEMORY;
+        }
+        samples->data = data;
+        samples->alloc = alloc;
+    }
+    samples->data[samples->count++] = (int)us;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+load_int_compare(const void* a, const void* b)
+{
+    return *((const int*)a) - *((const int*)b);
+}
+
+/*****************************************************************************/
+/* merges the peers' samples, video or audio */
+static int
+load_print_latency(struct load_peer* peers, int num_peers, int video,
+                   const char* name)
+{
+    struct load_samples* samples;
+    int* all;
+    int count;
+    int index;
+
+    count = 0;
+    for (index = 0; index < num_peers; index++)
+    {
+        samples = video ? &(peers[index].video_latency) :
+                          &(peers[index].audio_latency);
+        count += samples->count;
+    }
+    if (count < 1)
+    {
+        printf("%s latency us: no samples\n", name);
+        return BMD_ERROR_NONE;
+    }
+    all = xnew(int, count);
+    if (all == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    count = 0;
+    for (index = 0; index < num_peers; index++)
+    {
+        samples = video ? &(peers[index].video_latency) :
+                          &(peers[index].audio_latency);
+        memcpy(all + count, samples->data, samples->count * sizeof(int));
+        count += samples->count;
+    }
+    qsort(all, count, sizeof(int), load_int_compare);
+    printf("%s latency us: samples %d p50 %d p90 %d p99 %d p99.9 %d "
+           "max %d\n", name, count, all[count * 500 / 1000],
+           all[count * 900 / 1000], all[count * 990 / 1000],
+           all[count * 999 / 1000], all[count - 1]);
+    free(all);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+load_sample_daemon(int pid, struct load_daemon* daemon)
+{
+    FILE* file;
+    char path[256];
+    char line[1024];
+    char* p;
+    unsigned long long utime;
+    unsigned long long stime;
+
+    if (pid < 1)
+    {
+        return BMD_ERROR_PARAM;
+    }
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return BMD_ERROR_FD;
+    }
+    p = fgets(line, sizeof(line), file) == NULL ? NULL : strrchr(line, ')');
+    fclose(file);
+    /* utime and stime are fields 14 and 15, the comm field can have
+       spaces so count from the closing paren */
+    if ((p == NULL) ||
+        (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                "%llu %llu", &utime, &stime) != 2))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    daemon->ticks = (long long)(utime + stime);
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return BMD_ERROR_FD;
+    }
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (strncmp(line, "VmRSS:", 6) == 0)
+        {
+            daemon->rss_kb = atoi(line + 6);
+            if (daemon->rss_kb > daemon->max_rss_kb)
+            {
+                daemon->max_rss_kb = daemon->rss_kb;
+            }
+            break;
+        }
+    }
+    fclose(file);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+load_process_video(struct load_peer* peer, struct load_settings* settings,
+                   struct bmd_client_event* event)
+{
+    const unsigned int* src;
+    unsigned int sum;
+    int delta;
+    int index;
+
+    get_ustime(&(peer->video_recv_us));
+    peer->video_recv_seq = event->seq;
+    if (event->data != NULL)
+    {
+        /* a consumer at least looks at the frame, -r reads all of it */
+        src = (const unsigned int*)(event->data);
+        sum = src[0];
+        if (settings->read_frames)
+        {
+            for (index = 1; index < event->size / 4; index++)
+            {
+                sum += src[index];
+            }
+        }
+        g_sink += sum;
+    }
+    if (peer->have_video && (settings->every > 0))
+    {
+        delta = event->seq - peer->last_video_seq;
+        if (delta > settings->every)
+        {
+            peer->missed += delta / settings->every - 1;
+        }
+    }
+    peer->have_video = 1;
+    peer->last_video_seq = event->seq;
+    peer->video_count++;
+    if (settings->credits > 0)
+    {
+        return bmd_client_video_credit(peer->client, 1);
+    }
+    if (settings->request)
+    {
+        return bmd_client_request_video_frame(peer->client);
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+load_process_audio(struct load_peer* peer, struct bmd_client_event* event)
+{
+    int expected;
+    int samples;
+    int bytes;
+
+    get_ustime(&(peer->audio_recv_us));
+    peer->audio_recv_time = event->time;
+    if (peer->have_audio)
+    {
+        /* packet times are from the capture callback, so allow half a
+           packet of jitter before calling it a gap */
+        expected = peer->last_audio_time + peer->last_audio_ms;
+        if (event->time - expected > peer->last_audio_ms / 2)
+        {
+            peer->audio_gaps++;
+            peer->audio_gap_ms += event->time - expected;
+        }
+    }
+    bytes = event->sample_type == BMD_AUDIO_SAMPLE_S16 ? 2 : 4;
+    samples = event->channels < 1 ? 0 :
+              event->bytes / (event->channels * bytes);
+    peer->have_audio = 1;
+    peer->last_audio_time = event->time;
+    peer->last_audio_ms = samples * 1000 /
+                          (event->rate > 0 ? event->rate : LOAD_AUDIO_RATE);
+    peer->audio_count++;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* the trace pdu follows the media pdu it is for, the time from the
+   capture callback to our receive is the delivery latency */
+static int
+load_process_trace(struct load_peer* peer, struct bmd_client_event* event)
+{
+    long long recv_us;
+
+    if ((event->trace_pdu_code == BMD_PDU_CODE_VIDEO) &&
+        (event->seq == peer->video_recv_seq))
+    {
+        recv_us = peer->video_recv_us;
+        load_samples_add(&(peer->video_latency),
+                         recv_us - event->trace_us[0]);
+    }
+    else if ((event->trace_pdu_code == BMD_PDU_CODE_AUDIO) &&
+             (event->seq == peer->audio_recv_time))
+    {
+        recv_us = peer->audio_recv_us;
+        load_samples_add(&(peer->audio_latency),
+                         recv_us - event->trace_us[0]);
+    }
+    else
+    {
+        return BMD_ERROR_NONE;
+    }
+    /* echo so the daemon's per peer report has the deliver stage too */
+    return bmd_client_trace_echo(peer->client, event, recv_us, 0);
+}
+
+/*****************************************************************************/
+static int
+load_process_peer(struct load_peer* peer, struct load_settings* settings)
+{
+    struct bmd_client_event event;
+    int rv;
+
+    for (;;)
+    {
+        rv = bmd_client_check(peer->client, &event);
+        if (rv != BMD_ERROR_NONE)
+        {
+            return rv;
+        }
+        switch (event.type)
+        {
+            case BMD_CLIENT_EVENT_NONE:
+                return BMD_ERROR_NONE;
+            case BMD_CLIENT_EVENT_VERSION:
+                if ((event.major != BMD_VERSION_MAJOR) ||
+                    (event.minor < BMD_VERSION_MINOR))
+                {
+                    printf("daemon version %d.%d, this tool %d.%d\n",
+                           event.major, event.minor,
+                           BMD_VERSION_MAJOR, BMD_VERSION_MINOR);
+                }
+                break;
+            case BMD_CLIENT_EVENT_VIDEO:
+                rv = load_process_video(peer, settings, &event);
+                break;
+            case BMD_CLIENT_EVENT_AUDIO:
+                rv = load_process_audio(peer, &event);
+                break;
+            case BMD_CLIENT_EVENT_AUDIO_SHM:
+                peer->audio_shm_count++;
+                close(event.fd);
+                break;
+            case BMD_CLIENT_EVENT_TRACE:
+                rv = load_process_trace(peer, &event);
+                break;
+        }
+        if (rv != BMD_ERROR_NONE)
+        {
+            return rv;
+        }
+    }
+}
+
+/*****************************************************************************/
+/* entry index of the comma separated audio format list, the list wraps,
+   s16, s32 or f32 then p for planar, m for a mono downmix, @ with a
+   sample rate and / with a packet period in ms */
+static int
+load_audio_format(struct load_peer* peer, struct load_settings* settings,
+                  int index)
+{
+    static const short mono[2] =
+    {
+        BMD_AUDIO_MIX_UNITY / 2, BMD_AUDIO_MIX_UNITY / 2
+    };
+    const char* text;
+    char* end;
+    int count;
+    int sample_type;
+    int layout;
+    int rate;
+    int period_us;
+    int mix;
+
+    count = 1;
+    for (text = settings->audio_formats; *text != 0; text++)
+    {
+        count += *text == ',';
+    }
+    text = settings->audio_formats;
+    for (index %= count; index > 0; index--)
+    {
+        text = strchr(text, ',') + 1;
+    }
+    if (strncmp(text, "s32", 3) == 0)
+    {
+        sample_type = BMD_AUDIO_SAMPLE_S32;
+    }
+    else if (strncmp(text, "f32", 3) == 0)
+    {
+        sample_type = BMD_AUDIO_SAMPLE_F32;
+    }
+    else if (strncmp(text, "s16", 3) == 0)
+    {
+        sample_type = BMD_AUDIO_SAMPLE_S16;
+    }
+    else
+    {
+        return BMD_ERROR_PARAM;
+    }
+    text += 3;
+    layout = BMD_AUDIO_LAYOUT_INTERLEAVED;
+    if (*text == 'p')
+    {
+        layout = BMD_AUDIO_LAYOUT_PLANAR;
+        text++;
+    }
+    mix = 0;
+    if (*text == 'm')
+    {
+        mix = 1;
+        text++;
+    }
+    rate = 0;
+    if (*text == '@')
+    {
+        rate = (int)strtol(text + 1, &end, 10);
+        text = end;
+    }
+    period_us = *text == '/' ? atoi(text + 1) * 1000 : 0;
+    if (mix)
+    {
+        return bmd_client_subscribe_audio_format(peer->client, sample_type,
+                                                 layout, 1, 2, mono, rate,
+                                                 period_us);
+    }
+    return bmd_client_subscribe_audio_format(peer->client, sample_type,
+                                             layout, 0, 0, NULL, rate,
+                                             period_us);
+}
+
+/*****************************************************************************/
+static int
+load_start_peer(struct load_peer* peer, int index,
+                struct load_settings* settings)
+{
+    int rv;
+
+    rv = bmd_client_create(settings->uds, &(peer->client));
+    if (rv != BMD_ERROR_NONE)
+    {
+        return rv;
+    }
+    rv = bmd_client_subscribe_trace(peer->client, 1);
+    if ((rv == BMD_ERROR_NONE) && ((settings->every > 0) ||
+                                   (settings->fps > 0)))
+    {
+        rv = bmd_client_subscribe_video(peer->client, settings->every,
+                                        settings->fps, settings->credits,
+                                        1);
+    }
+    if ((rv == BMD_ERROR_NONE) && settings->request)
+    {
+        rv = bmd_client_request_video_frame(peer->client);
+    }
+    if ((rv == BMD_ERROR_NONE) && settings->audio &&
+        (settings->audio_formats[0] != 0))
+    {
+        rv = load_audio_format(peer, settings, index);
+    }
+    if ((rv == BMD_ERROR_NONE) && settings->audio)
+    {
+        rv = bmd_client_subscribe_audio(peer->client, 1);
+    }
+    if ((rv == BMD_ERROR_NONE) && settings->audio_shm)
+    {
+        rv = bmd_client_subscribe_audio_shm(peer->client, 1);
+    }
+    return rv;
+}
+
+/*****************************************************************************/
+/* counters start over when the warmup is done, sequence state stays */
+static int
+load_reset_peer(struct load_peer* peer)
+{
+    peer->video_count = 0;
+    peer->audio_count = 0;
+    peer->audio_shm_count = 0;
+    peer->missed = 0;
+    peer->audio_gaps = 0;
+    peer->audio_gap_ms = 0;
+    peer->video_latency.count = 0;
+    peer->audio_latency.count = 0;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+load_print_report(struct load_peer* peers, struct load_settings* settings,
+                  struct load_daemon* start, struct load_daemon* end,
+                  int elapsed_ms)
+{
+    struct load_peer* peer;
+    int index;
+    int video;
+    int audio;
+    int audio_shm;
+    int missed;
+    int min_video;
+    int gaps;
+    int gap_ms;
+    int failed;
+
+    video = 0;
+    audio = 0;
+    audio_shm = 0;
+    missed = 0;
+    gaps = 0;
+    gap_ms = 0;
+    failed = 0;
+    min_video = -1;
+    for (index = 0; index < settings->num_peers; index++)
+    {
+        peer = peers + index;
+        video += peer->video_count;
+        audio += peer->audio_count;
+        audio_shm += peer->audio_shm_count;
+        missed += peer->missed;
+        gaps += peer->audio_gaps;
+        gap_ms += peer->audio_gap_ms;
+        failed += peer->failed;
+        if ((min_video == -1) || (peer->video_count < min_video))
+        {
+            min_video = peer->video_count;
+        }
+        if ((settings->fps > 0) && (settings->every < 1))
+        {
+            /* no sequence to check against, count the shortfall */
+            if (settings->fps * elapsed_ms / 1000 > peer->video_count)
+            {
+                missed += settings->fps * elapsed_ms / 1000 -
+                          peer->video_count;
+            }
+        }
+    }
+    if (elapsed_ms < 1)
+    {
+        elapsed_ms = 1;
+    }
+    printf("peers %d failed %d over %d ms\n", settings->num_peers, failed,
+           elapsed_ms);
+    printf("video frames %d (%d/s total, slowest peer %d) missed %d\n",
+           video, video * 1000 / elapsed_ms, min_video, missed);
+    printf("audio packets %d (%d/s total) gaps %d gap ms %d, "
+           "audio shm fds %d\n", audio, audio * 1000 / elapsed_ms, gaps,
+           gap_ms, audio_shm);
+    load_print_latency(peers, settings->num_peers, 1, "video");
+    load_print_latency(peers, settings->num_peers, 0, "audio");
+    if (settings->pid > 0)
+    {
+        printf("daemon pid %d cpu %d%% rss %d kB max rss %d kB\n",
+               settings->pid, (int)((end->ticks - start->ticks) * 100000 /
+               sysconf(_SC_CLK_TCK) / elapsed_ms), end->rss_kb,
+               end->max_rss_kb);
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+load_run(struct load_peer* peers, struct load_settings* settings)
+{
+    struct pollfd* pfds;
+    struct load_daemon daemon;
+    struct load_daemon start_daemon;
+    struct load_daemon last_daemon;
+    int index;
+    int fd;
+    int want_write;
+    int now;
+    int stats_ms;
+    int end_ms;
+    int next_ms;
+    int last_video;
+    int video;
+    int recording;
+    int rv;
+
+    pfds = xnew0(struct pollfd, settings->num_peers);
+    if (pfds == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    memset(&daemon, 0, sizeof(daemon));
+    load_sample_daemon(settings->pid, &daemon);
+    start_daemon = daemon;
+    last_daemon = daemon;
+    get_mstime(&now);
+    stats_ms = now + settings->warmup_seconds * 1000;
+    end_ms = stats_ms + settings->seconds * 1000;
+    next_ms = now + 1000;
+    recording = settings->warmup_seconds < 1;
+    last_video = 0;
+    while (now - end_ms < 0)
+    {
+        for (index = 0; index < settings->num_peers; index++)
+        {
+            pfds[index].fd = -1;
+            pfds[index].events = 0;
+            if (!(peers[index].failed))
+            {
+                bmd_client_get_fd(peers[index].client, &fd, &want_write);
+                pfds[index].fd = fd;
+                pfds[index].events = POLLIN | (want_write ? POLLOUT : 0);
+            }
+        }
+        poll(pfds, settings->num_peers, 100);
+        for (index = 0; index < settings->num_peers; index++)
+        {
+            if ((pfds[index].fd == -1) || (pfds[index].revents == 0))
+            {
+                continue;
+            }
+            rv = load_process_peer(peers + index, settings);
+            if (rv != BMD_ERROR_NONE)
+            {
+                printf("peer %d failed error %d\n", index, rv);
+                peers[index].failed = 1;
+            }
+        }
+        get_mstime(&now);
+        if (now - next_ms >= 0)
+        {
+            /* once a second, what a scaling run wants to watch */
+            next_ms += 1000;
+            video = 0;
+            for (index = 0; index < settings->num_peers; index++)
+            {
+                video += peers[index].video_count;
+            }
+            if (load_sample_daemon(settings->pid, &daemon) ==
+                BMD_ERROR_NONE)
+            {
+                printf("%s video %d/s daemon cpu %d%% rss %d kB\n",
+                       recording ? "run" : "warmup", video - last_video,
+                       (int)((daemon.ticks - last_daemon.ticks) * 100 /
+                       sysconf(_SC_CLK_TCK)), daemon.rss_kb);
+            }
+            else
+            {
+                printf("%s video %d/s\n", recording ? "run" : "warmup",
+                       video - last_video);
+            }
+            last_daemon = daemon;
+            last_video = video;
+        }
+        if (!recording && (now - stats_ms >= 0))
+        {
+            for (index = 0; index < settings->num_peers; index++)
+            {
+                load_reset_peer(peers + index);
+            }
+            load_sample_daemon(settings->pid, &daemon);
+            daemon.max_rss_kb = daemon.rss_kb;
+            start_daemon = daemon;
+            recording = 1;
+            last_video = 0;
+        }
+    }
+    free(pfds);
+    load_sample_daemon(settings->pid, &daemon);
+    return load_print_report(peers, settings, &start_daemon, &daemon,
+                             settings->seconds * 1000);
+}
+
+/*****************************************************************************/
+static int
+process_args(int argc, char** argv, struct load_settings* settings)
+{
+    int index;
+
+    for (index = 1; index < argc; index++)
+    {
+        if ((index + 1 < argc) && (argv[index][0] == '-') &&
+            (strchr("cpntwvfkm", argv[index][1]) != NULL) &&
+            (argv[index][2] == 0))
+        {
+            switch (argv[index][1])
+            {
+                case 'c':
+                    strncpy(settings->uds, argv[index + 1], 255);
+                    break;
+                case 'p':
+                    settings->pid = atoi(argv[index + 1]);
+                    break;
+                case 'n':
+                    settings->num_peers = atoi(argv[index + 1]);
+                    break;
+                case 't':
+                    settings->seconds = atoi(argv[index + 1]);
+                    break;
+                case 'w':
+                    settings->warmup_seconds = atoi(argv[index + 1]);
+                    break;
+                case 'v':
+                    settings->every = atoi(argv[index + 1]);
+                    break;
+                case 'f':
+                    settings->fps = atoi(argv[index + 1]);
+                    break;
+                case 'k':
+                    settings->credits = atoi(argv[index + 1]);
+                    break;
+                case 'm':
+                    strncpy(settings->audio_formats, argv[index + 1], 63);
+                    break;
+            }
+            index++;
+        }
+        else if (strcmp("-q", argv[index]) == 0)
+        {
+            settings->request = 1;
+        }
+        else if (strcmp("-a", argv[index]) == 0)
+        {
+            settings->audio = 1;
+        }
+        else if (strcmp("-s", argv[index]) == 0)
+        {
+            settings->audio_shm = 1;
+        }
+        else if (strcmp("-r", argv[index]) == 0)
+        {
+            settings->read_frames = 1;
+        }
+        else
+        {
+            return BMD_ERROR_PARAM;
+        }
+    }
+    if (settings->uds[0] == 0)
+    {
+        if (settings->pid < 1)
+        {
+            return BMD_ERROR_PARAM;
+        }
+        snprintf(settings->uds, 255, BMD_UDS, settings->pid);
+    }
+    else if (settings->pid < 1)
+    {
+        /* default daemon name has the pid in it */
+        if (sscanf(settings->uds, BMD_UDS, &(settings->pid)) != 1)
+        {
+            settings->pid = 0;
+        }
+    }
+    if ((settings->num_peers < 1) || (settings->seconds < 1))
+    {
+        return BMD_ERROR_PARAM;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+printf_help(int argc, char** argv)
+{
+    if (argc < 1)
+    {
+        return BMD_ERROR_NONE;
+    }
+    printf("%s: command line options\n", argv[0]);
+    printf("    -p      daemon pid, connects to %s and samples its cpu and "
+           "rss, example -p 1234\n", BMD_UDS);
+    printf("    -c      uds or tcp:host:port to connect to instead, "
+           "example -c /tmp/wtv_bmd_1234 or -c tcp:10.0.0.5:5000\n");
+    printf("    -n      number of peers, default 1, example -n 16\n");
+    printf("    -t      seconds to measure, default 10, example -t 60\n");
+    printf("    -w      warmup seconds not measured, default 1, "
+           "example -w 2\n");
+    printf("    -v      push video, every Nth capture frame, example -v 1\n");
+    printf("    -f      push video, frames a second, example -f 15\n");
+    printf("    -k      push video credits, 0 for none, example -k 2\n");
+    printf("    -q      request mode video, a new request after each "
+           "frame, example -q\n");
+    printf("    -a      subscribe to socket audio, example -a\n");
+    printf("    -m      socket audio formats spread over the peers, s16, "
+           "s32 or f32, p for planar, m for a mono downmix, @ a sample "
+           "rate, / a packet period in ms, example -m f32m@16000/20,s16p\n");
+    printf("    -s      subscribe to shared memory audio, example -s\n");
+    printf("    -r      read every byte of each video frame, example -r\n");
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+main(int argc, char** argv)
+{
+    struct load_settings settings;
+    struct load_peer* peers;
+    int index;
+    int rv;
+
+    memset(&settings, 0, sizeof(settings));
+    settings.num_peers = 1;
+    settings.seconds = 10;
+    settings.warmup_seconds = 1;
+    if (process_args(argc, argv, &settings) != BMD_ERROR_NONE)
+    {
+        printf_help(argc, argv);
+        return 0;
+    }
+    peers = xnew0(struct load_peer, settings.num_peers);
+    if (peers == NULL)
+    {
+        printf("xnew0 failed\n");
+        return 1;
+    }
+    rv = BMD_ERROR_NONE;
+    for (index = 0; index < settings.num_peers; index++)
+    {
+        rv = load_start_peer(peers + index, index, &settings);
+        if (rv != BMD_ERROR_NONE)
+        {
+            printf("peer %d could not connect to %s error %d\n", index,
+                   settings.uds, rv);
+            break;
+        }
+    }
+    if (rv == BMD_ERROR_NONE)
+    {
+        printf("%d peers connected to %s\n", settings.num_peers,
+               settings.uds);
+        rv = load_run(peers, &settings);
+    }
+    for (index = 0; index < settings.num_peers; index++)
+    {
+        bmd_client_delete(peers[index].client);
+        free(peers[index].video_latency.data);
+        free(peers[index].audio_latency.data);
+    }
+    free(peers);
+    return rv == BMD_ERROR_NONE ? 0 : 1;
+}
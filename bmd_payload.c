@@ -0,0 +1,102 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arch.h"
+#include "parse.h"
+#include "bmd_payload.h"
+#include "bmd_pool.h"
+#include "bmd_error.h"
+#include "bmd_utils.h"
+
+/*****************************************************************************/
+/* returns with one reference held by the caller */
+int
+bmd_payload_create(int size, struct bmd_payload** payload)
+{
+    struct bmd_payload* self;
+    int alloc_size;
+
+    if ((size < 0) ||
+        (size > BMD_POOL_MAX_BYTES - (int)sizeof(struct bmd_payload)))
+    {
+        return BMD_ERROR_PARAM;
+    }
+    self = (struct bmd_payload*)
+           bmd_pool_alloc(sizeof(struct bmd_payload) + size, &alloc_size);
+    if (self == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    memset(self, 0, sizeof(struct bmd_payload));
+    self->data = (char*)(self + 1);
+    self->size = size;
+    self->alloc_size = alloc_size;
+    self->fd = -1;
+    self->ref_count = 1;
+    *payload = self;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_payload_addref(struct bmd_payload* payload)
+{
+    /* shard threads hold references too */
+    __atomic_add_fetch(&(payload->ref_count), 1, __ATOMIC_RELAXED);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_payload_release(struct bmd_payload* payload)
+{
+    if (payload == NULL)
+    {
+        return BMD_ERROR_NONE;
+    }
+    if (__atomic_sub_fetch(&(payload->ref_count), 1, __ATOMIC_ACQ_REL) > 0)
+    {
+        return BMD_ERROR_NONE;
+    }
+    if (payload->fd != -1)
+    {
+        close(payload->fd);
+    }
+    bmd_payload_release(payload->hold);
+    bmd_pool_free(payload, payload->alloc_size);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* point a stream at the payload data for building with out_uint32_le etc
+   set payload->bytes from s->p when done */
+int
+bmd_payload_set_stream(struct bmd_payload* payload, struct stream* s)
+{
+    memset(s, 0, sizeof(struct stream));
+    s->data = payload->data;
+    s->p = s->data;
+    s->size = payload->size;
+    s->end = s->data + s->size;
+    return BMD_ERROR_NONE;
+}
@@ -0,0 +1,46 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BMD_PAYLOAD_H_
+#define _BMD_PAYLOAD_H_
+
+/* an outgoing pdu, built once and shared by every peer queue that
+   holds a reference, do not change it after it is queued
+   the struct and data are one bmd_pool buffer */
+struct bmd_payload
+{
+    int ref_count;
+    int fd; /* -1 or owned fd that goes with the pdu */
+    int bytes;
+    int size;
+    int alloc_size; /* of the pool buffer */
+    int pad0;
+    char* data;
+    struct bmd_payload* hold; /* NULL or referenced until this one goes */
+};
+
+int
+bmd_payload_create(int size, struct bmd_payload** payload);
+int
+bmd_payload_addref(struct bmd_payload* payload);
+int
+bmd_payload_release(struct bmd_payload* payload);
+int
+bmd_payload_set_stream(struct bmd_payload* payload, struct stream* s);
+
+#endif
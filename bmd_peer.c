@@ -16,68 +16,407 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE /* sendmmsg, SOL_IP */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <time.h>
+#include <pthread.h>
 #include <sys/un.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
 
 #include "arch.h"
 #include "parse.h"
 #include "bmd.h"
+#include "bmd_declink.h"
+#include "bmd_audio_ring.h"
+#include "bmd_audio_format.h"
+#include "bmd_resample.h"
+#include "bmd_codec.h"
+#include "bmd_payload.h"
+#include "bmd_pool.h"
+#include "bmd_encoder.h"
+#include "bmd_history.h"
 #include "bmd_peer.h"
+#include "bmd_record.h"
+#include "bmd_shard.h"
+#include "bmd_timeshift.h"
+#include "bmd_uring.h"
 #include "bmd_log.h"
 #include "bmd_utils.h"
 #include "bmd_error.h"
 
+/* TRACE pdu bytes and where its send stamp goes */
+#define BMD_TRACE_PDU_BYTES 64
+#define BMD_TRACE_SEND_OFFSET 56
+/* TRACE_ECHO is the TRACE body and two more stamps */
+#define BMD_TRACE_ECHO_PDU_BYTES 80
+#define BMD_TRACE_REPORT_MS 5000
+
+/* latency stages, from the trace stamps */
+#define BMD_TRACE_STAGE_CAPTURE     0 /* callback to main thread */
+#define BMD_TRACE_STAGE_CONVERT     1 /* to conversion done */
+#define BMD_TRACE_STAGE_EXPORT      2 /* to surface exported */
+#define BMD_TRACE_STAGE_DISPATCH    3 /* to queued for the peer */
+#define BMD_TRACE_STAGE_QUEUE       4 /* to sendmsg */
+#define BMD_TRACE_STAGE_DELIVER     5 /* to received by the peer */
+#define BMD_TRACE_STAGE_PRESENT     6 /* to displayed by the peer */
+#define BMD_TRACE_NUM_STAGES        7
+
+/* the last peer_info id, any thread adds peers */
+static int g_peer_id = 0;
+
+static const char g_stage_names[BMD_TRACE_NUM_STAGES][10] =
+{
+    "capture", "convert", "export", "dispatch", "queue", "deliver", "present"
+};
+
+struct peer_latency
+{
+    long long sum_us[BMD_TRACE_NUM_STAGES];
+    long long max_us[BMD_TRACE_NUM_STAGES];
+    int count[BMD_TRACE_NUM_STAGES];
+};
+
+/* most pdus gathered into one sendmsg */
+#define BMD_PEER_MAX_IOV 64
+/* input buffer holds a burst of pipelined pdus and grows for a bigger
+   pdu up to the max */
+#define BMD_PEER_IN_BYTES 4096
+#define BMD_PEER_MAX_IN_BYTES (1024 * 1024)
+/* a SOCK_SEQPACKET message can not be read in parts so the buffer has
+   to hold the biggest pdu a client sends */
+#define BMD_PEER_SEQPACKET_IN_BYTES 4096
+/* remote peers get raw frames, give the socket room for a few */
+#define BMD_PEER_TCP_SNDBUF (8 * 1024 * 1024)
+/* smaller sends are cheaper to copy than to pin and complete */
+#define BMD_PEER_ZEROCOPY_BYTES (64 * 1024)
+
+/* io_uring user_data, a peer pointer with the request in the low bits,
+   or a listener fd above them for accept */
+#define BMD_PEER_OP_RECV    1
+#define BMD_PEER_OP_SEND    2
+#define BMD_PEER_OP_CANCEL  3
+#define BMD_PEER_OP_ACCEPT  4
+#define BMD_PEER_OP_MASK    7
+#define BMD_PEER_OP_REMOTE  8
+
+/* capture audio further from where the pending samples say it should be
+   than this starts the period over */
+#define BMD_PEER_AUDIO_RESYNC_MS 100
+
+/* peers that asked for the same audio format share one conversion per
+   packet and one resampler, which keeps its stream state for as long as
+   the group has peers
+   with a period, capture samples wait in pending until there is a whole
+   period and go out as one pdu each, so a packet can make none or
+   several */
+struct peer_audio_group
+{
+    struct bmd_audio_format format;
+    void* resample; /* bmd_resample, NULL at the capture rate */
+    int resample_channels; /* resample was made for */
+    int delay_us; /* of resample */
+    int peers; /* referencing it */
+    int wanted; /* boolean, a subscribed peer for this packet */
+    short* pending; /* capture samples, interleaved */
+    int pending_alloc; /* samples */
+    int pending_samples;
+    int pending_channels;
+    int pending_offset; /* samples sent since the base, under a second */
+    int pending_atime; /* base, atime of the first sample after a start */
+    int pad0;
+    long long pending_capture_us; /* base, when that sample was captured */
+    struct bmd_payload** payloads; /* this packet converted */
+    int num_payloads;
+    int payloads_alloc;
+    struct peer_audio_group* next;
+};
+
+/* a capture AUDIO pdu */
+struct peer_audio_in
+{
+    int atime;
+    int channels;
+    int samples;
+    int pad0;
+    long long capture_us; /* first sample, from the callback stamp */
+    const short* data;
+};
+
+/* a payload the kernel may still read after a MSG_ZEROCOPY send, held
+   until the completion for that send comes on the error queue */
+struct peer_zc
+{
+    struct bmd_payload* payload;
+    unsigned int id;
+    int pad0;
+    struct peer_zc* next;
+};
+
+struct peer_out
+{
+    struct bmd_payload* payload;
+    int offset; /* payload bytes already sent */
+    int fd_sent; /* boolean */
+    int pdu_code;
+    int rendition; /* encoded only */
+    int flags; /* encoded only */
+    int mstime; /* when queued */
+    int inflight; /* boolean, an io_uring send is reading it */
+    int pad0;
+    struct peer_out* next;
+};
+
+/* what an io_uring send reads until it completes, one gathered message
+   or for SOCK_SEQPACKET one message per pdu */
+struct peer_ring
+{
+    struct msghdr msgs[BMD_PEER_MAX_IOV];
+    struct iovec iov[BMD_PEER_MAX_IOV];
+    char control[BMD_PEER_MAX_IOV][CMSG_SPACE(sizeof(int))];
+    int bytes; /* stream, bytes in the message */
+    int zerocopy; /* boolean, stream, SENDMSG_ZC */
+};
+
 struct peer_info
 {
     int sck;
+    int id; /* unique, timeshift answers find their peer by it */
     int got_subscribe_audio; /* boolean */
     int got_request_video; /* boolean */
+    /* SUBSCRIBE_AUDIO_FORMAT, NULL for capture audio as it is */
+    struct peer_audio_group* audio_group;
     int video_frame_count;
-    struct stream* out_s_head;
-    struct stream* out_s_tail;
+    int subscribe_encoded; /* bit mask of renditions */
+    int got_subscribe_audio_shm; /* boolean */
+    int video_subscribed; /* boolean, push mode */
+    int video_every; /* every Nth capture frame */
+    int video_fps; /* or this rate when not zero */
+    int video_credits; /* -1 when not flow controlled */
+    int video_next_valid; /* boolean, when not the next frame is due */
+    int video_next_seq;
+    int video_next_mstime;
+    int video_next_rem;
+    int encoded_wait_key; /* bit mask of renditions that lost a frame */
+    int out_bytes;
+    int out_fds;
+    int progress_mstime; /* last send progress or empty queue */
+    int video_drops;
+    int audio_drops;
+    int encoded_drops;
+    int got_subscribe_trace; /* boolean */
+    int trace_report_mstime;
+    int seqpacket; /* boolean, one message per pdu */
+    int remote; /* boolean, tcp, no fds, video as pixels */
+    int zerocopy; /* boolean, SO_ZEROCOPY is on */
+    unsigned int zc_next_id; /* of the next MSG_ZEROCOPY send */
+    struct peer_zc* zc_head;
+    struct peer_zc* zc_tail;
+    int tiles; /* boolean, remote peer decodes VIDEO_TILES */
+    int tiles_have_base; /* boolean */
+    int tiles_base_seq; /* seq of the last VIDEO_TILES sent in full */
+    int ring_slot; /* io_uring registered file */
+    int ring_ops; /* io_uring requests that will still complete */
+    int ring_recv; /* boolean, multishot recv is armed */
+    int ring_sends; /* sendmsg requests in flight */
+    int ring_error; /* boolean, remove at the next check */
+    int ring_retired; /* boolean, removed, waiting for ring_ops */
+    struct peer_ring* ring;
+    struct peer_latency video_latency;
+    struct peer_latency audio_latency;
+    struct peer_out* out_head;
+    struct peer_out* out_tail;
     struct stream* in_s;
     struct peer_info* next;
 };
 
+/*****************************************************************************/
+static int
+bmd_peer_trace_report_one(struct peer_info* peer, const char* name,
+                          struct peer_latency* lat)
+{
+    char text[512];
+    int index;
+    int len;
+
+    len = 0;
+    text[0] = 0;
+    for (index = 0; index < BMD_TRACE_NUM_STAGES; index++)
+    {
+        if ((lat->count[index] > 0) && (len < (int)sizeof(text)))
+        {
+            len += snprintf(text + len, sizeof(text) - len, " %s %d/%d",
+                            g_stage_names[index],
+                            (int)(lat->sum_us[index] / lat->count[index]),
+                            (int)(lat->max_us[index]));
+        }
+    }
+    if (len > 0)
+    {
+        LOGLN0((LOG_INFO, LOGS "sck %d %s latency us avg/max%s", LOGP,
+                peer->sck, name, text));
+    }
+    memset(lat, 0, sizeof(struct peer_latency));
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_peer_trace_report(struct peer_info* peer)
+{
+    bmd_peer_trace_report_one(peer, "video", &(peer->video_latency));
+    bmd_peer_trace_report_one(peer, "audio", &(peer->audio_latency));
+    return BMD_ERROR_NONE;
+}
+
 /*****************************************************************************/
 static int
 bmd_peer_delete_one(struct peer_info* peer)
 {
-    struct stream* out_s;
-    struct stream* lout_s;
+    struct peer_out* out;
+    struct peer_out* lout;
+    struct peer_zc* zc;
 
+    LOGLN0((LOG_INFO, LOGS "sck %d drops video %d audio %d encoded %d",
+            LOGP, peer->sck, peer->video_drops, peer->audio_drops,
+            peer->encoded_drops));
+    bmd_peer_trace_report(peer);
     close(peer->sck);
-    out_s = peer->out_s_head;
-    while (out_s != NULL)
+    out = peer->out_head;
+    while (out != NULL)
+    {
+        lout = out;
+        out = out->next;
+        bmd_payload_release(lout->payload);
+        bmd_pool_free(lout, sizeof(struct peer_out));
+    }
+    while (peer->zc_head != NULL)
+    {
+        /* socket is closed, nothing more will be read from these */
+        zc = peer->zc_head;
+        peer->zc_head = zc->next;
+        bmd_payload_release(zc->payload);
+        bmd_pool_free(zc, sizeof(struct peer_zc));
+    }
+    if (peer->in_s != NULL)
+    {
+        bmd_pool_free(peer->in_s->data, peer->in_s->size);
+        free(peer->in_s);
+    }
+    free(peer->ring);
+    free(peer);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* the group for format, made when no peer has it yet */
+static int
+bmd_peer_audio_group_get(struct bmd_info* bmd,
+                         const struct bmd_audio_format* format,
+                         struct peer_audio_group** agroup)
+{
+    struct peer_audio_group* group;
+
+    for (group = bmd->audio_groups; group != NULL; group = group->next)
     {
-        lout_s = out_s;
-        out_s = out_s->next;
-        if (lout_s->data == NULL)
+        if (bmd_audio_format_equal(&(group->format), format))
         {
-            if (lout_s->fd > 0)
-            {
-                close(lout_s->fd);
-            }
+            break;
         }
-        else
+    }
+    if (group == NULL)
+    {
+        group = xnew0(struct peer_audio_group, 1);
+        if (group == NULL)
         {
-            free(lout_s->data);
+            return BMD_ERROR_MEMORY;
         }
-        free(lout_s);
+        group->format = *format;
+        group->next = bmd->audio_groups;
+        bmd->audio_groups = group;
     }
-    if (peer->in_s != NULL)
+    group->peers++;
+    *agroup = group;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_peer_audio_group_delete(struct peer_audio_group* group)
+{
+    bmd_resample_delete(group->resample);
+    free(group->pending);
+    free(group->payloads);
+    free(group);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_peer_audio_group_put(struct bmd_info* bmd,
+                         struct peer_audio_group* group)
+{
+    struct peer_audio_group** agroup;
+
+    if (group == NULL)
     {
-        free(peer->in_s->data);
-        free(peer->in_s);
+        return BMD_ERROR_NONE;
     }
-    free(peer);
+    group->peers--;
+    if (group->peers > 0)
+    {
+        return BMD_ERROR_NONE;
+    }
+    for (agroup = &(bmd->audio_groups); *agroup != NULL;
+         agroup = &((*agroup)->next))
+    {
+        if (*agroup == group)
+        {
+            *agroup = group->next;
+            break;
+        }
+    }
+    return bmd_peer_audio_group_delete(group);
+}
+
+/*****************************************************************************/
+/* the kernel may still read payloads and the peer through user_data
+   while io_uring requests are in flight, shutdown ends them and the peer
+   waits on peer_zombies for the last completion */
+static int
+bmd_peer_retire(struct bmd_info* bmd, struct peer_info* peer)
+{
+    bmd_peer_audio_group_put(bmd, peer->audio_group);
+    peer->audio_group = NULL;
+    if (bmd->io_uring == NULL)
+    {
+        return bmd_peer_delete_one(peer);
+    }
+    bmd_uring_remove_file(bmd->io_uring, peer->ring_slot);
+    if (peer->ring_ops == 0)
+    {
+        return bmd_peer_delete_one(peer);
+    }
+    shutdown(peer->sck, SHUT_RDWR);
+    if (bmd_uring_cancel_fd(bmd->io_uring, peer->sck,
+                            (size_t)peer | BMD_PEER_OP_CANCEL) ==
+        BMD_ERROR_NONE)
+    {
+        peer->ring_ops++;
+    }
+    peer->ring_retired = 1;
+    peer->next = bmd->peer_zombies;
+    bmd->peer_zombies = peer;
     return BMD_ERROR_NONE;
 }
 
@@ -96,7 +435,7 @@ bmd_peer_remove_one(struct bmd_info* bmd, struct peer_info** apeer,
         LOGLN10((LOG_INFO, LOGS "remove only item", LOGP));
         bmd->peer_head = NULL;
         bmd->peer_tail = NULL;
-        bmd_peer_delete_one(peer);
+        bmd_peer_retire(bmd, peer);
         peer = NULL;
     }
     else if (bmd->peer_head == peer)
@@ -105,7 +444,7 @@ bmd_peer_remove_one(struct bmd_info* bmd, struct peer_info** apeer,
         LOGLN10((LOG_INFO, LOGS "remove first item", LOGP));
         bmd->peer_head = peer->next;
         next_peer = peer->next;
-        bmd_peer_delete_one(peer);
+        bmd_peer_retire(bmd, peer);
         peer = next_peer;
     }
     else if (bmd->peer_tail == peer)
@@ -114,7 +453,7 @@ bmd_peer_remove_one(struct bmd_info* bmd, struct peer_info** apeer,
         LOGLN10((LOG_INFO, LOGS "remove last item", LOGP));
         bmd->peer_tail = last_peer;
         last_peer->next = NULL;
-        bmd_peer_delete_one(peer);
+        bmd_peer_retire(bmd, peer);
         peer = NULL;
     }
     else
@@ -123,7 +462,7 @@ bmd_peer_remove_one(struct bmd_info* bmd, struct peer_info** apeer,
         LOGLN10((LOG_INFO, LOGS "remove middle item", LOGP));
         last_peer->next = peer->next;
         next_peer = peer->next;
-        bmd_peer_delete_one(peer);
+        bmd_peer_retire(bmd, peer);
         peer = next_peer;
     }
     *apeer = peer;
@@ -132,26 +471,300 @@ bmd_peer_remove_one(struct bmd_info* bmd, struct peer_info** apeer,
 
 /*****************************************************************************/
 static int
-bmd_peer_queue_frame(struct bmd_info* bmd, struct peer_info* peer)
+bmd_peer_stamp_send(struct bmd_payload* payload)
+{
+    struct stream out_s;
+    long long now_us;
+
+    get_ustime(&now_us);
+    bmd_payload_set_stream(payload, &out_s);
+    out_s.p += BMD_TRACE_SEND_OFFSET;
+    out_uint64_le(&out_s, now_us);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* a TRACE pdu goes right after the media pdu it is for, if the media pdu
+   was dropped there is nothing to trace, if it was conflated into an
+   earlier queued one that one's trace is rewritten */
+static int
+bmd_peer_queue_trace(struct bmd_info* bmd, struct peer_info* peer,
+                     struct bmd_payload* media, int pdu_code,
+                     struct bmd_trace* trace)
 {
-    struct stream* out_s;
+    struct peer_out* out;
+    struct peer_out* tout;
+    struct bmd_payload* payload;
+    struct stream out_s;
+    long long now_us;
+    int size;
     int rv;
 
-    if (bmd->fd < 1)
+    (void)bmd;
+
+    for (out = peer->out_head; out != NULL; out = out->next)
     {
-        return BMD_ERROR_FD;
+        if ((out->payload == media) && (out->offset == 0) &&
+            !(out->fd_sent))
+        {
+            break;
+        }
     }
-    out_s = xnew0(struct stream, 1);
-    if (out_s == NULL)
+    if (out == NULL)
     {
-        return BMD_ERROR_MEMORY;
+        return BMD_ERROR_NONE;
     }
-    out_s->size = 1024 * 1024;
-    out_s->data = xnew(char, out_s->size);
-    if (out_s->data == NULL)
+    tout = out->next;
+    if ((tout != NULL) && (tout->pdu_code == BMD_PDU_CODE_TRACE) &&
+        (tout->offset == 0))
     {
-        free(out_s);
-        return BMD_ERROR_MEMORY;
+        payload = tout->payload;
+    }
+    else
+    {
+        rv = bmd_payload_create(BMD_TRACE_PDU_BYTES, &payload);
+        if (rv != BMD_ERROR_NONE)
+        {
+            return rv;
+        }
+        tout = (struct peer_out*)
+               bmd_pool_alloc(sizeof(struct peer_out), &size);
+        if (tout == NULL)
+        {
+            bmd_payload_release(payload);
+            return BMD_ERROR_MEMORY;
+        }
+        memset(tout, 0, sizeof(struct peer_out));
+        payload->bytes = BMD_TRACE_PDU_BYTES;
+        tout->payload = payload;
+        tout->pdu_code = BMD_PDU_CODE_TRACE;
+        tout->mstime = out->mstime;
+        tout->next = out->next;
+        out->next = tout;
+        if (peer->out_tail == out)
+        {
+            peer->out_tail = tout;
+        }
+        peer->out_bytes += payload->bytes;
+    }
+    get_ustime(&now_us);
+    bmd_payload_set_stream(payload, &out_s);
+    out_uint32_le(&out_s, BMD_PDU_CODE_TRACE);
+    out_uint32_le(&out_s, BMD_TRACE_PDU_BYTES);
+    out_uint32_le(&out_s, pdu_code);
+    out_uint32_le(&out_s, trace->seq);
+    out_uint64_le(&out_s, trace->callback_us);
+    out_uint64_le(&out_s, trace->dequeue_us);
+    out_uint64_le(&out_s, trace->convert_us);
+    out_uint64_le(&out_s, trace->export_us);
+    out_uint64_le(&out_s, now_us); /* enqueue */
+    out_uint64_le(&out_s, 0); /* send, set by bmd_peer_stamp_send */
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* a rate subscriber takes a frame a little early so capture jitter does
+   not push it to the frame after */
+static int
+bmd_peer_video_slack(struct peer_info* peer)
+{
+    return 1000 / (peer->video_fps * 8);
+}
+
+/*****************************************************************************/
+static int
+bmd_peer_video_due(struct peer_info* peer, int seq, int mstime)
+{
+    if (!(peer->video_subscribed) || (peer->video_credits == 0))
+    {
+        return 0;
+    }
+    if (!(peer->video_next_valid))
+    {
+        return 1;
+    }
+    if (peer->video_fps > 0)
+    {
+        return mstime - (peer->video_next_mstime -
+                         bmd_peer_video_slack(peer)) >= 0;
+    }
+    return seq - peer->video_next_seq >= 0;
+}
+
+/*****************************************************************************/
+static int
+bmd_peer_video_advance(struct peer_info* peer, int seq, int mstime)
+{
+    if (peer->video_credits > 0)
+    {
+        peer->video_credits--;
+    }
+    if (peer->video_fps > 0)
+    {
+        if (!(peer->video_next_valid) ||
+            (mstime - peer->video_next_mstime > 1000 / peer->video_fps))
+        {
+            /* first frame or fell behind, restart the schedule */
+            peer->video_next_mstime = mstime;
+            peer->video_next_rem = 0;
+        }
+        /* 1000 / fps in whole ms with the remainder carried */
+        peer->video_next_mstime += 1000 / peer->video_fps;
+        peer->video_next_rem += 1000 % peer->video_fps;
+        if (peer->video_next_rem >= peer->video_fps)
+        {
+            peer->video_next_rem -= peer->video_fps;
+            peer->video_next_mstime++;
+        }
+    }
+    else
+    {
+        peer->video_next_seq = seq + peer->video_every;
+    }
+    peer->video_next_valid = 1;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* the payload goes into bmd's cache for this frame */
+static struct bmd_payload*
+bmd_peer_build_tiles(struct bmd_info* bmd, void* codec, int key,
+                     int base_seq)
+{
+    struct bmd_payload* payload;
+    struct stream out_s;
+    int bytes;
+
+    if (bmd_codec_get_bytes(codec, key, base_seq, &bytes) != BMD_ERROR_NONE)
+    {
+        return NULL;
+    }
+    if (bmd_payload_create(40 + bytes, &payload) != BMD_ERROR_NONE)
+    {
+        return NULL;
+    }
+    bmd_payload_set_stream(payload, &out_s);
+    out_uint32_le(&out_s, BMD_PDU_CODE_VIDEO_TILES);
+    out_uint32_le(&out_s, 40 + bytes);
+    out_uint32_le(&out_s, bmd->fd_time);
+    out_uint32_le(&out_s, bmd->fd_seq);
+    out_uint32_le(&out_s, key ? BMD_VIDEO_TILES_FLAG_KEY : 0);
+    out_uint32_le(&out_s, base_seq);
+    out_uint32_le(&out_s, bmd->fd_width);
+    out_uint32_le(&out_s, bmd->fd_height);
+    out_uint32_le(&out_s, bytes);
+    out_uint32_le(&out_s, bmd->fd_bpp);
+    if (bmd_codec_write(codec, key, base_seq, out_s.p,
+                        bytes) != BMD_ERROR_NONE)
+    {
+        bmd_payload_release(payload);
+        return NULL;
+    }
+    payload->bytes = 40 + bytes;
+    if (key)
+    {
+        bmd->video_tiles_key = payload;
+    }
+    else
+    {
+        bmd->video_tiles[bmd->video_tiles_count] = payload;
+        bmd->video_tiles_base[bmd->video_tiles_count] = base_seq;
+        bmd->video_tiles_count++;
+    }
+    return payload;
+}
+
+/*****************************************************************************/
+/* VIDEO_TILES for the current frame, a delta from the last frame the peer
+   was sent in full shared with every peer that has the same base, or a
+   key when it has none the codec still knows
+   a frame queued after the base but not sent yet may be dropped, a delta
+   from the base still decodes on top of it when it is not */
+static struct bmd_payload*
+bmd_peer_tiles_payload(struct bmd_info* bmd, struct peer_info* peer)
+{
+    struct bmd_info* main_bmd;
+    struct bmd_payload* payload;
+    int key;
+    int base_seq;
+    int index;
+
+    base_seq = peer->tiles_base_seq;
+    key = !(peer->tiles_have_base);
+    if (!key)
+    {
+        for (index = 0; index < bmd->video_tiles_count; index++)
+        {
+            if (bmd->video_tiles_base[index] == base_seq)
+            {
+                return bmd->video_tiles[index];
+            }
+        }
+        key = bmd->video_tiles_count >= BMD_VIDEO_TILES_PAYLOADS;
+    }
+    if (key && (bmd->video_tiles_key != NULL))
+    {
+        return bmd->video_tiles_key;
+    }
+    /* a shard's view codes nothing, it reads the main thread's codec
+       while it still has the frame the view has */
+    main_bmd = (bmd->parent != NULL) ? bmd->parent : bmd;
+    bmd_shard_lock_codec(main_bmd->shards, 0);
+    payload = NULL;
+    if ((main_bmd->codec != NULL) &&
+        (main_bmd->video_tiles_frame_count == bmd->video_frame_count))
+    {
+        if (!key && (bmd_codec_check_base(main_bmd->codec,
+                                          base_seq) != BMD_ERROR_NONE))
+        {
+            /* codec started over since the peer's base */
+            key = 1;
+            payload = bmd->video_tiles_key;
+        }
+        if (payload == NULL)
+        {
+            payload = bmd_peer_build_tiles(bmd, main_bmd->codec, key,
+                                           key ? 0 : base_seq);
+        }
+    }
+    bmd_shard_unlock_codec(main_bmd->shards);
+    return payload;
+}
+
+/*****************************************************************************/
+/* the fd video payload for local peers, the pixels for remote ones, NULL
+   when the current frame has none for this peer */
+static struct bmd_payload*
+bmd_peer_frame_payload(struct bmd_info* bmd, struct peer_info* peer)
+{
+    if (!(peer->remote))
+    {
+        return bmd->video_payload;
+    }
+    if (peer->tiles)
+    {
+        return bmd_peer_tiles_payload(bmd, peer);
+    }
+    if (bmd->video_raw_frame_count != bmd->video_frame_count)
+    {
+        return NULL;
+    }
+    return bmd->video_raw_payload;
+}
+
+/*****************************************************************************/
+/* the video payload is built once per frame in bmd_process_av, every
+   peer just takes a reference */
+static int
+bmd_peer_queue_frame(struct bmd_info* bmd, struct peer_info* peer)
+{
+    struct bmd_payload* payload;
+    int rv;
+
+    payload = bmd_peer_frame_payload(bmd, peer);
+    if (payload == NULL)
+    {
+        return BMD_ERROR_FD;
     }
     if (peer->video_frame_count == bmd->video_frame_count)
     {
@@ -161,27 +774,12 @@ bmd_peer_queue_frame(struct bmd_info* bmd, struct peer_info* peer)
                 bmd->video_frame_count));
     }
     peer->video_frame_count = bmd->video_frame_count;
-    out_s->p = out_s->data;
-    out_uint32_le(out_s, BMD_PDU_CODE_VIDEO);
-    out_uint32_le(out_s, 40);
-    out_uint32_le(out_s, bmd->fd_time);
-    out_uint8s(out_s, 4);
-    out_uint32_le(out_s, bmd->fd);
-    out_uint32_le(out_s, bmd->fd_width);
-    out_uint32_le(out_s, bmd->fd_height);
-    out_uint32_le(out_s, bmd->fd_stride);
-    out_uint32_le(out_s, bmd->fd_size);
-    out_uint32_le(out_s, bmd->fd_bpp);
-    out_s->end = out_s->p;
-    rv = bmd_peer_queue(peer, out_s);
-    free(out_s->data);
-    if (rv == BMD_ERROR_NONE)
+    rv = bmd_peer_queue(bmd, peer, payload);
+    if ((rv == BMD_ERROR_NONE) && peer->got_subscribe_trace)
     {
-        memset(out_s, 0, sizeof(struct stream));
-        out_s->fd = bmd->fd;
-        rv = bmd_peer_queue(peer, out_s);
+        rv = bmd_peer_queue_trace(bmd, peer, payload,
+                                  BMD_PDU_CODE_VIDEO, &(bmd->video_trace));
     }
-    free(out_s);
     return rv;
 }
 
@@ -200,7 +798,7 @@ bmd_peer_process_msg_request_video_frame(struct bmd_info* bmd,
         LOGLN10((LOG_INFO, LOGS "already requested", LOGP));
         return BMD_ERROR_NONE;
     }
-    if ((bmd->fd < 1) ||
+    if ((bmd_peer_frame_payload(bmd, peer) == NULL) ||
         (peer->video_frame_count == bmd->video_frame_count))
     {
         LOGLN10((LOG_INFO, LOGS "set to get next frame", LOGP));
@@ -213,515 +811,3019 @@ bmd_peer_process_msg_request_video_frame(struct bmd_info* bmd,
 }
 
 /*****************************************************************************/
+/* a frame from the history by BMD_VIDEO_HISTORY_BY_*, the VIDEO_HISTORY
+   answer has what the history holds, then the frame's VIDEO fields and
+   its fd when it is held, the frame is not copied */
 static int
-bmd_peer_process_msg_subscribe_audio(struct bmd_info* bmd,
-                                     struct peer_info* peer,
-                                     struct stream* in_s)
+bmd_peer_process_msg_request_video_history(struct bmd_info* bmd,
+                                           struct peer_info* peer,
+                                           struct stream* in_s)
 {
-    unsigned char val8;
-
-    (void)bmd;
+    struct bmd_history_range range;
+    struct bmd_payload* frame;
+    struct bmd_payload* payload;
+    struct stream out_s;
+    int status;
+    int by;
+    int value;
+    int rv;
 
-    in_uint8(in_s, val8);
-    if (val8)
+    if (!s_check_rem(in_s, 8))
     {
-        peer->got_subscribe_audio = 1;
+        return BMD_ERROR_RANGE;
+    }
+    in_uint32_le(in_s, by);
+    in_uint32_le(in_s, value);
+    frame = NULL;
+    memset(&range, 0, sizeof(range));
+    status = BMD_VIDEO_HISTORY_NONE;
+    if ((bmd->history != NULL) && !(peer->remote))
+    {
+        rv = bmd_history_find(bmd->history, by, value, &frame, &range);
+        if (rv != BMD_ERROR_NONE)
+        {
+            return rv;
+        }
+        status = frame == NULL ? BMD_VIDEO_HISTORY_MISSING :
+                 BMD_VIDEO_HISTORY_FOUND;
+    }
+    rv = bmd_payload_create(64, &payload);
+    if (rv != BMD_ERROR_NONE)
+    {
+        bmd_payload_release(frame);
+        return rv;
+    }
+    bmd_payload_set_stream(payload, &out_s);
+    out_uint32_le(&out_s, BMD_PDU_CODE_VIDEO_HISTORY);
+    out_uint32_le(&out_s, 64);
+    out_uint32_le(&out_s, status);
+    out_uint32_le(&out_s, range.frames);
+    out_uint32_le(&out_s, range.oldest_seq);
+    out_uint32_le(&out_s, range.newest_seq);
+    out_uint32_le(&out_s, range.oldest_time);
+    out_uint32_le(&out_s, range.newest_time);
+    if (frame != NULL)
+    {
+        /* VIDEO after its code and length */
+        out_uint8p(&out_s, frame->data + 8, 32);
+        payload->fd = dup(frame->fd);
+        /* the history does not take the surface back while it is held */
+        payload->hold = frame;
+        if (payload->fd == -1)
+        {
+            bmd_payload_release(payload);
+            return BMD_ERROR_DUP;
+        }
     }
     else
     {
-        peer->got_subscribe_audio = 0;
+        out_uint8s(&out_s, 32);
     }
-    return BMD_ERROR_NONE;
+    payload->bytes = (int)(out_s.p - out_s.data);
+    rv = bmd_peer_queue(bmd, peer, payload);
+    bmd_payload_release(payload);
+    return rv;
 }
 
 /*****************************************************************************/
+/* TIMESHIFT has the VIDEO_HISTORY status, the format and the times the
+   file holds, the data is a sealed memfd copy */
 static int
-bmd_peer_process_msg_version(struct bmd_info* bmd,
-                             struct peer_info* peer,
-                             struct stream* in_s)
+bmd_peer_queue_timeshift(struct bmd_info* bmd, struct peer_info* peer,
+                         const struct bmd_timeshift_result* result)
+{
+    struct bmd_payload* payload;
+    struct stream out_s;
+    int rv;
+
+    rv = bmd_payload_create(56, &payload);
+    if (rv != BMD_ERROR_NONE)
+    {
+        if (result->fd != -1)
+        {
+            close(result->fd);
+        }
+        return rv;
+    }
+    bmd_payload_set_stream(payload, &out_s);
+    out_uint32_le(&out_s, BMD_PDU_CODE_TIMESHIFT);
+    out_uint32_le(&out_s, 56);
+    out_uint32_le(&out_s, result->status);
+    out_uint32_le(&out_s, result->type);
+    out_uint32_le(&out_s, result->header.time);
+    out_uint32_le(&out_s, result->header.seq);
+    out_uint32_le(&out_s, result->header.width);
+    out_uint32_le(&out_s, result->header.height);
+    out_uint32_le(&out_s, result->header.channels);
+    out_uint32_le(&out_s, result->header.bytes_per_sample);
+    out_uint32_le(&out_s, result->header.sample_rate);
+    out_uint32_le(&out_s, result->header.bytes);
+    out_uint32_le(&out_s, result->oldest_time);
+    out_uint32_le(&out_s, result->newest_time);
+    payload->fd = result->fd;
+    payload->bytes = (int)(out_s.p - out_s.data);
+    rv = bmd_peer_queue(bmd, peer, payload);
+    bmd_payload_release(payload);
+    return rv;
+}
+
+/*****************************************************************************/
+/* a frame by BMD_VIDEO_HISTORY_BY_SEQ or _BY_TIME or an audio range from
+   the timeshift file, the lookup is on the timeshift's thread, TIMESHIFT
+   is queued from bmd_peer_check_timeshift when it is done */
+static int
+bmd_peer_process_msg_request_timeshift(struct bmd_info* bmd,
+                                       struct peer_info* peer,
+                                       struct stream* in_s)
+{
+    struct bmd_timeshift_result result;
+    int type;
+    int by;
+    int value;
+    int duration_ms;
+    int rv;
+
+    if (!s_check_rem(in_s, 16))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    in_uint32_le(in_s, type);
+    in_uint32_le(in_s, by);
+    in_uint32_le(in_s, value);
+    in_uint32_le(in_s, duration_ms);
+    memset(&result, 0, sizeof(result));
+    result.type = type;
+    result.fd = -1;
+    result.status = BMD_VIDEO_HISTORY_NONE;
+    if ((bmd->timeshift != NULL) && !(peer->remote))
+    {
+        rv = BMD_ERROR_NONE;
+        if (bmd->timeshift_replies == NULL)
+        {
+            rv = bmd_timeshift_replies_create(&(bmd->timeshift_replies));
+        }
+        if (rv == BMD_ERROR_NONE)
+        {
+            rv = bmd_timeshift_lookup(bmd->timeshift, bmd->timeshift_replies,
+                                      peer->id, type, by, value,
+                                      duration_ms);
+        }
+        if (rv == BMD_ERROR_NONE)
+        {
+            return BMD_ERROR_NONE;
+        }
+        /* too many queued, answered, not a reason to drop the peer */
+        LOGLN10((LOG_INFO, LOGS "sck %d timeshift lookup failed error %d",
+                 LOGP, peer->sck, rv));
+        result.status = BMD_VIDEO_HISTORY_MISSING;
+    }
+    return bmd_peer_queue_timeshift(bmd, peer, &result);
+}
+
+/*****************************************************************************/
+static int
+bmd_peer_process_msg_subscribe_audio(struct bmd_info* bmd,
+                                     struct peer_info* peer,
+                                     struct stream* in_s)
+{
+    unsigned char val8;
+
+    (void)bmd;
+
+    in_uint8(in_s, val8);
+    if (val8)
+    {
+        peer->got_subscribe_audio = 1;
+    }
+    else
+    {
+        peer->got_subscribe_audio = 0;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* sample type, layout and an out by in mix matrix for the socket audio,
+   no matrix keeps the capture channels, then from minor 10 an output
+   rate, 0 keeps the capture rate, and from minor 11 a packet period in
+   microseconds, 0 sends each packet as captured */
+static int
+bmd_peer_process_msg_subscribe_audio_format(struct bmd_info* bmd,
+                                            struct peer_info* peer,
+                                            struct stream* in_s)
+{
+    struct bmd_audio_format format;
+    struct peer_audio_group* group;
+    int period_us;
+    int index;
+    int jndex;
+    int rv;
+
+    if (!s_check_rem(in_s, 4))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    memset(&format, 0, sizeof(format));
+    in_uint8(in_s, format.sample_type);
+    in_uint8(in_s, format.layout);
+    in_uint8(in_s, format.out_channels);
+    in_uint8(in_s, format.in_channels);
+    if ((format.sample_type > BMD_AUDIO_SAMPLE_F32) ||
+        (format.layout > BMD_AUDIO_LAYOUT_PLANAR) ||
+        (format.out_channels > BMD_AUDIO_MIX_MAX_CHANNELS) ||
+        (format.in_channels > BMD_AUDIO_MIX_MAX_CHANNELS) ||
+        ((format.out_channels == 0) != (format.in_channels == 0)) ||
+        !s_check_rem(in_s, format.out_channels * format.in_channels * 2))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    for (index = 0; index < format.out_channels; index++)
+    {
+        for (jndex = 0; jndex < format.in_channels; jndex++)
+        {
+            in_sint16_le(in_s, format.matrix[index][jndex]);
+        }
+    }
+    if (s_check_rem(in_s, 4))
+    {
+        in_uint32_le(in_s, format.rate);
+    }
+    period_us = 0;
+    if (s_check_rem(in_s, 4))
+    {
+        in_uint32_le(in_s, period_us);
+    }
+    if ((period_us != 0) && ((period_us < BMD_AUDIO_MIN_PERIOD_US) ||
+                             (period_us > BMD_AUDIO_MAX_PERIOD_US)))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    format.period = (int)(period_us * (long long)BMD_AUDIO_SAMPLE_RATE /
+                          1000000);
+    if (format.rate == BMD_AUDIO_SAMPLE_RATE)
+    {
+        format.rate = 0;
+    }
+    if ((format.rate != 0) &&
+        (bmd_resample_check(BMD_AUDIO_SAMPLE_RATE, format.rate) !=
+         BMD_ERROR_NONE))
+    {
+        LOGLN0((LOG_ERROR, LOGS "sck %d can not resample to %d", LOGP,
+                peer->sck, format.rate));
+        return BMD_ERROR_RANGE;
+    }
+    LOGLN0((LOG_INFO, LOGS "sck %d sample type %d layout %d out channels "
+            "%d in channels %d rate %d period %d", LOGP, peer->sck,
+            format.sample_type, format.layout, format.out_channels,
+            format.in_channels, format.rate, format.period));
+    group = NULL;
+    if (!bmd_audio_format_is_capture(&format))
+    {
+        /* before the put so the same format keeps its stream */
+        rv = bmd_peer_audio_group_get(bmd, &format, &group);
+        if (rv != BMD_ERROR_NONE)
+        {
+            return rv;
+        }
+    }
+    bmd_peer_audio_group_put(bmd, peer->audio_group);
+    peer->audio_group = group;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* continuous video, every Nth capture frame or at a rate, optionally
+   credit flow controlled, credits 0 means no flow control */
+static int
+bmd_peer_process_msg_subscribe_video(struct bmd_info* bmd,
+                                     struct peer_info* peer,
+                                     struct stream* in_s)
+{
+    int every;
+    int fps;
+    int credits;
+    unsigned char val8;
+
+    (void)bmd;
+
+    if (!s_check_rem(in_s, 13))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    in_uint32_le(in_s, every);
+    in_uint32_le(in_s, fps);
+    in_uint32_le(in_s, credits);
+    in_uint8(in_s, val8);
+    if ((every < 0) || (fps < 0) || (fps > 1000) || (credits < 0))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    LOGLN0((LOG_INFO, LOGS "sck %d subscribe %d every %d fps %d credits %d",
+            LOGP, peer->sck, val8, every, fps, credits));
+    if (val8)
+    {
+        peer->video_subscribed = 1;
+        peer->video_every = every < 1 ? 1 : every;
+        peer->video_fps = fps;
+        peer->video_credits = credits == 0 ? -1 : credits;
+        peer->video_next_valid = 0;
+    }
+    else
+    {
+        peer->video_subscribed = 0;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_peer_process_msg_video_credit(struct bmd_info* bmd,
+                                  struct peer_info* peer,
+                                  struct stream* in_s)
+{
+    int credits;
+
+    (void)bmd;
+
+    if (!s_check_rem(in_s, 4))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    in_uint32_le(in_s, credits);
+    if (credits < 0)
+    {
+        return BMD_ERROR_RANGE;
+    }
+    if (peer->video_credits >= 0)
+    {
+        peer->video_credits += credits;
+        if (peer->video_credits < 0)
+        {
+            peer->video_credits = 0x7fffffff;
+        }
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_peer_process_msg_subscribe_trace(struct bmd_info* bmd,
+                                     struct peer_info* peer,
+                                     struct stream* in_s)
+{
+    unsigned char val8;
+
+    (void)bmd;
+
+    if (!s_check_rem(in_s, 1))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    in_uint8(in_s, val8);
+    peer->got_subscribe_trace = val8 ? 1 : 0;
+    get_mstime(&(peer->trace_report_mstime));
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* the peer sends back a TRACE body with its receive and display stamps,
+   either can be 0 when not known */
+static int
+bmd_peer_process_msg_trace_echo(struct bmd_info* bmd,
+                                struct peer_info* peer,
+                                struct stream* in_s)
+{
+    struct peer_latency* lat;
+    long long stamps[BMD_TRACE_NUM_STAGES + 1];
+    long long diff;
+    int pdu_code;
+    int index;
+    int now;
+
+    (void)bmd;
+
+    if (!s_check_rem(in_s, BMD_TRACE_ECHO_PDU_BYTES - 8))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    in_uint32_le(in_s, pdu_code);
+    in_uint8s(in_s, 4); /* seq */
+    for (index = 0; index < BMD_TRACE_NUM_STAGES + 1; index++)
+    {
+        in_uint64_le(in_s, stamps[index]);
+    }
+    if (pdu_code == BMD_PDU_CODE_VIDEO)
+    {
+        lat = &(peer->video_latency);
+    }
+    else if (pdu_code == BMD_PDU_CODE_AUDIO)
+    {
+        lat = &(peer->audio_latency);
+    }
+    else
+    {
+        return BMD_ERROR_NONE;
+    }
+    for (index = 0; index < BMD_TRACE_NUM_STAGES; index++)
+    {
+        if ((stamps[index] == 0) || (stamps[index + 1] == 0))
+        {
+            continue;
+        }
+        diff = stamps[index + 1] - stamps[index];
+        if (diff < 0)
+        {
+            diff = 0;
+        }
+        lat->sum_us[index] += diff;
+        if (diff > lat->max_us[index])
+        {
+            lat->max_us[index] = diff;
+        }
+        lat->count[index]++;
+    }
+    get_mstime(&now);
+    if (now - peer->trace_report_mstime >= BMD_TRACE_REPORT_MS)
+    {
+        bmd_peer_trace_report(peer);
+        peer->trace_report_mstime = now;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* the ring is created on first use and lives until bmd_stop, peers map
+   the fd that comes with the BMD_PDU_CODE_AUDIO_SHM pdu */
+static int
+bmd_peer_process_msg_subscribe_audio_shm(struct bmd_info* bmd,
+                                         struct peer_info* peer,
+                                         struct stream* in_s)
+{
+    struct bmd_payload* payload;
+    struct stream out_s;
+    unsigned char val8;
+    int fd;
+    int fd_bytes;
+    int rv;
+
+    if (!s_check_rem(in_s, 1))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    in_uint8(in_s, val8);
+    if (!val8)
+    {
+        peer->got_subscribe_audio_shm = 0;
+        return BMD_ERROR_NONE;
+    }
+    if (peer->got_subscribe_audio_shm)
+    {
+        return BMD_ERROR_NONE;
+    }
+    if (peer->remote)
+    {
+        LOGLN0((LOG_ERROR, LOGS "sck %d remote peer can not map the audio "
+                "ring, use socket audio", LOGP, peer->sck));
+        return BMD_ERROR_NONE;
+    }
+    if (bmd->audio_ring == NULL)
+    {
+        rv = bmd_audio_ring_create(BMD_AUDIO_RING_DATA_BYTES,
+                                   BMD_AUDIO_CHANNELS,
+                                   BMD_AUDIO_BYTES_PER_SAMPLE,
+                                   BMD_AUDIO_SAMPLE_RATE,
+                                   &(bmd->audio_ring));
+        if (rv != BMD_ERROR_NONE)
+        {
+            LOGLN0((LOG_ERROR, LOGS "bmd_audio_ring_create failed", LOGP));
+            bmd->audio_ring = NULL;
+            return rv;
+        }
+    }
+    bmd_audio_ring_get_fd(bmd->audio_ring, &fd, &fd_bytes);
+    rv = bmd_payload_create(16, &payload);
+    if (rv != BMD_ERROR_NONE)
+    {
+        return rv;
+    }
+    payload->fd = dup(fd);
+    if (payload->fd == -1)
+    {
+        bmd_payload_release(payload);
+        return BMD_ERROR_DUP;
+    }
+    bmd_payload_set_stream(payload, &out_s);
+    out_uint32_le(&out_s, BMD_PDU_CODE_AUDIO_SHM);
+    out_uint32_le(&out_s, 16);
+    out_uint32_le(&out_s, fd_bytes);
+    out_uint8s(&out_s, 4);
+    payload->bytes = (int)(out_s.p - out_s.data);
+    rv = bmd_peer_queue(bmd, peer, payload);
+    bmd_payload_release(payload);
+    if (rv == BMD_ERROR_NONE)
+    {
+        peer->got_subscribe_audio_shm = 1;
+    }
+    return rv;
+}
+
+/*****************************************************************************/
+static int
+bmd_peer_process_msg_subscribe_encoded(struct bmd_info* bmd,
+                                       struct peer_info* peer,
+                                       struct stream* in_s)
+{
+    int rendition;
+    unsigned char val8;
+
+    if (!s_check_rem(in_s, 5))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    in_uint32_le(in_s, rendition);
+    in_uint8(in_s, val8);
+    if ((rendition < 0) || (rendition >= bmd->num_renditions))
+    {
+        LOGLN0((LOG_INFO, LOGS "unknown rendition %d, sck %d",
+                LOGP, rendition, peer->sck));
+        return BMD_ERROR_NONE;
+    }
+    if (val8)
+    {
+        peer->subscribe_encoded |= 1 << rendition;
+    }
+    else
+    {
+        peer->subscribe_encoded &= ~(1 << rendition);
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_peer_process_msg_version(struct bmd_info* bmd,
+                             struct peer_info* peer,
+                             struct stream* in_s)
 {
     int version_major;
     int version_minor;
 
-    (void)bmd;
-    (void)peer;
     if (!s_check_rem(in_s, 8))
     {
-        return BMD_ERROR_RANGE;
+        return BMD_ERROR_RANGE;
+    }
+    in_uint32_le(in_s, version_major);
+    in_uint32_le(in_s, version_minor);
+    LOGLN0((LOG_INFO, LOGS "connection client version %d %d",
+            LOGP, version_major, version_minor));
+    if (peer->remote && bmd->compress &&
+        ((version_major > 0) || (version_minor >= 8)))
+    {
+        LOGLN0((LOG_INFO, LOGS "sck %d video as VIDEO_TILES", LOGP,
+                peer->sck));
+        peer->tiles = 1;
+        return bmd_peer_update_demand(bmd);
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_peer_process_msg(struct bmd_info* bmd, struct peer_info* peer)
+{
+    int pdu_code;
+    int pdu_bytes;
+    int rv;
+    struct stream* in_s;
+
+    (void)bmd;
+
+    rv = BMD_ERROR_NONE;
+    in_s = peer->in_s;
+    in_uint32_le(in_s, pdu_code);
+    in_uint32_le(in_s, pdu_bytes);
+    LOGLN10((LOG_INFO, LOGS "sck %d pdu_code %d pdu_bytes %d",
+             LOGP, peer->sck, pdu_code, pdu_bytes));
+    if ((pdu_bytes < 8) || !s_check_rem(in_s, pdu_bytes - 8))
+    {
+        LOGLN0((LOG_INFO, LOGS "bad pdu_bytes, sck %d pdu_code %d "
+                "pdu_bytes %d", LOGP, peer->sck, pdu_code, pdu_bytes));
+        return BMD_ERROR_RANGE;
+    }
+    switch (pdu_code)
+    {
+        case BMD_PDU_CODE_SUBSCRIBE_AUDIO:
+            rv = bmd_peer_process_msg_subscribe_audio(bmd, peer, in_s);
+            break;
+        case BMD_PDU_CODE_REQUEST_VIDEO_FRAME:
+            rv = bmd_peer_process_msg_request_video_frame(bmd, peer, in_s);
+            break;
+        case BMD_PDU_CODE_VERSION:
+            rv = bmd_peer_process_msg_version(bmd, peer, in_s);
+            break;
+        case BMD_PDU_CODE_SUBSCRIBE_ENCODED:
+            rv = bmd_peer_process_msg_subscribe_encoded(bmd, peer, in_s);
+            break;
+        case BMD_PDU_CODE_SUBSCRIBE_AUDIO_SHM:
+            rv = bmd_peer_process_msg_subscribe_audio_shm(bmd, peer, in_s);
+            break;
+        case BMD_PDU_CODE_SUBSCRIBE_AUDIO_FORMAT:
+            rv = bmd_peer_process_msg_subscribe_audio_format(bmd, peer,
+                                                             in_s);
+            break;
+        case BMD_PDU_CODE_REQUEST_VIDEO_HISTORY:
+            rv = bmd_peer_process_msg_request_video_history(bmd, peer,
+                                                            in_s);
+            break;
+        case BMD_PDU_CODE_REQUEST_TIMESHIFT:
+            rv = bmd_peer_process_msg_request_timeshift(bmd, peer, in_s);
+            break;
+        case BMD_PDU_CODE_SUBSCRIBE_VIDEO:
+            rv = bmd_peer_process_msg_subscribe_video(bmd, peer, in_s);
+            break;
+        case BMD_PDU_CODE_VIDEO_CREDIT:
+            rv = bmd_peer_process_msg_video_credit(bmd, peer, in_s);
+            break;
+        case BMD_PDU_CODE_SUBSCRIBE_TRACE:
+            rv = bmd_peer_process_msg_subscribe_trace(bmd, peer, in_s);
+            break;
+        case BMD_PDU_CODE_TRACE_ECHO:
+            rv = bmd_peer_process_msg_trace_echo(bmd, peer, in_s);
+            break;
+    }
+    return rv;
+}
+
+/*****************************************************************************/
+static int
+bmd_peer_unlink_out(struct peer_info* peer, struct peer_out* out,
+                    struct peer_out* prev)
+{
+    if (prev == NULL)
+    {
+        peer->out_head = out->next;
+    }
+    else
+    {
+        prev->next = out->next;
+    }
+    if (peer->out_tail == out)
+    {
+        peer->out_tail = prev;
+    }
+    peer->out_bytes -= out->payload->bytes;
+    if (out->payload->fd != -1)
+    {
+        peer->out_fds--;
+    }
+    bmd_payload_release(out->payload);
+    bmd_pool_free(out, sizeof(struct peer_out));
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* unlink and release an out that has not started sending and count it,
+   a trace pdu right after it goes too
+   when an encoded frame goes the later frames of that rendition go too,
+   up to the next keyframe */
+static int
+bmd_peer_drop_out(struct peer_info* peer, struct peer_out* out,
+                  struct peer_out* prev)
+{
+    struct peer_out* next;
+    int rendition;
+
+    rendition = -1;
+    while (out != NULL)
+    {
+        next = out->next;
+        if ((rendition != -1) &&
+            ((out->pdu_code != BMD_PDU_CODE_ENCODED) ||
+             (out->rendition != rendition)))
+        {
+            prev = out;
+            out = next;
+            continue;
+        }
+        if ((rendition != -1) && (out->flags & BMD_ENCODER_FLAGS_KEYFRAME))
+        {
+            /* decodable again from here */
+            peer->encoded_wait_key &= ~(1 << rendition);
+            break;
+        }
+        switch (out->pdu_code)
+        {
+            case BMD_PDU_CODE_VIDEO:
+                peer->video_drops++;
+                break;
+            case BMD_PDU_CODE_AUDIO:
+                peer->audio_drops++;
+                break;
+            case BMD_PDU_CODE_ENCODED:
+                peer->encoded_drops++;
+                rendition = out->rendition;
+                peer->encoded_wait_key |= 1 << rendition;
+                break;
+        }
+        bmd_peer_unlink_out(peer, out, prev);
+        if ((next != NULL) && (next->pdu_code == BMD_PDU_CODE_TRACE))
+        {
+            out = next;
+            next = out->next;
+            bmd_peer_unlink_out(peer, out, prev);
+        }
+        if (rendition == -1)
+        {
+            break;
+        }
+        out = next;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* oldest out that can go to make room, never a partly sent one or a
+   control pdu */
+static int
+bmd_peer_find_victim(struct bmd_info* bmd, struct peer_info* peer,
+                     struct peer_out** aout, struct peer_out** aprev)
+{
+    struct peer_out* out;
+    struct peer_out* prev;
+
+    prev = NULL;
+    out = peer->out_head;
+    while (out != NULL)
+    {
+        if ((out->offset == 0) && !(out->fd_sent) && !(out->inflight))
+        {
+            if ((out->pdu_code == BMD_PDU_CODE_VIDEO) ||
+                (out->pdu_code == BMD_PDU_CODE_ENCODED) ||
+                ((out->pdu_code == BMD_PDU_CODE_AUDIO) &&
+                 (bmd->peer_limits.audio_policy ==
+                  BMD_AUDIO_POLICY_DROP_OLDEST)))
+            {
+                *aout = out;
+                *aprev = prev;
+                return BMD_ERROR_NONE;
+            }
+        }
+        prev = out;
+        out = out->next;
+    }
+    return BMD_ERROR_RANGE;
+}
+
+/*****************************************************************************/
+static int
+bmd_peer_over_limits(struct bmd_info* bmd, struct peer_info* peer,
+                     struct bmd_payload* payload)
+{
+    struct bmd_peer_limits* limits;
+
+    limits = &(bmd->peer_limits);
+    if ((limits->max_bytes > 0) &&
+        (peer->out_bytes + payload->bytes > limits->max_bytes))
+    {
+        return 1;
+    }
+    if ((limits->max_fds > 0) && (payload->fd != -1) &&
+        (peer->out_fds + 1 > limits->max_fds))
+    {
+        return 1;
+    }
+    return 0;
+}
+
+/*****************************************************************************/
+/* drop queued video, audio and encoded pdus older than max_age_ms */
+static int
+bmd_peer_expire(struct bmd_info* bmd, struct peer_info* peer, int now)
+{
+    struct peer_out* out;
+    struct peer_out* prev;
+
+    if (bmd->peer_limits.max_age_ms < 1)
+    {
+        return BMD_ERROR_NONE;
+    }
+    prev = NULL;
+    out = peer->out_head;
+    while (out != NULL)
+    {
+        if ((out->offset == 0) && !(out->fd_sent) && !(out->inflight) &&
+            ((out->pdu_code == BMD_PDU_CODE_VIDEO) ||
+             (out->pdu_code == BMD_PDU_CODE_AUDIO) ||
+             (out->pdu_code == BMD_PDU_CODE_ENCODED)) &&
+            (now - out->mstime > bmd->peer_limits.max_age_ms))
+        {
+            LOGLN10((LOG_INFO, LOGS "sck %d pdu_code %d expired",
+                     LOGP, peer->sck, out->pdu_code));
+            bmd_peer_drop_out(peer, out, prev);
+            /* start over, dropping an encoded frame can take later ones */
+            prev = NULL;
+            out = peer->out_head;
+            continue;
+        }
+        prev = out;
+        out = out->next;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* a VIDEO_TILES the peer got all of is the base for its next delta */
+static void
+bmd_peer_tiles_sent(struct peer_info* peer, struct bmd_payload* payload)
+{
+    struct stream in_s;
+    int pdu_code;
+
+    memset(&in_s, 0, sizeof(in_s));
+    in_s.data = payload->data;
+    in_s.p = in_s.data;
+    in_s.end = in_s.data + payload->bytes;
+    in_uint32_le(&in_s, pdu_code);
+    if ((pdu_code == BMD_PDU_CODE_VIDEO_TILES) && s_check_rem(&in_s, 12))
+    {
+        in_uint8s(&in_s, 8);
+        in_uint32_le(&in_s, peer->tiles_base_seq);
+        peer->tiles_have_base = 1;
+    }
+}
+
+/*****************************************************************************/
+/* dequeue and release what sendmsg took */
+static int
+bmd_peer_out_sent(struct peer_info* peer, int sent)
+{
+    struct peer_out* out;
+    int bytes;
+
+    while (sent > 0)
+    {
+        out = peer->out_head;
+        bytes = out->payload->bytes - out->offset;
+        if (sent < bytes)
+        {
+            out->offset += sent;
+            break;
+        }
+        sent -= bytes;
+        if (peer->tiles)
+        {
+            bmd_peer_tiles_sent(peer, out->payload);
+        }
+        bmd_peer_unlink_out(peer, out, NULL);
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* SOCK_SEQPACKET, every pdu is its own message with its fd on it, a batch
+   of them goes in one sendmmsg and a message is never sent in part
+   returns BMD_ERROR_NONE when the queue is empty or the socket is full */
+static int
+bmd_peer_send_packets(struct peer_info* peer)
+{
+    struct mmsghdr msgs[BMD_PEER_MAX_IOV];
+    struct iovec iov[BMD_PEER_MAX_IOV];
+    char control[BMD_PEER_MAX_IOV][CMSG_SPACE(sizeof(int))];
+    struct cmsghdr* cmsg;
+    struct peer_out* out;
+    struct bmd_payload* payload;
+    int count;
+    int sent;
+
+    while (peer->out_head != NULL)
+    {
+        out = peer->out_head;
+        if (out->payload->bytes > BMD_SEQPACKET_MAX_BYTES)
+        {
+            LOGLN0((LOG_ERROR, LOGS "sck %d dropping pdu_code %d of %d "
+                    "bytes, too big for a message", LOGP, peer->sck,
+                    out->pdu_code, out->payload->bytes));
+            bmd_peer_drop_out(peer, out, NULL);
+            continue;
+        }
+        count = 0;
+        while ((out != NULL) && (count < BMD_PEER_MAX_IOV))
+        {
+            payload = out->payload;
+            if (payload->bytes > BMD_SEQPACKET_MAX_BYTES)
+            {
+                /* goes when it gets to the head */
+                break;
+            }
+            if (out->pdu_code == BMD_PDU_CODE_TRACE)
+            {
+                bmd_peer_stamp_send(payload);
+            }
+            memset(msgs + count, 0, sizeof(struct mmsghdr));
+            iov[count].iov_base = payload->data;
+            iov[count].iov_len = payload->bytes;
+            msgs[count].msg_hdr.msg_iov = iov + count;
+            msgs[count].msg_hdr.msg_iovlen = 1;
+            if (payload->fd != -1)
+            {
+                memset(control[count], 0, sizeof(control[count]));
+                msgs[count].msg_hdr.msg_control = control[count];
+                msgs[count].msg_hdr.msg_controllen = sizeof(control[count]);
+                cmsg = CMSG_FIRSTHDR(&(msgs[count].msg_hdr));
+                cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                memcpy(CMSG_DATA(cmsg), &(payload->fd), sizeof(int));
+            }
+            count++;
+            out = out->next;
+        }
+        sent = sendmmsg(peer->sck, msgs, count, 0);
+        if (sent < 0)
+        {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+                (errno == EINTR))
+            {
+                return BMD_ERROR_NONE;
+            }
+            if (errno == EMSGSIZE)
+            {
+                /* socket buffer is smaller than we asked for */
+                LOGLN0((LOG_ERROR, LOGS "sck %d dropping pdu_code %d of %d "
+                        "bytes, too big for the socket", LOGP, peer->sck,
+                        peer->out_head->pdu_code,
+                        peer->out_head->payload->bytes));
+                bmd_peer_drop_out(peer, peer->out_head, NULL);
+                continue;
+            }
+            LOGLN0((LOG_ERROR, LOGS "sendmmsg failed sck %d errno %d",
+                    LOGP, peer->sck, errno));
+            return BMD_ERROR_FD;
+        }
+        LOGLN10((LOG_DEBUG, LOGS "sendmmsg ok, count %d sent %d",
+                 LOGP, count, sent));
+        if (sent > 0)
+        {
+            get_mstime(&(peer->progress_mstime));
+        }
+        while (sent > 0)
+        {
+            bmd_peer_unlink_out(peer, peer->out_head, NULL);
+            count--;
+            sent--;
+        }
+        if (count > 0)
+        {
+            /* socket buffer is full, wait for select */
+            return BMD_ERROR_NONE;
+        }
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* a MSG_ZEROCOPY sendmsg took sent bytes from the head of the queue, keep
+   a reference to each payload it read from until the kernel is done */
+static int
+bmd_peer_zc_hold(struct peer_info* peer, int sent)
+{
+    struct peer_out* out;
+    struct peer_zc* zc;
+    int size;
+
+    out = peer->out_head;
+    while ((out != NULL) && (sent > 0))
+    {
+        zc = (struct peer_zc*)bmd_pool_alloc(sizeof(struct peer_zc), &size);
+        if (zc == NULL)
+        {
+            return BMD_ERROR_MEMORY;
+        }
+        memset(zc, 0, sizeof(struct peer_zc));
+        bmd_payload_addref(out->payload);
+        zc->payload = out->payload;
+        zc->id = peer->zc_next_id;
+        if (peer->zc_tail == NULL)
+        {
+            peer->zc_head = zc;
+        }
+        else
+        {
+            peer->zc_tail->next = zc;
+        }
+        peer->zc_tail = zc;
+        sent -= out->payload->bytes - out->offset;
+        out = out->next;
+    }
+    /* the kernel numbers every successful MSG_ZEROCOPY send */
+    peer->zc_next_id++;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* completions from the error queue, each covers the sends numbered
+   ee_info to ee_data */
+static int
+bmd_peer_zc_complete(struct peer_info* peer)
+{
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    struct sock_extended_err* serr;
+    struct peer_zc* zc;
+    struct peer_zc* prev;
+    struct peer_zc* next;
+    char control[128];
+    unsigned int lo;
+    unsigned int hi;
+
+    while (peer->zc_head != NULL)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(peer->sck, &msg, MSG_ERRQUEUE) < 0)
+        {
+            /* EAGAIN, none yet */
+            break;
+        }
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (!(((cmsg->cmsg_level == SOL_IP) &&
+                   (cmsg->cmsg_type == IP_RECVERR)) ||
+                  ((cmsg->cmsg_level == SOL_IPV6) &&
+                   (cmsg->cmsg_type == IPV6_RECVERR))))
+            {
+                continue;
+            }
+            serr = (struct sock_extended_err*)CMSG_DATA(cmsg);
+            if ((serr->ee_errno != 0) ||
+                (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY))
+            {
+                continue;
+            }
+            if ((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) &&
+                peer->zerocopy)
+            {
+                /* loopback or a device that can not gather, the kernel
+                   copied anyway so pinning is only overhead */
+                LOGLN0((LOG_INFO, LOGS "sck %d kernel copied, zerocopy off",
+                        LOGP, peer->sck));
+                peer->zerocopy = 0;
+            }
+            lo = serr->ee_info;
+            hi = serr->ee_data;
+            prev = NULL;
+            zc = peer->zc_head;
+            while (zc != NULL)
+            {
+                next = zc->next;
+                if (zc->id - lo <= hi - lo)
+                {
+                    if (prev == NULL)
+                    {
+                        peer->zc_head = next;
+                    }
+                    else
+                    {
+                        prev->next = next;
+                    }
+                    if (peer->zc_tail == zc)
+                    {
+                        peer->zc_tail = prev;
+                    }
+                    bmd_payload_release(zc->payload);
+                    bmd_pool_free(zc, sizeof(struct peer_zc));
+                }
+                else
+                {
+                    prev = zc;
+                }
+                zc = next;
+            }
+        }
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* gather pending pdus into one sendmsg, a pdu's fd goes as SCM_RIGHTS on
+   its own header bytes so a batch ends before the next pdu with an fd
+   returns BMD_ERROR_NONE when the queue is empty or the socket is full */
+static int
+bmd_peer_send_out(struct peer_info* peer)
+{
+    struct msghdr msg;
+    struct iovec iov[BMD_PEER_MAX_IOV];
+    char control[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr* cmsg;
+    struct peer_out* out;
+    struct bmd_payload* payload;
+    ssize_t sent;
+    int count;
+    int bytes;
+    int zerocopy;
+
+    if (peer->seqpacket)
+    {
+        return bmd_peer_send_packets(peer);
+    }
+    while (peer->out_head != NULL)
+    {
+        memset(&msg, 0, sizeof(msg));
+        out = peer->out_head;
+        payload = out->payload;
+        if ((payload->fd != -1) && !(out->fd_sent))
+        {
+            memset(control, 0, sizeof(control));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            memcpy(CMSG_DATA(cmsg), &(payload->fd), sizeof(int));
+        }
+        count = 0;
+        bytes = 0;
+        while ((out != NULL) && (count < BMD_PEER_MAX_IOV))
+        {
+            payload = out->payload;
+            if ((count > 0) && (payload->fd != -1))
+            {
+                break;
+            }
+            if ((out->pdu_code == BMD_PDU_CODE_TRACE) && (out->offset == 0))
+            {
+                bmd_peer_stamp_send(payload);
+            }
+            iov[count].iov_base = payload->data + out->offset;
+            iov[count].iov_len = payload->bytes - out->offset;
+            bytes += payload->bytes - out->offset;
+            count++;
+            out = out->next;
+        }
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        zerocopy = peer->zerocopy && (bytes >= BMD_PEER_ZEROCOPY_BYTES);
+        sent = sendmsg(peer->sck, &msg, zerocopy ? MSG_ZEROCOPY : 0);
+        if (sent < 0)
+        {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+                (errno == EINTR))
+            {
+                return BMD_ERROR_NONE;
+            }
+            LOGLN0((LOG_ERROR, LOGS "sendmsg failed sck %d errno %d",
+                    LOGP, peer->sck, errno));
+            return BMD_ERROR_FD;
+        }
+        LOGLN10((LOG_DEBUG, LOGS "sendmsg ok, count %d sent %d",
+                 LOGP, count, (int)sent));
+        if ((sent > 0) && zerocopy &&
+            (bmd_peer_zc_hold(peer, (int)sent) != BMD_ERROR_NONE))
+        {
+            return BMD_ERROR_MEMORY;
+        }
+        if (sent > 0)
+        {
+            get_mstime(&(peer->progress_mstime));
+            if (msg.msg_control != NULL)
+            {
+                /* the fd went with the first byte */
+                peer->out_head->fd_sent = 1;
+            }
+        }
+        bmd_peer_out_sent(peer, (int)sent);
+        if (sent < bytes)
+        {
+            /* socket buffer is full, wait for select */
+            return BMD_ERROR_NONE;
+        }
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* the start of a pdu bigger than the buffer is in, move it to a buffer
+   that holds pdu_bytes */
+static int
+bmd_peer_grow_in_s(struct stream* in_s, int pdu_bytes)
+{
+    char* data;
+    int size;
+    int bytes;
+
+    data = (char*)bmd_pool_alloc(pdu_bytes, &size);
+    if (data == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    bytes = (int)(in_s->end - in_s->data);
+    memcpy(data, in_s->data, bytes);
+    bmd_pool_free(in_s->data, in_s->size);
+    in_s->data = data;
+    in_s->size = size;
+    in_s->p = data;
+    in_s->end = data + bytes;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_peer_create_in_s(struct peer_info* peer, int bytes)
+{
+    struct stream* in_s;
+
+    in_s = xnew0(struct stream, 1);
+    if (in_s == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    in_s->data = (char*)bmd_pool_alloc(bytes, &(in_s->size));
+    if (in_s->data == NULL)
+    {
+        free(in_s);
+        return BMD_ERROR_MEMORY;
+    }
+    in_s->p = in_s->data;
+    in_s->end = in_s->data;
+    peer->in_s = in_s;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* SOCK_SEQPACKET, a message of reed bytes is at in_s->data */
+static int
+bmd_peer_parse_packet(struct bmd_info* bmd, struct peer_info* peer,
+                      int reed)
+{
+    struct stream* in_s;
+    int pdu_bytes;
+
+    in_s = peer->in_s;
+    if ((reed < 8) || (reed > in_s->size))
+    {
+        LOGLN0((LOG_ERROR, LOGS "bad message bytes %d", LOGP, reed));
+        return BMD_ERROR_RANGE;
+    }
+    in_s->p = in_s->data + 4;
+    in_s->end = in_s->data + reed;
+    in_uint32_le(in_s, pdu_bytes);
+    if (pdu_bytes != reed)
+    {
+        LOGLN0((LOG_ERROR, LOGS "pdu_bytes %d in a message of %d",
+                LOGP, pdu_bytes, reed));
+        return BMD_ERROR_RANGE;
+    }
+    in_s->p = in_s->data;
+    return bmd_peer_process_msg(bmd, peer);
+}
+
+/*****************************************************************************/
+/* SOCK_SEQPACKET, one recv is one whole pdu, nothing to reassemble
+   returns BMD_ERROR_NOTREADY when there is no message */
+static int
+bmd_peer_recv_packet(struct bmd_info* bmd, struct peer_info* peer)
+{
+    struct stream* in_s;
+    int reed;
+
+    if ((peer->in_s == NULL) &&
+        (bmd_peer_create_in_s(peer, BMD_PEER_SEQPACKET_IN_BYTES) !=
+         BMD_ERROR_NONE))
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    in_s = peer->in_s;
+    /* MSG_TRUNC gives the real length of a message that did not fit */
+    reed = recv(peer->sck, in_s->data, in_s->size, MSG_TRUNC);
+    if (reed < 0)
+    {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+        {
+            return BMD_ERROR_NOTREADY;
+        }
+        return BMD_ERROR_FD;
+    }
+    if (reed == 0)
+    {
+        return BMD_ERROR_FD;
+    }
+    return bmd_peer_parse_packet(bmd, peer, reed);
+}
+
+/*****************************************************************************/
+/* SOCK_STREAM, reed bytes were added at in_s->end, run every whole pdu in
+   the buffer, so a client that pipelines pdus costs one wakeup, a partial
+   pdu moves to the front and waits for the next read */
+static int
+bmd_peer_parse_stream(struct bmd_info* bmd, struct peer_info* peer,
+                      int reed)
+{
+    struct stream* in_s;
+    char* start;
+    char* end;
+    int pdu_bytes;
+    int bytes;
+    int rv;
+
+    in_s = peer->in_s;
+    in_s->end += reed;
+    start = in_s->data;
+    pdu_bytes = 0;
+    while (in_s->end - start >= 8)
+    {
+        in_s->p = start + 4;
+        in_uint32_le(in_s, pdu_bytes);
+        if ((pdu_bytes < 8) || (pdu_bytes > BMD_PEER_MAX_IN_BYTES))
+        {
+            LOGLN0((LOG_ERROR, LOGS "bad pdu_bytes %d", LOGP, pdu_bytes));
+            return BMD_ERROR_RANGE;
+        }
+        if (in_s->end - start < pdu_bytes)
+        {
+            break;
+        }
+        /* bmd_peer_process_msg sees just this pdu */
+        end = in_s->end;
+        in_s->p = start;
+        in_s->end = start + pdu_bytes;
+        rv = bmd_peer_process_msg(bmd, peer);
+        in_s->end = end;
+        if (rv != BMD_ERROR_NONE)
+        {
+            LOGLN0((LOG_ERROR, LOGS "bmd_peer_process_msg failed", LOGP));
+            return rv;
+        }
+        start += pdu_bytes;
+        pdu_bytes = 0;
+    }
+    bytes = (int)(in_s->end - start);
+    if ((bytes > 0) && (start != in_s->data))
+    {
+        memmove(in_s->data, start, bytes);
+    }
+    in_s->p = in_s->data;
+    in_s->end = in_s->data + bytes;
+    if (pdu_bytes > in_s->size)
+    {
+        return bmd_peer_grow_in_s(in_s, pdu_bytes);
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* SOCK_STREAM, read what the socket has and parse it
+   returns BMD_ERROR_NOTREADY when there is nothing to read */
+static int
+bmd_peer_recv_stream(struct bmd_info* bmd, struct peer_info* peer)
+{
+    struct stream* in_s;
+    int reed;
+
+    if ((peer->in_s == NULL) &&
+        (bmd_peer_create_in_s(peer, BMD_PEER_IN_BYTES) != BMD_ERROR_NONE))
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    in_s = peer->in_s;
+    /* in_s->data to in_s->end is what is not yet parsed */
+    reed = recv(peer->sck, in_s->end,
+                in_s->size - (int)(in_s->end - in_s->data), 0);
+    if (reed < 0)
+    {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+        {
+            return BMD_ERROR_NOTREADY;
+        }
+        return BMD_ERROR_FD;
+    }
+    if (reed == 0)
+    {
+        return BMD_ERROR_FD;
+    }
+    return bmd_peer_parse_stream(bmd, peer, reed);
+}
+
+/*****************************************************************************/
+/* io_uring, the outs an ended send read are the queue's again */
+static void
+bmd_peer_ring_clear(struct peer_info* peer)
+{
+    struct peer_out* out;
+
+    for (out = peer->out_head; out != NULL; out = out->next)
+    {
+        out->inflight = 0;
+    }
+}
+
+/*****************************************************************************/
+/* io_uring, SOCK_SEQPACKET, a sendmsg for each pdu up to a full batch,
+   linked so they go in order and the rest stop at the first failure */
+static int
+bmd_peer_ring_send_packets(struct bmd_info* bmd, struct peer_info* peer)
+{
+    struct peer_ring* ring;
+    struct msghdr* msg;
+    struct cmsghdr* cmsg;
+    struct peer_out* out;
+    struct bmd_payload* payload;
+    int count;
+    int index;
+
+    ring = peer->ring;
+    while ((peer->out_head != NULL) &&
+           (peer->out_head->payload->bytes > BMD_SEQPACKET_MAX_BYTES))
+    {
+        LOGLN0((LOG_ERROR, LOGS "sck %d dropping pdu_code %d of %d "
+                "bytes, too big for a message", LOGP, peer->sck,
+                peer->out_head->pdu_code, peer->out_head->payload->bytes));
+        bmd_peer_drop_out(peer, peer->out_head, NULL);
+    }
+    count = 0;
+    out = peer->out_head;
+    while ((out != NULL) && (count < BMD_PEER_MAX_IOV))
+    {
+        payload = out->payload;
+        if (payload->bytes > BMD_SEQPACKET_MAX_BYTES)
+        {
+            /* goes when it gets to the head */
+            break;
+        }
+        if (out->pdu_code == BMD_PDU_CODE_TRACE)
+        {
+            bmd_peer_stamp_send(payload);
+        }
+        msg = ring->msgs + count;
+        memset(msg, 0, sizeof(struct msghdr));
+        ring->iov[count].iov_base = payload->data;
+        ring->iov[count].iov_len = payload->bytes;
+        msg->msg_iov = ring->iov + count;
+        msg->msg_iovlen = 1;
+        if (payload->fd != -1)
+        {
+            memset(ring->control[count], 0, sizeof(ring->control[count]));
+            msg->msg_control = ring->control[count];
+            msg->msg_controllen = sizeof(ring->control[count]);
+            cmsg = CMSG_FIRSTHDR(msg);
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            memcpy(CMSG_DATA(cmsg), &(payload->fd), sizeof(int));
+        }
+        out->inflight = 1;
+        count++;
+        out = out->next;
+    }
+    if (bmd_uring_reserve(bmd->io_uring, count) != BMD_ERROR_NONE)
+    {
+        /* sq is full, try after the next completions */
+        bmd_peer_ring_clear(peer);
+        return BMD_ERROR_NONE;
+    }
+    for (index = 0; index < count; index++)
+    {
+        bmd_uring_sendmsg(bmd->io_uring, peer->ring_slot, ring->msgs + index,
+                          0, index + 1 < count,
+                          (size_t)peer | BMD_PEER_OP_SEND);
+        peer->ring_sends++;
+        peer->ring_ops++;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* io_uring, what bmd_peer_send_out would send, in one sendmsg request
+   that stays in flight until the kernel took it */
+static int
+bmd_peer_ring_send(struct bmd_info* bmd, struct peer_info* peer)
+{
+    struct peer_ring* ring;
+    struct msghdr* msg;
+    struct cmsghdr* cmsg;
+    struct peer_out* out;
+    struct bmd_payload* payload;
+    int count;
+    int bytes;
+
+    if (peer->ring == NULL)
+    {
+        peer->ring = xnew0(struct peer_ring, 1);
+        if (peer->ring == NULL)
+        {
+            return BMD_ERROR_MEMORY;
+        }
+    }
+    if (peer->seqpacket)
+    {
+        return bmd_peer_ring_send_packets(bmd, peer);
+    }
+    ring = peer->ring;
+    msg = ring->msgs;
+    memset(msg, 0, sizeof(struct msghdr));
+    out = peer->out_head;
+    payload = out->payload;
+    if ((payload->fd != -1) && !(out->fd_sent))
+    {
+        memset(ring->control[0], 0, sizeof(ring->control[0]));
+        msg->msg_control = ring->control[0];
+        msg->msg_controllen = sizeof(ring->control[0]);
+        cmsg = CMSG_FIRSTHDR(msg);
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsg), &(payload->fd), sizeof(int));
+    }
+    count = 0;
+    bytes = 0;
+    while ((out != NULL) && (count < BMD_PEER_MAX_IOV))
+    {
+        payload = out->payload;
+        if ((count > 0) && (payload->fd != -1))
+        {
+            break;
+        }
+        if ((out->pdu_code == BMD_PDU_CODE_TRACE) && (out->offset == 0))
+        {
+            bmd_peer_stamp_send(payload);
+        }
+        ring->iov[count].iov_base = payload->data + out->offset;
+        ring->iov[count].iov_len = payload->bytes - out->offset;
+        bytes += payload->bytes - out->offset;
+        out->inflight = 1;
+        count++;
+        out = out->next;
+    }
+    msg->msg_iov = ring->iov;
+    msg->msg_iovlen = count;
+    ring->bytes = bytes;
+    ring->zerocopy = peer->zerocopy && (bytes >= BMD_PEER_ZEROCOPY_BYTES);
+    if (bmd_uring_sendmsg(bmd->io_uring, peer->ring_slot, msg,
+                          ring->zerocopy, 0,
+                          (size_t)peer | BMD_PEER_OP_SEND) != BMD_ERROR_NONE)
+    {
+        bmd_peer_ring_clear(peer);
+        return BMD_ERROR_NONE;
+    }
+    peer->ring_sends = 1;
+    peer->ring_ops++;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* io_uring, a SENDMSG_ZC is done reading, zerocopy sends on a socket
+   finish in order so it is the oldest one held */
+static int
+bmd_peer_ring_zc_notif(struct peer_info* peer, int copied)
+{
+    struct peer_zc* zc;
+    unsigned int id;
+
+    if (copied && peer->zerocopy)
+    {
+        LOGLN0((LOG_INFO, LOGS "sck %d kernel copied, zerocopy off",
+                LOGP, peer->sck));
+        peer->zerocopy = 0;
+    }
+    if (peer->zc_head == NULL)
+    {
+        return BMD_ERROR_NONE;
+    }
+    id = peer->zc_head->id;
+    while ((peer->zc_head != NULL) && (peer->zc_head->id == id))
+    {
+        zc = peer->zc_head;
+        peer->zc_head = zc->next;
+        bmd_payload_release(zc->payload);
+        bmd_pool_free(zc, sizeof(struct peer_zc));
+    }
+    if (peer->zc_head == NULL)
+    {
+        peer->zc_tail = NULL;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* io_uring, a sendmsg completed, the same book keeping bmd_peer_send_out
+   and bmd_peer_send_packets do after the syscall */
+static int
+bmd_peer_ring_sent(struct peer_info* peer, struct bmd_uring_cqe* cqe)
+{
+    struct peer_ring* ring;
+    int sent;
+
+    ring = peer->ring;
+    sent = cqe->res;
+    peer->ring_sends--;
+    if (peer->seqpacket)
+    {
+        if (sent >= 0)
+        {
+            get_mstime(&(peer->progress_mstime));
+            bmd_peer_unlink_out(peer, peer->out_head, NULL);
+        }
+        else if (sent == -EMSGSIZE)
+        {
+            /* socket buffer is smaller than we asked for */
+            LOGLN0((LOG_ERROR, LOGS "sck %d dropping pdu_code %d of %d "
+                    "bytes, too big for the socket", LOGP, peer->sck,
+                    peer->out_head->pdu_code,
+                    peer->out_head->payload->bytes));
+            bmd_peer_drop_out(peer, peer->out_head, NULL);
+        }
+        else if ((sent != -ECANCELED) && (sent != -EINTR) &&
+                 (sent != -EAGAIN))
+        {
+            LOGLN0((LOG_ERROR, LOGS "sendmsg failed sck %d errno %d",
+                    LOGP, peer->sck, -sent));
+            peer->ring_error = 1;
+        }
+        if (peer->ring_sends == 0)
+        {
+            bmd_peer_ring_clear(peer);
+        }
+        return BMD_ERROR_NONE;
+    }
+    bmd_peer_ring_clear(peer);
+    if (sent < 0)
+    {
+        if ((sent != -ECANCELED) && (sent != -EINTR) && (sent != -EAGAIN))
+        {
+            LOGLN0((LOG_ERROR, LOGS "sendmsg failed sck %d errno %d",
+                    LOGP, peer->sck, -sent));
+            peer->ring_error = 1;
+        }
+        return BMD_ERROR_NONE;
+    }
+    LOGLN10((LOG_DEBUG, LOGS "sendmsg ok, bytes %d sent %d",
+             LOGP, ring->bytes, sent));
+    if ((sent > 0) && ring->zerocopy && cqe->more &&
+        (bmd_peer_zc_hold(peer, sent) != BMD_ERROR_NONE))
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    if (sent > 0)
+    {
+        get_mstime(&(peer->progress_mstime));
+        if (ring->msgs[0].msg_control != NULL)
+        {
+            /* the fd went with the first byte */
+            peer->out_head->fd_sent = 1;
+        }
+    }
+    return bmd_peer_out_sent(peer, sent);
+}
+
+/*****************************************************************************/
+/* io_uring, data from a multishot recv, copied into in_s and parsed the
+   way bmd_peer_recv_stream and bmd_peer_recv_packet do */
+static int
+bmd_peer_ring_recv(struct bmd_info* bmd, struct peer_info* peer,
+                   char* data, int bytes)
+{
+    struct stream* in_s;
+    int room;
+    int error;
+
+    if ((peer->in_s == NULL) &&
+        (bmd_peer_create_in_s(peer, peer->seqpacket ?
+                              BMD_PEER_SEQPACKET_IN_BYTES :
+                              BMD_PEER_IN_BYTES) != BMD_ERROR_NONE))
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    in_s = peer->in_s;
+    if (peer->seqpacket)
+    {
+        /* a message longer than the buffer was cut, the length check
+           catches it */
+        memcpy(in_s->data, data, bytes);
+        return bmd_peer_parse_packet(bmd, peer, bytes);
+    }
+    while (bytes > 0)
+    {
+        room = in_s->size - (int)(in_s->end - in_s->data);
+        if (room > bytes)
+        {
+            room = bytes;
+        }
+        memcpy(in_s->end, data, room);
+        error = bmd_peer_parse_stream(bmd, peer, room);
+        if (error != BMD_ERROR_NONE)
+        {
+            return error;
+        }
+        /* parse made room or grew in_s for the pdu */
+        in_s = peer->in_s;
+        data += room;
+        bytes -= room;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* io_uring, a completion for a removed peer, it is freed with the last */
+static int
+bmd_peer_ring_zombie(struct bmd_info* bmd, struct peer_info* peer,
+                     struct bmd_uring_cqe* cqe)
+{
+    struct peer_info* lpeer;
+
+    if (cqe->buf_id != -1)
+    {
+        bmd_uring_put_buf(bmd->io_uring, cqe->buf_id);
+    }
+    if (cqe->more)
+    {
+        return BMD_ERROR_NONE;
+    }
+    peer->ring_ops--;
+    if (peer->ring_ops > 0)
+    {
+        return BMD_ERROR_NONE;
+    }
+    if (bmd->peer_zombies == peer)
+    {
+        bmd->peer_zombies = peer->next;
+    }
+    else
+    {
+        lpeer = bmd->peer_zombies;
+        while ((lpeer != NULL) && (lpeer->next != peer))
+        {
+            lpeer = lpeer->next;
+        }
+        if (lpeer != NULL)
+        {
+            lpeer->next = peer->next;
+        }
+    }
+    return bmd_peer_delete_one(peer);
+}
+
+/*****************************************************************************/
+/* io_uring, a peer's completion */
+static int
+bmd_peer_ring_complete(struct bmd_info* bmd, struct peer_info* peer,
+                       int op, struct bmd_uring_cqe* cqe)
+{
+    char* data;
+    int error;
+
+    if (peer->ring_retired)
+    {
+        return bmd_peer_ring_zombie(bmd, peer, cqe);
+    }
+    if (!(cqe->more))
+    {
+        peer->ring_ops--;
+    }
+    error = BMD_ERROR_NONE;
+    if (op == BMD_PEER_OP_SEND)
+    {
+        if (cqe->notif)
+        {
+            return bmd_peer_ring_zc_notif(peer, cqe->copied);
+        }
+        return bmd_peer_ring_sent(peer, cqe);
+    }
+    if (op != BMD_PEER_OP_RECV)
+    {
+        return BMD_ERROR_NONE;
+    }
+    if (!(cqe->more))
+    {
+        /* out of buffers or done, bmd_peer_ring_flush arms it again */
+        peer->ring_recv = 0;
+    }
+    if (cqe->buf_id != -1)
+    {
+        if ((cqe->res > 0) && !(peer->ring_error) &&
+            (bmd_uring_get_buf(bmd->io_uring, cqe->buf_id,
+                               &data) == BMD_ERROR_NONE))
+        {
+            error = bmd_peer_ring_recv(bmd, peer, data, cqe->res);
+            if ((error != BMD_ERROR_NONE) && (error != BMD_ERROR_MEMORY))
+            {
+                LOGLN0((LOG_ERROR, LOGS "recv failed sck %d error %d",
+                        LOGP, peer->sck, error));
+                peer->ring_error = 1;
+                error = BMD_ERROR_NONE;
+            }
+        }
+        bmd_uring_put_buf(bmd->io_uring, cqe->buf_id);
+    }
+    if ((cqe->res == 0) || ((cqe->res < 0) && (cqe->res != -ENOBUFS)))
+    {
+        LOGLN0((LOG_ERROR, LOGS "recv failed sck %d res %d",
+                LOGP, peer->sck, cqe->res));
+        peer->ring_error = 1;
+    }
+    return error;
+}
+
+/*****************************************************************************/
+/* io_uring, every completion there is, no syscall */
+static int
+bmd_peer_ring_check(struct bmd_info* bmd)
+{
+    struct bmd_uring_cqe cqe;
+    struct peer_info* peer;
+    unsigned long long user_data;
+    int listener;
+    int remote;
+    int op;
+    int error;
+
+    while (bmd_uring_get_cqe(bmd->io_uring, &cqe) == BMD_ERROR_NONE)
+    {
+        user_data = cqe.user_data;
+        op = (int)(user_data & BMD_PEER_OP_MASK);
+        if (op == BMD_PEER_OP_ACCEPT)
+        {
+            listener = (int)(user_data >> 8);
+            remote = (user_data & BMD_PEER_OP_REMOTE) != 0;
+            LOGLN0((LOG_INFO, LOGS "got connection sck %d remote %d", LOGP,
+                    cqe.res, remote));
+            if ((cqe.res >= 0) &&
+                (bmd_peer_add_fd(bmd, cqe.res, remote) != BMD_ERROR_NONE))
+            {
+                LOGLN0((LOG_ERROR, LOGS "bmd_peer_add_fd failed", LOGP));
+                close(cqe.res);
+            }
+            if (!(cqe.more) && (cqe.res != -EINVAL) &&
+                (cqe.res != -EBADF) && (cqe.res != -ECANCELED))
+            {
+                bmd_uring_accept(bmd->io_uring, listener, user_data);
+            }
+            continue;
+        }
+        peer = (struct peer_info*)(size_t)(user_data & ~BMD_PEER_OP_MASK);
+        error = bmd_peer_ring_complete(bmd, peer, op, &cqe);
+        if (error != BMD_ERROR_NONE)
+        {
+            return error;
+        }
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* io_uring, from bmd_peer_get_fds, every peer's pending output and any
+   recv that has to be armed again go to the kernel in one syscall, how
+   many peers there are does not matter */
+static int
+bmd_peer_ring_flush(struct bmd_info* bmd)
+{
+    struct peer_info* peer;
+    int error;
+
+    for (peer = bmd->peer_head; peer != NULL; peer = peer->next)
+    {
+        if (peer->ring_error)
+        {
+            continue;
+        }
+        if (!(peer->ring_recv) &&
+            (bmd_uring_recv(bmd->io_uring, peer->ring_slot,
+                            (size_t)peer | BMD_PEER_OP_RECV) ==
+             BMD_ERROR_NONE))
+        {
+            peer->ring_recv = 1;
+            peer->ring_ops++;
+        }
+        if ((peer->out_head != NULL) && (peer->ring_sends == 0))
+        {
+            error = bmd_peer_ring_send(bmd, peer);
+            if (error != BMD_ERROR_NONE)
+            {
+                return error;
+            }
+        }
+    }
+    return bmd_uring_submit(bmd->io_uring);
+}
+
+/*****************************************************************************/
+/* peer io through io_uring from here on, before any peer is added */
+int
+bmd_peer_start_io_uring(struct bmd_info* bmd)
+{
+    return bmd_uring_create(&(bmd->io_uring));
+}
+
+/*****************************************************************************/
+/* io_uring accepts on listener and adds the peers in bmd_peer_check_fds */
+int
+bmd_peer_add_listener(struct bmd_info* bmd, int listener, int remote)
+{
+    unsigned long long user_data;
+
+    if (bmd->io_uring == NULL)
+    {
+        return BMD_ERROR_NOT_SUPPORTED;
+    }
+    user_data = ((unsigned long long)listener << 8) | BMD_PEER_OP_ACCEPT;
+    if (remote)
+    {
+        user_data |= BMD_PEER_OP_REMOTE;
+    }
+    return bmd_uring_accept(bmd->io_uring, listener, user_data);
+}
+
+/*****************************************************************************/
+int
+bmd_peer_get_fds(struct bmd_info* bmd, int* max_fd,
+                 fd_set* rfds, fd_set* wfds)
+{
+    struct peer_info* peer;
+    int lmax_fd;
+    int fd;
+
+    lmax_fd = *max_fd;
+    if (bmd->timeshift_replies != NULL)
+    {
+        bmd_timeshift_replies_get_fd(bmd->timeshift_replies, &fd);
+        FD_SET(fd, rfds);
+        if (fd > lmax_fd)
+        {
+            lmax_fd = fd;
+        }
+    }
+    if (bmd->io_uring != NULL)
+    {
+        /* only the ring, it is readable when there are completions */
+        bmd_uring_get_fd(bmd->io_uring, &fd);
+        FD_SET(fd, rfds);
+        if (fd > lmax_fd)
+        {
+            lmax_fd = fd;
+        }
+        *max_fd = lmax_fd;
+        return bmd_peer_ring_flush(bmd);
+    }
+    peer = bmd->peer_head;
+    while (peer != NULL)
+    {
+        if (peer->sck > lmax_fd)
+        {
+            lmax_fd = peer->sck;
+        }
+        FD_SET(peer->sck, rfds);
+        if (peer->out_head != NULL)
+        {
+            FD_SET(peer->sck, wfds);
+        }
+        peer = peer->next;
+    }
+    *max_fd = lmax_fd;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* the timeshift answers for this thread's peers, a peer that left since it
+   asked gets none */
+static int
+bmd_peer_check_timeshift(struct bmd_info* bmd, fd_set* rfds)
+{
+    struct bmd_timeshift_result result;
+    struct peer_info* peer;
+    int got;
+    int fd;
+    int rv;
+
+    if (bmd->timeshift_replies == NULL)
+    {
+        return BMD_ERROR_NONE;
+    }
+    bmd_timeshift_replies_get_fd(bmd->timeshift_replies, &fd);
+    if (!FD_ISSET(fd, rfds))
+    {
+        return BMD_ERROR_NONE;
+    }
+    for (;;)
+    {
+        bmd_timeshift_replies_get(bmd->timeshift_replies, &result, &got);
+        if (!got)
+        {
+            break;
+        }
+        peer = bmd->peer_head;
+        while ((peer != NULL) && (peer->id != result.peer_id))
+        {
+            peer = peer->next;
+        }
+        if (peer == NULL)
+        {
+            if (result.fd != -1)
+            {
+                close(result.fd);
+            }
+            continue;
+        }
+        rv = bmd_peer_queue_timeshift(bmd, peer, &result);
+        if (rv == BMD_ERROR_MEMORY)
+        {
+            return rv;
+        }
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_peer_check_fds(struct bmd_info* bmd, fd_set* rfds, fd_set* wfds)
+{
+    struct peer_info* peer;
+    struct peer_info* last_peer;
+    int rv;
+    int error;
+    int now;
+
+    rv = BMD_ERROR_NONE;
+    if (bmd->io_uring != NULL)
+    {
+        rv = bmd_peer_ring_check(bmd);
+        if (rv != BMD_ERROR_NONE)
+        {
+            return rv;
+        }
+    }
+    rv = bmd_peer_check_timeshift(bmd, rfds);
+    if (rv != BMD_ERROR_NONE)
+    {
+        return rv;
+    }
+    get_mstime(&now);
+    last_peer = NULL;
+    peer = bmd->peer_head;
+    while (peer != NULL)
+    {
+        if (peer->ring_error)
+        {
+            error = bmd_peer_remove_one(bmd, &peer, last_peer);
+            if (error != BMD_ERROR_NONE)
+            {
+                return error;
+            }
+            rv = BMD_ERROR_PEER_REMOVED;
+            continue;
+        }
+        if ((peer->out_head != NULL) && (bmd->peer_limits.stall_ms > 0) &&
+            (now - peer->progress_mstime > bmd->peer_limits.stall_ms))
+        {
+            LOGLN0((LOG_ERROR, LOGS "sck %d stalled for %d ms with %d bytes "
+                    "queued, evicting", LOGP, peer->sck,
+                    now - peer->progress_mstime, peer->out_bytes));
+            error = bmd_peer_remove_one(bmd, &peer, last_peer);
+            if (error != BMD_ERROR_NONE)
+            {
+                return error;
+            }
+            rv = BMD_ERROR_PEER_REMOVED;
+            continue;
+        }
+        bmd_peer_expire(bmd, peer, now);
+        if (FD_ISSET(peer->sck, rfds))
+        {
+            if (peer->zc_head != NULL)
+            {
+                /* the error queue makes the socket readable too */
+                bmd_peer_zc_complete(peer);
+            }
+            if (peer->seqpacket)
+            {
+                error = bmd_peer_recv_packet(bmd, peer);
+            }
+            else
+            {
+                error = bmd_peer_recv_stream(bmd, peer);
+            }
+            if (error == BMD_ERROR_MEMORY)
+            {
+                return error;
+            }
+            if ((error != BMD_ERROR_NONE) && (error != BMD_ERROR_NOTREADY))
+            {
+                LOGLN0((LOG_ERROR, LOGS "recv failed sck %d error %d",
+                        LOGP, peer->sck, error));
+                error = bmd_peer_remove_one(bmd, &peer, last_peer);
+                if (error != BMD_ERROR_NONE)
+                {
+                    return error;
+                }
+                rv = BMD_ERROR_PEER_REMOVED;
+                continue;
+            }
+        }
+        if (FD_ISSET(peer->sck, wfds))
+        {
+            if (bmd_peer_send_out(peer) != BMD_ERROR_NONE)
+            {
+                /* error */
+                LOGLN0((LOG_ERROR, LOGS "bmd_peer_send_out failed", LOGP));
+                error = bmd_peer_remove_one(bmd, &peer, last_peer);
+                if (error != BMD_ERROR_NONE)
+                {
+                    return error;
+                }
+                rv = BMD_ERROR_PEER_REMOVED;
+                continue;
+            }
+        }
+        last_peer = peer;
+        peer = peer->next;
+    }
+    bmd_peer_update_demand(bmd);
+    return rv;
+}
+
+/*****************************************************************************/
+static int
+bmd_queue_version(struct bmd_info* bmd, struct peer_info* peer)
+{
+    struct bmd_payload* payload;
+    struct stream out_s;
+    int rv;
+
+    rv = bmd_payload_create(32, &payload);
+    if (rv != BMD_ERROR_NONE)
+    {
+        return rv;
+    }
+    bmd_payload_set_stream(payload, &out_s);
+    out_uint32_le(&out_s, BMD_PDU_CODE_VERSION);
+    out_uint32_le(&out_s, 32);
+    out_uint32_le(&out_s, BMD_VERSION_MAJOR);
+    out_uint32_le(&out_s, BMD_VERSION_MINOR);
+    /* ms, rounded up */
+    out_uint32_le(&out_s, bmd->audio_latency_us > 0 ?
+                  (bmd->audio_latency_us + 999) / 1000 : BMD_AUDIO_LATENCY);
+    out_uint32_le(&out_s, bmd->num_renditions);
+    out_uint8s(&out_s, 8);
+    payload->bytes = (int)(out_s.p - out_s.data);
+    rv = bmd_peer_queue(bmd, peer, payload);
+    bmd_payload_release(payload);
+    return rv;
+}
+
+/*****************************************************************************/
+int
+bmd_peer_add_fd(struct bmd_info* bmd, int sck, int remote)
+{
+    struct peer_info* peer;
+    int flags;
+
+    if (bmd->shards != NULL)
+    {
+        return bmd_shard_add_fd(bmd->shards, sck, remote);
+    }
+    peer = xnew0(struct peer_info, 1);
+    if (peer == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    peer->sck = sck;
+    peer->id = __atomic_add_fetch(&g_peer_id, 1, __ATOMIC_RELAXED);
+    peer->remote = remote;
+    peer->seqpacket = remote ? 0 : bmd->seqpacket;
+    if (peer->remote)
+    {
+        flags = BMD_PEER_TCP_SNDBUF;
+        setsockopt(sck, SOL_SOCKET, SO_SNDBUF, &flags, sizeof(flags));
+        flags = 1;
+        setsockopt(sck, IPPROTO_TCP, TCP_NODELAY, &flags, sizeof(flags));
+        /* io_uring has its own zerocopy sendmsg */
+        peer->zerocopy = (bmd->io_uring != NULL) ||
+                         (setsockopt(sck, SOL_SOCKET, SO_ZEROCOPY, &flags,
+                                     sizeof(flags)) == 0);
+        LOGLN0((LOG_INFO, LOGS "remote peer sck %d zerocopy %d", LOGP, sck,
+                peer->zerocopy));
+    }
+    if (peer->seqpacket)
+    {
+        /* a message has to fit the send buffer whole */
+        flags = BMD_SEQPACKET_MAX_BYTES;
+        if (setsockopt(sck, SOL_SOCKET, SO_SNDBUF, &flags,
+                       sizeof(flags)) != 0)
+        {
+            LOGLN0((LOG_ERROR, LOGS "SO_SNDBUF failed sck %d", LOGP, sck));
+        }
+    }
+    if (bmd->io_uring != NULL)
+    {
+        /* io_uring waits on the socket itself, the recv is armed in
+           bmd_peer_ring_flush */
+        bmd_uring_add_file(bmd->io_uring, sck, &(peer->ring_slot));
+    }
+    else
+    {
+        flags = fcntl(sck, F_GETFL);
+        if ((flags == -1) ||
+            (fcntl(sck, F_SETFL, flags | O_NONBLOCK) == -1))
+        {
+            LOGLN0((LOG_ERROR, LOGS "fcntl O_NONBLOCK failed sck %d",
+                    LOGP, sck));
+            free(peer);
+            return BMD_ERROR_FD;
+        }
+    }
+    if (bmd->peer_head == NULL)
+    {
+        bmd->peer_head = peer;
+        bmd->peer_tail = peer;
+    }
+    else
+    {
+        bmd->peer_tail->next = peer;
+        bmd->peer_tail = peer;
+    }
+    bmd_queue_version(bmd, peer);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_peer_cleanup(struct bmd_info* bmd)
+{
+    struct peer_info* peer;
+    struct peer_info* lpeer;
+    struct peer_audio_group* group;
+
+    /* the kernel cancels what is in flight */
+    bmd_uring_delete(bmd->io_uring);
+    bmd->io_uring = NULL;
+    peer = bmd->peer_head;
+    while (peer != NULL)
+    {
+        lpeer = peer;
+        peer = peer->next;
+        bmd_peer_delete_one(lpeer);
+    }
+    bmd->peer_head = NULL;
+    bmd->peer_tail = NULL;
+    peer = bmd->peer_zombies;
+    while (peer != NULL)
+    {
+        lpeer = peer;
+        peer = peer->next;
+        bmd_peer_delete_one(lpeer);
+    }
+    bmd->peer_zombies = NULL;
+    bmd_timeshift_replies_delete(bmd->timeshift_replies);
+    bmd->timeshift_replies = NULL;
+    while (bmd->audio_groups != NULL)
+    {
+        group = bmd->audio_groups;
+        bmd->audio_groups = group->next;
+        bmd_peer_audio_group_delete(group);
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_peer_queue_all_video(struct bmd_info* bmd)
+{
+    int rv;
+    struct peer_info* peer;
+
+    if (bmd->shards != NULL)
+    {
+        bmd_shard_post_video(bmd->shards, bmd);
+    }
+    peer = bmd->peer_head;
+    while (peer != NULL)
+    {
+        if (bmd_peer_frame_payload(bmd, peer) == NULL)
+        {
+            /* remote peer that wanted video after this frame was
+               converted, it gets the next one */
+            peer = peer->next;
+            continue;
+        }
+        if (peer->got_request_video)
+        {
+            rv = bmd_peer_queue_frame(bmd, peer);
+            if (rv != BMD_ERROR_NONE)
+            {
+                return rv;
+            }
+            peer->got_request_video = 0;
+        }
+        if ((peer->video_frame_count != bmd->video_frame_count) &&
+            bmd_peer_video_due(peer, bmd->fd_seq, bmd->fd_time))
+        {
+            rv = bmd_peer_queue_frame(bmd, peer);
+            if (rv != BMD_ERROR_NONE)
+            {
+                return rv;
+            }
+            bmd_peer_video_advance(peer, bmd->fd_seq, bmd->fd_time);
+        }
+        peer = peer->next;
+    }
+    return bmd_peer_update_demand(bmd);
+}
+
+/*****************************************************************************/
+static int
+bmd_peer_queue_audio(struct bmd_info* bmd, struct peer_info* peer,
+                     struct bmd_payload* payload)
+{
+    int rv;
+
+    rv = bmd_peer_queue(bmd, peer, payload);
+    if ((rv == BMD_ERROR_NONE) && peer->got_subscribe_trace)
+    {
+        rv = bmd_peer_queue_trace(bmd, peer, payload, BMD_PDU_CODE_AUDIO,
+                                  &(bmd->audio_trace));
+    }
+    return rv;
+}
+
+/*****************************************************************************/
+static int
+bmd_peer_audio_parse(struct bmd_info* bmd, struct bmd_payload* capture,
+                     struct peer_audio_in* in)
+{
+    struct stream in_s;
+    int bytes;
+
+    bmd_payload_set_stream(capture, &in_s);
+    in_s.end = in_s.data + capture->bytes;
+    if (!s_check_rem(&in_s, 24))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    in_uint8s(&in_s, 8);
+    in_uint32_le(&in_s, in->atime);
+    in_uint8s(&in_s, 4);
+    in_uint32_le(&in_s, in->channels);
+    in_uint32_le(&in_s, bytes);
+    if ((in->channels < 1) || (bytes < 0) || !s_check_rem(&in_s, bytes))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    in->samples = bytes / (in->channels * BMD_AUDIO_BYTES_PER_SAMPLE);
+    in->data = (const short*)(in_s.p);
+    /* the callback comes when the last sample is in */
+    in->capture_us = bmd->audio_trace.callback_us -
+                     in->samples * 1000000LL / BMD_AUDIO_SAMPLE_RATE;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* an AUDIO pdu in the group's format */
+static int
+bmd_peer_audio_build(struct peer_audio_group* group, const short* data,
+                     int channels, int samples, int atime, int latency_us,
+                     struct bmd_payload** payload)
+{
+    struct stream out_s;
+    int bytes;
+    int out_samples;
+    int rate;
+    int och;
+    int rv;
+
+    out_samples = samples;
+    rate = BMD_AUDIO_SAMPLE_RATE;
+    if (group->format.rate != 0)
+    {
+        och = group->format.out_channels == 0 ?
+              channels : group->format.out_channels;
+        if ((group->resample == NULL) || (group->resample_channels != och))
+        {
+            bmd_resample_delete(group->resample);
+            group->resample = NULL;
+            rv = bmd_resample_create(BMD_AUDIO_SAMPLE_RATE,
+                                     group->format.rate, och,
+                                     &(group->resample));
+            if (rv != BMD_ERROR_NONE)
+            {
+                group->resample = NULL;
+                return rv;
+            }
+            group->resample_channels = och;
+            bmd_resample_get_delay_us(group->resample, &(group->delay_us));
+        }
+        bmd_resample_get_out_samples(group->resample, samples,
+                                     &out_samples);
+        rate = group->format.rate;
+    }
+    rv = bmd_audio_format_get_bytes(&(group->format), channels, out_samples,
+                                    &och, &bytes);
+    if (rv != BMD_ERROR_NONE)
+    {
+        return rv;
+    }
+    rv = bmd_payload_create(36 + bytes, payload);
+    if (rv != BMD_ERROR_NONE)
+    {
+        return rv;
+    }
+    bmd_payload_set_stream(*payload, &out_s);
+    out_uint32_le(&out_s, BMD_PDU_CODE_AUDIO);
+    out_uint32_le(&out_s, 36 + bytes);
+    out_uint32_le(&out_s, atime);
+    out_uint8(&out_s, group->format.sample_type);
+    out_uint8(&out_s, group->format.layout);
+    out_uint8s(&out_s, 2);
+    out_uint32_le(&out_s, och);
+    out_uint32_le(&out_s, bytes);
+    rv = bmd_audio_format_convert(&(group->format), group->resample, data,
+                                  channels, samples, out_samples, out_s.p);
+    if (rv != BMD_ERROR_NONE)
+    {
+        bmd_payload_release(*payload);
+        return rv;
+    }
+    out_s.p += bytes;
+    out_uint32_le(&out_s, rate);
+    out_uint32_le(&out_s, group->resample == NULL ? 0 : group->delay_us);
+    out_uint32_le(&out_s, latency_us);
+    (*payload)->bytes = (int)(out_s.p - out_s.data);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_peer_audio_group_add(struct peer_audio_group* group,
+                         struct bmd_payload* payload)
+{
+    struct bmd_payload** payloads;
+    int alloc;
+
+    if (group->num_payloads >= group->payloads_alloc)
+    {
+        alloc = group->payloads_alloc + 4;
+        payloads = (struct bmd_payload**)
+                   realloc(group->payloads, alloc * sizeof(payload));
+        if (payloads == NULL)
+        {
+            bmd_payload_release(payload);
+            return BMD_ERROR_MEMORY;
+        }
+        group->payloads = payloads;
+        group->payloads_alloc = alloc;
+    }
+    group->payloads[group->num_payloads++] = payload;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* capture samples onto pending, a gap or a channel change in capture
+   starts over */
+static int
+bmd_peer_audio_group_append(struct peer_audio_group* group,
+                            const struct peer_audio_in* in)
+{
+    short* pending;
+    int expected;
+    int alloc;
+
+    if (group->pending_samples > 0)
+    {
+        expected = group->pending_atime +
+                   (int)((group->pending_offset + group->pending_samples) *
+                         1000LL / BMD_AUDIO_SAMPLE_RATE);
+        if ((group->pending_channels != in->channels) ||
+            (abs(in->atime - expected) > BMD_PEER_AUDIO_RESYNC_MS))
+        {
+            group->pending_samples = 0;
+        }
+    }
+    if (group->pending_samples == 0)
+    {
+        group->pending_channels = in->channels;
+        group->pending_offset = 0;
+        group->pending_atime = in->atime;
+        group->pending_capture_us = in->capture_us;
+    }
+    alloc = (group->pending_samples + in->samples) * in->channels;
+    if (alloc > group->pending_alloc)
+    {
+        pending = (short*)realloc(group->pending, alloc * sizeof(short));
+        if (pending == NULL)
+        {
+            return BMD_ERROR_MEMORY;
+        }
+        group->pending = pending;
+        group->pending_alloc = alloc;
     }
-    in_uint32_le(in_s, version_major);
-    in_uint32_le(in_s, version_minor);
-    LOGLN0((LOG_INFO, LOGS "connection client version %d %d",
-            LOGP, version_major, version_minor));
+    memcpy(group->pending + group->pending_samples * in->channels,
+           in->data, in->samples * in->channels * sizeof(short));
+    group->pending_samples += in->samples;
     return BMD_ERROR_NONE;
 }
 
 /*****************************************************************************/
+/* the group's AUDIO pdus for a capture packet */
 static int
-bmd_peer_process_msg(struct bmd_info* bmd, struct peer_info* peer)
+bmd_peer_audio_group_convert(struct peer_audio_group* group,
+                             const struct peer_audio_in* in)
 {
-    int pdu_code;
-    int pdu_bytes;
+    struct bmd_payload* payload;
+    long long now_us;
+    long long offset_us;
+    int period;
+    int done;
     int rv;
-    struct stream* in_s;
-
-    (void)bmd;
 
-    rv = BMD_ERROR_NONE;
-    in_s = peer->in_s;
-    in_uint32_le(in_s, pdu_code);
-    in_uint32_le(in_s, pdu_bytes);
-    LOGLN10((LOG_INFO, LOGS "sck %d pdu_code %d pdu_bytes %d",
-             LOGP, peer->sck, pdu_code, pdu_bytes));
-    if ((pdu_bytes < 8) || !s_check_rem(in_s, pdu_bytes - 8))
+    get_ustime(&now_us);
+    period = group->format.period;
+    if (period == 0)
     {
-        LOGLN0((LOG_INFO, LOGS "bad pdu_bytes, sck %d pdu_code %d "
-                "pdu_bytes %d", LOGP, peer->sck, pdu_code, pdu_bytes));
-        return BMD_ERROR_RANGE;
+        rv = bmd_peer_audio_build(group, in->data, in->channels,
+                                  in->samples, in->atime,
+                                  (int)(now_us - in->capture_us), &payload);
+        if (rv != BMD_ERROR_NONE)
+        {
+            return rv;
+        }
+        return bmd_peer_audio_group_add(group, payload);
     }
-    switch (pdu_code)
+    rv = bmd_peer_audio_group_append(group, in);
+    if (rv != BMD_ERROR_NONE)
     {
-        case BMD_PDU_CODE_SUBSCRIBE_AUDIO:
-            rv = bmd_peer_process_msg_subscribe_audio(bmd, peer, in_s);
-            break;
-        case BMD_PDU_CODE_REQUEST_VIDEO_FRAME:
-            rv = bmd_peer_process_msg_request_video_frame(bmd, peer, in_s);
-            break;
-        case BMD_PDU_CODE_VERSION:
-            rv = bmd_peer_process_msg_version(bmd, peer, in_s);
+        return rv;
+    }
+    done = 0;
+    while (group->pending_samples - done >= period)
+    {
+        offset_us = group->pending_offset * 1000000LL /
+                    BMD_AUDIO_SAMPLE_RATE;
+        rv = bmd_peer_audio_build(group,
+                                  group->pending + done * in->channels,
+                                  in->channels, period,
+                                  group->pending_atime +
+                                  (int)(offset_us / 1000),
+                                  (int)(now_us - group->pending_capture_us -
+                                        offset_us), &payload);
+        if (rv == BMD_ERROR_NONE)
+        {
+            rv = bmd_peer_audio_group_add(group, payload);
+        }
+        if (rv != BMD_ERROR_NONE)
+        {
             break;
+        }
+        group->pending_offset += period;
+        if (group->pending_offset >= BMD_AUDIO_SAMPLE_RATE)
+        {
+            /* move the base a whole second on, exact in ms and us, so
+               the offset stays small on a stream that runs for days */
+            group->pending_offset -= BMD_AUDIO_SAMPLE_RATE;
+            group->pending_atime += 1000;
+            group->pending_capture_us += 1000000;
+        }
+        done += period;
     }
+    group->pending_samples -= done;
+    memmove(group->pending, group->pending + done * in->channels,
+            group->pending_samples * in->channels * sizeof(short));
     return rv;
 }
 
 /*****************************************************************************/
+/* payload is capture audio, peers that asked for another format get
+   their group's conversion, made once for the group */
 int
-bmd_peer_get_fds(struct bmd_info* bmd, int* max_fd,
-                 fd_set* rfds, fd_set* wfds)
+bmd_peer_queue_all_audio(struct bmd_info* bmd, struct bmd_payload* payload)
 {
+    int rv;
+    int index;
+    int latency_us;
+    long long now_us;
     struct peer_info* peer;
-    int lmax_fd;
+    struct peer_audio_group* group;
+    struct peer_audio_in in;
 
-    lmax_fd = *max_fd;
-    peer = bmd->peer_head;
-    while (peer != NULL)
+    if (bmd->shards != NULL)
     {
-        if (peer->sck > lmax_fd)
+        bmd_shard_post_audio(bmd->shards, bmd, payload);
+    }
+    rv = bmd_peer_audio_parse(bmd, payload, &in);
+    if (rv != BMD_ERROR_NONE)
+    {
+        return rv;
+    }
+    /* what VERSION says, an eighth of each new packet */
+    get_ustime(&now_us);
+    latency_us = (int)(now_us - in.capture_us);
+    bmd->audio_latency_us = bmd->audio_latency_us == 0 ? latency_us :
+                            bmd->audio_latency_us +
+                            (latency_us - bmd->audio_latency_us) / 8;
+    for (peer = bmd->peer_head; peer != NULL; peer = peer->next)
+    {
+        if (peer->got_subscribe_audio && (peer->audio_group != NULL))
         {
-            lmax_fd = peer->sck;
+            peer->audio_group->wanted = 1;
         }
-        FD_SET(peer->sck, rfds);
-        if (peer->out_s_head != NULL)
+    }
+    for (group = bmd->audio_groups; group != NULL; group = group->next)
+    {
+        if (group->wanted &&
+            (bmd_peer_audio_group_convert(group, &in) != BMD_ERROR_NONE))
         {
-            FD_SET(peer->sck, wfds);
+            LOGLN0((LOG_ERROR, LOGS "bmd_peer_audio_group_convert failed",
+                    LOGP));
         }
-        peer = peer->next;
     }
-    *max_fd = lmax_fd;
-    return BMD_ERROR_NONE;
+    for (peer = bmd->peer_head; peer != NULL; peer = peer->next)
+    {
+        if (!(peer->got_subscribe_audio))
+        {
+            continue;
+        }
+        group = peer->audio_group;
+        if (group == NULL)
+        {
+            rv = bmd_peer_queue_audio(bmd, peer, payload);
+        }
+        else
+        {
+            for (index = 0; index < group->num_payloads; index++)
+            {
+                rv = bmd_peer_queue_audio(bmd, peer, group->payloads[index]);
+                if (rv != BMD_ERROR_NONE)
+                {
+                    break;
+                }
+            }
+        }
+        if (rv != BMD_ERROR_NONE)
+        {
+            break;
+        }
+    }
+    for (group = bmd->audio_groups; group != NULL; group = group->next)
+    {
+        for (index = 0; index < group->num_payloads; index++)
+        {
+            bmd_payload_release(group->payloads[index]);
+        }
+        group->num_payloads = 0;
+        group->wanted = 0;
+    }
+    return rv;
 }
 
-/******************************************************************************/
-static int
-bmd_peer_send_fd(int sck, int fd)
+/*****************************************************************************/
+int
+bmd_peer_queue_all_encoded(struct bmd_info* bmd, int rendition,
+                           struct bmd_payload* payload)
 {
-    ssize_t size;
-    struct msghdr msg;
-    struct iovec iov;
-    char control[CMSG_SPACE(sizeof(int))];
-    struct cmsghdr *cmsg;
-    int* fds;
-    char text[4] = "int";
-
-    memset(&iov, 0, sizeof(iov));
-    iov.iov_base = text;
-    iov.iov_len = 4;
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-    memset(control, 0, sizeof(control));
-    msg.msg_control = control;
-    msg.msg_controllen = sizeof(control);
-    cmsg = CMSG_FIRSTHDR(&msg);
-    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
-    cmsg->cmsg_level = SOL_SOCKET;
-    cmsg->cmsg_type = SCM_RIGHTS;
-    fds = (int*)CMSG_DATA(cmsg);
-    *fds = fd;
-    size = sendmsg(sck, &msg, 0);
-    LOGLN10((LOG_INFO, LOGS "size %d", LOGP, (int)size));
-    if (size != 4)
+    int rv;
+    struct peer_info* peer;
+
+    if (bmd->shards != NULL)
     {
-        return BMD_ERROR_FD;
+        bmd_shard_post_encoded(bmd->shards, rendition, payload);
+    }
+    peer = bmd->peer_head;
+    while (peer != NULL)
+    {
+        if (peer->subscribe_encoded & (1 << rendition))
+        {
+            rv = bmd_peer_queue(bmd, peer, payload);
+            if (rv != BMD_ERROR_NONE)
+            {
+                return rv;
+            }
+        }
+        peer = peer->next;
     }
     return BMD_ERROR_NONE;
 }
 
 /*****************************************************************************/
+/* tell the capture callback if any peer will take the next video frame
+   or audio packet so it can skip the copy when nobody wants it */
 int
-bmd_peer_check_fds(struct bmd_info* bmd, fd_set* rfds, fd_set* wfds)
+bmd_peer_update_demand(struct bmd_info* bmd)
 {
     struct peer_info* peer;
-    struct peer_info* last_peer;
-    struct stream* out_s;
-    struct stream* in_s;
-    int out_bytes;
-    int in_bytes;
-    int sent;
-    int reed;
-    int pdu_bytes;
-    int rv;
-    int error;
+    struct bmd_demand demand;
+    int num_peers;
 
-    rv = BMD_ERROR_NONE;
-    last_peer = NULL;
+    memset(&demand, 0, sizeof(demand));
+    demand.video_demand = bmd->prime_surface ? BMD_VIDEO_DEMAND_ALL : 0;
+    num_peers = 0;
     peer = bmd->peer_head;
     while (peer != NULL)
     {
-        if (FD_ISSET(peer->sck, rfds))
+        num_peers++;
+        if (peer->got_request_video || (peer->subscribe_encoded != 0))
         {
-            in_s = peer->in_s;
-            if (in_s == NULL)
-            {
-                in_s = xnew0(struct stream, 1);
-                if (in_s == NULL)
-                {
-                    return BMD_ERROR_MEMORY;
-                }
-                in_s->size = 1024 * 1024;
-                in_s->data = xnew(char, in_s->size);
-                if (in_s->data == NULL)
-                {
-                    free(in_s);
-                    return BMD_ERROR_MEMORY;
-                }
-                in_s->p = in_s->data;
-                in_s->end = in_s->data;
-                peer->in_s = in_s;
-            }
-            if (in_s->p == in_s->data)
+            demand.video_demand |= BMD_VIDEO_DEMAND_ALL;
+        }
+        if (peer->video_subscribed && (peer->video_credits != 0))
+        {
+            /* the capture callback only copies the frames some
+               subscriber is due for */
+            if (!(peer->video_next_valid) ||
+                ((peer->video_fps == 0) && (peer->video_every < 2)))
             {
-                in_s->end = in_s->data + 8;
+                demand.video_demand |= BMD_VIDEO_DEMAND_ALL;
             }
-            in_bytes = (int)(in_s->end - in_s->p);
-            reed = recv(peer->sck, in_s->p, in_bytes, 0);
-            if (reed < 1)
+            else if (peer->video_fps > 0)
             {
-                /* error */
-                LOGLN0((LOG_ERROR, LOGS "recv failed sck %d reed %d",
-                        LOGP, peer->sck, reed));
-                error = bmd_peer_remove_one(bmd, &peer, last_peer);
-                if (error != BMD_ERROR_NONE)
+                if (!(demand.video_demand & BMD_VIDEO_DEMAND_TIME) ||
+                    (peer->video_next_mstime - bmd_peer_video_slack(peer) -
+                     demand.want_mstime < 0))
                 {
-                    return error;
+                    demand.want_mstime = peer->video_next_mstime -
+                                         bmd_peer_video_slack(peer);
                 }
-                rv = BMD_ERROR_PEER_REMOVED;
-                continue;
+                demand.video_demand |= BMD_VIDEO_DEMAND_TIME;
             }
             else
             {
-                in_s->p += reed;
-                if (in_s->p >= in_s->end)
+                if (!(demand.video_demand & BMD_VIDEO_DEMAND_SEQ) ||
+                    (peer->video_next_seq - demand.want_seq < 0))
                 {
-                    if (in_s->p == in_s->data + 8)
-                    {
-                        /* finished reading in header */
-                        in_s->p = in_s->data;
-                        in_uint8s(in_s, 4); /* pdu_code */
-                        in_uint32_le(in_s, pdu_bytes);
-                        if ((pdu_bytes < 8) || (pdu_bytes > in_s->size))
-                        {
-                            LOGLN0((LOG_ERROR, LOGS "bad pdu_bytes %d",
-                                    LOGP, pdu_bytes));
-                            error = bmd_peer_remove_one(bmd, &peer, last_peer);
-                            if (error != BMD_ERROR_NONE)
-                            {
-                                return error;
-                            }
-                            rv = BMD_ERROR_PEER_REMOVED;
-                            continue;
-                        }
-                        in_s->end = in_s->data + pdu_bytes;
-                    }
-                    if (in_s->p >= in_s->end)
-                    {
-                        /* finished reading in header and payload */
-                        in_s->p = in_s->data;
-                        rv = bmd_peer_process_msg(bmd, peer);
-                        if (rv != BMD_ERROR_NONE)
-                        {
-                            LOGLN0((LOG_ERROR, LOGS "bmd_peer_process_msg "
-                                   "failed", LOGP));
-                            error = bmd_peer_remove_one(bmd, &peer, last_peer);
-                            if (error != BMD_ERROR_NONE)
-                            {
-                                return error;
-                            }
-                            rv = BMD_ERROR_PEER_REMOVED;
-                            continue;
-                        }
-                        in_s->p = in_s->data;
-                    }
+                    demand.want_seq = peer->video_next_seq;
                 }
+                demand.video_demand |= BMD_VIDEO_DEMAND_SEQ;
             }
         }
-        if (FD_ISSET(peer->sck, wfds))
+        if (peer->got_subscribe_audio)
+        {
+            demand.audio_socket_demand = 1;
+        }
+        if (peer->got_subscribe_audio_shm)
+        {
+            demand.audio_shm_demand = 1;
+        }
+        if (peer->remote &&
+            (peer->got_request_video || peer->video_subscribed))
         {
-            out_s = peer->out_s_head;
-            if (out_s != NULL)
+            if (peer->tiles)
             {
-                if (out_s->data == NULL)
-                {
-                    rv = bmd_peer_send_fd(peer->sck, out_s->fd);
-                    if (rv != BMD_ERROR_NONE)
-                    {
-                        /* error */
-                        LOGLN0((LOG_ERROR, LOGS "bmd_peer_send_fd failed "
-                                "fd %d", LOGP, out_s->fd));
-                        error = bmd_peer_remove_one(bmd, &peer, last_peer);
-                        if (error != BMD_ERROR_NONE)
-                        {
-                            return error;
-                        }
-                        rv = BMD_ERROR_PEER_REMOVED;
-                        continue;
-                    }
-                    LOGLN10((LOG_DEBUG, LOGS "bmd_peer_send_fd ok", LOGP));
-                    if (out_s->next == NULL)
-                    {
-                        peer->out_s_head = NULL;
-                        peer->out_s_tail = NULL;
-                    }
-                    else
-                    {
-                        peer->out_s_head = out_s->next;
-                    }
-                    close(out_s->fd);
-                    free(out_s);
-                }
-                else
-                {
-                    out_bytes = (int)(out_s->end - out_s->p);
-                    sent = send(peer->sck, out_s->p, out_bytes, 0);
-                    if (sent < 1)
-                    {
-                        /* error */
-                        LOGLN0((LOG_ERROR, LOGS "send failed", LOGP));
-                        error = bmd_peer_remove_one(bmd, &peer, last_peer);
-                        if (error != BMD_ERROR_NONE)
-                        {
-                            return error;
-                        }
-                        rv = BMD_ERROR_PEER_REMOVED;
-                        continue;
-                    }
-                    LOGLN10((LOG_DEBUG, LOGS "send ok, sent %d", LOGP, sent));
-                    out_s->p += sent;
-                    if (out_s->p >= out_s->end)
-                    {
-                        if (out_s->next == NULL)
-                        {
-                            peer->out_s_head = NULL;
-                            peer->out_s_tail = NULL;
-                        }
-                        else
-                        {
-                            peer->out_s_head = out_s->next;
-                        }
-                        free(out_s->data);
-                        free(out_s);
-                    }
-                }
+                demand.video_tiles_demand = 1;
+            }
+            else
+            {
+                demand.video_raw_demand = 1;
             }
         }
-        last_peer = peer;
+        demand.encoded_mask |= peer->subscribe_encoded;
         peer = peer->next;
     }
-    return rv;
-}
-
-/*****************************************************************************/
-static int
-bmd_queue_version(struct bmd_info* bmd, struct peer_info* peer)
-{
-    struct stream* out_s;
-    int rv;
-
-    (void)bmd;
-    out_s = xnew0(struct stream, 1);
-    if (out_s == NULL)
-    {
-        return BMD_ERROR_MEMORY;
-    }
-    out_s->data = xnew(char, 1024);
-    if (out_s->data == NULL)
+    if ((bmd->record != NULL) || (bmd->timeshift != NULL))
     {
-        free(out_s);
-        return BMD_ERROR_MEMORY;
+        /* the recorder and the timeshift take every frame */
+        demand.video_demand |= BMD_VIDEO_DEMAND_ALL;
     }
-    out_s->p = out_s->data;
-    out_uint32_le(out_s, BMD_PDU_CODE_VERSION);
-    out_uint32_le(out_s, 32);
-    out_uint32_le(out_s, BMD_VERSION_MAJOR);
-    out_uint32_le(out_s, BMD_VERSION_MINOR);
-    out_uint32_le(out_s, BMD_AUDIO_LATENCY);
-    out_uint8s(out_s, 12);
-    out_s->end = out_s->p;
-    out_s->p = out_s->data;
-    rv = bmd_peer_queue(peer, out_s);
-    free(out_s->data);
-    free(out_s);
-    return rv;
-}
-
-/*****************************************************************************/
-int
-bmd_peer_add_fd(struct bmd_info* bmd, int sck)
-{
-    struct peer_info* peer;
-
-    peer = xnew0(struct peer_info, 1);
-    if (peer == NULL)
+    if (bmd->shard != NULL)
     {
-        return BMD_ERROR_MEMORY;
+        /* a shard's view, the main thread sums the shards */
+        return bmd_shard_set_demand(bmd->shard, &demand, num_peers);
     }
-    peer->sck = sck;
-    if (bmd->peer_head == NULL)
+    if (bmd->shards != NULL)
     {
-        bmd->peer_head = peer;
-        bmd->peer_tail = peer;
+        bmd_shard_merge_demand(bmd->shards, &demand);
+        bmd->shard_encoded_mask = demand.encoded_mask;
     }
-    else
+    bmd->video_raw_demand = demand.video_raw_demand;
+    bmd->video_tiles_demand = demand.video_tiles_demand;
+    bmd->video_demand = demand.video_demand;
+    bmd->audio_socket_demand = demand.audio_socket_demand;
+    bmd->audio_shm_demand = demand.audio_shm_demand;
+    if (bmd->av_info != NULL)
     {
-        bmd->peer_tail->next = peer;
-        bmd->peer_tail = peer;
+        __atomic_store_n(&(bmd->av_info->video_want_seq), demand.want_seq,
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&(bmd->av_info->video_want_mstime),
+                         demand.want_mstime, __ATOMIC_RELAXED);
+        __atomic_store_n(&(bmd->av_info->video_demand), demand.video_demand,
+                         __ATOMIC_RELEASE);
+        __atomic_store_n(&(bmd->av_info->audio_demand),
+                         demand.audio_socket_demand ||
+                         demand.audio_shm_demand ||
+                         (bmd->record != NULL) || (bmd->timeshift != NULL),
+                         __ATOMIC_RELEASE);
     }
-    bmd_queue_version(bmd, peer);
     return BMD_ERROR_NONE;
 }
 
 /*****************************************************************************/
+/* peers here and on the shards */
 int
-bmd_peer_cleanup(struct bmd_info* bmd)
+bmd_peer_get_count(struct bmd_info* bmd, int* count)
 {
     struct peer_info* peer;
-    struct peer_info* lpeer;
+    int lcount;
 
-    peer = bmd->peer_head;
-    while (peer != NULL)
+    lcount = 0;
+    if (bmd->shards != NULL)
     {
-        lpeer = peer;
-        peer = peer->next;
-        bmd_peer_delete_one(lpeer);
+        bmd_shard_get_peer_count(bmd->shards, &lcount);
     }
-    bmd->peer_head = NULL;
-    bmd->peer_tail = NULL;
+    for (peer = bmd->peer_head; peer != NULL; peer = peer->next)
+    {
+        lcount++;
+    }
+    *count = lcount;
     return BMD_ERROR_NONE;
 }
 
 /*****************************************************************************/
+/* VIDEO_TILES payloads built from the codec as peers with different bases
+   ask, they only hold for the frame they were built for */
 int
-bmd_peer_queue_all_video(struct bmd_info* bmd)
+bmd_peer_release_video_tiles(struct bmd_info* bmd)
 {
-    int rv;
-    struct peer_info* peer;
+    int index;
 
-    peer = bmd->peer_head;
-    while (peer != NULL)
+    bmd_payload_release(bmd->video_tiles_key);
+    bmd->video_tiles_key = NULL;
+    for (index = 0; index < bmd->video_tiles_count; index++)
     {
-        if (peer->got_request_video)
-        {
-            rv = bmd_peer_queue_frame(bmd, peer);
-            if (rv != BMD_ERROR_NONE)
-            {
-                return rv;
-            }
-            peer->got_request_video = 0;
-        }
-        peer = peer->next;
+        bmd_payload_release(bmd->video_tiles[index]);
+        bmd->video_tiles[index] = NULL;
     }
+    bmd->video_tiles_count = 0;
     return BMD_ERROR_NONE;
 }
 
 /*****************************************************************************/
+/* bit mask of renditions that have at least one subscriber */
 int
-bmd_peer_queue_all_audio(struct bmd_info* bmd, struct stream* out_s)
+bmd_peer_get_encoded_mask(struct bmd_info* bmd, int* mask)
 {
-    int rv;
+    int lmask;
     struct peer_info* peer;
 
+    lmask = bmd->shard_encoded_mask;
     peer = bmd->peer_head;
     while (peer != NULL)
     {
-        if (peer->got_subscribe_audio)
-        {
-            rv = bmd_peer_queue(peer, out_s);
-            if (rv != BMD_ERROR_NONE)
-            {
-                return rv;
-            }
-        }
+        lmask |= peer->subscribe_encoded;
         peer = peer->next;
     }
+    *mask = lmask;
     return BMD_ERROR_NONE;
 }
 
 /*****************************************************************************/
+/* takes a reference, the payload is not copied
+   the peer limits and policies decide what gets dropped, a drop is not
+   an error so one slow peer does not hold up the others */
 int
-bmd_peer_queue(struct peer_info* peer, struct stream* out_s)
+bmd_peer_queue(struct bmd_info* bmd, struct peer_info* peer,
+               struct bmd_payload* payload)
 {
-    struct stream* lout_s;
-    int bytes;
+    struct peer_out* out;
+    struct peer_out* prev;
+    struct stream in_s;
+    int pdu_code;
+    int rendition;
+    int flags;
+    int now;
+    int size;
 
-    lout_s = xnew0(struct stream, 1);
-    if (lout_s == NULL)
+    if ((payload->bytes < 8) || (payload->bytes > BMD_PDU_MAX_BYTES))
     {
-        return BMD_ERROR_MEMORY;
+        return BMD_ERROR_PARAM;
+    }
+    get_mstime(&now);
+    rendition = 0;
+    flags = 0;
+    memset(&in_s, 0, sizeof(in_s));
+    in_s.data = payload->data;
+    in_s.p = in_s.data;
+    in_s.end = in_s.data + payload->bytes;
+    in_uint32_le(&in_s, pdu_code);
+    if ((pdu_code == BMD_PDU_CODE_VIDEO_RAW) ||
+        (pdu_code == BMD_PDU_CODE_VIDEO_TILES))
+    {
+        /* same conflation and drop policies as fd video */
+        pdu_code = BMD_PDU_CODE_VIDEO;
     }
-    if (out_s->data == NULL)
+    if ((pdu_code == BMD_PDU_CODE_ENCODED) && s_check_rem(&in_s, 24))
     {
-        if (out_s->fd < 1)
+        in_uint8s(&in_s, 12);
+        in_uint32_le(&in_s, rendition);
+        in_uint8s(&in_s, 4);
+        in_uint32_le(&in_s, flags);
+        rendition &= BMD_MAX_RENDITIONS - 1;
+        if (peer->seqpacket && (payload->bytes > BMD_SEQPACKET_MAX_BYTES))
         {
-            free(lout_s);
-            return BMD_ERROR_FD;
+            /* the sw encoder's I_PCM frames are bigger than the raw
+               frame, none of them would ever fit a message */
+            LOGLN0((LOG_ERROR, LOGS "sck %d rendition %d access units of "
+                    "%d bytes do not fit a message, unsubscribed", LOGP,
+                    peer->sck, rendition, payload->bytes));
+            peer->subscribe_encoded &= ~(1 << rendition);
+            peer->encoded_drops++;
+            return BMD_ERROR_NONE;
         }
-        lout_s->fd = dup(out_s->fd);
-        if (lout_s->fd == -1)
+        if (peer->encoded_wait_key & (1 << rendition))
         {
-            free(lout_s);
-            return BMD_ERROR_DUP;
+            if (!(flags & BMD_ENCODER_FLAGS_KEYFRAME))
+            {
+                /* can not be decoded, an earlier frame was dropped */
+                peer->encoded_drops++;
+                return BMD_ERROR_NONE;
+            }
+            peer->encoded_wait_key &= ~(1 << rendition);
         }
-        LOGLN10((LOG_INFO, LOGS "fd %d", LOGP, lout_s->fd));
     }
-    else
+    if ((pdu_code == BMD_PDU_CODE_VIDEO) &&
+        (bmd->peer_limits.video_policy == BMD_VIDEO_POLICY_LATEST))
+    {
+        for (out = peer->out_head; out != NULL; out = out->next)
+        {
+            if ((out->pdu_code == BMD_PDU_CODE_VIDEO) &&
+                (out->offset == 0) && !(out->fd_sent) && !(out->inflight))
+            {
+                /* conflate, the newer frame takes the queued one's place */
+                peer->out_bytes += payload->bytes - out->payload->bytes;
+                bmd_payload_release(out->payload);
+                bmd_payload_addref(payload);
+                out->payload = payload;
+                out->mstime = now;
+                peer->video_drops++;
+                return BMD_ERROR_NONE;
+            }
+        }
+    }
+    while (bmd_peer_over_limits(bmd, peer, payload))
     {
-        bytes = (int)(out_s->end - out_s->data);
-        if ((bytes < 1) || (bytes > 1024 * 1024))
+        if ((pdu_code != BMD_PDU_CODE_VIDEO) &&
+            (pdu_code != BMD_PDU_CODE_AUDIO) &&
+            (pdu_code != BMD_PDU_CODE_ENCODED))
         {
-            free(lout_s);
-            return BMD_ERROR_PARAM;
+            /* small control pdus always go */
+            break;
         }
-        lout_s->size = bytes;
-        lout_s->data = xnew(char, lout_s->size);
-        if (lout_s->data == NULL)
+        if (((pdu_code == BMD_PDU_CODE_AUDIO) &&
+             (bmd->peer_limits.audio_policy ==
+              BMD_AUDIO_POLICY_DROP_NEWEST)) ||
+            (bmd_peer_find_victim(bmd, peer, &out, &prev) != BMD_ERROR_NONE))
         {
-            free(lout_s);
-            return BMD_ERROR_MEMORY;
+            LOGLN10((LOG_INFO, LOGS "sck %d dropping new pdu_code %d",
+                     LOGP, peer->sck, pdu_code));
+            switch (pdu_code)
+            {
+                case BMD_PDU_CODE_VIDEO:
+                    peer->video_drops++;
+                    break;
+                case BMD_PDU_CODE_AUDIO:
+                    peer->audio_drops++;
+                    break;
+                default:
+                    peer->encoded_drops++;
+                    peer->encoded_wait_key |= 1 << rendition;
+                    break;
+            }
+            return BMD_ERROR_NONE;
         }
-        lout_s->p = lout_s->data;
-        out_uint8p(lout_s, out_s->data, bytes);
-        lout_s->end = lout_s->p;
-        lout_s->p = lout_s->data;
+        LOGLN10((LOG_INFO, LOGS "sck %d dropping queued pdu_code %d",
+                 LOGP, peer->sck, out->pdu_code));
+        bmd_peer_drop_out(peer, out, prev);
     }
-    if (peer->out_s_tail == NULL)
+    if ((pdu_code == BMD_PDU_CODE_ENCODED) &&
+        (peer->encoded_wait_key & (1 << rendition)) &&
+        !(flags & BMD_ENCODER_FLAGS_KEYFRAME))
     {
-        peer->out_s_head = lout_s;
-        peer->out_s_tail = lout_s;
+        /* making room dropped a frame this one depends on */
+        peer->encoded_drops++;
+        return BMD_ERROR_NONE;
+    }
+    out = (struct peer_out*)bmd_pool_alloc(sizeof(struct peer_out), &size);
+    if (out == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    memset(out, 0, sizeof(struct peer_out));
+    bmd_payload_addref(payload);
+    out->payload = payload;
+    out->pdu_code = pdu_code;
+    out->rendition = rendition;
+    out->flags = flags;
+    out->mstime = now;
+    if (peer->out_tail == NULL)
+    {
+        peer->out_head = out;
+        peer->out_tail = out;
+        peer->progress_mstime = now;
     }
     else
     {
-        peer->out_s_tail->next = lout_s;
-        peer->out_s_tail = lout_s;
+        peer->out_tail->next = out;
+        peer->out_tail = out;
+    }
+    peer->out_bytes += payload->bytes;
+    if (payload->fd != -1)
+    {
+        peer->out_fds++;
     }
     return BMD_ERROR_NONE;
 }
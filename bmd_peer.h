@@ -25,15 +25,31 @@ bmd_peer_get_fds(struct bmd_info* bmd, int* max_fd,
 int
 bmd_peer_check_fds(struct bmd_info* bmd, fd_set* rfds, fd_set* wfds);
 int
-bmd_peer_add_fd(struct bmd_info* bmd, int sck);
+bmd_peer_add_fd(struct bmd_info* bmd, int sck, int remote);
 int
 bmd_peer_cleanup(struct bmd_info* bmd);
 int
 bmd_peer_queue_all_video(struct bmd_info* bmd);
 int
-bmd_peer_queue_all_audio(struct bmd_info* bmd, struct stream* out_s);
+bmd_peer_queue_all_audio(struct bmd_info* bmd, struct bmd_payload* payload);
 int
-bmd_peer_queue(struct peer_info* peer, struct stream* out_s);
+bmd_peer_queue_all_encoded(struct bmd_info* bmd, int rendition,
+                           struct bmd_payload* payload);
+int
+bmd_peer_update_demand(struct bmd_info* bmd);
+int
+bmd_peer_start_io_uring(struct bmd_info* bmd);
+int
+bmd_peer_add_listener(struct bmd_info* bmd, int listener, int remote);
+int
+bmd_peer_get_count(struct bmd_info* bmd, int* count);
+int
+bmd_peer_release_video_tiles(struct bmd_info* bmd);
+int
+bmd_peer_get_encoded_mask(struct bmd_info* bmd, int* mask);
+int
+bmd_peer_queue(struct bmd_info* bmd, struct peer_info* peer,
+               struct bmd_payload* payload);
 
 #endif
 
@@ -0,0 +1,156 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "bmd_pool.h"
+#include "bmd_log.h"
+#include "bmd_utils.h"
+#include "bmd_error.h"
+
+#define BMD_POOL_NUM_CLASSES 20 /* 64 bytes to 32 MB */
+
+struct pool_free
+{
+    struct pool_free* next;
+};
+
+struct pool_class
+{
+    struct pool_free* head;
+    int count;
+    int max_count;
+};
+
+static struct pool_class g_classes[BMD_POOL_NUM_CLASSES];
+static int g_heap_allocs = 0;
+static int g_pool_allocs = 0;
+/* payloads are released on the shard threads too */
+static pthread_mutex_t g_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*****************************************************************************/
+static int
+bmd_pool_get_class(int bytes, int* size)
+{
+    int index;
+    int lsize;
+
+    index = 0;
+    lsize = BMD_POOL_MIN_BYTES;
+    while (lsize < bytes)
+    {
+        lsize <<= 1;
+        index++;
+    }
+    *size = lsize;
+    return index;
+}
+
+/*****************************************************************************/
+/* size gets the real size of the buffer, give it back to bmd_pool_free */
+void*
+bmd_pool_alloc(int bytes, int* size)
+{
+    struct pool_class* pc;
+    struct pool_free* pf;
+    int index;
+
+    if ((bytes < 0) || (bytes > BMD_POOL_MAX_BYTES))
+    {
+        return NULL;
+    }
+    index = bmd_pool_get_class(bytes, size);
+    pc = g_classes + index;
+    pthread_mutex_lock(&g_pool_mutex);
+    pf = pc->head;
+    if (pf != NULL)
+    {
+        pc->head = pf->next;
+        pc->count--;
+        g_pool_allocs++;
+        pthread_mutex_unlock(&g_pool_mutex);
+        return pf;
+    }
+    g_heap_allocs++;
+    pthread_mutex_unlock(&g_pool_mutex);
+    return xnew(char, *size);
+}
+
+/*****************************************************************************/
+int
+bmd_pool_free(void* ptr, int size)
+{
+    struct pool_class* pc;
+    struct pool_free* pf;
+    int index;
+
+    if (ptr == NULL)
+    {
+        return BMD_ERROR_NONE;
+    }
+    index = bmd_pool_get_class(size, &size);
+    pc = g_classes + index;
+    pthread_mutex_lock(&g_pool_mutex);
+    if (pc->max_count == 0)
+    {
+        pc->max_count = BMD_POOL_CLASS_KEEP / size;
+        if (pc->max_count < 1)
+        {
+            pc->max_count = 1;
+        }
+    }
+    if (pc->count >= pc->max_count)
+    {
+        pthread_mutex_unlock(&g_pool_mutex);
+        free(ptr);
+        return BMD_ERROR_NONE;
+    }
+    pf = (struct pool_free*)ptr;
+    pf->next = pc->head;
+    pc->head = pf;
+    pc->count++;
+    pthread_mutex_unlock(&g_pool_mutex);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_pool_cleanup(void)
+{
+    struct pool_class* pc;
+    struct pool_free* pf;
+    int index;
+
+    LOGLN0((LOG_INFO, LOGS "heap allocs %d pool allocs %d", LOGP,
+            g_heap_allocs, g_pool_allocs));
+    for (index = 0; index < BMD_POOL_NUM_CLASSES; index++)
+    {
+        pc = g_classes + index;
+        while (pc->head != NULL)
+        {
+            pf = pc->head;
+            pc->head = pf->next;
+            free(pf);
+        }
+        pc->count = 0;
+    }
+    return BMD_ERROR_NONE;
+}
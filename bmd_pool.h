@@ -0,0 +1,37 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BMD_POOL_H_
+#define _BMD_POOL_H_
+
+/* power of 2 size classes from BMD_POOL_MIN_BYTES to BMD_POOL_MAX_BYTES,
+   freed buffers are kept for reuse so steady state capture does no
+   malloc or free, main thread only */
+#define BMD_POOL_MIN_BYTES      64
+#define BMD_POOL_MAX_BYTES      (32 * 1024 * 1024)
+/* most memory kept free in one class */
+#define BMD_POOL_CLASS_KEEP     (16 * 1024 * 1024)
+
+void*
+bmd_pool_alloc(int bytes, int* size);
+int
+bmd_pool_free(void* ptr, int size);
+int
+bmd_pool_cleanup(void);
+
+#endif
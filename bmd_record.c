@@ -0,0 +1,541 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* recording, see bmd_record.h
+   buffers go from a free list to the queue and back, the main thread
+   only ever waits for the mutex, the writer thread owns the files */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "bmd_record.h"
+#include "bmd_error.h"
+#include "bmd_log.h"
+#include "bmd_utils.h"
+
+#define BMD_RECORD_ALIGN_UP(_bytes) \
+    (((_bytes) + BMD_RECORD_ALIGN - 1) & ~(BMD_RECORD_ALIGN - 1))
+
+struct record_buffer
+{
+    char* data; /* BMD_RECORD_ALIGN aligned */
+    int size;
+    int type;
+    int mstime;
+    int seq;
+    int record_bytes;
+    int pad0;
+    struct record_buffer* next;
+};
+
+struct bmd_record
+{
+    char dir[256];
+    int segment_ms;
+    int pid;
+    pthread_t thread;
+    int thread_started; /* boolean */
+    int quit; /* boolean, the writer drains the queue then stops */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct record_buffer* queue_head;
+    struct record_buffer* queue_tail;
+    struct record_buffer* video_free;
+    struct record_buffer* audio_free;
+    int video_buffers; /* made */
+    int audio_buffers;
+    int audio_seq;
+    int drops;
+    /* writer thread only */
+    int data_fd;
+    int index_fd;
+    int segment;
+    int segment_mstime;
+    int direct; /* boolean, data_fd is O_DIRECT */
+    int entries;
+    long long offset;
+    int write_errors;
+    int pad0;
+};
+
+/*****************************************************************************/
+static int
+bmd_record_close_segment(struct bmd_record* self)
+{
+    int drops;
+
+    if (self->data_fd == -1)
+    {
+        return BMD_ERROR_NONE;
+    }
+    pthread_mutex_lock(&(self->mutex));
+    drops = self->drops;
+    pthread_mutex_unlock(&(self->mutex));
+    LOGLN0((LOG_INFO, LOGS "segment %d records %d bytes %lld drops %d "
+            "write errors %d", LOGP, self->segment, self->entries,
+            self->offset, drops, self->write_errors));
+    close(self->data_fd);
+    self->data_fd = -1;
+    if (self->index_fd != -1)
+    {
+        close(self->index_fd);
+        self->index_fd = -1;
+    }
+    self->segment++;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_record_open_segment(struct bmd_record* self, int mstime)
+{
+    struct bmd_record_index_header header;
+    struct timespec ts;
+    char path[512];
+    int flags;
+
+    snprintf(path, sizeof(path), "%s/bmd_%d_%06d.bmdr", self->dir,
+             self->pid, self->segment);
+    flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    self->direct = 1;
+    self->data_fd = open(path, flags | O_DIRECT, 0644);
+    if ((self->data_fd == -1) && (errno == EINVAL))
+    {
+        /* tmpfs and some others can not do O_DIRECT */
+        LOGLN0((LOG_INFO, LOGS "no O_DIRECT for %s", LOGP, path));
+        self->direct = 0;
+        self->data_fd = open(path, flags, 0644);
+    }
+    if (self->data_fd == -1)
+    {
+        LOGLN0((LOG_ERROR, LOGS "open %s failed", LOGP, path));
+        return BMD_ERROR_FD;
+    }
+    snprintf(path, sizeof(path), "%s/bmd_%d_%06d.bmdi", self->dir,
+             self->pid, self->segment);
+    self->index_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                          0644);
+    if (self->index_fd == -1)
+    {
+        LOGLN0((LOG_ERROR, LOGS "open %s failed", LOGP, path));
+        close(self->data_fd);
+        self->data_fd = -1;
+        return BMD_ERROR_FD;
+    }
+    memset(&header, 0, sizeof(header));
+    header.magic = BMD_RECORD_INDEX_MAGIC;
+    header.version = BMD_RECORD_VERSION;
+    header.header_bytes = sizeof(header);
+    header.entry_bytes = sizeof(struct bmd_record_index_entry);
+    header.segment = self->segment;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.start_us = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    if (pwrite(self->index_fd, &header, sizeof(header), 0) !=
+        (ssize_t)sizeof(header))
+    {
+        LOGLN0((LOG_ERROR, LOGS "pwrite %s failed", LOGP, path));
+    }
+    LOGLN0((LOG_INFO, LOGS "segment %d direct %d", LOGP, self->segment,
+            self->direct));
+    self->segment_mstime = mstime;
+    self->offset = 0;
+    self->entries = 0;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* the record then its index entry, then the entry count */
+static int
+bmd_record_write(struct bmd_record* self, struct record_buffer* buffer)
+{
+    struct bmd_record_index_entry entry;
+    ssize_t sent;
+    off_t entry_offset;
+    int bytes;
+
+    if ((self->data_fd != -1) && (buffer->type == BMD_RECORD_TYPE_VIDEO) &&
+        (buffer->mstime - self->segment_mstime >= self->segment_ms))
+    {
+        bmd_record_close_segment(self);
+    }
+    if ((self->data_fd == -1) &&
+        (bmd_record_open_segment(self, buffer->mstime) != BMD_ERROR_NONE))
+    {
+        self->write_errors++;
+        return BMD_ERROR_FD;
+    }
+    bytes = 0;
+    while (bytes < buffer->record_bytes)
+    {
+        sent = pwrite(self->data_fd, buffer->data + bytes,
+                      buffer->record_bytes - bytes, self->offset + bytes);
+        if (sent < 1)
+        {
+            if ((sent == -1) && (errno == EINTR))
+            {
+                continue;
+            }
+            /* try a new segment with the next frame */
+            LOGLN0((LOG_ERROR, LOGS "pwrite failed errno %d", LOGP, errno));
+            self->write_errors++;
+            bmd_record_close_segment(self);
+            return BMD_ERROR_FD;
+        }
+        bytes += sent;
+    }
+    entry.type = buffer->type;
+    entry.time = buffer->mstime;
+    entry.seq = buffer->seq;
+    entry.record_bytes = buffer->record_bytes;
+    entry.offset = self->offset;
+    entry_offset = sizeof(struct bmd_record_index_header) +
+                   (off_t)(self->entries) * sizeof(entry);
+    self->offset += buffer->record_bytes;
+    if (pwrite(self->index_fd, &entry, sizeof(entry), entry_offset) !=
+        (ssize_t)sizeof(entry))
+    {
+        self->write_errors++;
+        return BMD_ERROR_FD;
+    }
+    self->entries++;
+    if (pwrite(self->index_fd, &(self->entries), sizeof(self->entries),
+               offsetof(struct bmd_record_index_header, entries)) !=
+        (ssize_t)sizeof(self->entries))
+    {
+        self->write_errors++;
+        return BMD_ERROR_FD;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static void*
+bmd_record_thread(void* arg)
+{
+    struct bmd_record* self;
+    struct record_buffer* buffer;
+
+    self = (struct bmd_record*)arg;
+    LOGLN0((LOG_INFO, LOGS "writer started", LOGP));
+    pthread_mutex_lock(&(self->mutex));
+    for (;;)
+    {
+        while ((self->queue_head == NULL) && !(self->quit))
+        {
+            pthread_cond_wait(&(self->cond), &(self->mutex));
+        }
+        buffer = self->queue_head;
+        if (buffer == NULL)
+        {
+            break;
+        }
+        self->queue_head = buffer->next;
+        if (self->queue_head == NULL)
+        {
+            self->queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&(self->mutex));
+        bmd_record_write(self, buffer);
+        pthread_mutex_lock(&(self->mutex));
+        if (buffer->type == BMD_RECORD_TYPE_VIDEO)
+        {
+            buffer->next = self->video_free;
+            self->video_free = buffer;
+        }
+        else
+        {
+            buffer->next = self->audio_free;
+            self->audio_free = buffer;
+        }
+    }
+    pthread_mutex_unlock(&(self->mutex));
+    bmd_record_close_segment(self);
+    LOGLN0((LOG_INFO, LOGS "writer done", LOGP));
+    return 0;
+}
+
+/*****************************************************************************/
+/* a free buffer of at least record_bytes, NULL when the writer has all
+   of them */
+static struct record_buffer*
+bmd_record_get_buffer(struct bmd_record* self, int type, int record_bytes)
+{
+    struct record_buffer* buffer;
+    struct record_buffer** free_list;
+    int* made;
+    int max_made;
+    void* data;
+
+    if (type == BMD_RECORD_TYPE_VIDEO)
+    {
+        free_list = &(self->video_free);
+        made = &(self->video_buffers);
+        max_made = BMD_RECORD_VIDEO_BUFFERS;
+    }
+    else
+    {
+        free_list = &(self->audio_free);
+        made = &(self->audio_buffers);
+        max_made = BMD_RECORD_AUDIO_BUFFERS;
+    }
+    pthread_mutex_lock(&(self->mutex));
+    buffer = *free_list;
+    if (buffer != NULL)
+    {
+        *free_list = buffer->next;
+    }
+    else if (*made < max_made)
+    {
+        buffer = xnew0(struct record_buffer, 1);
+        if (buffer != NULL)
+        {
+            (*made)++;
+        }
+    }
+    if (buffer == NULL)
+    {
+        self->drops++;
+    }
+    pthread_mutex_unlock(&(self->mutex));
+    if ((buffer != NULL) && (buffer->size < record_bytes))
+    {
+        if (posix_memalign(&data, BMD_RECORD_ALIGN, record_bytes) != 0)
+        {
+            pthread_mutex_lock(&(self->mutex));
+            buffer->next = *free_list;
+            *free_list = buffer;
+            self->drops++;
+            pthread_mutex_unlock(&(self->mutex));
+            return NULL;
+        }
+        free(buffer->data);
+        buffer->data = (char*)data;
+        buffer->size = record_bytes;
+    }
+    return buffer;
+}
+
+/*****************************************************************************/
+static int
+bmd_record_post(struct bmd_record* self, struct record_buffer* buffer)
+{
+    buffer->next = NULL;
+    pthread_mutex_lock(&(self->mutex));
+    if (self->queue_tail == NULL)
+    {
+        self->queue_head = buffer;
+    }
+    else
+    {
+        self->queue_tail->next = buffer;
+    }
+    self->queue_tail = buffer;
+    pthread_cond_signal(&(self->cond));
+    pthread_mutex_unlock(&(self->mutex));
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_record_free_list(struct record_buffer* buffer)
+{
+    struct record_buffer* next;
+
+    while (buffer != NULL)
+    {
+        next = buffer->next;
+        free(buffer->data);
+        free(buffer);
+        buffer = next;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_record_create(const char* dir, int segment_ms, void** obj)
+{
+    struct bmd_record* self;
+
+    if ((dir == NULL) || (dir[0] == 0) || (segment_ms < 1))
+    {
+        return BMD_ERROR_PARAM;
+    }
+    if (access(dir, W_OK) != 0)
+    {
+        LOGLN0((LOG_ERROR, LOGS "can not write to %s", LOGP, dir));
+        return BMD_ERROR_FD;
+    }
+    self = xnew0(struct bmd_record, 1);
+    if (self == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    strncpy(self->dir, dir, sizeof(self->dir) - 1);
+    self->segment_ms = segment_ms;
+    self->pid = getpid();
+    self->data_fd = -1;
+    self->index_fd = -1;
+    pthread_mutex_init(&(self->mutex), NULL);
+    pthread_cond_init(&(self->cond), NULL);
+    if (pthread_create(&(self->thread), NULL, bmd_record_thread, self) != 0)
+    {
+        bmd_record_delete(self);
+        return BMD_ERROR_START;
+    }
+    self->thread_started = 1;
+    *obj = self;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* what is queued is written before the writer stops */
+int
+bmd_record_delete(void* obj)
+{
+    struct bmd_record* self;
+
+    self = (struct bmd_record*)obj;
+    if (self == NULL)
+    {
+        return BMD_ERROR_NONE;
+    }
+    if (self->thread_started)
+    {
+        pthread_mutex_lock(&(self->mutex));
+        self->quit = 1;
+        pthread_cond_signal(&(self->cond));
+        pthread_mutex_unlock(&(self->mutex));
+        pthread_join(self->thread, NULL);
+    }
+    bmd_record_free_list(self->queue_head);
+    bmd_record_free_list(self->video_free);
+    bmd_record_free_list(self->audio_free);
+    pthread_cond_destroy(&(self->cond));
+    pthread_mutex_destroy(&(self->mutex));
+    free(self);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* nv12 planes, copied tight */
+int
+bmd_record_video(void* obj, int mstime, int seq, int width, int height,
+                 const void* ydata, int ystride,
+                 const void* uvdata, int uvstride)
+{
+    struct bmd_record* self;
+    struct bmd_record_header* header;
+    struct record_buffer* buffer;
+    const char* src;
+    char* dst;
+    int bytes;
+    int index;
+
+    self = (struct bmd_record*)obj;
+    bytes = width * height * 3 / 2;
+    buffer = bmd_record_get_buffer(self, BMD_RECORD_TYPE_VIDEO,
+                                   BMD_RECORD_ALIGN_UP(sizeof(*header) +
+                                                       bytes));
+    if (buffer == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    buffer->type = BMD_RECORD_TYPE_VIDEO;
+    buffer->mstime = mstime;
+    buffer->seq = seq;
+    buffer->record_bytes = BMD_RECORD_ALIGN_UP(sizeof(*header) + bytes);
+    header = (struct bmd_record_header*)(buffer->data);
+    memset(header, 0, sizeof(*header));
+    header->magic = BMD_RECORD_MAGIC;
+    header->type = BMD_RECORD_TYPE_VIDEO;
+    header->time = mstime;
+    header->seq = seq;
+    header->bytes = bytes;
+    header->record_bytes = buffer->record_bytes;
+    header->width = width;
+    header->height = height;
+    dst = buffer->data + sizeof(*header);
+    src = (const char*)ydata;
+    for (index = 0; index < height; index++)
+    {
+        memcpy(dst, src, width);
+        dst += width;
+        src += ystride;
+    }
+    src = (const char*)uvdata;
+    for (index = 0; index < height / 2; index++)
+    {
+        memcpy(dst, src, width);
+        dst += width;
+        src += uvstride;
+    }
+    /* padding is written too, keep it from leaking old data */
+    memset(dst, 0, buffer->data + buffer->record_bytes - dst);
+    return bmd_record_post(self, buffer);
+}
+
+/*****************************************************************************/
+int
+bmd_record_audio(void* obj, int mstime, int channels, int bytes_per_sample,
+                 int sample_rate, const void* data, int bytes)
+{
+    struct bmd_record* self;
+    struct bmd_record_header* header;
+    struct record_buffer* buffer;
+    char* dst;
+
+    self = (struct bmd_record*)obj;
+    buffer = bmd_record_get_buffer(self, BMD_RECORD_TYPE_AUDIO,
+                                   BMD_RECORD_ALIGN_UP(sizeof(*header) +
+                                                       bytes));
+    if (buffer == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    buffer->type = BMD_RECORD_TYPE_AUDIO;
+    buffer->mstime = mstime;
+    buffer->seq = self->audio_seq++;
+    buffer->record_bytes = BMD_RECORD_ALIGN_UP(sizeof(*header) + bytes);
+    header = (struct bmd_record_header*)(buffer->data);
+    memset(header, 0, sizeof(*header));
+    header->magic = BMD_RECORD_MAGIC;
+    header->type = BMD_RECORD_TYPE_AUDIO;
+    header->time = mstime;
+    header->seq = buffer->seq;
+    header->bytes = bytes;
+    header->record_bytes = buffer->record_bytes;
+    header->channels = channels;
+    header->bytes_per_sample = bytes_per_sample;
+    header->sample_rate = sample_rate;
+    dst = buffer->data + sizeof(*header);
+    memcpy(dst, data, bytes);
+    dst += bytes;
+    memset(dst, 0, buffer->data + buffer->record_bytes - dst);
+    return bmd_record_post(self, buffer);
+}
@@ -0,0 +1,96 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _BMD_RECORD_H_
+#define _BMD_RECORD_H_
+
+/* recording inside the daemon, -r
+   the main thread copies each converted frame and capture audio packet
+   once into an aligned buffer and a writer thread writes it with O_DIRECT
+   to segment files, when the writer falls behind records are dropped,
+   capture is never held up
+   a segment is bmd_<pid>_<n>.bmdr, records in capture order, and
+   bmd_<pid>_<n>.bmdi, an index to mmap, a new segment starts at the
+   first frame past the segment length */
+
+#define BMD_RECORD_ALIGN            4096
+#define BMD_RECORD_VIDEO_BUFFERS    8
+#define BMD_RECORD_AUDIO_BUFFERS    32
+#define BMD_RECORD_SEGMENT_MS       60000
+
+#define BMD_RECORD_MAGIC            0x52444d42 /* BMDR */
+#define BMD_RECORD_INDEX_MAGIC      0x49444d42 /* BMDI */
+#define BMD_RECORD_VERSION          1
+
+#define BMD_RECORD_TYPE_VIDEO       1 /* tight nv12 */
+#define BMD_RECORD_TYPE_AUDIO       2 /* capture pcm, interleaved */
+
+/* each record in a .bmdr starts on a BMD_RECORD_ALIGN boundary with this,
+   its data follows and it is padded to the next boundary */
+struct bmd_record_header
+{
+    unsigned int magic;
+    unsigned int type;
+    unsigned int time; /* capture mstime */
+    unsigned int seq; /* video capture sequence, audio packet count */
+    unsigned int bytes; /* data after the header */
+    unsigned int record_bytes; /* header, data and padding */
+    unsigned int width; /* video */
+    unsigned int height;
+    unsigned int channels; /* audio */
+    unsigned int bytes_per_sample;
+    unsigned int sample_rate;
+    unsigned int pad0[5];
+};
+
+/* start of a .bmdi, entries follow at header_bytes, one a record in file
+   order, entries only grows and is written after the entry it counts */
+struct bmd_record_index_header
+{
+    unsigned int magic;
+    unsigned int version;
+    unsigned int header_bytes;
+    unsigned int entry_bytes;
+    unsigned int entries;
+    unsigned int segment;
+    long long start_us; /* CLOCK_REALTIME when the segment was opened */
+};
+
+struct bmd_record_index_entry
+{
+    unsigned int type;
+    unsigned int time;
+    unsigned int seq;
+    unsigned int record_bytes;
+    long long offset; /* in the .bmdr */
+};
+
+int
+bmd_record_create(const char* dir, int segment_ms, void** obj);
+int
+bmd_record_delete(void* obj);
+int
+bmd_record_video(void* obj, int mstime, int seq, int width, int height,
+                 const void* ydata, int ystride,
+                 const void* uvdata, int uvstride);
+int
+bmd_record_audio(void* obj, int mstime, int channels, int bytes_per_sample,
+                 int sample_rate, const void* data, int bytes);
+
+#endif
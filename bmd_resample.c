@@ -0,0 +1,346 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* polyphase sample rate converter, see bmd_resample.h
+   output sample t, in units of 1 / L input samples, is phase t % L of the
+   filter over the N inputs ending at t / L, the phases are stored
+   reversed so that is a forward dot product, sse2 when there is sse2 */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "bmd_resample.h"
+#include "bmd_error.h"
+#include "bmd_utils.h"
+
+/* taps per phase when not decimating, a multiple of 4 */
+#define BMD_RESAMPLE_TAPS       32
+/* more phases than this is an odd ratio, not supported */
+#define BMD_RESAMPLE_MAX_PHASES 1024
+/* of the lower nyquist, where the pass band ends */
+#define BMD_RESAMPLE_ROLLOFF    0.9
+#define BMD_RESAMPLE_KAISER     8.0
+
+struct bmd_resample
+{
+    int in_rate;
+    int out_rate;
+    int channels;
+    int phases; /* L */
+    int step; /* M */
+    int taps; /* N */
+    int pos; /* next output, in 1 / L input samples from the next input */
+    int max_out; /* outputs from BMD_RESAMPLE_MAX_SAMPLES inputs */
+    float* coefs; /* phases * taps, each phase reversed */
+    /* per channel, taps - 1 samples of history then the new input */
+    float* hist[BMD_RESAMPLE_MAX_CHANNELS];
+    float* out[BMD_RESAMPLE_MAX_CHANNELS];
+};
+
+/*****************************************************************************/
+static int
+bmd_resample_gcd(int a, int b)
+{
+    int t;
+
+    while (b != 0)
+    {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/*****************************************************************************/
+/* zeroth order modified bessel function of the first kind */
+static double
+bmd_resample_i0(double x)
+{
+    double sum;
+    double term;
+    int index;
+
+    sum = 1.0;
+    term = 1.0;
+    for (index = 1; index < 32; index++)
+    {
+        term *= (x / (2.0 * index)) * (x / (2.0 * index));
+        sum += term;
+    }
+    return sum;
+}
+
+/*****************************************************************************/
+int
+bmd_resample_check(int in_rate, int out_rate)
+{
+    int gcd;
+
+    if ((in_rate < BMD_RESAMPLE_MIN_RATE) ||
+        (in_rate > BMD_RESAMPLE_MAX_RATE) ||
+        (out_rate < BMD_RESAMPLE_MIN_RATE) ||
+        (out_rate > BMD_RESAMPLE_MAX_RATE))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    gcd = bmd_resample_gcd(in_rate, out_rate);
+    if (out_rate / gcd > BMD_RESAMPLE_MAX_PHASES)
+    {
+        return BMD_ERROR_NOT_SUPPORTED;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* kaiser windowed sinc at the upsampled rate, normalized so the phases
+   sum to a gain of 1 */
+static void
+bmd_resample_design(struct bmd_resample* self)
+{
+    double cutoff;
+    double center;
+    double denom;
+    double x;
+    double w;
+    double sum;
+    float* coefs;
+    int length;
+    int index;
+    int phase;
+    int tap;
+
+    length = self->phases * self->taps;
+    center = (length - 1) / 2.0;
+    /* cycles per upsampled sample */
+    cutoff = BMD_RESAMPLE_ROLLOFF * 0.5 /
+             (self->phases > self->step ? self->phases : self->step);
+    denom = bmd_resample_i0(BMD_RESAMPLE_KAISER);
+    coefs = self->coefs;
+    sum = 0.0;
+    for (index = 0; index < length; index++)
+    {
+        x = index - center;
+        w = 2.0 * x / (length - 1);
+        w = bmd_resample_i0(BMD_RESAMPLE_KAISER * sqrt(1.0 - w * w)) / denom;
+        x = x == 0.0 ? 2.0 * cutoff :
+            sin(2.0 * M_PI * cutoff * x) / (M_PI * x);
+        /* tap j of phase p is index p + j * L, stored at N - 1 - j */
+        phase = index % self->phases;
+        tap = index / self->phases;
+        coefs[phase * self->taps + self->taps - 1 - tap] = (float)(x * w);
+        sum += x * w;
+    }
+    for (index = 0; index < length; index++)
+    {
+        coefs[index] = (float)(coefs[index] * self->phases / sum);
+    }
+}
+
+/*****************************************************************************/
+int
+bmd_resample_create(int in_rate, int out_rate, int channels, void** obj)
+{
+    struct bmd_resample* self;
+    int gcd;
+    int index;
+    int rv;
+
+    rv = bmd_resample_check(in_rate, out_rate);
+    if (rv != BMD_ERROR_NONE)
+    {
+        return rv;
+    }
+    if ((channels < 1) || (channels > BMD_RESAMPLE_MAX_CHANNELS))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    self = xnew0(struct bmd_resample, 1);
+    if (self == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    gcd = bmd_resample_gcd(in_rate, out_rate);
+    self->in_rate = in_rate;
+    self->out_rate = out_rate;
+    self->channels = channels;
+    self->phases = out_rate / gcd;
+    self->step = in_rate / gcd;
+    /* decimating narrows the pass band, more taps keep the transition
+       band as sharp in input samples */
+    self->taps = BMD_RESAMPLE_TAPS *
+                 ((self->step + self->phases - 1) / self->phases);
+    self->max_out = (int)(((long long)BMD_RESAMPLE_MAX_SAMPLES *
+                           self->phases + self->step - 1) / self->step) + 1;
+    self->coefs = xnew(float, self->phases * self->taps);
+    if (self->coefs == NULL)
+    {
+        bmd_resample_delete(self);
+        return BMD_ERROR_MEMORY;
+    }
+    for (index = 0; index < channels; index++)
+    {
+        self->hist[index] = xnew0(float, self->taps - 1 +
+                                  BMD_RESAMPLE_MAX_SAMPLES);
+        self->out[index] = xnew(float, self->max_out);
+        if ((self->hist[index] == NULL) || (self->out[index] == NULL))
+        {
+            bmd_resample_delete(self);
+            return BMD_ERROR_MEMORY;
+        }
+    }
+    bmd_resample_design(self);
+    *obj = self;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_resample_delete(void* obj)
+{
+    struct bmd_resample* self;
+    int index;
+
+    self = (struct bmd_resample*)obj;
+    if (self == NULL)
+    {
+        return BMD_ERROR_NONE;
+    }
+    for (index = 0; index < BMD_RESAMPLE_MAX_CHANNELS; index++)
+    {
+        free(self->hist[index]);
+        free(self->out[index]);
+    }
+    free(self->coefs);
+    free(self);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* output lags input by half the filter */
+int
+bmd_resample_get_delay_us(void* obj, int* delay_us)
+{
+    struct bmd_resample* self;
+
+    self = (struct bmd_resample*)obj;
+    *delay_us = (int)((self->phases * (long long)self->taps - 1) *
+                      500000 / ((long long)self->phases * self->in_rate));
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* outputs the next samples inputs will give, split over any number of
+   bmd_resample_process calls */
+int
+bmd_resample_get_out_samples(void* obj, int samples, int* out_samples)
+{
+    struct bmd_resample* self;
+    long long span;
+
+    self = (struct bmd_resample*)obj;
+    span = (long long)samples * self->phases - self->pos;
+    *out_samples = span > 0 ? (int)((span + self->step - 1) / self->step) : 0;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static float
+bmd_resample_dot(const float* coefs, const float* in, int taps)
+{
+    int index;
+#if defined(__SSE2__)
+    __m128 acc0;
+    __m128 acc1;
+    float sums[4];
+
+    acc0 = _mm_setzero_ps();
+    acc1 = _mm_setzero_ps();
+    /* taps is a multiple of 8 */
+    for (index = 0; index < taps; index += 8)
+    {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(coefs + index),
+                                           _mm_loadu_ps(in + index)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(coefs + index + 4),
+                                           _mm_loadu_ps(in + index + 4)));
+    }
+    _mm_storeu_ps(sums, _mm_add_ps(acc0, acc1));
+    return (sums[0] + sums[1]) + (sums[2] + sums[3]);
+#else
+    float sum;
+
+    sum = 0.0f;
+    for (index = 0; index < taps; index++)
+    {
+        sum += coefs[index] * in[index];
+    }
+    return sum;
+#endif
+}
+
+/*****************************************************************************/
+/* samples of every channel in, out is set to rows owned by the
+   resampler, valid until the next call */
+int
+bmd_resample_process(void* obj, float* const* in, int samples,
+                     float** out, int* out_samples)
+{
+    struct bmd_resample* self;
+    float* hist;
+    float* dst;
+    int channel;
+    int count;
+    int limit;
+    int pos;
+    int keep;
+
+    self = (struct bmd_resample*)obj;
+    if ((samples < 0) || (samples > BMD_RESAMPLE_MAX_SAMPLES))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    keep = self->taps - 1;
+    limit = samples * self->phases;
+    count = 0;
+    for (channel = 0; channel < self->channels; channel++)
+    {
+        hist = self->hist[channel];
+        dst = self->out[channel];
+        memcpy(hist + keep, in[channel], sizeof(float) * samples);
+        count = 0;
+        for (pos = self->pos; pos < limit; pos += self->step)
+        {
+            /* inputs pos / L - N + 1 to pos / L, history first */
+            dst[count++] = bmd_resample_dot(self->coefs +
+                                            (pos % self->phases) *
+                                            self->taps,
+                                            hist + pos / self->phases,
+                                            self->taps);
+        }
+        memmove(hist, hist + samples, sizeof(float) * keep);
+        out[channel] = dst;
+    }
+    self->pos += count * self->step - limit;
+    *out_samples = count;
+    return BMD_ERROR_NONE;
+}
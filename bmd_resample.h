@@ -0,0 +1,51 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _BMD_RESAMPLE_H_
+#define _BMD_RESAMPLE_H_
+
+/* polyphase sample rate converter for planar float audio
+   the rate ratio is reduced to L / M, a windowed sinc low pass at the
+   lower of the two nyquists is cut into L phases of N taps and each
+   output sample is one N tap dot product over the input, history is kept
+   between calls so a stream can be fed a block at a time
+   the delay is fixed, half the filter, and is the same for every
+   channel */
+
+#define BMD_RESAMPLE_MIN_RATE   8000
+#define BMD_RESAMPLE_MAX_RATE   192000
+#define BMD_RESAMPLE_MAX_CHANNELS 16
+/* most input samples to one bmd_resample_process */
+#define BMD_RESAMPLE_MAX_SAMPLES 256
+
+int
+bmd_resample_check(int in_rate, int out_rate);
+int
+bmd_resample_create(int in_rate, int out_rate, int channels, void** obj);
+int
+bmd_resample_delete(void* obj);
+int
+bmd_resample_get_delay_us(void* obj, int* delay_us);
+int
+bmd_resample_get_out_samples(void* obj, int samples, int* out_samples);
+int
+bmd_resample_process(void* obj, float* const* in, int samples,
+                     float** out, int* out_samples);
+
+#endif
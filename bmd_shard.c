@@ -0,0 +1,793 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* peer io threads, see bmd_shard.h */
+
+#define _GNU_SOURCE /* pipe2 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/select.h>
+
+#include "arch.h"
+#include "parse.h"
+#include "bmd.h"
+#include "bmd_audio_ring.h"
+#include "bmd_declink.h"
+#include "bmd_error.h"
+#include "bmd_log.h"
+#include "bmd_payload.h"
+#include "bmd_peer.h"
+#include "bmd_shard.h"
+#include "bmd_utils.h"
+
+#define BMD_SHARD_MSG_ADD       1
+#define BMD_SHARD_MSG_VIDEO     2
+#define BMD_SHARD_MSG_AUDIO     3
+#define BMD_SHARD_MSG_ENCODED   4
+
+/* payloads in a message carry a reference for the shard */
+struct bmd_shard_msg
+{
+    int type;
+    int sck; /* add */
+    int remote; /* add */
+    int rendition; /* encoded */
+    struct bmd_payload* payload; /* video fd payload, audio or encoded */
+    struct bmd_payload* raw_payload; /* video pixels, can be NULL */
+    int video_frame_count;
+    int video_raw_frame_count;
+    int fd_time;
+    int fd_seq;
+    int fd_width;
+    int fd_height;
+    int fd_bpp;
+    int pad0;
+    struct bmd_trace trace; /* video or audio */
+};
+
+struct bmd_shards;
+
+struct bmd_shard
+{
+    struct bmd_shards* shards;
+    struct bmd_info* view; /* what bmd_peer runs on in this thread */
+    pthread_t thread;
+    int thread_started; /* boolean */
+    int index;
+    int wake_pipe[2]; /* main to shard */
+    int wake_pending; /* atomic, boolean, a byte is in wake_pipe */
+    int quit; /* atomic, boolean */
+    /* the ring, head is moved by the main thread, tail by the shard */
+    unsigned int head;
+    unsigned int tail;
+    int posted_adds; /* main thread */
+    int drops; /* main thread, ring was full */
+    /* atomic, head << 1 | 1 when the main thread went idle there, the
+       shard drops its frame when its tail gets to it, not in the ring
+       so a full ring can not lose it */
+    unsigned long long idle_mark;
+    /* published by the shard */
+    pthread_mutex_t demand_mutex;
+    struct bmd_demand demand;
+    int num_peers;
+    int seen_adds;
+    /* shard thread */
+    int adds;
+    int have_published; /* boolean */
+    struct bmd_demand last_demand;
+    int last_num_peers;
+    int last_adds;
+    struct bmd_shard_msg msgs[BMD_SHARD_RING];
+};
+
+struct bmd_shards
+{
+    int num_shards;
+    int wake_pipe[2]; /* shards to main */
+    pthread_rwlock_t codec_lock;
+    struct bmd_shard* shard[BMD_SHARD_MAX];
+};
+
+/*****************************************************************************/
+static void
+bmd_shard_release_msg(struct bmd_shard_msg* msg)
+{
+    if (msg->type == BMD_SHARD_MSG_ADD)
+    {
+        close(msg->sck);
+    }
+    bmd_payload_release(msg->payload);
+    bmd_payload_release(msg->raw_payload);
+}
+
+/*****************************************************************************/
+/* the frame bmd_peer_queue_all_video and requests in this shard see */
+static void
+bmd_shard_release_video(struct bmd_info* view)
+{
+    bmd_payload_release(view->video_payload);
+    view->video_payload = NULL;
+    bmd_payload_release(view->video_raw_payload);
+    view->video_raw_payload = NULL;
+    bmd_peer_release_video_tiles(view);
+}
+
+/*****************************************************************************/
+static int
+bmd_shard_process_msg(struct bmd_shard* self, struct bmd_shard_msg* msg)
+{
+    struct bmd_info* view;
+
+    view = self->view;
+    switch (msg->type)
+    {
+        case BMD_SHARD_MSG_ADD:
+            self->adds++;
+            if (bmd_peer_add_fd(view, msg->sck,
+                                msg->remote) != BMD_ERROR_NONE)
+            {
+                LOGLN0((LOG_ERROR, LOGS "shard %d bmd_peer_add_fd failed",
+                        LOGP, self->index));
+                close(msg->sck);
+            }
+            bmd_peer_update_demand(view);
+            break;
+        case BMD_SHARD_MSG_VIDEO:
+            bmd_shard_release_video(view);
+            view->video_payload = msg->payload;
+            view->video_raw_payload = msg->raw_payload;
+            view->video_frame_count = msg->video_frame_count;
+            view->video_raw_frame_count = msg->video_raw_frame_count;
+            view->fd_time = msg->fd_time;
+            view->fd_seq = msg->fd_seq;
+            view->fd_width = msg->fd_width;
+            view->fd_height = msg->fd_height;
+            view->fd_bpp = msg->fd_bpp;
+            view->video_trace = msg->trace;
+            bmd_peer_queue_all_video(view);
+            break;
+        case BMD_SHARD_MSG_AUDIO:
+            view->audio_trace = msg->trace;
+            bmd_peer_queue_all_audio(view, msg->payload);
+            bmd_payload_release(msg->payload);
+            break;
+        case BMD_SHARD_MSG_ENCODED:
+            bmd_peer_queue_all_encoded(view, msg->rendition, msg->payload);
+            bmd_payload_release(msg->payload);
+            break;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_shard_process_msgs(struct bmd_shard* self)
+{
+    unsigned long long mark;
+    unsigned int head;
+    unsigned int tail;
+
+    tail = self->tail;
+    /* head first, a mark set before a post is seen with it */
+    head = __atomic_load_n(&(self->head), __ATOMIC_SEQ_CST);
+    mark = __atomic_load_n(&(self->idle_mark), __ATOMIC_ACQUIRE);
+    for (;;)
+    {
+        if ((mark & 1) && ((int)((unsigned int)(mark >> 1) - tail) <= 0))
+        {
+            bmd_shard_release_video(self->view);
+            /* a newer mark from main stays */
+            __atomic_compare_exchange_n(&(self->idle_mark), &mark, 0, 0,
+                                        __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE);
+            mark = 0;
+        }
+        if (tail == head)
+        {
+            break;
+        }
+        bmd_shard_process_msg(self, self->msgs +
+                              (tail & (BMD_SHARD_RING - 1)));
+        tail++;
+        /* slot can be reused */
+        __atomic_store_n(&(self->tail), tail, __ATOMIC_RELEASE);
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static void*
+bmd_shard_thread(void* arg)
+{
+    struct bmd_shard* self;
+    struct timeval time;
+    fd_set rfds;
+    fd_set wfds;
+    int max_fd;
+    char buf[64];
+
+    self = (struct bmd_shard*)arg;
+    LOGLN0((LOG_INFO, LOGS "shard %d started", LOGP, self->index));
+    while (!__atomic_load_n(&(self->quit), __ATOMIC_ACQUIRE))
+    {
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        FD_SET(self->wake_pipe[0], &rfds);
+        max_fd = self->wake_pipe[0];
+        if (bmd_peer_get_fds(self->view, &max_fd, &rfds, &wfds) != 0)
+        {
+            LOGLN0((LOG_ERROR, LOGS "bmd_peer_get_fds failed", LOGP));
+        }
+        /* wake now and then for the queue age and stall limits */
+        time.tv_sec = 1;
+        time.tv_usec = 0;
+        if (select(max_fd + 1, &rfds, &wfds, 0, &time) < 0)
+        {
+            FD_ZERO(&rfds);
+            FD_ZERO(&wfds);
+        }
+        if (FD_ISSET(self->wake_pipe[0], &rfds))
+        {
+            while (read(self->wake_pipe[0], buf, sizeof(buf)) > 0)
+            {
+            }
+            /* after the read, a post from here on writes again */
+            __atomic_store_n(&(self->wake_pending), 0, __ATOMIC_SEQ_CST);
+        }
+        bmd_shard_process_msgs(self);
+        bmd_peer_check_fds(self->view, &rfds, &wfds);
+    }
+    LOGLN0((LOG_INFO, LOGS "shard %d done", LOGP, self->index));
+    return NULL;
+}
+
+/*****************************************************************************/
+/* main thread */
+static void
+bmd_shard_wake(struct bmd_shard* self)
+{
+    if (__atomic_exchange_n(&(self->wake_pending), 1, __ATOMIC_SEQ_CST) == 0)
+    {
+        if (write(self->wake_pipe[1], "w", 1) != 1)
+        {
+            /* pipe full, the shard is woken anyway */
+        }
+    }
+}
+
+/*****************************************************************************/
+/* main thread, BMD_ERROR_RANGE when the ring is full */
+static int
+bmd_shard_post(struct bmd_shard* self, const struct bmd_shard_msg* msg)
+{
+    unsigned int head;
+    unsigned int tail;
+
+    head = __atomic_load_n(&(self->head), __ATOMIC_RELAXED);
+    tail = __atomic_load_n(&(self->tail), __ATOMIC_ACQUIRE);
+    if (head - tail >= BMD_SHARD_RING)
+    {
+        self->drops++;
+        LOGLN10((LOG_INFO, LOGS "shard %d ring full, drops %d", LOGP,
+                 self->index, self->drops));
+        return BMD_ERROR_RANGE;
+    }
+    self->msgs[head & (BMD_SHARD_RING - 1)] = *msg;
+    __atomic_store_n(&(self->head), head + 1, __ATOMIC_SEQ_CST);
+    bmd_shard_wake(self);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* the shard owns msg's references from here, posted or not */
+static int
+bmd_shard_post_or_release(struct bmd_shard* self, struct bmd_shard_msg* msg)
+{
+    int error;
+
+    error = bmd_shard_post(self, msg);
+    if (error != BMD_ERROR_NONE)
+    {
+        bmd_shard_release_msg(msg);
+    }
+    return error;
+}
+
+/*****************************************************************************/
+static int
+bmd_shard_delete_one(struct bmd_shard* self)
+{
+    unsigned int tail;
+
+    if (self->thread_started)
+    {
+        __atomic_store_n(&(self->quit), 1, __ATOMIC_RELEASE);
+        if (write(self->wake_pipe[1], "q", 1) != 1)
+        {
+            /* pipe full, the shard is woken anyway */
+        }
+        pthread_join(self->thread, NULL);
+    }
+    /* whatever was not taken */
+    for (tail = self->tail; tail != self->head; tail++)
+    {
+        bmd_shard_release_msg(self->msgs + (tail & (BMD_SHARD_RING - 1)));
+    }
+    if (self->view != NULL)
+    {
+        bmd_peer_cleanup(self->view);
+        bmd_shard_release_video(self->view);
+        free(self->view);
+    }
+    if (self->wake_pipe[0] != -1)
+    {
+        close(self->wake_pipe[0]);
+        close(self->wake_pipe[1]);
+    }
+    pthread_mutex_destroy(&(self->demand_mutex));
+    free(self);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_shard_create_one(struct bmd_shards* shards, struct bmd_info* bmd,
+                     int index, struct bmd_shard** shard)
+{
+    struct bmd_shard* self;
+    struct bmd_info* view;
+
+    self = xnew0(struct bmd_shard, 1);
+    if (self == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    self->shards = shards;
+    self->index = index;
+    self->wake_pipe[0] = -1;
+    self->wake_pipe[1] = -1;
+    pthread_mutex_init(&(self->demand_mutex), NULL);
+    if (pipe2(self->wake_pipe, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        self->wake_pipe[0] = -1;
+        bmd_shard_delete_one(self);
+        return BMD_ERROR_PIPE;
+    }
+    view = xnew0(struct bmd_info, 1);
+    if (view == NULL)
+    {
+        bmd_shard_delete_one(self);
+        return BMD_ERROR_MEMORY;
+    }
+    /* the settings bmd_peer reads, the rest comes with the messages */
+    view->listener = -1;
+    view->tcp_listener = -1;
+    view->num_renditions = bmd->num_renditions;
+    view->seqpacket = bmd->seqpacket;
+    view->compress = bmd->compress;
+    view->peer_limits = bmd->peer_limits;
+    view->audio_ring = bmd->audio_ring;
+    view->history = bmd->history;
+    view->timeshift = bmd->timeshift;
+    view->shard = self;
+    view->parent = bmd;
+    self->view = view;
+    if ((bmd->io_uring != NULL) &&
+        (bmd_peer_start_io_uring(view) != BMD_ERROR_NONE))
+    {
+        LOGLN0((LOG_ERROR, LOGS "shard %d bmd_peer_start_io_uring failed, "
+                "using select", LOGP, index));
+        view->io_uring = NULL;
+    }
+    if (pthread_create(&(self->thread), NULL, bmd_shard_thread, self) != 0)
+    {
+        bmd_shard_delete_one(self);
+        return BMD_ERROR_START;
+    }
+    self->thread_started = 1;
+    *shard = self;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_shard_create(struct bmd_info* bmd, int num_shards, void** obj)
+{
+    struct bmd_shards* self;
+    int error;
+    int index;
+
+    if ((num_shards < 1) || (num_shards > BMD_SHARD_MAX))
+    {
+        return BMD_ERROR_PARAM;
+    }
+    if (bmd->audio_ring == NULL)
+    {
+        /* shards share it, so it is made up front and lives until
+           bmd_shard_delete instead of coming and going with capture */
+        error = bmd_audio_ring_create(BMD_AUDIO_RING_DATA_BYTES,
+                                      BMD_AUDIO_CHANNELS,
+                                      BMD_AUDIO_BYTES_PER_SAMPLE,
+                                      BMD_AUDIO_SAMPLE_RATE,
+                                      &(bmd->audio_ring));
+        if (error != BMD_ERROR_NONE)
+        {
+            bmd->audio_ring = NULL;
+            return error;
+        }
+    }
+    self = xnew0(struct bmd_shards, 1);
+    if (self == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    pthread_rwlock_init(&(self->codec_lock), NULL);
+    if (pipe2(self->wake_pipe, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        pthread_rwlock_destroy(&(self->codec_lock));
+        free(self);
+        return BMD_ERROR_PIPE;
+    }
+    for (index = 0; index < num_shards; index++)
+    {
+        error = bmd_shard_create_one(self, bmd, index,
+                                     &(self->shard[index]));
+        if (error != BMD_ERROR_NONE)
+        {
+            bmd_shard_delete(self);
+            return error;
+        }
+        self->num_shards++;
+    }
+    *obj = self;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_shard_delete(void* obj)
+{
+    struct bmd_shards* self;
+    int index;
+
+    self = (struct bmd_shards*)obj;
+    if (self == NULL)
+    {
+        return BMD_ERROR_NONE;
+    }
+    for (index = 0; index < self->num_shards; index++)
+    {
+        bmd_shard_delete_one(self->shard[index]);
+    }
+    close(self->wake_pipe[0]);
+    close(self->wake_pipe[1]);
+    pthread_rwlock_destroy(&(self->codec_lock));
+    free(self);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* readable when a shard's demand or peer count changed */
+int
+bmd_shard_get_wake_fd(void* obj, int* fd)
+{
+    struct bmd_shards* self;
+
+    self = (struct bmd_shards*)obj;
+    *fd = self->wake_pipe[0];
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_shard_check_wake(void* obj)
+{
+    struct bmd_shards* self;
+    char buf[64];
+
+    self = (struct bmd_shards*)obj;
+    while (read(self->wake_pipe[0], buf, sizeof(buf)) > 0)
+    {
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* to the shard with the fewest peers, counting ones not added yet */
+int
+bmd_shard_add_fd(void* obj, int sck, int remote)
+{
+    struct bmd_shards* self;
+    struct bmd_shard* shard;
+    struct bmd_shard_msg msg;
+    int best;
+    int best_count;
+    int count;
+    int index;
+
+    self = (struct bmd_shards*)obj;
+    best = 0;
+    best_count = 0;
+    for (index = 0; index < self->num_shards; index++)
+    {
+        shard = self->shard[index];
+        pthread_mutex_lock(&(shard->demand_mutex));
+        count = shard->posted_adds - shard->seen_adds + shard->num_peers;
+        pthread_mutex_unlock(&(shard->demand_mutex));
+        if ((index == 0) || (count < best_count))
+        {
+            best = index;
+            best_count = count;
+        }
+    }
+    shard = self->shard[best];
+    memset(&msg, 0, sizeof(msg));
+    msg.type = BMD_SHARD_MSG_ADD;
+    msg.sck = sck;
+    msg.remote = remote;
+    if (bmd_shard_post(shard, &msg) != BMD_ERROR_NONE)
+    {
+        /* caller closes sck */
+        return BMD_ERROR_RANGE;
+    }
+    shard->posted_adds++;
+    LOGLN0((LOG_INFO, LOGS "sck %d to shard %d with %d peers", LOGP, sck,
+            best, best_count));
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* every shard gets a reference to the frame just built */
+int
+bmd_shard_post_video(void* obj, struct bmd_info* bmd)
+{
+    struct bmd_shards* self;
+    struct bmd_shard_msg msg;
+    int index;
+
+    self = (struct bmd_shards*)obj;
+    for (index = 0; index < self->num_shards; index++)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.type = BMD_SHARD_MSG_VIDEO;
+        msg.payload = bmd->video_payload;
+        msg.raw_payload = bmd->video_raw_payload;
+        msg.video_frame_count = bmd->video_frame_count;
+        msg.video_raw_frame_count = bmd->video_raw_frame_count;
+        msg.fd_time = bmd->fd_time;
+        msg.fd_seq = bmd->fd_seq;
+        msg.fd_width = bmd->fd_width;
+        msg.fd_height = bmd->fd_height;
+        msg.fd_bpp = bmd->fd_bpp;
+        msg.trace = bmd->video_trace;
+        if (msg.payload != NULL)
+        {
+            bmd_payload_addref(msg.payload);
+        }
+        if (msg.raw_payload != NULL)
+        {
+            bmd_payload_addref(msg.raw_payload);
+        }
+        bmd_shard_post_or_release(self->shard[index], &msg);
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_shard_post_audio(void* obj, struct bmd_info* bmd,
+                     struct bmd_payload* payload)
+{
+    struct bmd_shards* self;
+    struct bmd_shard_msg msg;
+    int index;
+
+    self = (struct bmd_shards*)obj;
+    for (index = 0; index < self->num_shards; index++)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.type = BMD_SHARD_MSG_AUDIO;
+        msg.payload = payload;
+        msg.trace = bmd->audio_trace;
+        bmd_payload_addref(payload);
+        bmd_shard_post_or_release(self->shard[index], &msg);
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_shard_post_encoded(void* obj, int rendition,
+                       struct bmd_payload* payload)
+{
+    struct bmd_shards* self;
+    struct bmd_shard_msg msg;
+    int index;
+
+    self = (struct bmd_shards*)obj;
+    for (index = 0; index < self->num_shards; index++)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.type = BMD_SHARD_MSG_ENCODED;
+        msg.rendition = rendition;
+        msg.payload = payload;
+        bmd_payload_addref(payload);
+        bmd_shard_post_or_release(self->shard[index], &msg);
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* the main thread dropped its cached frame, the shards drop theirs
+   after what is posted so far, never lost to a full ring */
+int
+bmd_shard_post_idle(void* obj)
+{
+    struct bmd_shards* self;
+    struct bmd_shard* shard;
+    unsigned long long mark;
+    int index;
+
+    self = (struct bmd_shards*)obj;
+    for (index = 0; index < self->num_shards; index++)
+    {
+        shard = self->shard[index];
+        mark = __atomic_load_n(&(shard->head), __ATOMIC_RELAXED);
+        __atomic_store_n(&(shard->idle_mark), (mark << 1) | 1,
+                         __ATOMIC_SEQ_CST);
+        bmd_shard_wake(shard);
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* shard thread, from bmd_peer_update_demand on its view, the main thread
+   is only woken when something changed */
+int
+bmd_shard_set_demand(void* shard, const struct bmd_demand* demand,
+                     int num_peers)
+{
+    struct bmd_shard* self;
+
+    self = (struct bmd_shard*)shard;
+    if (self->have_published && (self->last_num_peers == num_peers) &&
+        (self->last_adds == self->adds) &&
+        (memcmp(&(self->last_demand), demand,
+                sizeof(struct bmd_demand)) == 0))
+    {
+        return BMD_ERROR_NONE;
+    }
+    self->have_published = 1;
+    self->last_demand = *demand;
+    self->last_num_peers = num_peers;
+    self->last_adds = self->adds;
+    pthread_mutex_lock(&(self->demand_mutex));
+    self->demand = *demand;
+    self->num_peers = num_peers;
+    self->seen_adds = self->adds;
+    pthread_mutex_unlock(&(self->demand_mutex));
+    if (write(self->shards->wake_pipe[1], "d", 1) != 1)
+    {
+        /* pipe full, main is woken anyway */
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* main thread, add every shard's demand to demand */
+int
+bmd_shard_merge_demand(void* obj, struct bmd_demand* demand)
+{
+    struct bmd_shards* self;
+    struct bmd_demand sd;
+    int index;
+
+    self = (struct bmd_shards*)obj;
+    for (index = 0; index < self->num_shards; index++)
+    {
+        pthread_mutex_lock(&(self->shard[index]->demand_mutex));
+        sd = self->shard[index]->demand;
+        pthread_mutex_unlock(&(self->shard[index]->demand_mutex));
+        if ((sd.video_demand & BMD_VIDEO_DEMAND_SEQ) &&
+            (!(demand->video_demand & BMD_VIDEO_DEMAND_SEQ) ||
+             (sd.want_seq - demand->want_seq < 0)))
+        {
+            demand->want_seq = sd.want_seq;
+        }
+        if ((sd.video_demand & BMD_VIDEO_DEMAND_TIME) &&
+            (!(demand->video_demand & BMD_VIDEO_DEMAND_TIME) ||
+             (sd.want_mstime - demand->want_mstime < 0)))
+        {
+            demand->want_mstime = sd.want_mstime;
+        }
+        demand->video_demand |= sd.video_demand;
+        demand->audio_socket_demand |= sd.audio_socket_demand;
+        demand->audio_shm_demand |= sd.audio_shm_demand;
+        demand->video_raw_demand |= sd.video_raw_demand;
+        demand->video_tiles_demand |= sd.video_tiles_demand;
+        demand->encoded_mask |= sd.encoded_mask;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* peers on all shards, ones posted but not added yet included */
+int
+bmd_shard_get_peer_count(void* obj, int* count)
+{
+    struct bmd_shards* self;
+    struct bmd_shard* shard;
+    int lcount;
+    int index;
+
+    self = (struct bmd_shards*)obj;
+    lcount = 0;
+    for (index = 0; index < self->num_shards; index++)
+    {
+        shard = self->shard[index];
+        pthread_mutex_lock(&(shard->demand_mutex));
+        lcount += shard->posted_adds - shard->seen_adds + shard->num_peers;
+        pthread_mutex_unlock(&(shard->demand_mutex));
+    }
+    *count = lcount;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* the main thread codes the frame while shards build VIDEO_TILES from the
+   last one, obj NULL when there are no shards */
+int
+bmd_shard_lock_codec(void* obj, int write)
+{
+    struct bmd_shards* self;
+
+    self = (struct bmd_shards*)obj;
+    if (self == NULL)
+    {
+        return BMD_ERROR_NONE;
+    }
+    if (write)
+    {
+        pthread_rwlock_wrlock(&(self->codec_lock));
+    }
+    else
+    {
+        pthread_rwlock_rdlock(&(self->codec_lock));
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_shard_unlock_codec(void* obj)
+{
+    struct bmd_shards* self;
+
+    self = (struct bmd_shards*)obj;
+    if (self == NULL)
+    {
+        return BMD_ERROR_NONE;
+    }
+    pthread_rwlock_unlock(&(self->codec_lock));
+    return BMD_ERROR_NONE;
+}
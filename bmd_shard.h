@@ -0,0 +1,63 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BMD_SHARD_H_
+#define _BMD_SHARD_H_
+
+/* peers spread over io threads, -K
+   each shard thread runs bmd_peer on its own bmd_info view with its own
+   peers, the main thread hands it new sockets and every published frame,
+   audio packet and access unit through a single producer single consumer
+   ring, the shards hand back what their peers want */
+
+#define BMD_SHARD_MAX       64
+#define BMD_SHARD_RING      256 /* messages, power of 2 */
+
+int
+bmd_shard_create(struct bmd_info* bmd, int num_shards, void** obj);
+int
+bmd_shard_delete(void* obj);
+int
+bmd_shard_get_wake_fd(void* obj, int* fd);
+int
+bmd_shard_check_wake(void* obj);
+int
+bmd_shard_add_fd(void* obj, int sck, int remote);
+int
+bmd_shard_post_video(void* obj, struct bmd_info* bmd);
+int
+bmd_shard_post_audio(void* obj, struct bmd_info* bmd,
+                     struct bmd_payload* payload);
+int
+bmd_shard_post_encoded(void* obj, int rendition,
+                       struct bmd_payload* payload);
+int
+bmd_shard_post_idle(void* obj);
+int
+bmd_shard_set_demand(void* shard, const struct bmd_demand* demand,
+                     int num_peers);
+int
+bmd_shard_merge_demand(void* obj, struct bmd_demand* demand);
+int
+bmd_shard_get_peer_count(void* obj, int* count);
+int
+bmd_shard_lock_codec(void* obj, int write);
+int
+bmd_shard_unlock_codec(void* obj);
+
+#endif
@@ -0,0 +1,160 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <yami_inf.h>
+
+#include "bmd_surface.h"
+#include "bmd_udmabuf.h"
+#include "bmd_error.h"
+#include "bmd_log.h"
+#include "bmd_utils.h"
+
+struct bmd_surface
+{
+    int type;
+    int pad0;
+    void* obj;
+};
+
+/*****************************************************************************/
+int
+bmd_surface_create(int type, int dev_fd, int width, int height, void** obj)
+{
+    struct bmd_surface* self;
+    int error;
+
+    self = xnew0(struct bmd_surface, 1);
+    if (self == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    self->type = type;
+    switch (type)
+    {
+        case BMD_SURFACE_TYPE_YAMI:
+            error = yami_surface_create(&(self->obj), width, height, 0, 0);
+            if (error != YI_SUCCESS)
+            {
+                LOGLN0((LOG_ERROR, LOGS "yami_surface_create failed %d",
+                        LOGP, error));
+                free(self);
+                return BMD_ERROR_CREATE;
+            }
+            break;
+        case BMD_SURFACE_TYPE_UDMABUF:
+            error = bmd_udmabuf_create(dev_fd, width, height, &(self->obj));
+            if (error != BMD_ERROR_NONE)
+            {
+                free(self);
+                return error;
+            }
+            break;
+        default:
+            free(self);
+            return BMD_ERROR_NOT_SUPPORTED;
+    }
+    *obj = self;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_surface_delete(void* obj)
+{
+    struct bmd_surface* self;
+
+    self = (struct bmd_surface*)obj;
+    if (self == NULL)
+    {
+        return BMD_ERROR_NONE;
+    }
+    if (self->type == BMD_SURFACE_TYPE_YAMI)
+    {
+        yami_surface_delete(self->obj);
+    }
+    else
+    {
+        bmd_udmabuf_delete(self->obj);
+    }
+    free(self);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_surface_get_ybuffer(void* obj, void** ydata, int* ydata_stride_bytes)
+{
+    struct bmd_surface* self;
+
+    self = (struct bmd_surface*)obj;
+    if (self->type == BMD_SURFACE_TYPE_YAMI)
+    {
+        if (yami_surface_get_ybuffer(self->obj, ydata,
+                                     ydata_stride_bytes) != YI_SUCCESS)
+        {
+            return BMD_ERROR_NOTREADY;
+        }
+        return BMD_ERROR_NONE;
+    }
+    return bmd_udmabuf_get_ybuffer(self->obj, ydata, ydata_stride_bytes);
+}
+
+/*****************************************************************************/
+int
+bmd_surface_get_uvbuffer(void* obj, void** uvdata, int* uvdata_stride_bytes)
+{
+    struct bmd_surface* self;
+
+    self = (struct bmd_surface*)obj;
+    if (self->type == BMD_SURFACE_TYPE_YAMI)
+    {
+        if (yami_surface_get_uvbuffer(self->obj, uvdata,
+                                      uvdata_stride_bytes) != YI_SUCCESS)
+        {
+            return BMD_ERROR_NOTREADY;
+        }
+        return BMD_ERROR_NONE;
+    }
+    return bmd_udmabuf_get_uvbuffer(self->obj, uvdata, uvdata_stride_bytes);
+}
+
+/*****************************************************************************/
+int
+bmd_surface_get_fd_dst(void* obj, int* fd, int* fd_width, int* fd_height,
+                       int* fd_stride, int* fd_size, int* fd_bpp)
+{
+    struct bmd_surface* self;
+
+    self = (struct bmd_surface*)obj;
+    if (self->type == BMD_SURFACE_TYPE_YAMI)
+    {
+        if (yami_surface_get_fd_dst(self->obj, fd, fd_width, fd_height,
+                                    fd_stride, fd_size,
+                                    fd_bpp) != YI_SUCCESS)
+        {
+            return BMD_ERROR_FD;
+        }
+        return BMD_ERROR_NONE;
+    }
+    return bmd_udmabuf_get_fd_dst(self->obj, fd, fd_width, fd_height,
+                                  fd_stride, fd_size, fd_bpp);
+}
@@ -0,0 +1,37 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BMD_SURFACE_H_
+#define _BMD_SURFACE_H_
+
+#define BMD_SURFACE_TYPE_YAMI       0
+#define BMD_SURFACE_TYPE_UDMABUF    1
+
+int
+bmd_surface_create(int type, int dev_fd, int width, int height, void** obj);
+int
+bmd_surface_delete(void* obj);
+int
+bmd_surface_get_ybuffer(void* obj, void** ydata, int* ydata_stride_bytes);
+int
+bmd_surface_get_uvbuffer(void* obj, void** uvdata, int* uvdata_stride_bytes);
+int
+bmd_surface_get_fd_dst(void* obj, int* fd, int* fd_width, int* fd_height,
+                       int* fd_stride, int* fd_size, int* fd_bpp);
+
+#endif
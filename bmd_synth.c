@@ -0,0 +1,431 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "arch.h"
+#include "bmd.h"
+#include "bmd_declink.h"
+#include "bmd_error.h"
+#include "bmd_log.h"
+#include "bmd_synth.h"
+#include "bmd_utils.h"
+
+#define BMD_SYNTH_AUDIO_RATE    48000
+#define BMD_SYNTH_TONE_HZ       1000
+
+struct bmd_synth
+{
+    struct bmd_av_info* av_info;
+    long long frame_count;
+    int width;
+    int height;
+    int stride_bytes;
+    int fps_num; /* frames per second is fps_num / fps_den */
+    int fps_den;
+    int audio_carry; /* remainder of samples per frame */
+    int tone_phase;
+    int is_running; /* boolean */
+    char* pattern; /* two lines of YUY2, rows are copied at an offset */
+    short* tone; /* one second of tone, looped */
+    char* vdata; /* the frame the thread builds, like a DeckLink buffer */
+    short* adata;
+    int adata_samples;
+    int pad1;
+    pthread_t thread;
+};
+
+/*****************************************************************************/
+/* "1080p29.97" to 1920x1080 at 30000/1001, interlaced modes deliver
+   frames at half the field rate like DeckLink does */
+static int
+bmd_synth_parse_mode(struct bmd_synth* self, const char* mode_name)
+{
+    const char* rate;
+    int lines;
+    int whole;
+    int frac;
+
+    lines = atoi(mode_name);
+    switch (lines)
+    {
+        case 525:
+            self->width = 720;
+            self->height = 486;
+            break;
+        case 625:
+            self->width = 720;
+            self->height = 576;
+            break;
+        case 720:
+            self->width = 1280;
+            self->height = 720;
+            break;
+        case 1080:
+            self->width = 1920;
+            self->height = 1080;
+            break;
+        default:
+            return BMD_ERROR_PARAM;
+    }
+    rate = mode_name;
+    while ((*rate >= '0') && (*rate <= '9'))
+    {
+        rate++;
+    }
+    whole = atoi(rate + 1);
+    frac = strchr(rate, '.') != NULL;
+    if (whole < 1)
+    {
+        return BMD_ERROR_PARAM;
+    }
+    if (frac)
+    {
+        /* 23.98, 29.97 and 59.94 are the 1000/1001 rates */
+        self->fps_num = (whole + 1) * 1000;
+        self->fps_den = 1001;
+    }
+    else
+    {
+        self->fps_num = whole;
+        self->fps_den = 1;
+    }
+    if (*rate == 'i')
+    {
+        self->fps_den *= 2;
+    }
+    self->stride_bytes = self->width * 2;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* vertical bars that scroll one step a frame, so no two frames in a row
+   are the same to an encoder */
+static int
+bmd_synth_make_pattern(struct bmd_synth* self)
+{
+    unsigned char* dst;
+    int index;
+    int luma;
+
+    dst = (unsigned char*)(self->pattern);
+    for (index = 0; index < self->width; index += 2)
+    {
+        luma = 16 + ((index * 219 / self->width) & 0xF0);
+        dst[0] = luma;
+        dst[1] = 128 + (index & 0x3F);
+        dst[2] = luma;
+        dst[3] = 128 - (index & 0x3F);
+        dst += 4;
+    }
+    memcpy(self->pattern + self->stride_bytes, self->pattern,
+           self->stride_bytes);
+    for (index = 0; index < BMD_SYNTH_AUDIO_RATE; index++)
+    {
+        self->tone[index] = (short)(8192.0 * sin(2.0 * M_PI *
+                BMD_SYNTH_TONE_HZ * index / BMD_SYNTH_AUDIO_RATE));
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_synth_make_frame(struct bmd_synth* self)
+{
+    int offset;
+    int index;
+
+    offset = (int)((self->frame_count * 4) % self->stride_bytes);
+    for (index = 0; index < self->height; index++)
+    {
+        memcpy(self->vdata + index * self->stride_bytes,
+               self->pattern + offset, self->stride_bytes);
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_synth_make_audio(struct bmd_synth* self, int* samples)
+{
+    int lsamples;
+    int index;
+
+    /* 1600 a frame at 30, 1601.6 at 29.97 carried as a remainder */
+    lsamples = (BMD_SYNTH_AUDIO_RATE * self->fps_den + self->audio_carry) /
+               self->fps_num;
+    self->audio_carry = (BMD_SYNTH_AUDIO_RATE * self->fps_den +
+                         self->audio_carry) % self->fps_num;
+    if (lsamples > self->adata_samples)
+    {
+        lsamples = self->adata_samples;
+    }
+    for (index = 0; index < lsamples; index++)
+    {
+        self->adata[index * 2] = self->tone[self->tone_phase];
+        self->adata[index * 2 + 1] = self->tone[self->tone_phase];
+        self->tone_phase = (self->tone_phase + 1) % BMD_SYNTH_AUDIO_RATE;
+    }
+    *samples = lsamples;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* same hand off to the main thread as the DeckLink frame callback */
+static int
+bmd_synth_frame_arrived(struct bmd_synth* self)
+{
+    struct bmd_av_info* av_info;
+    int do_sig;
+    int bytes;
+    int now;
+    int demand;
+    int take_video;
+    int samples;
+    long long now_us;
+
+    if (get_mstime(&now) != BMD_ERROR_NONE)
+    {
+        return BMD_ERROR_GETTIME;
+    }
+    get_ustime(&now_us);
+    bmd_synth_make_audio(self, &samples);
+    do_sig = 0;
+    av_info = self->av_info;
+    pthread_mutex_lock(&(av_info->av_mutex));
+    take_video = 0;
+    av_info->vseq++;
+    demand = __atomic_load_n(&(av_info->video_demand), __ATOMIC_ACQUIRE);
+    if (demand & BMD_VIDEO_DEMAND_ALL)
+    {
+        take_video = 1;
+    }
+    if ((demand & BMD_VIDEO_DEMAND_SEQ) &&
+        (av_info->vseq - __atomic_load_n(&(av_info->video_want_seq),
+                                         __ATOMIC_RELAXED) >= 0))
+    {
+        take_video = 1;
+    }
+    if ((demand & BMD_VIDEO_DEMAND_TIME) &&
+        (now - __atomic_load_n(&(av_info->video_want_mstime),
+                               __ATOMIC_RELAXED) >= 0))
+    {
+        take_video = 1;
+    }
+    if (take_video && (!(av_info->got_video)))
+    {
+        bytes = self->stride_bytes * self->height;
+        if (bytes > av_info->vdata_alloc_bytes)
+        {
+            LOGLN0((LOG_INFO, LOGS "free, alloc vdata old %d new %d", LOGP,
+                    av_info->vdata_alloc_bytes, bytes));
+            free(av_info->vdata);
+            av_info->vdata = xnew(char, bytes);
+            av_info->vdata_alloc_bytes = av_info->vdata == NULL ? 0 : bytes;
+        }
+        if (av_info->vdata != NULL)
+        {
+            av_info->vformat = 0;
+            av_info->vwidth = self->width;
+            av_info->vheight = self->height;
+            av_info->vstride_bytes = self->stride_bytes;
+            av_info->vtime = now;
+            av_info->vframe_seq = av_info->vseq;
+            av_info->vcallback_us = now_us;
+            memcpy(av_info->vdata, self->vdata, bytes);
+            av_info->got_video = 1;
+            do_sig = 1;
+        }
+    }
+    if ((!(av_info->got_audio)) &&
+        __atomic_load_n(&(av_info->audio_demand), __ATOMIC_ACQUIRE))
+    {
+        bytes = samples * 2 * 2;
+        if (bytes > av_info->adata_alloc_bytes)
+        {
+            LOGLN0((LOG_INFO, LOGS "free, alloc adata old %d new %d", LOGP,
+                    av_info->adata_alloc_bytes, bytes));
+            free(av_info->adata);
+            av_info->adata = xnew(char, bytes);
+            av_info->adata_alloc_bytes = av_info->adata == NULL ? 0 : bytes;
+        }
+        if (av_info->adata != NULL)
+        {
+            av_info->aformat = 0;
+            av_info->achannels = 2;
+            av_info->abytes_per_sample = 2;
+            av_info->asamples = samples;
+            av_info->atime = now;
+            av_info->acallback_us = now_us;
+            memcpy(av_info->adata, self->adata, bytes);
+            av_info->got_audio = 1;
+            do_sig = 1;
+        }
+    }
+    pthread_mutex_unlock(&(av_info->av_mutex));
+    if (do_sig)
+    {
+        if (write(av_info->av_pipe[1], "sig", 4) != 4)
+        {
+            LOGLN0((LOG_ERROR, LOGS "write failed", LOGP));
+        }
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* frame times are absolute from the start so the rate does not drift
+   with how long a frame takes to build */
+static void*
+bmd_synth_thread(void* arg)
+{
+    struct bmd_synth* self;
+    struct timespec start;
+    struct timespec due;
+    long long ticks;
+    long long ns;
+
+    self = (struct bmd_synth*)arg;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (__atomic_load_n(&(self->is_running), __ATOMIC_ACQUIRE))
+    {
+        bmd_synth_make_frame(self);
+        bmd_synth_frame_arrived(self);
+        self->frame_count++;
+        /* whole seconds apart from the rest, frame_count times
+           1000000000 times fps_den would overflow in days */
+        ticks = self->frame_count * self->fps_den;
+        ns = ticks % self->fps_num * 1000000000LL / self->fps_num;
+        due.tv_sec = start.tv_sec + ticks / self->fps_num;
+        due.tv_nsec = start.tv_nsec + ns;
+        if (due.tv_nsec >= 1000000000L)
+        {
+            due.tv_sec++;
+            due.tv_nsec -= 1000000000L;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                               &due, NULL) != 0)
+        {
+        }
+    }
+    return NULL;
+}
+
+/*****************************************************************************/
+int
+bmd_synth_create(int mode_index, struct bmd_av_info* av_info, void** obj)
+{
+    struct bmd_synth* self;
+    int error;
+
+    self = xnew0(struct bmd_synth, 1);
+    if (self == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    error = bmd_synth_parse_mode(self, g_mode_names[mode_index]);
+    if (error != BMD_ERROR_NONE)
+    {
+        LOGLN0((LOG_ERROR, LOGS "unknown mode %s", LOGP,
+                g_mode_names[mode_index]));
+        free(self);
+        return error;
+    }
+    LOGLN0((LOG_INFO, LOGS "mode %s width %d height %d fps %d/%d", LOGP,
+            g_mode_names[mode_index], self->width, self->height,
+            self->fps_num, self->fps_den));
+    self->av_info = av_info;
+    self->adata_samples = BMD_SYNTH_AUDIO_RATE / 10;
+    self->pattern = xnew(char, self->stride_bytes * 2);
+    self->tone = xnew(short, BMD_SYNTH_AUDIO_RATE);
+    self->vdata = xnew(char, self->stride_bytes * self->height);
+    self->adata = xnew(short, self->adata_samples * 2);
+    if ((self->pattern == NULL) || (self->tone == NULL) ||
+        (self->vdata == NULL) || (self->adata == NULL))
+    {
+        bmd_synth_delete(self);
+        return BMD_ERROR_MEMORY;
+    }
+    bmd_synth_make_pattern(self);
+    *obj = self;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_synth_delete(void* obj)
+{
+    struct bmd_synth* self;
+
+    self = (struct bmd_synth*)obj;
+    if (self == NULL)
+    {
+        return BMD_ERROR_NONE;
+    }
+    bmd_synth_stop(self);
+    free(self->pattern);
+    free(self->tone);
+    free(self->vdata);
+    free(self->adata);
+    free(self);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_synth_start(void* obj)
+{
+    struct bmd_synth* self;
+
+    LOGLN0((LOG_INFO, LOGS, LOGP));
+    self = (struct bmd_synth*)obj;
+    if (self->is_running)
+    {
+        return BMD_ERROR_NONE;
+    }
+    self->is_running = 1;
+    if (pthread_create(&(self->thread), NULL, bmd_synth_thread, self) != 0)
+    {
+        self->is_running = 0;
+        return BMD_ERROR_START;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_synth_stop(void* obj)
+{
+    struct bmd_synth* self;
+
+    LOGLN0((LOG_INFO, LOGS, LOGP));
+    self = (struct bmd_synth*)obj;
+    if (!(self->is_running))
+    {
+        return BMD_ERROR_NONE;
+    }
+    __atomic_store_n(&(self->is_running), 0, __ATOMIC_RELEASE);
+    pthread_join(self->thread, NULL);
+    return BMD_ERROR_NONE;
+}
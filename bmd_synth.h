@@ -0,0 +1,36 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BMD_SYNTH_H_
+#define _BMD_SYNTH_H_
+
+/* synthetic capture source, same contract as bmd_declink, fills
+   bmd_av_info from its own thread at the rate of the display mode with
+   a moving YUY2 pattern and a 48 kHz stereo tone, for load testing
+   without a DeckLink card */
+
+int
+bmd_synth_create(int mode_index, struct bmd_av_info* av_info, void** obj);
+int
+bmd_synth_delete(void* obj);
+int
+bmd_synth_start(void* obj);
+int
+bmd_synth_stop(void* obj);
+
+#endif
@@ -0,0 +1,1208 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* timeshift, see bmd_timeshift.h
+   positions are logical byte counts that only grow, a record at pos is
+   at pos % bytes in the file, a record that would run past the end of
+   the file goes to the start after a pad record, so records never wrap
+   reserve_pos is moved before the writer touches the file, a record at
+   pos is intact for as long as pos >= reserve_pos - bytes
+   buffers go from a free list to the writer's queue and back like
+   bmd_record's, a lookup goes from the lookup queue to the replies of
+   the thread that asked, its answer in it */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "bmd.h"
+#include "bmd_record.h"
+#include "bmd_timeshift.h"
+#include "bmd_error.h"
+#include "bmd_log.h"
+#include "bmd_utils.h"
+
+#define BMD_TIMESHIFT_ALIGN_UP(_bytes) \
+    (((_bytes) + BMD_RECORD_ALIGN - 1) & ~(BMD_RECORD_ALIGN - 1))
+
+/* fills the end of the file when the next record does not fit there */
+#define BMD_TIMESHIFT_TYPE_PAD      0
+
+struct timeshift_index
+{
+    long long pos;
+    int mstime; /* of the record at pos */
+    int vseq; /* first frame at or after pos */
+    int have_vseq; /* boolean */
+    int pad0;
+};
+
+/* a record as it goes in the file, the header then tight data */
+struct timeshift_buffer
+{
+    char* data;
+    int size;
+    int type;
+    struct timeshift_buffer* next;
+};
+
+struct timeshift_lookup
+{
+    struct bmd_timeshift_replies* replies;
+    int by;
+    int value;
+    int duration_ms;
+    int pad0;
+    struct bmd_timeshift_result result;
+    struct timeshift_lookup* next;
+};
+
+struct bmd_timeshift_replies
+{
+    pthread_mutex_t mutex;
+    int ref_count; /* the owner's and one for each queued lookup */
+    int wake_pipe[2];
+    int pad0;
+    struct timeshift_lookup* head; /* answered */
+    struct timeshift_lookup* tail;
+};
+
+struct bmd_timeshift
+{
+    int fd;
+    int audio_seq; /* main thread */
+    long long bytes; /* of the file, a BMD_RECORD_ALIGN multiple */
+    char* data; /* the file, mapped */
+    long long reserve_pos; /* atomic, the writer is up to here */
+    pthread_t write_thread;
+    pthread_t lookup_thread;
+    int write_started; /* boolean */
+    int lookup_started; /* boolean */
+    pthread_mutex_t mutex; /* everything from here on */
+    pthread_cond_t write_cond;
+    pthread_cond_t lookup_cond;
+    int quit; /* boolean */
+    int video_buffers; /* made */
+    int audio_buffers;
+    int drops;
+    int lookups; /* queued */
+    int pad0;
+    struct timeshift_buffer* queue_head;
+    struct timeshift_buffer* queue_tail;
+    struct timeshift_buffer* video_free;
+    struct timeshift_buffer* audio_free;
+    struct timeshift_lookup* lookup_head;
+    struct timeshift_lookup* lookup_tail;
+    long long head_pos; /* written up to */
+    int newest_time;
+    int index_first;
+    int index_count;
+    int pad1;
+    struct timeshift_index index[BMD_TIMESHIFT_INDEX_MAX];
+};
+
+static void*
+bmd_timeshift_write_thread(void* arg);
+static void*
+bmd_timeshift_lookup_thread(void* arg);
+
+/*****************************************************************************/
+int
+bmd_timeshift_create(const char* path, long long bytes, void** obj)
+{
+    struct bmd_timeshift* self;
+    int error;
+
+    bytes &= ~((long long)BMD_RECORD_ALIGN - 1);
+    if (bytes < BMD_TIMESHIFT_MIN_BYTES)
+    {
+        return BMD_ERROR_PARAM;
+    }
+    self = xnew0(struct bmd_timeshift, 1);
+    if (self == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    self->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (self->fd == -1)
+    {
+        LOGLN0((LOG_ERROR, LOGS "open %s failed", LOGP, path));
+        free(self);
+        return BMD_ERROR_FD;
+    }
+    /* every block is allocated now, writes later never extend the file */
+    if (ftruncate(self->fd, bytes) != 0)
+    {
+        LOGLN0((LOG_ERROR, LOGS "ftruncate %s failed", LOGP, path));
+        close(self->fd);
+        free(self);
+        return BMD_ERROR_FD;
+    }
+    error = posix_fallocate(self->fd, 0, bytes);
+    if (error != 0)
+    {
+        LOGLN0((LOG_ERROR, LOGS "posix_fallocate %s failed error %d", LOGP,
+                path, error));
+        close(self->fd);
+        free(self);
+        return BMD_ERROR_FD;
+    }
+    self->data = (char*)mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, self->fd, 0);
+    if (self->data == MAP_FAILED)
+    {
+        LOGLN0((LOG_ERROR, LOGS "mmap %s failed", LOGP, path));
+        close(self->fd);
+        free(self);
+        return BMD_ERROR_MEMORY;
+    }
+    self->bytes = bytes;
+    pthread_mutex_init(&(self->mutex), NULL);
+    pthread_cond_init(&(self->write_cond), NULL);
+    pthread_cond_init(&(self->lookup_cond), NULL);
+    if (pthread_create(&(self->write_thread), NULL,
+                       bmd_timeshift_write_thread, self) != 0)
+    {
+        bmd_timeshift_delete(self);
+        return BMD_ERROR_START;
+    }
+    self->write_started = 1;
+    if (pthread_create(&(self->lookup_thread), NULL,
+                       bmd_timeshift_lookup_thread, self) != 0)
+    {
+        bmd_timeshift_delete(self);
+        return BMD_ERROR_START;
+    }
+    self->lookup_started = 1;
+    *obj = self;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_timeshift_free_buffers(struct timeshift_buffer* buffer)
+{
+    struct timeshift_buffer* next;
+
+    while (buffer != NULL)
+    {
+        next = buffer->next;
+        free(buffer->data);
+        free(buffer);
+        buffer = next;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* the file is not kept, what is queued is dropped, lookups not answered
+   yet are never answered */
+int
+bmd_timeshift_delete(void* obj)
+{
+    struct bmd_timeshift* self;
+    struct timeshift_lookup* lookup;
+
+    self = (struct bmd_timeshift*)obj;
+    if (self == NULL)
+    {
+        return BMD_ERROR_NONE;
+    }
+    pthread_mutex_lock(&(self->mutex));
+    self->quit = 1;
+    pthread_cond_signal(&(self->write_cond));
+    pthread_cond_signal(&(self->lookup_cond));
+    pthread_mutex_unlock(&(self->mutex));
+    if (self->write_started)
+    {
+        pthread_join(self->write_thread, NULL);
+    }
+    if (self->lookup_started)
+    {
+        pthread_join(self->lookup_thread, NULL);
+    }
+    LOGLN0((LOG_INFO, LOGS "drops %d", LOGP, self->drops));
+    while (self->lookup_head != NULL)
+    {
+        lookup = self->lookup_head;
+        self->lookup_head = lookup->next;
+        bmd_timeshift_replies_delete(lookup->replies);
+        free(lookup);
+    }
+    bmd_timeshift_free_buffers(self->queue_head);
+    bmd_timeshift_free_buffers(self->video_free);
+    bmd_timeshift_free_buffers(self->audio_free);
+    munmap(self->data, self->bytes);
+    close(self->fd);
+    pthread_cond_destroy(&(self->write_cond));
+    pthread_cond_destroy(&(self->lookup_cond));
+    pthread_mutex_destroy(&(self->mutex));
+    free(self);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* where the next record goes, index entries for what it overwrites go
+   first, then reserve_pos moves */
+static char*
+bmd_timeshift_reserve(struct bmd_timeshift* self, int record_bytes,
+                      long long* apos)
+{
+    struct bmd_record_header* pad;
+    struct timeshift_index* entry;
+    long long pos;
+    long long offset;
+    long long end;
+    long long gap;
+
+    pos = self->head_pos;
+    offset = pos % self->bytes;
+    gap = offset + record_bytes > self->bytes ? self->bytes - offset : 0;
+    end = pos + gap + record_bytes;
+    pthread_mutex_lock(&(self->mutex));
+    while (self->index_count > 0)
+    {
+        entry = self->index + self->index_first;
+        if (entry->pos >= end - self->bytes)
+        {
+            break;
+        }
+        self->index_first = (self->index_first + 1) %
+                            BMD_TIMESHIFT_INDEX_MAX;
+        self->index_count--;
+    }
+    pthread_mutex_unlock(&(self->mutex));
+    __atomic_store_n(&(self->reserve_pos), end, __ATOMIC_SEQ_CST);
+    if (gap > 0)
+    {
+        pad = (struct bmd_record_header*)(self->data + offset);
+        memset(pad, 0, sizeof(*pad));
+        pad->magic = BMD_RECORD_MAGIC;
+        pad->type = BMD_TIMESHIFT_TYPE_PAD;
+        pad->record_bytes = gap;
+        pos += gap;
+    }
+    *apos = pos;
+    return self->data + pos % self->bytes;
+}
+
+/*****************************************************************************/
+/* the record at pos is written, it is found from here on */
+static int
+bmd_timeshift_commit(struct bmd_timeshift* self, long long pos,
+                     const struct bmd_record_header* header)
+{
+    struct timeshift_index* entry;
+    int index;
+    int count;
+
+    pthread_mutex_lock(&(self->mutex));
+    count = self->index_count;
+    index = (self->index_first + count - 1) % BMD_TIMESHIFT_INDEX_MAX;
+    if ((count < 1) ||
+        ((int)(header->time) - self->index[index].mstime >=
+         BMD_TIMESHIFT_INDEX_MS))
+    {
+        if (count >= BMD_TIMESHIFT_INDEX_MAX)
+        {
+            /* the file holds more than the index reaches */
+            self->index_first = (self->index_first + 1) %
+                                BMD_TIMESHIFT_INDEX_MAX;
+            count--;
+        }
+        index = (self->index_first + count) % BMD_TIMESHIFT_INDEX_MAX;
+        entry = self->index + index;
+        entry->pos = pos;
+        entry->mstime = header->time;
+        entry->have_vseq = 0;
+        self->index_count = count + 1;
+    }
+    if (header->type == BMD_RECORD_TYPE_VIDEO)
+    {
+        for (count = self->index_count; count > 0; count--)
+        {
+            index = (self->index_first + count - 1) %
+                    BMD_TIMESHIFT_INDEX_MAX;
+            entry = self->index + index;
+            if (entry->have_vseq)
+            {
+                break;
+            }
+            entry->vseq = header->seq;
+            entry->have_vseq = 1;
+        }
+    }
+    self->head_pos = pos + header->record_bytes;
+    self->newest_time = header->time;
+    pthread_mutex_unlock(&(self->mutex));
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* writer thread, the record goes in the file, the padding up to
+   record_bytes is left as it was */
+static int
+bmd_timeshift_write(struct bmd_timeshift* self,
+                    struct timeshift_buffer* buffer)
+{
+    struct bmd_record_header* header;
+    long long pos;
+    char* dst;
+
+    header = (struct bmd_record_header*)(buffer->data);
+    dst = bmd_timeshift_reserve(self, header->record_bytes, &pos);
+    memcpy(dst, buffer->data, sizeof(*header) + header->bytes);
+    return bmd_timeshift_commit(self, pos, header);
+}
+
+/*****************************************************************************/
+static void*
+bmd_timeshift_write_thread(void* arg)
+{
+    struct bmd_timeshift* self;
+    struct timeshift_buffer* buffer;
+
+    self = (struct bmd_timeshift*)arg;
+    LOGLN0((LOG_INFO, LOGS "writer started", LOGP));
+    pthread_mutex_lock(&(self->mutex));
+    for (;;)
+    {
+        while ((self->queue_head == NULL) && !(self->quit))
+        {
+            pthread_cond_wait(&(self->write_cond), &(self->mutex));
+        }
+        if (self->quit)
+        {
+            break;
+        }
+        buffer = self->queue_head;
+        self->queue_head = buffer->next;
+        if (self->queue_head == NULL)
+        {
+            self->queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&(self->mutex));
+        bmd_timeshift_write(self, buffer);
+        pthread_mutex_lock(&(self->mutex));
+        if (buffer->type == BMD_RECORD_TYPE_VIDEO)
+        {
+            buffer->next = self->video_free;
+            self->video_free = buffer;
+        }
+        else
+        {
+            buffer->next = self->audio_free;
+            self->audio_free = buffer;
+        }
+    }
+    pthread_mutex_unlock(&(self->mutex));
+    LOGLN0((LOG_INFO, LOGS "writer done", LOGP));
+    return 0;
+}
+
+/*****************************************************************************/
+/* a free buffer of at least size bytes, NULL when the writer has all of
+   them */
+static struct timeshift_buffer*
+bmd_timeshift_get_buffer(struct bmd_timeshift* self, int type, int size)
+{
+    struct timeshift_buffer* buffer;
+    struct timeshift_buffer** free_list;
+    int* made;
+    int max_made;
+    char* data;
+
+    if (type == BMD_RECORD_TYPE_VIDEO)
+    {
+        free_list = &(self->video_free);
+        made = &(self->video_buffers);
+        max_made = BMD_TIMESHIFT_VIDEO_BUFFERS;
+    }
+    else
+    {
+        free_list = &(self->audio_free);
+        made = &(self->audio_buffers);
+        max_made = BMD_TIMESHIFT_AUDIO_BUFFERS;
+    }
+    pthread_mutex_lock(&(self->mutex));
+    buffer = *free_list;
+    if (buffer != NULL)
+    {
+        *free_list = buffer->next;
+    }
+    else if (*made < max_made)
+    {
+        buffer = xnew0(struct timeshift_buffer, 1);
+        if (buffer != NULL)
+        {
+            buffer->type = type;
+            (*made)++;
+        }
+    }
+    if (buffer == NULL)
+    {
+        self->drops++;
+    }
+    pthread_mutex_unlock(&(self->mutex));
+    if ((buffer != NULL) && (buffer->size < size))
+    {
+        data = (char*)malloc(size);
+        if (data == NULL)
+        {
+            pthread_mutex_lock(&(self->mutex));
+            buffer->next = *free_list;
+            *free_list = buffer;
+            self->drops++;
+            pthread_mutex_unlock(&(self->mutex));
+            return NULL;
+        }
+        free(buffer->data);
+        buffer->data = data;
+        buffer->size = size;
+    }
+    return buffer;
+}
+
+/*****************************************************************************/
+static int
+bmd_timeshift_post(struct bmd_timeshift* self,
+                   struct timeshift_buffer* buffer)
+{
+    buffer->next = NULL;
+    pthread_mutex_lock(&(self->mutex));
+    if (self->queue_tail == NULL)
+    {
+        self->queue_head = buffer;
+    }
+    else
+    {
+        self->queue_tail->next = buffer;
+    }
+    self->queue_tail = buffer;
+    pthread_cond_signal(&(self->write_cond));
+    pthread_mutex_unlock(&(self->mutex));
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* nv12 planes, copied tight, dropped when the writer is that far behind */
+int
+bmd_timeshift_video(void* obj, int mstime, int seq, int width, int height,
+                    const void* ydata, int ystride,
+                    const void* uvdata, int uvstride)
+{
+    struct bmd_timeshift* self;
+    struct bmd_record_header* header;
+    struct timeshift_buffer* buffer;
+    const char* src;
+    char* dst;
+    int bytes;
+    int record_bytes;
+    int index;
+
+    self = (struct bmd_timeshift*)obj;
+    bytes = width * height * 3 / 2;
+    record_bytes = BMD_TIMESHIFT_ALIGN_UP(sizeof(*header) + bytes);
+    if (record_bytes > self->bytes / 4)
+    {
+        return BMD_ERROR_RANGE;
+    }
+    buffer = bmd_timeshift_get_buffer(self, BMD_RECORD_TYPE_VIDEO,
+                                      sizeof(*header) + bytes);
+    if (buffer == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    header = (struct bmd_record_header*)(buffer->data);
+    memset(header, 0, sizeof(*header));
+    header->magic = BMD_RECORD_MAGIC;
+    header->type = BMD_RECORD_TYPE_VIDEO;
+    header->time = mstime;
+    header->seq = seq;
+    header->bytes = bytes;
+    header->record_bytes = record_bytes;
+    header->width = width;
+    header->height = height;
+    dst = buffer->data + sizeof(*header);
+    src = (const char*)ydata;
+    for (index = 0; index < height; index++)
+    {
+        memcpy(dst, src, width);
+        dst += width;
+        src += ystride;
+    }
+    src = (const char*)uvdata;
+    for (index = 0; index < height / 2; index++)
+    {
+        memcpy(dst, src, width);
+        dst += width;
+        src += uvstride;
+    }
+    return bmd_timeshift_post(self, buffer);
+}
+
+/*****************************************************************************/
+int
+bmd_timeshift_audio(void* obj, int mstime, int channels,
+                    int bytes_per_sample, int sample_rate,
+                    const void* data, int bytes)
+{
+    struct bmd_timeshift* self;
+    struct bmd_record_header* header;
+    struct timeshift_buffer* buffer;
+    int record_bytes;
+
+    self = (struct bmd_timeshift*)obj;
+    record_bytes = BMD_TIMESHIFT_ALIGN_UP(sizeof(*header) + bytes);
+    if (record_bytes > self->bytes / 4)
+    {
+        return BMD_ERROR_RANGE;
+    }
+    buffer = bmd_timeshift_get_buffer(self, BMD_RECORD_TYPE_AUDIO,
+                                      sizeof(*header) + bytes);
+    if (buffer == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    header = (struct bmd_record_header*)(buffer->data);
+    memset(header, 0, sizeof(*header));
+    header->magic = BMD_RECORD_MAGIC;
+    header->type = BMD_RECORD_TYPE_AUDIO;
+    header->time = mstime;
+    header->seq = self->audio_seq++;
+    header->bytes = bytes;
+    header->record_bytes = record_bytes;
+    header->channels = channels;
+    header->bytes_per_sample = bytes_per_sample;
+    header->sample_rate = sample_rate;
+    memcpy(header + 1, data, bytes);
+    return bmd_timeshift_post(self, buffer);
+}
+
+/*****************************************************************************/
+/* boolean, the writer has not reached the record at pos */
+static int
+bmd_timeshift_intact(struct bmd_timeshift* self, long long pos)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return pos >= __atomic_load_n(&(self->reserve_pos), __ATOMIC_SEQ_CST) -
+                  self->bytes;
+}
+
+/*****************************************************************************/
+static int
+bmd_timeshift_read_header(struct bmd_timeshift* self, long long pos,
+                          struct bmd_record_header* header)
+{
+    long long offset;
+
+    offset = pos % self->bytes;
+    memcpy(header, self->data + offset, sizeof(*header));
+    if (!bmd_timeshift_intact(self, pos) ||
+        (header->magic != BMD_RECORD_MAGIC) ||
+        (header->record_bytes < BMD_RECORD_ALIGN) ||
+        (header->record_bytes % BMD_RECORD_ALIGN != 0) ||
+        (offset + header->record_bytes > self->bytes) ||
+        (header->bytes + sizeof(*header) > header->record_bytes))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* where to walk from and up to, the last index entry at or before value,
+   back entries earlier, or the oldest one */
+static int
+bmd_timeshift_find_start(struct bmd_timeshift* self, int by, int value,
+                         int back, long long* pos, long long* head)
+{
+    struct timeshift_index* entry;
+    int index;
+
+    pthread_mutex_lock(&(self->mutex));
+    if (self->index_count < 1)
+    {
+        pthread_mutex_unlock(&(self->mutex));
+        return BMD_ERROR_RANGE;
+    }
+    for (index = self->index_count - 1; index > 0; index--)
+    {
+        entry = self->index + (self->index_first + index) %
+                BMD_TIMESHIFT_INDEX_MAX;
+        if ((by == BMD_VIDEO_HISTORY_BY_TIME) &&
+            (value - entry->mstime >= 0))
+        {
+            break;
+        }
+        if ((by == BMD_VIDEO_HISTORY_BY_SEQ) && entry->have_vseq &&
+            (value - entry->vseq >= 0))
+        {
+            break;
+        }
+    }
+    index = index > back ? index - back : 0;
+    entry = self->index + (self->index_first + index) %
+            BMD_TIMESHIFT_INDEX_MAX;
+    *pos = entry->pos;
+    *head = self->head_pos;
+    pthread_mutex_unlock(&(self->mutex));
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* a sealed memfd of bytes copied from pos, -1 when the writer got to pos
+   during the copy */
+static int
+bmd_timeshift_copy(struct bmd_timeshift* self, long long first_pos,
+                   int fd, long long pos, int bytes, int fd_offset)
+{
+    ssize_t sent;
+    char* src;
+    int done;
+
+    src = self->data + pos % self->bytes +
+          sizeof(struct bmd_record_header);
+    done = 0;
+    while (done < bytes)
+    {
+        sent = pwrite(fd, src + done, bytes - done, fd_offset + done);
+        if (sent < 1)
+        {
+            return BMD_ERROR_FD;
+        }
+        done += sent;
+    }
+    if (!bmd_timeshift_intact(self, first_pos))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_timeshift_memfd(int bytes, int* fd)
+{
+    int lfd;
+
+    lfd = memfd_create("bmd_timeshift", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (lfd == -1)
+    {
+        return BMD_ERROR_FD;
+    }
+    if (ftruncate(lfd, bytes) != 0)
+    {
+        close(lfd);
+        return BMD_ERROR_FD;
+    }
+    *fd = lfd;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_timeshift_seal(int fd)
+{
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE |
+              F_SEAL_SEAL) != 0)
+    {
+        LOGLN0((LOG_INFO, LOGS "F_ADD_SEALS failed", LOGP));
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_timeshift_get_range(struct bmd_timeshift* self, int* oldest_time,
+                        int* newest_time)
+{
+    pthread_mutex_lock(&(self->mutex));
+    *oldest_time = 0;
+    *newest_time = 0;
+    if (self->index_count > 0)
+    {
+        *oldest_time = self->index[self->index_first].mstime;
+        *newest_time = self->newest_time;
+    }
+    pthread_mutex_unlock(&(self->mutex));
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* by is BMD_VIDEO_HISTORY_BY_SEQ or BMD_VIDEO_HISTORY_BY_TIME, *fd is a
+   sealed memfd with the tight nv12 frame or -1 when the file does not
+   hold it */
+static int
+bmd_timeshift_get_video(struct bmd_timeshift* self, int by, int value,
+                        int* fd, struct bmd_record_header* header)
+{
+    struct bmd_record_header rec;
+    long long pos;
+    long long head;
+    long long found;
+    int error;
+
+    *fd = -1;
+    if ((by != BMD_VIDEO_HISTORY_BY_SEQ) && (by != BMD_VIDEO_HISTORY_BY_TIME))
+    {
+        return BMD_ERROR_PARAM;
+    }
+    /* by time an entry back, the entry can be an audio record just
+       after the frame on screen at value */
+    if (bmd_timeshift_find_start(self, by, value,
+                                 by == BMD_VIDEO_HISTORY_BY_TIME, &pos,
+                                 &head) != BMD_ERROR_NONE)
+    {
+        return BMD_ERROR_NONE;
+    }
+    found = -1;
+    for (; pos < head; pos += rec.record_bytes)
+    {
+        if (bmd_timeshift_read_header(self, pos, &rec) != BMD_ERROR_NONE)
+        {
+            break;
+        }
+        if (rec.type == BMD_RECORD_TYPE_VIDEO)
+        {
+            if (by == BMD_VIDEO_HISTORY_BY_SEQ)
+            {
+                if ((int)(rec.seq) == value)
+                {
+                    found = pos;
+                    *header = rec;
+                    break;
+                }
+                if ((int)(rec.seq) - value > 0)
+                {
+                    break;
+                }
+            }
+            else
+            {
+                if (value - (int)(rec.time) < 0)
+                {
+                    break;
+                }
+                found = pos;
+                *header = rec;
+            }
+        }
+    }
+    if (found < 0)
+    {
+        return BMD_ERROR_NONE;
+    }
+    error = bmd_timeshift_memfd(header->bytes, fd);
+    if (error != BMD_ERROR_NONE)
+    {
+        return error;
+    }
+    error = bmd_timeshift_copy(self, found, *fd, found, header->bytes, 0);
+    if (error != BMD_ERROR_NONE)
+    {
+        close(*fd);
+        *fd = -1;
+        return error == BMD_ERROR_RANGE ? BMD_ERROR_NONE : error;
+    }
+    return bmd_timeshift_seal(*fd);
+}
+
+/*****************************************************************************/
+/* boolean, the audio record overlaps [mstime, mstime + duration_ms) and
+   is in the first one's format */
+static int
+bmd_timeshift_audio_wanted(const struct bmd_record_header* rec,
+                           const struct bmd_record_header* first,
+                           int mstime, int duration_ms)
+{
+    int frame_bytes;
+    int rec_ms;
+
+    frame_bytes = rec->channels * rec->bytes_per_sample;
+    if ((rec->type != BMD_RECORD_TYPE_AUDIO) || (frame_bytes < 1) ||
+        (rec->sample_rate < 1))
+    {
+        return 0;
+    }
+    if ((first != NULL) &&
+        ((rec->channels != first->channels) ||
+         (rec->bytes_per_sample != first->bytes_per_sample) ||
+         (rec->sample_rate != first->sample_rate)))
+    {
+        return 0;
+    }
+    rec_ms = (int)((long long)(rec->bytes / frame_bytes) * 1000 /
+                   rec->sample_rate);
+    return ((int)(rec->time) + rec_ms - mstime > 0) &&
+           ((int)(rec->time) - (mstime + duration_ms) < 0);
+}
+
+/*****************************************************************************/
+/* the capture audio packets that overlap [mstime, mstime + duration_ms)
+   back to back in a sealed memfd, header has the first packet's time and
+   format and the total bytes, *fd is -1 when the file has none of it */
+static int
+bmd_timeshift_get_audio(struct bmd_timeshift* self, int mstime,
+                        int duration_ms, int* fd,
+                        struct bmd_record_header* header)
+{
+    struct bmd_record_header rec;
+    long long start;
+    long long pos;
+    long long head;
+    long long first;
+    long long last;
+    int total;
+    int error;
+
+    *fd = -1;
+    if ((duration_ms < 1) || (duration_ms > BMD_TIMESHIFT_MAX_AUDIO_MS))
+    {
+        return BMD_ERROR_PARAM;
+    }
+    /* an entry back, the packet with mstime in it can be before it */
+    if (bmd_timeshift_find_start(self, BMD_VIDEO_HISTORY_BY_TIME, mstime, 1,
+                                 &start, &head) != BMD_ERROR_NONE)
+    {
+        return BMD_ERROR_NONE;
+    }
+    first = -1;
+    last = -1;
+    total = 0;
+    for (pos = start; pos < head; pos += rec.record_bytes)
+    {
+        if (bmd_timeshift_read_header(self, pos, &rec) != BMD_ERROR_NONE)
+        {
+            break;
+        }
+        if (bmd_timeshift_audio_wanted(&rec, first < 0 ? NULL : header,
+                                       mstime, duration_ms))
+        {
+            if (first < 0)
+            {
+                first = pos;
+                *header = rec;
+            }
+            last = pos;
+            total += rec.bytes;
+        }
+        if ((int)(rec.time) - (mstime + duration_ms) >
+            BMD_TIMESHIFT_INDEX_MS)
+        {
+            break;
+        }
+    }
+    if (first < 0)
+    {
+        return BMD_ERROR_NONE;
+    }
+    error = bmd_timeshift_memfd(total, fd);
+    if (error != BMD_ERROR_NONE)
+    {
+        return error;
+    }
+    total = 0;
+    for (pos = first; pos <= last; pos += rec.record_bytes)
+    {
+        if (bmd_timeshift_read_header(self, pos, &rec) != BMD_ERROR_NONE)
+        {
+            error = BMD_ERROR_RANGE;
+            break;
+        }
+        if (bmd_timeshift_audio_wanted(&rec, header, mstime, duration_ms))
+        {
+            error = bmd_timeshift_copy(self, first, *fd, pos, rec.bytes,
+                                       total);
+            if (error != BMD_ERROR_NONE)
+            {
+                break;
+            }
+            total += rec.bytes;
+        }
+    }
+    if (error != BMD_ERROR_NONE)
+    {
+        close(*fd);
+        *fd = -1;
+        return error == BMD_ERROR_RANGE ? BMD_ERROR_NONE : error;
+    }
+    header->bytes = total;
+    return bmd_timeshift_seal(*fd);
+}
+
+/*****************************************************************************/
+/* lookup thread, the answer goes in the lookup, the lookup goes to the
+   replies and wakes the thread that asked */
+static int
+bmd_timeshift_answer(struct bmd_timeshift* self,
+                     struct timeshift_lookup* lookup)
+{
+    struct bmd_timeshift_replies* replies;
+    struct bmd_timeshift_result* result;
+    int error;
+
+    result = &(lookup->result);
+    if (result->type == BMD_TIMESHIFT_TYPE_VIDEO)
+    {
+        error = bmd_timeshift_get_video(self, lookup->by, lookup->value,
+                                        &(result->fd), &(result->header));
+    }
+    else if (result->type == BMD_TIMESHIFT_TYPE_AUDIO)
+    {
+        error = bmd_timeshift_get_audio(self, lookup->value,
+                                        lookup->duration_ms, &(result->fd),
+                                        &(result->header));
+    }
+    else
+    {
+        error = BMD_ERROR_PARAM;
+    }
+    if (error != BMD_ERROR_NONE)
+    {
+        LOGLN10((LOG_INFO, LOGS "lookup type %d failed error %d", LOGP,
+                 result->type, error));
+    }
+    result->status = result->fd == -1 ? BMD_VIDEO_HISTORY_MISSING :
+                     BMD_VIDEO_HISTORY_FOUND;
+    bmd_timeshift_get_range(self, &(result->oldest_time),
+                            &(result->newest_time));
+    replies = lookup->replies;
+    lookup->next = NULL;
+    pthread_mutex_lock(&(replies->mutex));
+    if (replies->tail == NULL)
+    {
+        replies->head = lookup;
+    }
+    else
+    {
+        replies->tail->next = lookup;
+    }
+    replies->tail = lookup;
+    pthread_mutex_unlock(&(replies->mutex));
+    if (write(replies->wake_pipe[1], "w", 1) != 1)
+    {
+        /* pipe full, the thread is woken anyway */
+    }
+    /* the lookup's reference, the answer goes with the replies when the
+       owner is gone */
+    return bmd_timeshift_replies_delete(replies);
+}
+
+/*****************************************************************************/
+static void*
+bmd_timeshift_lookup_thread(void* arg)
+{
+    struct bmd_timeshift* self;
+    struct timeshift_lookup* lookup;
+
+    self = (struct bmd_timeshift*)arg;
+    LOGLN0((LOG_INFO, LOGS "lookups started", LOGP));
+    pthread_mutex_lock(&(self->mutex));
+    for (;;)
+    {
+        while ((self->lookup_head == NULL) && !(self->quit))
+        {
+            pthread_cond_wait(&(self->lookup_cond), &(self->mutex));
+        }
+        if (self->quit)
+        {
+            break;
+        }
+        lookup = self->lookup_head;
+        self->lookup_head = lookup->next;
+        if (self->lookup_head == NULL)
+        {
+            self->lookup_tail = NULL;
+        }
+        self->lookups--;
+        pthread_mutex_unlock(&(self->mutex));
+        bmd_timeshift_answer(self, lookup);
+        pthread_mutex_lock(&(self->mutex));
+    }
+    pthread_mutex_unlock(&(self->mutex));
+    LOGLN0((LOG_INFO, LOGS "lookups done", LOGP));
+    return 0;
+}
+
+/*****************************************************************************/
+/* any thread, type is BMD_TIMESHIFT_TYPE_*, a frame by
+   BMD_VIDEO_HISTORY_BY_SEQ or _BY_TIME or the audio from time value for
+   duration_ms, the answer comes later from bmd_timeshift_replies_get
+   BMD_ERROR_RANGE when too many lookups are queued */
+int
+bmd_timeshift_lookup(void* obj, void* replies, int peer_id, int type,
+                     int by, int value, int duration_ms)
+{
+    struct bmd_timeshift* self;
+    struct bmd_timeshift_replies* lreplies;
+    struct timeshift_lookup* lookup;
+
+    self = (struct bmd_timeshift*)obj;
+    lreplies = (struct bmd_timeshift_replies*)replies;
+    lookup = xnew0(struct timeshift_lookup, 1);
+    if (lookup == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    lookup->replies = lreplies;
+    lookup->by = by;
+    lookup->value = value;
+    lookup->duration_ms = duration_ms;
+    lookup->result.peer_id = peer_id;
+    lookup->result.type = type;
+    lookup->result.fd = -1;
+    pthread_mutex_lock(&(self->mutex));
+    if (self->lookups >= BMD_TIMESHIFT_MAX_LOOKUPS)
+    {
+        pthread_mutex_unlock(&(self->mutex));
+        free(lookup);
+        return BMD_ERROR_RANGE;
+    }
+    pthread_mutex_lock(&(lreplies->mutex));
+    lreplies->ref_count++;
+    pthread_mutex_unlock(&(lreplies->mutex));
+    if (self->lookup_tail == NULL)
+    {
+        self->lookup_head = lookup;
+    }
+    else
+    {
+        self->lookup_tail->next = lookup;
+    }
+    self->lookup_tail = lookup;
+    self->lookups++;
+    pthread_cond_signal(&(self->lookup_cond));
+    pthread_mutex_unlock(&(self->mutex));
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* one per thread that asks, poll the fd from
+   bmd_timeshift_replies_get_fd for read */
+int
+bmd_timeshift_replies_create(void** replies)
+{
+    struct bmd_timeshift_replies* self;
+
+    self = xnew0(struct bmd_timeshift_replies, 1);
+    if (self == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    if (pipe2(self->wake_pipe, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        free(self);
+        return BMD_ERROR_PIPE;
+    }
+    pthread_mutex_init(&(self->mutex), NULL);
+    self->ref_count = 1;
+    *replies = self;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* drops a reference, the owner's or a lookup's, the last one frees what
+   was not taken */
+int
+bmd_timeshift_replies_delete(void* replies)
+{
+    struct bmd_timeshift_replies* self;
+    struct timeshift_lookup* lookup;
+    int ref_count;
+
+    self = (struct bmd_timeshift_replies*)replies;
+    if (self == NULL)
+    {
+        return BMD_ERROR_NONE;
+    }
+    pthread_mutex_lock(&(self->mutex));
+    ref_count = --(self->ref_count);
+    pthread_mutex_unlock(&(self->mutex));
+    if (ref_count > 0)
+    {
+        return BMD_ERROR_NONE;
+    }
+    while (self->head != NULL)
+    {
+        lookup = self->head;
+        self->head = lookup->next;
+        if (lookup->result.fd != -1)
+        {
+            close(lookup->result.fd);
+        }
+        free(lookup);
+    }
+    close(self->wake_pipe[0]);
+    close(self->wake_pipe[1]);
+    pthread_mutex_destroy(&(self->mutex));
+    free(self);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_timeshift_replies_get_fd(void* replies, int* fd)
+{
+    struct bmd_timeshift_replies* self;
+
+    self = (struct bmd_timeshift_replies*)replies;
+    *fd = self->wake_pipe[0];
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* the next answer, *got is 0 when there is none */
+int
+bmd_timeshift_replies_get(void* replies,
+                          struct bmd_timeshift_result* result, int* got)
+{
+    struct bmd_timeshift_replies* self;
+    struct timeshift_lookup* lookup;
+    char buf[64];
+
+    self = (struct bmd_timeshift_replies*)replies;
+    /* before the queue, an answer after this wakes again */
+    while (read(self->wake_pipe[0], buf, sizeof(buf)) > 0)
+    {
+    }
+    pthread_mutex_lock(&(self->mutex));
+    lookup = self->head;
+    if (lookup != NULL)
+    {
+        self->head = lookup->next;
+        if (self->head == NULL)
+        {
+            self->tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&(self->mutex));
+    *got = lookup != NULL;
+    if (lookup != NULL)
+    {
+        *result = lookup->result;
+        free(lookup);
+    }
+    return BMD_ERROR_NONE;
+}
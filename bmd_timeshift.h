@@ -0,0 +1,83 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _BMD_TIMESHIFT_H_
+#define _BMD_TIMESHIFT_H_
+
+/* disk backed timeshift, -X
+   a preallocated file mapped once and written as a ring of
+   bmd_record_header records, frames as tight nv12 and capture audio
+   packets, the oldest records are overwritten in place, nothing is
+   allocated and no file is made or removed while it runs
+   a sparse index, an entry every BMD_TIMESHIFT_INDEX_MS, finds where to
+   start and the record headers chain from there
+   the main thread only copies into a buffer, a writer thread puts it in
+   the file and a lookup thread answers lookups, neither ever holds up
+   capture or peer io, lookups copy out into a sealed memfd and check
+   after the copy that the writer did not get to what they read
+   answers go to a replies queue the thread that asked polls */
+
+#include "bmd_record.h"
+
+#define BMD_TIMESHIFT_INDEX_MS      1000
+#define BMD_TIMESHIFT_INDEX_MAX     16384 /* entries, over 4 hours */
+#define BMD_TIMESHIFT_MIN_BYTES     (64 * 1024 * 1024)
+#define BMD_TIMESHIFT_MAX_AUDIO_MS  60000 /* in one lookup */
+#define BMD_TIMESHIFT_VIDEO_BUFFERS 8 /* frames the writer can be behind */
+#define BMD_TIMESHIFT_AUDIO_BUFFERS 32
+#define BMD_TIMESHIFT_MAX_LOOKUPS   64 /* queued, from every peer */
+
+/* a lookup answer */
+struct bmd_timeshift_result
+{
+    int peer_id;
+    int type; /* BMD_TIMESHIFT_TYPE_* */
+    int status; /* BMD_VIDEO_HISTORY_FOUND or _MISSING */
+    int fd; /* sealed memfd with found, the receiver's to close */
+    int oldest_time; /* what the file holds */
+    int newest_time;
+    struct bmd_record_header header; /* time, seq, format and bytes */
+};
+
+int
+bmd_timeshift_create(const char* path, long long bytes, void** obj);
+int
+bmd_timeshift_delete(void* obj);
+int
+bmd_timeshift_video(void* obj, int mstime, int seq, int width, int height,
+                    const void* ydata, int ystride,
+                    const void* uvdata, int uvstride);
+int
+bmd_timeshift_audio(void* obj, int mstime, int channels,
+                    int bytes_per_sample, int sample_rate,
+                    const void* data, int bytes);
+int
+bmd_timeshift_lookup(void* obj, void* replies, int peer_id, int type,
+                     int by, int value, int duration_ms);
+int
+bmd_timeshift_replies_create(void** replies);
+int
+bmd_timeshift_replies_delete(void* replies);
+int
+bmd_timeshift_replies_get_fd(void* replies, int* fd);
+int
+bmd_timeshift_replies_get(void* replies,
+                          struct bmd_timeshift_result* result, int* got);
+
+#endif
@@ -0,0 +1,217 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* nv12 surfaces in plain memory, memfd turned into a dmabuf by
+   /dev/udmabuf so peers can import them without a render node */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/udmabuf.h>
+#include <linux/dma-buf.h>
+
+#include "bmd_udmabuf.h"
+#include "bmd_error.h"
+#include "bmd_log.h"
+#include "bmd_utils.h"
+
+#define BMD_UDMABUF_STRIDE_ALIGN 64
+
+struct bmd_udmabuf
+{
+    int memfd;
+    int dmabuf_fd;
+    int width;
+    int height;
+    int stride;
+    int size;
+    int in_cpu_access; /* boolean */
+    int pad0;
+    char* data;
+};
+
+/*****************************************************************************/
+static int
+bmd_udmabuf_sync(struct bmd_udmabuf* self, int start)
+{
+    struct dma_buf_sync sync;
+
+    memset(&sync, 0, sizeof(sync));
+    sync.flags = DMA_BUF_SYNC_WRITE;
+    sync.flags |= start ? DMA_BUF_SYNC_START : DMA_BUF_SYNC_END;
+    if (ioctl(self->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync) != 0)
+    {
+        return BMD_ERROR_FD;
+    }
+    self->in_cpu_access = start;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_udmabuf_create(int udmabuf_fd, int width, int height, void** obj)
+{
+    struct bmd_udmabuf* self;
+    struct udmabuf_create create;
+    int page_size;
+
+    if ((udmabuf_fd < 0) || (width < 2) || (height < 2))
+    {
+        return BMD_ERROR_PARAM;
+    }
+    self = xnew0(struct bmd_udmabuf, 1);
+    if (self == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    page_size = getpagesize();
+    self->width = width;
+    self->height = (height + 1) & ~1;
+    self->stride = (width + BMD_UDMABUF_STRIDE_ALIGN - 1) &
+                   ~(BMD_UDMABUF_STRIDE_ALIGN - 1);
+    /* y plane followed by interleaved uv plane at half height */
+    self->size = self->stride * self->height * 3 / 2;
+    self->size = (self->size + page_size - 1) & ~(page_size - 1);
+    self->memfd = memfd_create("bmd_udmabuf", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (self->memfd == -1)
+    {
+        LOGLN0((LOG_ERROR, LOGS "memfd_create failed", LOGP));
+        free(self);
+        return BMD_ERROR_FD;
+    }
+    if ((ftruncate(self->memfd, self->size) != 0) ||
+        (fcntl(self->memfd, F_ADD_SEALS, F_SEAL_SHRINK) != 0))
+    {
+        LOGLN0((LOG_ERROR, LOGS "ftruncate or F_ADD_SEALS failed", LOGP));
+        close(self->memfd);
+        free(self);
+        return BMD_ERROR_FD;
+    }
+    self->data = (char*)mmap(NULL, self->size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, self->memfd, 0);
+    if (self->data == MAP_FAILED)
+    {
+        LOGLN0((LOG_ERROR, LOGS "mmap failed", LOGP));
+        close(self->memfd);
+        free(self);
+        return BMD_ERROR_MEMORY;
+    }
+    memset(&create, 0, sizeof(create));
+    create.memfd = self->memfd;
+    create.flags = UDMABUF_FLAGS_CLOEXEC;
+    create.offset = 0;
+    create.size = self->size;
+    self->dmabuf_fd = ioctl(udmabuf_fd, UDMABUF_CREATE, &create);
+    if (self->dmabuf_fd < 0)
+    {
+        LOGLN0((LOG_ERROR, LOGS "UDMABUF_CREATE failed", LOGP));
+        munmap(self->data, self->size);
+        close(self->memfd);
+        free(self);
+        return BMD_ERROR_FD;
+    }
+    LOGLN0((LOG_INFO, LOGS "width %d height %d stride %d size %d", LOGP,
+            self->width, self->height, self->stride, self->size));
+    *obj = self;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_udmabuf_delete(void* obj)
+{
+    struct bmd_udmabuf* self;
+
+    self = (struct bmd_udmabuf*)obj;
+    if (self == NULL)
+    {
+        return BMD_ERROR_NONE;
+    }
+    munmap(self->data, self->size);
+    close(self->dmabuf_fd);
+    close(self->memfd);
+    free(self);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_udmabuf_get_ybuffer(void* obj, void** ydata, int* ydata_stride_bytes)
+{
+    struct bmd_udmabuf* self;
+
+    self = (struct bmd_udmabuf*)obj;
+    if (!(self->in_cpu_access))
+    {
+        /* not fatal, udmabuf memory is cached system memory */
+        bmd_udmabuf_sync(self, 1);
+    }
+    *ydata = self->data;
+    *ydata_stride_bytes = self->stride;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_udmabuf_get_uvbuffer(void* obj, void** uvdata, int* uvdata_stride_bytes)
+{
+    struct bmd_udmabuf* self;
+
+    self = (struct bmd_udmabuf*)obj;
+    if (!(self->in_cpu_access))
+    {
+        bmd_udmabuf_sync(self, 1);
+    }
+    *uvdata = self->data + self->stride * self->height;
+    *uvdata_stride_bytes = self->stride;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* the returned fd is a dup the caller owns, same as yami_surface_get_fd_dst */
+int
+bmd_udmabuf_get_fd_dst(void* obj, int* fd, int* fd_width, int* fd_height,
+                       int* fd_stride, int* fd_size, int* fd_bpp)
+{
+    struct bmd_udmabuf* self;
+    int lfd;
+
+    self = (struct bmd_udmabuf*)obj;
+    if (self->in_cpu_access)
+    {
+        bmd_udmabuf_sync(self, 0);
+    }
+    lfd = dup(self->dmabuf_fd);
+    if (lfd == -1)
+    {
+        return BMD_ERROR_DUP;
+    }
+    *fd = lfd;
+    *fd_width = self->width;
+    *fd_height = self->height;
+    *fd_stride = self->stride;
+    *fd_size = self->size;
+    *fd_bpp = 12; /* nv12 */
+    return BMD_ERROR_NONE;
+}
@@ -0,0 +1,640 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* io_uring with raw syscalls, see bmd_uring.h */
+
+#define _GNU_SOURCE /* syscall */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "bmd_error.h"
+#include "bmd_log.h"
+#include "bmd_uring.h"
+#include "bmd_utils.h"
+
+#define BMD_URING_BUF_GROUP 0
+
+struct bmd_uring
+{
+    int fd;
+    int files; /* boolean, registered file table */
+    unsigned int sq_entries;
+    unsigned int cq_entries;
+    char* sq_ring;
+    char* cq_ring; /* same as sq_ring with IORING_FEAT_SINGLE_MMAP */
+    int sq_ring_bytes;
+    int cq_ring_bytes;
+    struct io_uring_sqe* sqes;
+    int sqes_bytes;
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_array;
+    unsigned int sq_mask;
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned int to_submit;
+    struct io_uring_buf_ring* buf_ring;
+    int buf_ring_bytes;
+    unsigned short buf_tail;
+    char* bufs;
+    char file_used[BMD_URING_FILES];
+};
+
+/*****************************************************************************/
+static int
+bmd_uring_setup(unsigned int entries, struct io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+/*****************************************************************************/
+static int
+bmd_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+/*****************************************************************************/
+static int
+bmd_uring_register(int fd, unsigned int opcode, void* arg,
+                   unsigned int nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*****************************************************************************/
+static int
+bmd_uring_map(struct bmd_uring* self, struct io_uring_params* params)
+{
+    self->sq_ring_bytes = params->sq_off.array +
+                          params->sq_entries * sizeof(unsigned int);
+    self->cq_ring_bytes = params->cq_off.cqes +
+                          params->cq_entries * sizeof(struct io_uring_cqe);
+    if (params->features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (self->cq_ring_bytes > self->sq_ring_bytes)
+        {
+            self->sq_ring_bytes = self->cq_ring_bytes;
+        }
+        self->cq_ring_bytes = self->sq_ring_bytes;
+    }
+    self->sq_ring = (char*)mmap(NULL, self->sq_ring_bytes,
+                                PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, self->fd,
+                                IORING_OFF_SQ_RING);
+    if (self->sq_ring == MAP_FAILED)
+    {
+        self->sq_ring = NULL;
+        return BMD_ERROR_MEMORY;
+    }
+    if (params->features & IORING_FEAT_SINGLE_MMAP)
+    {
+        self->cq_ring = self->sq_ring;
+    }
+    else
+    {
+        self->cq_ring = (char*)mmap(NULL, self->cq_ring_bytes,
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, self->fd,
+                                    IORING_OFF_CQ_RING);
+        if (self->cq_ring == MAP_FAILED)
+        {
+            self->cq_ring = NULL;
+            return BMD_ERROR_MEMORY;
+        }
+    }
+    self->sqes_bytes = params->sq_entries * sizeof(struct io_uring_sqe);
+    self->sqes = (struct io_uring_sqe*)
+                 mmap(NULL, self->sqes_bytes, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, self->fd,
+                      IORING_OFF_SQES);
+    if (self->sqes == MAP_FAILED)
+    {
+        self->sqes = NULL;
+        return BMD_ERROR_MEMORY;
+    }
+    self->sq_entries = params->sq_entries;
+    self->cq_entries = params->cq_entries;
+    self->sq_head = (unsigned int*)(self->sq_ring + params->sq_off.head);
+    self->sq_tail = (unsigned int*)(self->sq_ring + params->sq_off.tail);
+    self->sq_array = (unsigned int*)(self->sq_ring + params->sq_off.array);
+    self->sq_mask = *((unsigned int*)
+                      (self->sq_ring + params->sq_off.ring_mask));
+    self->cq_head = (unsigned int*)(self->cq_ring + params->cq_off.head);
+    self->cq_tail = (unsigned int*)(self->cq_ring + params->cq_off.tail);
+    self->cq_mask = *((unsigned int*)
+                      (self->cq_ring + params->cq_off.ring_mask));
+    self->cqes = (struct io_uring_cqe*)(self->cq_ring + params->cq_off.cqes);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* recv buffers the kernel picks from, multishot recv needs them */
+static int
+bmd_uring_create_bufs(struct bmd_uring* self)
+{
+    struct io_uring_buf_reg reg;
+    int index;
+
+    self->buf_ring_bytes = BMD_URING_BUFS * sizeof(struct io_uring_buf);
+    self->buf_ring = (struct io_uring_buf_ring*)
+                     mmap(NULL, self->buf_ring_bytes,
+                          PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (self->buf_ring == MAP_FAILED)
+    {
+        self->buf_ring = NULL;
+        return BMD_ERROR_MEMORY;
+    }
+    self->bufs = xnew(char, BMD_URING_BUFS * BMD_URING_BUF_BYTES);
+    if (self->bufs == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long long)(size_t)(self->buf_ring);
+    reg.ring_entries = BMD_URING_BUFS;
+    reg.bgid = BMD_URING_BUF_GROUP;
+    if (bmd_uring_register(self->fd, IORING_REGISTER_PBUF_RING,
+                           &reg, 1) != 0)
+    {
+        LOGLN0((LOG_ERROR, LOGS "IORING_REGISTER_PBUF_RING failed errno %d",
+                LOGP, errno));
+        return BMD_ERROR_NOT_SUPPORTED;
+    }
+    for (index = 0; index < BMD_URING_BUFS; index++)
+    {
+        bmd_uring_put_buf(self, index);
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_uring_create(void** obj)
+{
+    struct bmd_uring* self;
+    struct io_uring_params params;
+    struct io_uring_rsrc_register files;
+    int error;
+
+    self = xnew0(struct bmd_uring, 1);
+    if (self == NULL)
+    {
+        return BMD_ERROR_MEMORY;
+    }
+    /* room for every recv a burst of frames wakes up */
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+    params.cq_entries = BMD_URING_ENTRIES * 4;
+    self->fd = bmd_uring_setup(BMD_URING_ENTRIES, &params);
+    if (self->fd == -1)
+    {
+        LOGLN0((LOG_ERROR, LOGS "io_uring_setup failed errno %d",
+                LOGP, errno));
+        free(self);
+        return BMD_ERROR_NOT_SUPPORTED;
+    }
+    error = bmd_uring_map(self, &params);
+    if (error == BMD_ERROR_NONE)
+    {
+        error = bmd_uring_create_bufs(self);
+    }
+    if (error != BMD_ERROR_NONE)
+    {
+        bmd_uring_delete(self);
+        return error;
+    }
+    memset(&files, 0, sizeof(files));
+    files.nr = BMD_URING_FILES;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    self->files = bmd_uring_register(self->fd, IORING_REGISTER_FILES2,
+                                     &files, sizeof(files)) == 0;
+    LOGLN0((LOG_INFO, LOGS "io_uring fd %d entries %d cq entries %d "
+            "registered files %d", LOGP, self->fd, self->sq_entries,
+            self->cq_entries, self->files));
+    *obj = self;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* requests still in flight are cancelled by the kernel */
+int
+bmd_uring_delete(void* obj)
+{
+    struct bmd_uring* self;
+
+    self = (struct bmd_uring*)obj;
+    if (self == NULL)
+    {
+        return BMD_ERROR_NONE;
+    }
+    close(self->fd);
+    if (self->sqes != NULL)
+    {
+        munmap(self->sqes, self->sqes_bytes);
+    }
+    if ((self->cq_ring != NULL) && (self->cq_ring != self->sq_ring))
+    {
+        munmap(self->cq_ring, self->cq_ring_bytes);
+    }
+    if (self->sq_ring != NULL)
+    {
+        munmap(self->sq_ring, self->sq_ring_bytes);
+    }
+    if (self->buf_ring != NULL)
+    {
+        munmap(self->buf_ring, self->buf_ring_bytes);
+    }
+    free(self->bufs);
+    free(self);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* readable when there are completions */
+int
+bmd_uring_get_fd(void* obj, int* fd)
+{
+    struct bmd_uring* self;
+
+    self = (struct bmd_uring*)obj;
+    *fd = self->fd;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* slot is what recv and sendmsg take, it is fd itself when the kernel
+   has no registered files */
+int
+bmd_uring_add_file(void* obj, int fd, int* slot)
+{
+    struct bmd_uring* self;
+    struct io_uring_rsrc_update2 update;
+    int index;
+
+    self = (struct bmd_uring*)obj;
+    if (!(self->files))
+    {
+        *slot = fd;
+        return BMD_ERROR_NONE;
+    }
+    for (index = 0; index < BMD_URING_FILES; index++)
+    {
+        if (!(self->file_used[index]))
+        {
+            memset(&update, 0, sizeof(update));
+            update.offset = index;
+            update.data = (unsigned long long)(size_t)&fd;
+            update.nr = 1;
+            if (bmd_uring_register(self->fd, IORING_REGISTER_FILES_UPDATE2,
+                                   &update, sizeof(update)) != 1)
+            {
+                break;
+            }
+            self->file_used[index] = 1;
+            *slot = index;
+            return BMD_ERROR_NONE;
+        }
+    }
+    /* table full, the plain fd works too */
+    *slot = fd;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_uring_remove_file(void* obj, int slot)
+{
+    struct bmd_uring* self;
+    struct io_uring_rsrc_update2 update;
+    int fd;
+
+    self = (struct bmd_uring*)obj;
+    if (!(self->files) || (slot < 0) || (slot >= BMD_URING_FILES) ||
+        !(self->file_used[slot]))
+    {
+        return BMD_ERROR_NONE;
+    }
+    fd = -1;
+    memset(&update, 0, sizeof(update));
+    update.offset = slot;
+    update.data = (unsigned long long)(size_t)&fd;
+    update.nr = 1;
+    bmd_uring_register(self->fd, IORING_REGISTER_FILES_UPDATE2,
+                       &update, sizeof(update));
+    self->file_used[slot] = 0;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+static int
+bmd_uring_is_fixed(struct bmd_uring* self, int slot)
+{
+    return self->files && (slot >= 0) && (slot < BMD_URING_FILES) &&
+           self->file_used[slot];
+}
+
+/*****************************************************************************/
+/* a zeroed sqe at the tail, submits what is pending when the queue is
+   full */
+static struct io_uring_sqe*
+bmd_uring_get_sqe(struct bmd_uring* self)
+{
+    struct io_uring_sqe* sqe;
+    unsigned int head;
+    unsigned int tail;
+
+    tail = *(self->sq_tail);
+    head = __atomic_load_n(self->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= self->sq_entries)
+    {
+        bmd_uring_submit(self);
+        head = __atomic_load_n(self->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= self->sq_entries)
+        {
+            return NULL;
+        }
+    }
+    sqe = self->sqes + (tail & self->sq_mask);
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+/*****************************************************************************/
+static int
+bmd_uring_push_sqe(struct bmd_uring* self)
+{
+    unsigned int tail;
+
+    tail = *(self->sq_tail);
+    self->sq_array[tail & self->sq_mask] = tail & self->sq_mask;
+    __atomic_store_n(self->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    self->to_submit++;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* room for count requests that have to go in the same submit, a link
+   chain must not be split */
+int
+bmd_uring_reserve(void* obj, int count)
+{
+    struct bmd_uring* self;
+    unsigned int head;
+    unsigned int tail;
+
+    self = (struct bmd_uring*)obj;
+    tail = *(self->sq_tail);
+    head = __atomic_load_n(self->sq_head, __ATOMIC_ACQUIRE);
+    if (self->sq_entries - (tail - head) >= (unsigned int)count)
+    {
+        return BMD_ERROR_NONE;
+    }
+    bmd_uring_submit(self);
+    head = __atomic_load_n(self->sq_head, __ATOMIC_ACQUIRE);
+    if (self->sq_entries - (tail - head) >= (unsigned int)count)
+    {
+        return BMD_ERROR_NONE;
+    }
+    return BMD_ERROR_RANGE;
+}
+
+/*****************************************************************************/
+/* multishot, a completion for every connection */
+int
+bmd_uring_accept(void* obj, int listener, unsigned long long user_data)
+{
+    struct bmd_uring* self;
+    struct io_uring_sqe* sqe;
+
+    self = (struct bmd_uring*)obj;
+    sqe = bmd_uring_get_sqe(self);
+    if (sqe == NULL)
+    {
+        return BMD_ERROR_RANGE;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = user_data;
+    return bmd_uring_push_sqe(self);
+}
+
+/*****************************************************************************/
+/* multishot, a completion with a provided buffer for every read */
+int
+bmd_uring_recv(void* obj, int slot, unsigned long long user_data)
+{
+    struct bmd_uring* self;
+    struct io_uring_sqe* sqe;
+
+    self = (struct bmd_uring*)obj;
+    sqe = bmd_uring_get_sqe(self);
+    if (sqe == NULL)
+    {
+        return BMD_ERROR_RANGE;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = slot;
+    if (bmd_uring_is_fixed(self, slot))
+    {
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BMD_URING_BUF_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = user_data;
+    return bmd_uring_push_sqe(self);
+}
+
+/*****************************************************************************/
+/* msg and everything it points to has to stay put until the completion,
+   a zerocopy send completes twice and the data has to stay put until the
+   second one, the notif
+   link chains the next request to this one, it only starts when this one
+   completed in full */
+int
+bmd_uring_sendmsg(void* obj, int slot, const struct msghdr* msg,
+                  int zerocopy, int link, unsigned long long user_data)
+{
+    struct bmd_uring* self;
+    struct io_uring_sqe* sqe;
+
+    self = (struct bmd_uring*)obj;
+    sqe = bmd_uring_get_sqe(self);
+    if (sqe == NULL)
+    {
+        return BMD_ERROR_RANGE;
+    }
+    if (zerocopy)
+    {
+        sqe->opcode = IORING_OP_SENDMSG_ZC;
+        sqe->ioprio = IORING_SEND_ZC_REPORT_USAGE;
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_SENDMSG;
+    }
+    sqe->fd = slot;
+    if (bmd_uring_is_fixed(self, slot))
+    {
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    if (link)
+    {
+        sqe->flags |= IOSQE_IO_LINK;
+    }
+    sqe->addr = (unsigned long long)(size_t)msg;
+    sqe->len = 1;
+    sqe->user_data = user_data;
+    return bmd_uring_push_sqe(self);
+}
+
+/*****************************************************************************/
+/* everything in flight on fd, registered or not */
+int
+bmd_uring_cancel_fd(void* obj, int fd, unsigned long long user_data)
+{
+    struct bmd_uring* self;
+    struct io_uring_sqe* sqe;
+
+    self = (struct bmd_uring*)obj;
+    sqe = bmd_uring_get_sqe(self);
+    if (sqe == NULL)
+    {
+        return BMD_ERROR_RANGE;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = user_data;
+    return bmd_uring_push_sqe(self);
+}
+
+/*****************************************************************************/
+/* one syscall for everything prepared since the last one */
+int
+bmd_uring_submit(void* obj)
+{
+    struct bmd_uring* self;
+    int rv;
+
+    self = (struct bmd_uring*)obj;
+    while (self->to_submit > 0)
+    {
+        rv = bmd_uring_enter(self->fd, self->to_submit, 0, 0);
+        if (rv < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            /* EAGAIN or EBUSY, the cq is full, try after reaping */
+            LOGLN10((LOG_ERROR, LOGS "io_uring_enter failed errno %d",
+                     LOGP, errno));
+            return BMD_ERROR_NOTREADY;
+        }
+        self->to_submit -= rv;
+    }
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* BMD_ERROR_NOTREADY when there are none, no syscall */
+int
+bmd_uring_get_cqe(void* obj, struct bmd_uring_cqe* cqe)
+{
+    struct bmd_uring* self;
+    struct io_uring_cqe* lcqe;
+    unsigned int head;
+    unsigned int tail;
+
+    self = (struct bmd_uring*)obj;
+    head = *(self->cq_head);
+    tail = __atomic_load_n(self->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+    {
+        return BMD_ERROR_NOTREADY;
+    }
+    lcqe = self->cqes + (head & self->cq_mask);
+    cqe->user_data = lcqe->user_data;
+    cqe->res = lcqe->res;
+    cqe->more = (lcqe->flags & IORING_CQE_F_MORE) != 0;
+    cqe->notif = (lcqe->flags & IORING_CQE_F_NOTIF) != 0;
+    cqe->copied = cqe->notif &&
+                  ((lcqe->res & IORING_NOTIF_USAGE_ZC_COPIED) != 0);
+    cqe->buf_id = -1;
+    if (lcqe->flags & IORING_CQE_F_BUFFER)
+    {
+        cqe->buf_id = lcqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    }
+    __atomic_store_n(self->cq_head, head + 1, __ATOMIC_RELEASE);
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+int
+bmd_uring_get_buf(void* obj, int buf_id, char** data)
+{
+    struct bmd_uring* self;
+
+    self = (struct bmd_uring*)obj;
+    if ((buf_id < 0) || (buf_id >= BMD_URING_BUFS))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    *data = self->bufs + buf_id * BMD_URING_BUF_BYTES;
+    return BMD_ERROR_NONE;
+}
+
+/*****************************************************************************/
+/* give a buffer back for the next recv */
+int
+bmd_uring_put_buf(void* obj, int buf_id)
+{
+    struct bmd_uring* self;
+    struct io_uring_buf* buf;
+
+    self = (struct bmd_uring*)obj;
+    if ((buf_id < 0) || (buf_id >= BMD_URING_BUFS))
+    {
+        return BMD_ERROR_RANGE;
+    }
+    buf = self->buf_ring->bufs + (self->buf_tail & (BMD_URING_BUFS - 1));
+    buf->addr = (unsigned long long)(size_t)
+                (self->bufs + buf_id * BMD_URING_BUF_BYTES);
+    buf->len = BMD_URING_BUF_BYTES;
+    buf->bid = buf_id;
+    self->buf_tail++;
+    __atomic_store_n(&(self->buf_ring->tail), self->buf_tail,
+                     __ATOMIC_RELEASE);
+    return BMD_ERROR_NONE;
+}
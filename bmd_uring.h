@@ -0,0 +1,74 @@
+/**
+ * black magic daemon
+ *
+ * Copyright 2020 Jay Sorg <jay.sorg@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BMD_URING_H_
+#define _BMD_URING_H_
+
+/* io_uring for peer io, -R
+   one ring per thread that runs bmd_peer, sockets are registered files,
+   reads land in a provided buffer ring, every send queued while the
+   thread was busy goes in one io_uring_enter */
+
+#define BMD_URING_ENTRIES   1024 /* submission queue */
+#define BMD_URING_FILES     1024 /* registered sockets */
+#define BMD_URING_BUFS      256 /* provided recv buffers, power of 2 */
+#define BMD_URING_BUF_BYTES 4096
+
+/* user_data of a completion, 0 is never used */
+struct bmd_uring_cqe
+{
+    unsigned long long user_data;
+    int res;
+    int more; /* boolean, the request stays armed */
+    int notif; /* boolean, zerocopy send done with the payload */
+    int copied; /* boolean, with notif, the kernel copied anyway */
+    int buf_id; /* provided buffer res bytes are in, -1 for none */
+    int pad0;
+};
+
+int
+bmd_uring_create(void** obj);
+int
+bmd_uring_delete(void* obj);
+int
+bmd_uring_get_fd(void* obj, int* fd);
+int
+bmd_uring_add_file(void* obj, int fd, int* slot);
+int
+bmd_uring_remove_file(void* obj, int slot);
+int
+bmd_uring_reserve(void* obj, int count);
+int
+bmd_uring_accept(void* obj, int listener, unsigned long long user_data);
+int
+bmd_uring_recv(void* obj, int slot, unsigned long long user_data);
+int
+bmd_uring_sendmsg(void* obj, int slot, const struct msghdr* msg,
+                  int zerocopy, int link, unsigned long long user_data);
+int
+bmd_uring_cancel_fd(void* obj, int fd, unsigned long long user_data);
+int
+bmd_uring_submit(void* obj);
+int
+bmd_uring_get_cqe(void* obj, struct bmd_uring_cqe* cqe);
+int
+bmd_uring_get_buf(void* obj, int buf_id, char** data);
+int
+bmd_uring_put_buf(void* obj, int buf_id);
+
+#endif
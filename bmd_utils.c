@@ -41,6 +41,21 @@ get_mstime(int* mstime)
     return BMD_ERROR_NONE;
 }
 
+/*****************************************************************************/
+/* same CLOCK_MONOTONIC as get_mstime, in microseconds */
+int
+get_ustime(long long* ustime)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+    {
+        return BMD_ERROR_GETTIME;
+    }
+    *ustime = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    return BMD_ERROR_NONE;
+}
+
 /*****************************************************************************/
 int
 hex_dump(const void* data, int bytes)
@@ -30,6 +30,8 @@ extern "C"
 int
 get_mstime(int* mstime);
 int
+get_ustime(long long* ustime);
+int
 hex_dump(const void* data, int bytes);
 
 #ifdef __cplusplus